@@ -0,0 +1,377 @@
+// End-to-end benchmark of the patch pipeline on synthetic binaries.
+//
+// Usage: crispr-bench [-n RUNS] [--symbols N,N...] [--patched N,N...]
+//                     [--iterations N] [--reuse-space] [--retarget]
+//                     [--cc CC] [--work-dir DIR] [-o FILE]
+//
+// For every pair of symbol count (by default 10^3 to 10^6) and number of
+// patched functions (by default 1 to 1000), a fixture binary is generated
+// with the C compiler: the functions to patch, called in a loop by main, and
+// filler functions up to the symbol count. The fillers are written in
+// assembly, which unlike C scales to millions of symbols in seconds. The
+// patch module is written as IR and computes the same values as the original
+// functions. Fixtures are kept in the work directory and reused by later runs.
+//
+// Every stage of the pipeline is timed separately, RUNS times: loading the
+// symbols, parsing the IR, optimizing, generating the code, planning the
+// layout, linking, and merging, which includes writing the detours and
+// retargeting the branches, also timed on their own. The layout, the linking
+// and the merge are the steps crispr runs, from CrisprPatchSteps.h, with
+// --reuse-space and --retarget as in crispr. The original and the patched
+// binaries then run the workload, ITERATIONS calls to the patched functions,
+// and must print the same checksum. The min and median of every measurement
+// are written as JSON to stdout or FILE, so that two versions of crispr can
+// be compared.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "ArgParser.h"
+#include "CrisprCompiler.h"
+#include "CrisprPages.h"
+#include "CrisprPatchSteps.h"
+#include "CrisprStats.h"
+#include "CrisprSymbolTable.h"
+#include "util.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+using namespace std;
+
+static constexpr array<const char *, 9> Stages = {"symbol_load", "ir_parse", "optimize", "codegen", "layout", "link",
+                                                  "merge", "detour", "retarget"};
+
+using StageTimes = array<double, Stages.size()>;
+
+// Where the new code is mapped, well above the fixtures
+static const uint64_t CodeAddress = 0x10000000;
+static const uint64_t DataAddress = 0x11000000;
+static const uint64_t RoDataAddress = 0x12000000;
+
+struct Fixture {
+    unsigned Symbols;
+    unsigned Patched;
+    string Binary;
+    string Module;
+    string Output;
+};
+
+// Options of crispr which change the steps being timed
+struct PipelineOptions {
+    bool ReuseSpace;
+    bool Retarget;
+};
+
+static void check(Error Err, const string &what) {
+    if (Err) {
+        errs() << what << ": " << Err << "\n";
+        exit(1);
+    }
+}
+
+static double elapsed_ms(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static unique_ptr<raw_fd_ostream> create_file(const string &path) {
+    std::error_code EC;
+    auto OS = std::make_unique<raw_fd_ostream>(path, EC, sys::fs::F_None);
+    if (EC) {
+        errs() << "Could not create " << path << ": " << EC.message() << "\n";
+        exit(1);
+    }
+    return OS;
+}
+
+// The functions to patch, and a main calling each of them rounds times
+static void write_workload_source(const string &path, unsigned patched) {
+    auto OS = create_file(path);
+    *OS << "#include <stdio.h>\n#include <stdlib.h>\n\n";
+    for (unsigned i = 0; i < patched; i++) {
+        *OS << "__attribute__((noinline)) unsigned work_" << i
+            << "(unsigned x) { return (x ^ (x >> 7)) * 2654435761u + " << i << "u; }\n";
+    }
+    *OS << "\nint main(int argc, char **argv) {\n"
+        << "    long rounds = argc > 1 ? atol(argv[1]) : 1;\n"
+        << "    unsigned acc = 1;\n"
+        << "    for (long i = 0; i < rounds; i++) {\n";
+    for (unsigned i = 0; i < patched; i++) *OS << "        acc = work_" << i << "(acc);\n";
+    *OS << "    }\n"
+        << "    printf(\"%u\\n\", acc);\n"
+        << "    return 0;\n"
+        << "}\n";
+}
+
+static void write_filler_assembly(const string &path, unsigned count) {
+    auto OS = create_file(path);
+    *OS << "    .text\n";
+    for (unsigned i = 0; i < count; i++) {
+        *OS << "    .globl filler_" << i << "; .type filler_" << i << ", @function; filler_" << i
+            << ": ret; .size filler_" << i << ", 1\n";
+    }
+    *OS << "    .section .note.GNU-stack, \"\", @progbits\n";
+}
+
+static void write_patch_module(const string &path, unsigned patched) {
+    auto OS = create_file(path);
+    *OS << "target triple = \"x86_64-unknown-linux-gnu\"\n";
+    for (unsigned i = 0; i < patched; i++) {
+        *OS << "\ndefine i32 @work_" << i << "(i32 %x) {\n"
+            << "  %shifted = lshr i32 %x, 7\n"
+            << "  %mixed = xor i32 %x, %shifted\n"
+            << "  %scaled = mul i32 %mixed, -1640531535\n"
+            << "  %result = add i32 %scaled, " << i << "\n"
+            << "  ret i32 %result\n"
+            << "}\n";
+    }
+}
+
+static Fixture prepare_fixture(const string &work_dir, const string &cc, unsigned symbols, unsigned patched) {
+    string prefix = work_dir + "/fixture-" + to_string(symbols) + "-" + to_string(patched);
+    Fixture F = {symbols, patched, prefix, prefix + ".ll", prefix + ".patched"};
+
+    if (sys::fs::exists(F.Binary) && sys::fs::exists(F.Module)) return F;
+
+    errs() << "Generating " << F.Binary << "\n";
+    write_workload_source(prefix + ".c", patched);
+    write_filler_assembly(prefix + ".s", symbols > patched ? symbols - patched : 0);
+    write_patch_module(F.Module, patched);
+
+    // Not position independent, like the binaries usually patched
+    string command = cc + " -O2 -no-pie -o " + F.Binary + " " + prefix + ".c " + prefix + ".s";
+    if (system(command.c_str()) != 0) {
+        errs() << "Could not build the fixture: " << command << "\n";
+        exit(1);
+    }
+    return F;
+}
+
+// Runs every stage of the pipeline on the fixture, as crispr does when
+// patching into a new segment
+static StageTimes run_pipeline(const Fixture &F, const PipelineOptions &Pipeline) {
+    StageTimes Times;
+    auto start = chrono::steady_clock::now();
+
+    CrisprCompilerOptions Options;
+    Options.Log = &nulls();
+    CrisprCompiler Compiler("x86_64-unknown-linux-gnu", CodeAddress, DataAddress, RoDataAddress, Options);
+
+    CrisprSymbolTable Symbols;
+    check(Symbols.addElf(F.Binary, false), "Could not read the symbols of " + F.Binary);
+    check(Compiler.addExistingSymbols(Symbols), "Error while adding existing symbols");
+    Times[0] = elapsed_ms(start);
+
+    start = chrono::steady_clock::now();
+    SMDiagnostic Diagnostic;
+    ThreadSafeContext Context(std::make_unique<LLVMContext>());
+    unique_ptr<Module> M = parseIRFile(F.Module, Diagnostic, *Context.getContext());
+    if (!M) {
+        errs() << "Could not parse " << F.Module << ": " << Diagnostic.getMessage() << "\n";
+        exit(1);
+    }
+    Times[1] = elapsed_ms(start);
+
+    start = chrono::steady_clock::now();
+    check(Compiler.addModule(ThreadSafeModule(std::move(M), Context)), "Error while adding module");
+    Times[2] = elapsed_ms(start);
+
+    start = chrono::steady_clock::now();
+    auto Compiled = Compiler.findSymbols(Compiler.NewFunctions);
+    if (!Compiled) check(Compiled.takeError(), "Could not look up the new functions");
+    Times[3] = elapsed_ms(start);
+
+    start = chrono::steady_clock::now();
+    map<string, uint64_t> SectionStarts;
+    vector<CrisprFreeSpace::Range> FreeRanges;
+    if (Pipeline.ReuseSpace) {
+        auto Layout = planCodeLayout(F.Binary, Compiler, Symbols, CodeAddress, FreeRanges, nulls());
+        if (!Layout) check(Layout.takeError(), "Error while planning the layout");
+        SectionStarts = std::move(*Layout);
+    }
+    Times[4] = elapsed_ms(start);
+
+    start = chrono::steady_clock::now();
+    auto Linked = linkNewCode(Compiler, CodeAddress, {}, Symbols, SectionStarts, false);
+    if (!Linked) check(Linked.takeError(), "Error while linking");
+    auto NewSymbols = lookupLinkedSymbols((*Linked)->getMemBufferRef(), Compiler);
+    if (!NewSymbols) check(NewSymbols.takeError(), "Error while reading the linked symbols");
+    Times[5] = elapsed_ms(start);
+
+    // The detours and the retargeting are stages of the merge
+    CrisprStats Stats;
+    {
+        auto MergeStage = Stats.stage("merge");
+        check(mergeIntoBinary(F.Binary, (*Linked)->getMemBufferRef(), F.Output, *NewSymbols, Symbols,
+                              Pipeline.Retarget, PageSize, false, Stats, false, nulls()),
+              "Error while merging");
+    }
+    Times[6] = Stats.getWallTime("merge");
+    Times[7] = Stats.getWallTime("detours");
+    Times[8] = Stats.getWallTime("retarget");
+
+    if (auto EC = sys::fs::setPermissions(F.Output, static_cast<sys::fs::perms>(0755))) {
+        errs() << "Could not make " << F.Output << " executable: " << EC.message() << "\n";
+        exit(1);
+    }
+    return Times;
+}
+
+// Runs the workload, returning the wall clock time and the printed checksum
+static pair<double, string> run_workload(const string &path, long rounds) {
+    int stdout_pipe[2];
+    if (pipe(stdout_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        dup2(stdout_pipe[1], STDOUT_FILENO);
+        close(stdout_pipe[0]);
+        string argument = to_string(rounds);
+        execl(path.c_str(), path.c_str(), argument.c_str(), nullptr);
+        _exit(127);
+    }
+
+    close(stdout_pipe[1]);
+    string output;
+    char buffer[256];
+    ssize_t count;
+    while ((count = read(stdout_pipe[0], buffer, sizeof(buffer))) > 0) output.append(buffer, count);
+    close(stdout_pipe[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    double time = elapsed_ms(start);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        errs() << path << " did not run correctly\n";
+        exit(1);
+    }
+    return {time, output};
+}
+
+template<typename T>
+static T median(vector<T> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static json::Object summarize(const vector<double> &values) {
+    return json::Object{{"min_ms",    *min_element(values.begin(), values.end())},
+                        {"median_ms", median(values)}};
+}
+
+static vector<unsigned> parse_counts(const string &list) {
+    vector<unsigned> counts;
+    for (auto const &count : split(list, ",")) counts.push_back(stoul(count));
+    return counts;
+}
+
+int main(int argc, char **argv) {
+    InputParser Parser(argc, argv);
+    int runs = stoi(Parser.getCmdOption("-n", "5"));
+    auto symbol_counts = parse_counts(Parser.getCmdOption("--symbols", "1000,10000,100000,1000000"));
+    auto patched_counts = parse_counts(Parser.getCmdOption("--patched", "1,10,100,1000"));
+    long iterations = stol(Parser.getCmdOption("--iterations", "10000000"));
+    PipelineOptions Pipeline = {Parser.cmdOptionExists("--reuse-space"), Parser.cmdOptionExists("--retarget")};
+    // Copies, the defaults are temporaries
+    string cc = Parser.getCmdOption("--cc", "cc");
+    string work_dir = Parser.getCmdOption("--work-dir", "bench-fixtures");
+    string output_path = Parser.getCmdOption("-o", "-");
+
+    if (runs <= 0 || iterations <= 0) {
+        errs() << "Usage: " << argv[0] << " [-n RUNS] [--symbols N,N...] [--patched N,N...] "
+               << "[--iterations N] [--reuse-space] [--retarget] [--cc CC] [--work-dir DIR] [-o FILE]\n";
+        return 1;
+    }
+
+    if (auto EC = sys::fs::create_directories(work_dir)) {
+        errs() << "Could not create " << work_dir << ": " << EC.message() << "\n";
+        return 1;
+    }
+
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+
+    json::Array Results;
+    for (unsigned symbols : symbol_counts) {
+        for (unsigned patched : patched_counts) {
+            if (patched == 0 || patched > symbols) continue;
+            Fixture F = prepare_fixture(work_dir, cc, symbols, patched);
+            errs() << "Patching " << patched << " of " << symbols << " symbols\n";
+
+            vector<vector<double>> stage_times(Stages.size());
+            for (int i = 0; i < runs; i++) {
+                StageTimes Times = run_pipeline(F, Pipeline);
+                for (size_t stage = 0; stage < Stages.size(); stage++) stage_times[stage].push_back(Times[stage]);
+            }
+
+            // Every patched function is called iterations / patched times
+            long rounds = max(1L, iterations / static_cast<long>(patched));
+            auto expected = run_workload(F.Binary, rounds).second;
+            vector<double> original;
+            vector<double> patched_binary;
+            for (int i = 0; i < runs; i++) {
+                original.push_back(run_workload(F.Binary, rounds).first);
+                auto run = run_workload(F.Output, rounds);
+                if (run.second != expected) {
+                    errs() << F.Output << " printed " << run.second << " instead of " << expected;
+                    return 1;
+                }
+                patched_binary.push_back(run.first);
+            }
+
+            json::Object StagesSummary;
+            for (size_t stage = 0; stage < Stages.size(); stage++) {
+                StagesSummary[Stages[stage]] = summarize(stage_times[stage]);
+            }
+            Results.push_back(json::Object{
+                    {"symbols",  symbols},
+                    {"patched",  patched},
+                    {"stages",   std::move(StagesSummary)},
+                    {"workload", json::Object{{"rounds",   rounds},
+                                              {"original", summarize(original)},
+                                              {"patched",  summarize(patched_binary)}}},
+            });
+        }
+    }
+
+    std::error_code EC;
+    raw_fd_ostream OS(output_path, EC, sys::fs::F_None);
+    if (EC) {
+        errs() << "Could not create " << output_path << ": " << EC.message() << "\n";
+        return 1;
+    }
+    OS << formatv("{0:2}", json::Value(json::Object{{"runs",        runs},
+                                                    {"reuse_space", Pipeline.ReuseSpace},
+                                                    {"retarget",    Pipeline.Retarget},
+                                                    {"results",     std::move(Results)}})) << "\n";
+    return 0;
+}
@@ -0,0 +1,287 @@
+// Measures the startup time of (patched) binaries.
+//
+// Usage: crispr-startup-bench [-n RUNS] [--bind-now] [--relocations N,N...]
+//                             [--functions N,N...] [--cc CC] [--work-dir DIR]
+//                             [LABEL=PATH...]
+//
+// Every binary is run RUNS times without arguments and with its output
+// discarded. Besides the wall clock time from fork to exit, the time spent in
+// the dynamic loader is read from the glibc LD_DEBUG=statistics report.
+// --bind-now resolves every PLT entry at startup, which makes the cost of the
+// symbol lookups (and so the quality of the hash tables) visible.
+//
+// With --relocations, a position independent fixture with N relative
+// relocations (a table of pointers) is generated for every N, and a small
+// shared object is merged into it twice: with the relocations kept as RELA
+// and packed as DT_RELR. Both outputs are benchmarked with the binaries given
+// on the command line. The packed ones only run with glibc 2.36 or later.
+//
+// With --functions, a position independent fixture exporting N functions,
+// which looks every one of them up with dlsym when it starts, is generated for
+// every N, and the shared object is merged into it. The lookups go through
+// the hash table the merger rebuilt for the merged dynamic symbols, so the
+// original and the merged binary should start in about the same time.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <gnu/libc-version.h>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "ArgParser.h"
+#include "CrisprElf.h"
+#include "CrisprElfMerger.h"
+#include "CrisprOutputFile.h"
+#include "util.h"
+
+using namespace llvm;
+using namespace std;
+
+struct Sample {
+    double WallMicroseconds;
+    uint64_t LoaderCycles;
+    uint64_t RelocationCycles;
+};
+
+// Returns the first number following Key in Report, or 0
+static uint64_t parse_statistic(const string &Report, const string &Key) {
+    auto Position = Report.find(Key);
+    if (Position == string::npos) return 0;
+    Position = Report.find_first_of("0123456789", Position + Key.size());
+    if (Position == string::npos) return 0;
+    return strtoull(Report.c_str() + Position, nullptr, 10);
+}
+
+static Sample run_once(const string &path, bool bind_now) {
+    int stderr_pipe[2];
+    if (pipe(stderr_pipe) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    auto start = chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(stderr_pipe[1], STDERR_FILENO);
+        close(stderr_pipe[0]);
+
+        setenv("LD_DEBUG", "statistics", 1);
+        if (bind_now) setenv("LD_BIND_NOW", "1", 1);
+        execl(path.c_str(), path.c_str(), nullptr);
+        _exit(127);
+    }
+
+    close(stderr_pipe[1]);
+    string report;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(stderr_pipe[0], buffer, sizeof(buffer))) > 0) report.append(buffer, count);
+    close(stderr_pipe[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    auto end = chrono::steady_clock::now();
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+        cerr << path << " did not run correctly\n";
+        exit(1);
+    }
+
+    return {chrono::duration<double, micro>(end - start).count(),
+            parse_statistic(report, "total startup time in dynamic loader:"),
+            parse_statistic(report, "time needed for relocation:")};
+}
+
+static void check(Error Err, const string &what) {
+    if (Err) {
+        errs() << what << ": " << Err << "\n";
+        exit(1);
+    }
+}
+
+static void run_command(const string &command) {
+    if (system(command.c_str()) != 0) {
+        cerr << "Could not build the fixture: " << command << "\n";
+        exit(1);
+    }
+}
+
+// Merges the shared object into a copy of the binary, returns the copy
+static string merge_fixture(const string &binary, const string &shared, bool pack) {
+    string output = binary + (pack ? ".relr" : ".rela");
+    auto Input = CrisprElf::open(binary);
+    if (!Input) check(Input.takeError(), "Could not parse " + binary);
+    auto Shared = CrisprElf::open(shared);
+    if (!Shared) check(Shared.takeError(), "Could not parse " + shared);
+    auto Output = CrisprOutputFile::createCopy(binary, output);
+    if (!Output) check(Output.takeError(), "Could not create " + output);
+
+    CrisprElfMerger Merger(**Input, **Shared);
+    Merger.setPackRelativeRelocations(pack);
+    check(Merger.merge(**Output), "Error while merging into " + binary);
+    if (pack) {
+        cerr << output << ": " << Merger.getPackedRelocations() << " relocations packed in "
+             << Merger.getPackedRelocationsSize() << " bytes\n";
+    }
+
+    if (auto EC = sys::fs::setPermissions(output, static_cast<sys::fs::perms>(0755))) {
+        cerr << "Could not make " << output << " executable: " << EC.message() << "\n";
+        exit(1);
+    }
+    return output;
+}
+
+// A PIE whose data starts with a table of count pointers, each needing a
+// relative relocation, and a shared object linked above it with a few more
+static pair<string, string> prepare_fixture(const string &work_dir, const string &cc, unsigned long count) {
+    string prefix = work_dir + "/relocations-" + to_string(count);
+    string binary = prefix;
+    string shared = prefix + ".so";
+    if (sys::fs::exists(binary) && sys::fs::exists(shared)) return {binary, shared};
+
+    cerr << "Generating " << binary << "\n";
+    {
+        ofstream main_source(prefix + ".c");
+        // A wrong pointer is reported as a failure to run
+        main_source << "extern void *table[];\nint main(void) {\n    for (unsigned long i = 0; i < " << count
+                    << "ul; i++) if (table[i] != table) return 127;\n    return 0;\n}\n";
+        ofstream table_source(prefix + ".s");
+        table_source << "    .data\n    .globl table\ntable:\n    .rept " << count << "\n    .quad table\n    .endr\n"
+                     << "    .section .note.GNU-stack, \"\", @progbits\n";
+        ofstream shared_source(prefix + ".so.s");
+        shared_source << "    .data\n    .globl extra\nextra:\n    .rept 16\n    .quad local\n    .endr\nlocal:\n"
+                      << "    .section .note.GNU-stack, \"\", @progbits\n";
+    }
+    run_command(cc + " -O2 -fPIE -pie -o " + binary + " " + prefix + ".c " + prefix + ".s");
+    run_command(cc + " -shared -nostdlib -Wl,-Ttext-segment=0x40000000 -o " + shared + " " + prefix + ".so.s");
+    return {binary, shared};
+}
+
+// A PIE exporting count functions, which it looks up by name at startup, and
+// a shared object linked above it
+static pair<string, string> prepare_symbols_fixture(const string &work_dir, const string &cc, unsigned long count) {
+    string prefix = work_dir + "/functions-" + to_string(count);
+    string binary = prefix;
+    string shared = prefix + ".so";
+    if (sys::fs::exists(binary) && sys::fs::exists(shared)) return {binary, shared};
+
+    cerr << "Generating " << binary << "\n";
+    {
+        ofstream main_source(prefix + ".c");
+        main_source << "#include <dlfcn.h>\n#include <stdio.h>\n\n";
+        for (unsigned long i = 0; i < count; i++) main_source << "int f" << i << "(void) { return " << i << "; }\n";
+        // A missing symbol is reported as a failure to run
+        main_source << "\nint main(void) {\n    void *self = dlopen(NULL, RTLD_NOW);\n    char name[32];\n"
+                    << "    for (unsigned long i = 0; i < " << count << "ul; i++) {\n"
+                    << "        snprintf(name, sizeof(name), \"f%lu\", i);\n"
+                    << "        if (!dlsym(self, name)) return 127;\n    }\n    return 0;\n}\n";
+        ofstream shared_source(prefix + ".so.s");
+        shared_source << "    .text\n    .globl extra\n    .type extra, @function\nextra:\n    ret\n"
+                      << "    .section .note.GNU-stack, \"\", @progbits\n";
+    }
+    run_command(cc + " -O2 -fPIE -pie -rdynamic -o " + binary + " " + prefix + ".c -ldl");
+    run_command(cc + " -shared -nostdlib -Wl,-Ttext-segment=0x40000000 -o " + shared + " " + prefix + ".so.s");
+    return {binary, shared};
+}
+
+template<typename T>
+static T median(vector<T> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+int main(int argc, char **argv) {
+    InputParser Parser(argc, argv);
+    int runs = stoi(Parser.getCmdOption("-n", "200"));
+    bool bind_now = Parser.cmdOptionExists("--bind-now");
+    string relocation_counts = Parser.getCmdOption("--relocations");
+    string function_counts = Parser.getCmdOption("--functions");
+    string cc = Parser.getCmdOption("--cc", "cc");
+    string work_dir = Parser.getCmdOption("--work-dir", "startup-fixtures");
+
+    vector<pair<string, string>> binaries;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-n" || arg == "--relocations" || arg == "--functions" || arg == "--cc" || arg == "--work-dir") {
+            i++;
+            continue;
+        }
+        auto separator = arg.find('=');
+        if (separator == string::npos) continue;
+        binaries.emplace_back(arg.substr(0, separator), arg.substr(separator + 1));
+    }
+
+    if (!relocation_counts.empty() || !function_counts.empty()) {
+        if (auto EC = sys::fs::create_directories(work_dir)) {
+            cerr << "Could not create " << work_dir << ": " << EC.message() << "\n";
+            return 1;
+        }
+    }
+
+    if (!relocation_counts.empty()) {
+        bool relr = strverscmp(gnu_get_libc_version(), "2.36") >= 0;
+        if (!relr) cerr << "glibc " << gnu_get_libc_version() << " does not support DT_RELR, only RELA is run\n";
+
+        for (auto const &count : split(relocation_counts, ",")) {
+            auto fixture = prepare_fixture(work_dir, cc, stoul(count));
+            binaries.emplace_back(count + " rela", merge_fixture(fixture.first, fixture.second, false));
+            if (relr) binaries.emplace_back(count + " relr", merge_fixture(fixture.first, fixture.second, true));
+        }
+    }
+
+    for (auto const &count : split(function_counts, ",")) {
+        auto fixture = prepare_symbols_fixture(work_dir, cc, stoul(count));
+        binaries.emplace_back(count + " original", fixture.first);
+        binaries.emplace_back(count + " merged", merge_fixture(fixture.first, fixture.second, false));
+    }
+
+    if (binaries.empty() || runs <= 0) {
+        cerr << "Usage: " << argv[0] << " [-n RUNS] [--bind-now] [--relocations N,N...] [--functions N,N...]"
+             << " [--cc CC] [--work-dir DIR] [LABEL=PATH...]\n";
+        return 1;
+    }
+
+    printf("%-20s %12s %12s %16s %16s\n", "binary", "min (us)", "median (us)", "loader (cycles)", "reloc (cycles)");
+    for (auto const &binary : binaries) {
+        // Warm up the page cache
+        run_once(binary.second, bind_now);
+
+        vector<double> wall;
+        vector<uint64_t> loader;
+        vector<uint64_t> relocation;
+        for (int i = 0; i < runs; i++) {
+            Sample sample = run_once(binary.second, bind_now);
+            wall.push_back(sample.WallMicroseconds);
+            loader.push_back(sample.LoaderCycles);
+            relocation.push_back(sample.RelocationCycles);
+        }
+
+        printf("%-20s %12.1f %12.1f %16llu %16llu\n",
+               binary.first.c_str(),
+               *min_element(wall.begin(), wall.end()),
+               median(wall),
+               (unsigned long long) median(loader),
+               (unsigned long long) median(relocation));
+    }
+
+    return 0;
+}
@@ -16,6 +16,15 @@ public:
         return default_val;
     }
 
+    [[nodiscard]] std::vector<std::string> getCmdOptions(const std::string &option) const{
+        std::vector<std::string> values;
+        auto itr = this->tokens.begin();
+        while ((itr = std::find(itr, this->tokens.end(), option)) != this->tokens.end() && ++itr != this->tokens.end()){
+            values.push_back(*itr);
+        }
+        return values;
+    }
+
     /// @author iain
     [[nodiscard]] bool cmdOptionExists(const std::string &option) const{
         return std::find(this->tokens.begin(), this->tokens.end(), option)
@@ -0,0 +1,52 @@
+#include <algorithm>
+
+#include "llvm/Support/MathExtras.h"
+
+#include "CrisprAddressPlanner.h"
+
+using namespace llvm;
+using namespace std;
+
+void CrisprAddressPlanner::reserve(uint64_t Address, uint64_t Size) {
+    if (Size == 0) return;
+    uint64_t Start = alignDown(Address, PageSize);
+    uint64_t End = alignTo(Address + Size, PageSize);
+
+    // Merge with the ranges it overlaps or touches
+    auto It = Ranges.upper_bound(Start);
+    if (It != Ranges.begin() && std::prev(It)->second >= Start) --It;
+    while (It != Ranges.end() && It->first <= End) {
+        Start = std::min(Start, It->first);
+        End = std::max(End, It->second);
+        It = Ranges.erase(It);
+    }
+    Ranges.emplace(Start, End);
+}
+
+void CrisprAddressPlanner::reserveSegments(const CrisprElf &Binary, uint64_t Base) {
+    for (auto const &Phdr : Binary.programHeaders()) {
+        if (Phdr.p_type == ELF::PT_LOAD) reserve(Base + Phdr.p_vaddr, Phdr.p_memsz);
+    }
+}
+
+bool CrisprAddressPlanner::isFree(uint64_t Address, uint64_t Size) const {
+    if (Size == 0) return true;
+    // The last range starting before the end is the only one which can overlap
+    auto It = Ranges.lower_bound(Address + Size);
+    if (It == Ranges.begin()) return true;
+    return std::prev(It)->second <= Address;
+}
+
+uint64_t CrisprAddressPlanner::findFree(uint64_t Size, uint64_t Alignment, uint64_t From) const {
+    Alignment = std::max(Alignment, PageSize);
+    uint64_t Address = alignTo(From, Alignment);
+
+    // Skip the range containing the candidate, if any, then try every gap
+    auto It = Ranges.upper_bound(Address);
+    if (It != Ranges.begin() && std::prev(It)->second > Address) Address = alignTo(std::prev(It)->second, Alignment);
+    for (; It != Ranges.end(); ++It) {
+        if (Address + Size <= It->first) return Address;
+        Address = std::max(Address, alignTo(It->second, Alignment));
+    }
+    return Address;
+}
@@ -0,0 +1,37 @@
+#ifndef CRISPR_CRISPRADDRESSPLANNER_H
+#define CRISPR_CRISPRADDRESSPLANNER_H
+
+#include <cstdint>
+#include <map>
+
+#include "CrisprElf.h"
+#include "CrisprPages.h"
+
+// Index of the address ranges taken by the LOAD segments of a process image,
+// to place new segments where they overlap nothing.
+//
+// The ranges are rounded to pages, as the segments are mapped, and kept
+// disjoint and sorted by start, so that finding what overlaps a range or the
+// first gap where a segment fits is logarithmic in the number of segments.
+class CrisprAddressPlanner {
+public:
+    // Below the usual vm.mmap_min_addr
+    static constexpr uint64_t LowestAddress = 0x10000;
+
+    void reserve(uint64_t Address, uint64_t Size);
+
+    // Reserves the LOAD segments of the binary, relocated by Base
+    void reserveSegments(const CrisprElf &Binary, uint64_t Base = 0);
+
+    [[nodiscard]] bool isFree(uint64_t Address, uint64_t Size) const;
+
+    // The lowest address at or above From, with the given alignment, where
+    // Size bytes overlap no reserved range
+    [[nodiscard]] uint64_t findFree(uint64_t Size, uint64_t Alignment, uint64_t From = LowestAddress) const;
+
+private:
+    // End of every reserved range, by start
+    std::map<uint64_t, uint64_t> Ranges;
+};
+
+#endif//CRISPR_CRISPRADDRESSPLANNER_H
@@ -0,0 +1,137 @@
+#include <algorithm>
+
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+#include "CrisprCallGraphLayout.h"
+
+using namespace llvm;
+using namespace std;
+
+CrisprCallGraphLayout::CrisprCallGraphLayout(const Module &M) {
+    for (auto const &F : M) {
+        if (F.isDeclaration()) continue;
+        if (F.getEntryCount().hasValue()) HasProfile = true;
+        Index[&F] = Nodes.size();
+        Nodes.push_back({&F, estimateSize(F), 0, false, {}});
+    }
+
+    for (auto &Caller : Nodes) {
+        const Function &F = *Caller.F;
+        bool Cold = F.hasFnAttribute(Attribute::Cold) || F.getName().contains(".cold.");
+        if (HasProfile) {
+            auto Count = F.getEntryCount();
+            Caller.Weight = Count.hasValue() ? Count.getCount() : 0;
+            Caller.Cold = Cold || Caller.Weight == 0;
+        } else {
+            // The functions visible outside of the patch are called by the
+            // input binary, the others only by the patch
+            Caller.Weight = F.hasLocalLinkage() ? 0 : 1;
+            Caller.Cold = Cold;
+        }
+
+        DominatorTree DT(const_cast<Function &>(F));
+        LoopInfo LI(DT);
+        BranchProbabilityInfo BPI(F, LI);
+        BlockFrequencyInfo BFI(F, BPI, LI);
+        double EntryFrequency = BFI.getEntryFreq();
+
+        unsigned CallerIndex = Index[&F];
+        for (auto const &BB : F) {
+            double Frequency = HasProfile ? BFI.getBlockProfileCount(&BB).getValueOr(0)
+                                          : BFI.getBlockFreq(&BB).getFrequency() / EntryFrequency;
+            for (auto const &I : BB) {
+                auto *Call = dyn_cast<CallBase>(&I);
+                if (!Call || isa<IntrinsicInst>(I)) continue;
+                auto *Callee = dyn_cast<Function>(Call->getCalledValue()->stripPointerCasts());
+                if (!Callee || Callee == &F) continue;
+
+                auto Defined = Index.find(Callee);
+                if (Defined != Index.end()) Nodes[Defined->second].Callers[CallerIndex] += Frequency;
+            }
+        }
+    }
+
+    // Without a profile, a function is as hot as the calls reaching it
+    if (!HasProfile) {
+        for (auto &Callee : Nodes) {
+            for (auto const &Caller : Callee.Callers) Callee.Weight += Caller.second;
+        }
+    }
+}
+
+uint64_t CrisprCallGraphLayout::estimateSize(const Function &F) {
+    // x86-64 instructions take about 4 bytes on average
+    uint64_t Instructions = 0;
+    for (auto const &BB : F) {
+        for (auto const &I : BB) {
+            if (!isa<DbgInfoIntrinsic>(I)) Instructions++;
+        }
+    }
+    return std::max<uint64_t>(Instructions * 4, 1);
+}
+
+bool CrisprCallGraphLayout::isHot(const Function &F) const {
+    auto Node = Index.find(&F);
+    return Node != Index.end() && !Nodes[Node->second].Cold;
+}
+
+vector<const Function *> CrisprCallGraphLayout::computeOrder() const {
+    struct Cluster {
+        vector<unsigned> Members;
+        uint64_t Size;
+        double Weight;
+    };
+    vector<Cluster> Clusters;
+    vector<unsigned> ClusterOf;
+    vector<unsigned> Hot;
+    for (unsigned I = 0; I < Nodes.size(); I++) {
+        ClusterOf.push_back(Clusters.size());
+        Clusters.push_back({{I}, Nodes[I].Size, Nodes[I].Weight});
+        if (!Nodes[I].Cold) Hot.push_back(I);
+    }
+    std::stable_sort(Hot.begin(), Hot.end(), [this](unsigned A, unsigned B) {
+        return Nodes[A].Weight > Nodes[B].Weight;
+    });
+
+    for (unsigned Callee : Hot) {
+        // The most frequent caller among the hot functions
+        const pair<const unsigned, double> *Best = nullptr;
+        for (auto const &Caller : Nodes[Callee].Callers) {
+            if (Nodes[Caller.first].Cold) continue;
+            if (!Best || Caller.second > Best->second) Best = &Caller;
+        }
+        if (!Best) continue;
+
+        Cluster &To = Clusters[ClusterOf[Best->first]];
+        Cluster &From = Clusters[ClusterOf[Callee]];
+        if (&To == &From || To.Size + From.Size > PageSize) continue;
+
+        for (unsigned Member : From.Members) ClusterOf[Member] = ClusterOf[Best->first];
+        To.Members.insert(To.Members.end(), From.Members.begin(), From.Members.end());
+        To.Size += From.Size;
+        To.Weight += From.Weight;
+        From.Members.clear();
+    }
+
+    vector<const Cluster *> Sorted;
+    for (auto const &C : Clusters) {
+        if (!C.Members.empty() && !Nodes[C.Members.front()].Cold) Sorted.push_back(&C);
+    }
+    std::stable_sort(Sorted.begin(), Sorted.end(), [](const Cluster *A, const Cluster *B) {
+        return A->Weight / A->Size > B->Weight / B->Size;
+    });
+
+    vector<const Function *> Order;
+    for (auto const *C : Sorted) {
+        for (unsigned Member : C->Members) Order.push_back(Nodes[Member].F);
+    }
+    for (auto const &N : Nodes) {
+        if (N.Cold) Order.push_back(N.F);
+    }
+    return Order;
+}
@@ -0,0 +1,56 @@
+#ifndef CRISPR_CRISPRCALLGRAPHLAYOUT_H
+#define CRISPR_CRISPRCALLGRAPHLAYOUT_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/Module.h"
+
+#include "CrisprPages.h"
+
+// Orders the functions of the patch so that the hot ones are packed in as
+// few pages and cache lines as possible, next to the functions they call.
+//
+// The call graph of the optimized module is built with the calls weighted by
+// the count of their block when the module carries a sample profile, or by
+// their estimated frequency relative to the entry of the caller otherwise.
+// Functions are then clustered as in C3 (Ottoni & Maher, CGO 2017): from the
+// hottest, every function is appended to the cluster of its most frequent
+// caller as long as the cluster fits in a page. The functions of the input
+// binary cannot move, the calls to them are left out. Clusters are sorted by
+// decreasing density, and the cold functions go at the end.
+class CrisprCallGraphLayout {
+    using string = std::string;
+
+public:
+    explicit CrisprCallGraphLayout(const llvm::Module &M);
+
+    // The definitions of the module, in the order they should be placed
+    [[nodiscard]] std::vector<const llvm::Function *> computeOrder() const;
+
+    // Whether the function runs in the profile or, without one, is not
+    // marked or split as cold
+    [[nodiscard]] bool isHot(const llvm::Function &F) const;
+
+private:
+    struct Node {
+        const llvm::Function *F;
+        // Estimated, the code is not generated yet
+        uint64_t Size;
+        double Weight;
+        bool Cold;
+        // Callers and the weight of their calls to this function
+        std::map<unsigned, double> Callers;
+    };
+
+    std::vector<Node> Nodes;
+    llvm::DenseMap<const llvm::Function *, unsigned> Index;
+    bool HasProfile = false;
+
+    static uint64_t estimateSize(const llvm::Function &F);
+};
+
+#endif//CRISPR_CRISPRCALLGRAPHLAYOUT_H
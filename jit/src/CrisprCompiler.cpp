@@ -1,12 +1,23 @@
 #include <memory>
 #include <utility>
 
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar/GVN.h"
-#include "llvm/Transforms/Scalar.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include "CrisprCompiler.h"
+#include "CrisprCallGraphLayout.h"
 #include "SeparateFunctionsPass.h"
 
 using namespace llvm;
@@ -18,68 +29,288 @@ CrisprCompiler::CrisprCompiler(
         string const &TargetTriple,
         uint64_t CodeSegmentVirtualAddress,
         uint64_t DataSegmentVirtualAddress,
-        uint64_t RoDataSegmentVirtualAddress
+        uint64_t RoDataSegmentVirtualAddress,
+        const CrisprCompilerOptions &Options
 ) :
         CodeSegmentVirtualAddress(CodeSegmentVirtualAddress),
         DataSegmentVirtualAddress(DataSegmentVirtualAddress),
         RoDataSegmentVirtualAddress(RoDataSegmentVirtualAddress),
+        Options(Options),
+        Log(Options.LogLevel == CrisprLogLevel::Quiet ? nulls() : *Options.Log),
         CSM(CodeSegmentVirtualAddress, DataSegmentVirtualAddress, RoDataSegmentVirtualAddress),
         TM(llvm::EngineBuilder()
                    .setVerifyModules(true)
                    .setRelocationModel(Reloc::Model::PIC_)
                    .setCodeModel(CodeModel::Small)
                    .setTargetOptions(getTargetOptions())
+                   .setOptLevel(getCodeGenOptLevel())
                    .selectTarget(
                            llvm::Triple(TargetTriple),
                            "",
-                           "generic",
-                           llvm::SmallVector<std::string, 0>({}))
+                           getTargetCPU(),
+                           getTargetFeatures())
         ),
         DL(TM->createDataLayout()),
         Mangler(ES, DL),
 
         LinkingLayer(ES, [this]() { return getMemoryManager(); }),
-        CrisprLinkingLayer(ES, LinkingLayer),
+        CrisprLinkingLayer(ES, LinkingLayer, EmitLock, Options.DumpDirectory, Log),
 
-        CompileLayer(ES, CrisprLinkingLayer, llvm::orc::SimpleCompiler(*TM)),
-        OptimizeLayer(ES, CompileLayer, optimizeModule),
-        IsolateSectionsLayer(ES, OptimizeLayer, isolateSections),
+        CompileLayer(ES, CrisprLinkingLayer, getCompileFunction(TargetTriple)),
+        IsolateSectionsLayer(ES, CompileLayer, [this](ThreadSafeModule M, const MaterializationResponsibility &R) {
+            isolateSections(*M.getModule());
+            return std::move(M);
+        }),
 
         ExistingSymbolsDylib(ES.createJITDylib("PreExistingSymbols", false)) {
 
     // LinkingLayer.setProcessAllSections(true);
     ES.getMainJITDylib().addToSearchOrder(ExistingSymbolsDylib, true);
+    ExistingSymbolsDylib.setGenerator([this](JITDylib &JD, const SymbolNameSet &Names) {
+        return defineUnresolvedImports(JD, Names);
+    });
+
+    if (Options.ObjectCache) Options.ObjectCache->setConfiguration(getCompilerConfiguration());
+
+    // Only the code generation runs on the pool, see compileConcurrently
+    if (Options.Jobs > 1) {
+        CompileThreads = std::make_unique<ThreadPool>(Options.Jobs);
+        CompileJob = getCompileFunction(TargetTriple);
+    }
+}
+
+CrisprCompiler::~CrisprCompiler() {
+    if (CompileThreads) CompileThreads->wait();
+}
+
+IRCompileLayer::CompileFunction CrisprCompiler::getCompileFunction(const string &TargetTriple) {
+    if (Options.Jobs <= 1) return SimpleCompiler(*TM, Options.ObjectCache);
+
+    // A TargetMachine cannot be shared between threads, so every job creates
+    // its own with the same configuration
+    JITTargetMachineBuilder JTMB((Triple(TargetTriple)));
+    JTMB.setCPU(getTargetCPU());
+    JTMB.addFeatures(getTargetFeatures());
+    JTMB.setRelocationModel(Reloc::Model::PIC_);
+    JTMB.setCodeModel(CodeModel::Small);
+    JTMB.setCodeGenOptLevel(getCodeGenOptLevel());
+    JTMB.getOptions() = getTargetOptions();
+    return ConcurrentIRCompiler(std::move(JTMB), Options.ObjectCache);
+}
+
+string CrisprCompiler::getTargetCPU() const {
+    if (Options.CPU == "native") return sys::getHostCPUName();
+    return Options.CPU;
+}
+
+std::vector<string> CrisprCompiler::getTargetFeatures() const {
+    std::vector<string> Features;
+    StringMap<bool> HostFeatures;
+    if (Options.CPU == "native" && sys::getHostCPUFeatures(HostFeatures)) {
+        for (auto const &Feature : HostFeatures) {
+            Features.push_back((Feature.second ? "+" : "-") + Feature.first().str());
+        }
+    }
+    Features.insert(Features.end(), Options.Features.begin(), Options.Features.end());
+    return Features;
+}
+
+CodeGenOpt::Level CrisprCompiler::getCodeGenOptLevel() const {
+    switch (Options.OptLevel) {
+        case 0:
+            return CodeGenOpt::None;
+        case 1:
+            return CodeGenOpt::Less;
+        case 2:
+            return CodeGenOpt::Default;
+        default:
+            return CodeGenOpt::Aggressive;
+    }
+}
+
+string CrisprCompiler::getCompilerConfiguration() const {
+    string Configuration;
+    raw_string_ostream OS(Configuration);
+    auto TO = getTargetOptions();
+    OS << TM->getTargetTriple().str() << ";" << TM->getTargetCPU() << ";" << TM->getTargetFeatureString()
+       << ";reloc=" << TM->getRelocationModel() << ";code=" << TM->getCodeModel()
+       << ";opt=" << TM->getOptLevel()
+       << ";sections=" << TO.FunctionSections << TO.DataSections << TO.UniqueSectionNames;
+    return OS.str();
 }
 
 Error CrisprCompiler::addModule(ThreadSafeModule M) {
+    // The whole module is optimized before being handed to the JIT, so that
+    // functions can be inlined across the split modules and so that the
+    // symbols removed by the optimizations are not expected from the JIT
+    optimizeModule(*M.getModule());
+    if (Options.OrderFunctions) orderFunctions(*M.getModule());
+
+    // Before the module is split, which promotes the local functions to
+    // hidden ones (__orc_lcl.*) that the binary does not have
     for (auto const &F : M.getModule()->functions()) {
-        errs() << "New function: " << F.getName() << "\n";
-        if (!F.isDeclaration()) NewFunctions.push_back(F.getName());
+        if (isVerbose()) Log << "New function: " << F.getName() << "\n";
+        // Local functions are not visible outside of their module
+        if (!F.isDeclaration() && !F.hasLocalLinkage()) NewFunctions.push_back(F.getName());
+    }
+
+    std::vector<ThreadSafeModule> Modules;
+    if (Options.Jobs > 1 || Options.ObjectCache) {
+        auto Split = splitModule(std::move(M));
+        if (!Split) return Split.takeError();
+        Modules = std::move(*Split);
+    } else {
+        Modules.push_back(std::move(M));
+    }
+
+    if (CompileThreads) return compileConcurrently(std::move(Modules));
+    for (auto &Part : Modules) {
+        if (auto Err = IsolateSectionsLayer.add(ES.getMainJITDylib(), std::move(Part))) return Err;
+    }
+    return Error::success();
+}
+
+Error CrisprCompiler::compileConcurrently(std::vector<ThreadSafeModule> Modules) {
+    // The objects are loaded by RuntimeDyld on the thread which looks the
+    // symbols up, not on the pool: resolving the relocations of an object
+    // blocks until the objects it references are loaded, which would never
+    // happen once every worker of the pool is waiting.
+    std::vector<std::unique_ptr<MemoryBuffer>> Objects(Modules.size());
+    std::mutex FailureLock;
+    Error Failure = Error::success();
+    for (size_t I = 0; I < Modules.size(); I++) {
+        CompileThreads->async([this, &Modules, &Objects, &FailureLock, &Failure, I]() {
+            // Every split module has its own context
+            Module &M = *Modules[I].getModule();
+            isolateSections(M);
+            auto Object = CompileJob(M);
+            if (Object) {
+                Objects[I] = std::move(*Object);
+                return;
+            }
+            std::lock_guard<std::mutex> Lock(FailureLock);
+            Failure = joinErrors(std::move(Failure), Object.takeError());
+        });
+    }
+    CompileThreads->wait();
+    if (Failure) return Failure;
+
+    for (auto &Object : Objects) {
+        if (auto Err = addObject(std::move(Object))) return Err;
+    }
+    return Error::success();
+}
+
+void CrisprCompiler::orderFunctions(Module &M) {
+    CrisprCallGraphLayout Layout(M);
+    auto Order = Layout.computeOrder();
+
+    // The linker keeps the sections in the order of the objects, and every
+    // object has them in the order of the module. The sections are named
+    // here, as the names of the local functions change when the module is
+    // split, which also keeps the order of the module.
+    unsigned Hot = 0;
+    for (auto const *F : Order) {
+        auto &Function = const_cast<llvm::Function &>(*F);
+        if (!Function.getSection().startswith(".funcs.")) Function.setSection(".funcs." + Function.getName().str());
+        SectionOrder.emplace(Function.getSection().str(), SectionOrder.size());
+        if (Layout.isHot(Function)) {
+            HotSections.insert(Function.getSection().str());
+            Hot++;
+        }
+
+        M.getFunctionList().splice(M.end(), M.getFunctionList(), Function.getIterator());
+    }
+    if (Options.Stats) Options.Stats->add("hot_functions", Hot);
+    if (isVerbose()) Log << "Ordered " << Order.size() << " functions, " << Hot << " of them hot\n";
+}
+
+Expected<std::vector<ThreadSafeModule>> CrisprCompiler::splitModule(ThreadSafeModule TSM) {
+    Module &M = *TSM.getModule();
+    std::vector<ThreadSafeModule> Modules;
+
+    // Aliases cannot refer to a definition living in another module
+    if (!M.alias_empty() || !M.ifunc_empty()) {
+        Log << "The module contains aliases, it will be compiled as a whole\n";
+        Modules.push_back(std::move(TSM));
+        return std::move(Modules);
+    }
+
+    // The split modules reference each other's local symbols, which are
+    // therefore renamed and made hidden
+    SymbolLinkagePromoter()(M);
+
+    auto Extract = [&M](function_ref<bool(const GlobalValue *)> ShouldCloneDefinition) -> Expected<ThreadSafeModule> {
+        ValueToValueMapTy VMap;
+        auto Clone = CloneModule(M, VMap, ShouldCloneDefinition);
+
+        // Round trip through bitcode to move the clone to a context of its
+        // own, so that it can be compiled independently of the others
+        SmallVector<char, 0> Bitcode;
+        raw_svector_ostream BitcodeStream(Bitcode);
+        WriteBitcodeToFile(*Clone, BitcodeStream);
+
+        ThreadSafeContext Context(std::make_unique<LLVMContext>());
+        MemoryBufferRef Buffer(StringRef(Bitcode.data(), Bitcode.size()), M.getModuleIdentifier());
+        auto Part = parseBitcodeFile(Buffer, *Context.getContext());
+        if (!Part) return Part.takeError();
+        return ThreadSafeModule(std::move(*Part), std::move(Context));
+    };
+
+    // All the global variables go in one module, then one module per function
+    if (!M.global_empty()) {
+        auto Globals = Extract([](const GlobalValue *GV) { return isa<GlobalVariable>(GV); });
+        if (!Globals) return Globals.takeError();
+        Modules.push_back(std::move(*Globals));
+    }
+
+    for (auto const &F : M.functions()) {
+        if (F.isDeclaration()) continue;
+        auto Part = Extract([&F](const GlobalValue *GV) { return GV == &F; });
+        if (!Part) return Part.takeError();
+        Modules.push_back(std::move(*Part));
     }
-    return IsolateSectionsLayer.add(ES.getMainJITDylib(), std::move(M));
+
+    return std::move(Modules);
 }
 
 Error CrisprCompiler::addObject(std::unique_ptr<llvm::MemoryBuffer> O) {
     return CrisprLinkingLayer.add(ES.getMainJITDylib(), std::move(O));
 }
 
-Error CrisprCompiler::addExistingSymbols(const std::map<string, uint64_t> &Symbols) {
+Error CrisprCompiler::addExistingSymbols(const CrisprSymbolTable &Symbols) {
     return addExistingSymbols(
             Symbols,
             llvm::JITSymbolFlags::Weak
     );
 }
 
-Error CrisprCompiler::addExistingSymbols(const map<string, uint64_t> &Symbols, JITSymbolFlags flags) {
+Error CrisprCompiler::addExistingSymbols(const CrisprSymbolTable &Symbols, JITSymbolFlags flags) {
     SymbolMap SM;
-    for (const auto &S : Symbols) {
-        auto const &SymbolName = S.first;
-        auto const &SymbolAddr = S.second;
-        dbgs() << "Defining symbol " << SymbolName << " as " << format_hex(SymbolAddr, 10) << "\n";
-        auto InternedName = ES.intern(SymbolName);
-        SM[InternedName] = JITEvaluatedSymbol(SymbolAddr, flags);
+    SM.reserve(Symbols.size());
+    for (auto const &S : Symbols.symbols()) {
+        SM[ES.intern(S.Name)] = JITEvaluatedSymbol(S.Address, flags);
     }
-    return ExistingSymbolsDylib.define(absoluteSymbols(SM));
+    if (Options.Stats) Options.Stats->add("existing_symbols", Symbols.size());
+    return ExistingSymbolsDylib.define(absoluteSymbols(std::move(SM)));
+}
+
+Expected<SymbolNameSet> CrisprCompiler::defineUnresolvedImports(JITDylib &JD, const SymbolNameSet &Names) {
+    // The actual address of imported symbols is only known after linking
+    // against the dynamic libraries, so we define placeholders to let the
+    // compilation go through
+    SymbolMap Placeholders;
+    if (Options.Stats) Options.Stats->add("unresolved_imports", Names.size());
+    for (auto const &Name : Names) {
+        if (isVerbose()) Log << "Symbol " << *Name << " will be resolved at link time\n";
+        UnresolvedImports.insert((*Name).str());
+        Placeholders[Name] = JITEvaluatedSymbol(0, JITSymbolFlags::Weak);
+    }
+
+    if (auto Err = JD.define(absoluteSymbols(std::move(Placeholders)))) {
+        return std::move(Err);
+    }
+    return Names;
 }
 
 Expected<JITSymbol> CrisprCompiler::findSymbol(StringRef Name) {
@@ -88,9 +319,32 @@ Expected<JITSymbol> CrisprCompiler::findSymbol(StringRef Name) {
     return ES.lookup(SearchOrder, Mangler(Name));
 }
 
+Expected<std::map<string, uint64_t>> CrisprCompiler::findSymbols(const std::list<string> &Names) {
+    SymbolNameSet MangledNames;
+    DenseMap<SymbolStringPtr, string> Unmangled;
+    for (auto const &Name : Names) {
+        auto Mangled = Mangler(Name);
+        MangledNames.insert(Mangled);
+        Unmangled[Mangled] = Name;
+    }
+
+    JITDylib &MainJITDylib = ES.getMainJITDylib();
+    std::vector<JITDylib *> SearchOrder({&MainJITDylib});
+    auto Symbols = ES.lookup(SearchOrder, MangledNames);
+    if (!Symbols) return Symbols.takeError();
+
+    std::map<string, uint64_t> Addresses;
+    for (auto const &Symbol : *Symbols) {
+        Addresses[Unmangled[Symbol.first]] = Symbol.second.getAddress();
+    }
+    return std::move(Addresses);
+}
+
 std::unique_ptr<RuntimeDyld::MemoryManager> CrisprCompiler::getMemoryManager() {
+    std::lock_guard<std::mutex> Lock(EmitLock);
     MemorySegmentsV.push_back(std::make_unique<CrisprMemoryManager::MemorySegments>());
-    return std::make_unique<CrisprMemoryManager>(CSM, *MemorySegmentsV.back());
+    return std::make_unique<CrisprMemoryManager>(CSM, SegmentArena, *MemorySegmentsV.back(), EmitLock, Log,
+                                                 Options.Stats, isVerbose());
 }
 
 void CrisprCompiler::dumpSegments(const string &to_dir) {
@@ -99,67 +353,103 @@ void CrisprCompiler::dumpSegments(const string &to_dir) {
     int i = 0;
     for (auto const &MemSegment: MemorySegmentsV) {
         ofstream outfile;
-        outs() << "Dumping code segment\n";
+        if (isVerbose()) Log << "Dumping code segment\n";
         outfile.open(dir_path / ("code_" + std::to_string(i)));
         outfile.seekp(0, std::ofstream::end);
         outfile.write(reinterpret_cast<char *>(MemSegment->CodeSegment), MemSegment->CodeSegmentSize);
         outfile.close();
 
         if (MemSegment->DataSegmentSize) {
-            outs() << "Dumping data segment\n";
+            if (isVerbose()) Log << "Dumping data segment\n";
             outfile.open(dir_path / ("data_" + std::to_string(i)));
             outfile.seekp(0, std::ofstream::end);
             outfile.write(reinterpret_cast<char *>(MemSegment->DataSegment), MemSegment->DataSegmentSize);
             outfile.close();
-        } else { outs() << "Empty data segment, skipping\n"; }
+        } else if (isVerbose()) { Log << "Empty data segment, skipping\n"; }
 
         if (MemSegment->RoDataSegmentSize) {
-            outs() << "Dumping rodata segment\n";
+            if (isVerbose()) Log << "Dumping rodata segment\n";
             outfile.open(dir_path / ("rodata_" + std::to_string(i)));
             outfile.seekp(0, std::ofstream::end);
             outfile.write(reinterpret_cast<char *>(MemSegment->RoDataSegment), MemSegment->RoDataSegmentSize);
             outfile.close();
-        } else { outs() << "Empty rodata segment, skipping\n"; }
+        } else if (isVerbose()) { Log << "Empty rodata segment, skipping\n"; }
         i++;
     }
 }
 
-Expected<ThreadSafeModule>
-CrisprCompiler::optimizeModule(ThreadSafeModule M, const MaterializationResponsibility &R) {
-    // Create a function pass manager.
-    auto FPM = std::make_unique<legacy::FunctionPassManager>(M.getModule());
+void CrisprCompiler::optimizeModule(Module &M) const {
+    // Functions carry the CPU and features they were compiled for, the ones
+    // given to us take precedence
+    string CPU = TM->getTargetCPU();
+    string Features = TM->getTargetFeatureString();
+    for (auto &F : M) {
+        if (F.isDeclaration()) continue;
+        if (Options.CPU != "generic") F.addFnAttr("target-cpu", CPU);
+        if (!Features.empty()) {
+            auto Existing = F.getFnAttribute("target-features").getValueAsString();
+            F.addFnAttr("target-features", Existing.empty() ? Features : (Existing + "," + Features).str());
+        }
+    }
 
-    // Add some optimizations.
-    FPM->add(createInstructionCombiningPass());
-    FPM->add(createReassociatePass());
-    FPM->add(createGVNPass());
-    FPM->add(createCFGSimplificationPass());
-    FPM->doInitialization();
+    // The same pipelines as clang
+    PassManagerBuilder Builder;
+    Builder.OptLevel = Options.OptLevel;
+    Builder.SizeLevel = Options.SizeLevel;
+    if (Options.OptLevel > 0) {
+        Builder.Inliner = createFunctionInliningPass(Options.OptLevel, Options.SizeLevel, false);
+    } else {
+        Builder.Inliner = createAlwaysInlinerLegacyPass();
+    }
+    Builder.LoopVectorize = Options.OptLevel > 1 && Options.SizeLevel < 2;
+    Builder.SLPVectorize = Options.OptLevel > 1 && Options.SizeLevel < 2;
+    Builder.LibraryInfo = new TargetLibraryInfoImpl(Triple(M.getTargetTriple()));
+    Builder.PGOSampleUse = Options.SampleProfile;
+    TM->adjustPassManager(Builder);
 
-    // Run the optimizations over all functions in the module being added to
-    // the JIT.
-    for (auto &F : *M.getModule()) {
-        FPM->run(F);
+    legacy::FunctionPassManager FPM(&M);
+    FPM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+    Builder.populateFunctionPassManager(FPM);
+
+    legacy::PassManager MPM;
+    MPM.add(createTargetTransformInfoWrapperPass(TM->getTargetIRAnalysis()));
+    Builder.populateModulePassManager(MPM);
+    // Moves the regions which the profile shows as cold to functions of their
+    // own, so that they don't take space in the cache lines of the hot code
+    if (!Options.SampleProfile.empty() && Options.OptLevel > 0) MPM.add(createHotColdSplittingPass());
+
+    FPM.doInitialization();
+    for (auto &F : M) {
+        FPM.run(F);
+    }
+    FPM.doFinalization();
+
+    MPM.run(M);
+
+    // The parts split from a function (e.g. foo.cold.1) share a section of
+    // their own, which the layout can place far from the hot code. This is
+    // done here, as the names change when the module is split.
+    for (auto &F : M) {
+        auto Cold = F.getName().find(".cold.");
+        if (F.isDeclaration() || Cold == StringRef::npos) continue;
+        F.setSection(".funcs." + F.getName().substr(0, Cold).str() + ".cold");
     }
-    return M;
 }
 
-Expected<ThreadSafeModule>
-CrisprCompiler::isolateSections(ThreadSafeModule M, const MaterializationResponsibility &R) {
+void CrisprCompiler::isolateSections(Module &M) const {
 
     // Create a function pass manager.
-    auto FPM = std::make_unique<legacy::FunctionPassManager>(M.getModule());
+    auto FPM = std::make_unique<legacy::FunctionPassManager>(&M);
 
     // Add some optimizations.
-    FPM->add(new SeparateFunctionsPass());
+    FPM->add(new SeparateFunctionsPass(Options.FunctionAlignment, Options.ColdFunctionAlignment));
     FPM->doInitialization();
 
     // Run the optimizations over all functions in the module being added to
     // the JIT.
-    for (auto &F : *M.getModule()) {
+    for (auto &F : M) {
         FPM->run(F);
     }
-    return M;
 
 }
 
@@ -10,6 +10,8 @@
 #include <llvm/ExecutionEngine/Orc/IRTransformLayer.h>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <utility>
 #include <vector>
@@ -24,14 +26,62 @@
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/Mangler.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/DynamicLibrary.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 
 #include "CrisprSegmentManager.h"
 #include "CrisprMemoryManager.h"
 #include "CrisprLinker.h"
+#include "CrisprObjectCache.h"
+#include "CrisprStats.h"
+#include "CrisprSymbolTable.h"
+
+struct CrisprCompilerOptions {
+    // As in clang -O<OptLevel>, SizeLevel is 1 for -Os and 2 for -Oz
+    unsigned OptLevel = 2;
+    unsigned SizeLevel = 0;
+
+    // Target CPU ("native" for the host) and additional features, e.g. "+avx2"
+    std::string CPU = "generic";
+    std::vector<std::string> Features;
+
+    // Number of threads used to compile. Modules are split per function when
+    // greater than one or when caching, so that functions are cached separately
+    unsigned Jobs = 1;
+
+    // Alignment of the new functions, and of the ones marked cold. 0 keeps
+    // the one chosen by the backend for the optimization level (e.g. 16
+    // bytes on x86-64 unless optimizing for size).
+    unsigned FunctionAlignment = 0;
+    unsigned ColdFunctionAlignment = 1;
+
+    // Optional sample profile (AutoFDO text, or binary from llvm-profdata)
+    // of the original binary. Its functions are matched by name, and its
+    // samples drive inlining, block placement and hot/cold splitting.
+    std::string SampleProfile;
+
+    // Orders the new functions along their call graph, hot clusters first
+    // and cold functions last (see CrisprCallGraphLayout)
+    bool OrderFunctions = true;
+
+    // Optional, not owned. It can be shared by several compilers.
+    CrisprObjectCache *ObjectCache = nullptr;
+
+    // Where the progress is reported, not owned
+    llvm::raw_ostream *Log = &llvm::outs();
+    CrisprLogLevel LogLevel = CrisprLogLevel::Info;
+
+    // Optional, not owned. Counts the symbols defined, the relocations
+    // processed and the bytes emitted per segment.
+    CrisprStats *Stats = nullptr;
+
+    // Where the emitted objects and the segments are dumped, nowhere if empty
+    std::string DumpDirectory;
+};
 
 class CrisprCompiler {
     using string = std::string;
@@ -43,8 +93,17 @@ private:
     uint64_t DataSegmentVirtualAddress;
     uint64_t RoDataSegmentVirtualAddress;
 
+    CrisprCompilerOptions Options;
+    llvm::raw_ostream &Log;
+
+    // Serializes the emission callbacks running on the compile threads
+    std::mutex EmitLock;
+
     CrisprSegmentManager CSM;
 
+    // Owns the segments of all the memory managers, guarded by EmitLock
+    llvm::BumpPtrAllocator SegmentArena;
+
     std::unique_ptr<llvm::TargetMachine> TM;
     const llvm::DataLayout DL;
 
@@ -53,21 +112,38 @@ private:
     llvm::orc::RTDyldObjectLinkingLayer LinkingLayer;
     CrisprLinker CrisprLinkingLayer;
     llvm::orc::IRCompileLayer CompileLayer;
-    llvm::orc::IRTransformLayer OptimizeLayer;
     llvm::orc::IRTransformLayer IsolateSectionsLayer;
 
     std::vector<std::unique_ptr<CrisprMemoryManager::MemorySegments>> MemorySegmentsV;
 
+    std::map<string, unsigned> SectionOrder;
+    std::set<string> HotSections;
+
     llvm::orc::JITDylib &ExistingSymbolsDylib;
 
+    // Compiles the split modules to objects with --jobs, on the threads of
+    // the pool
+    llvm::orc::IRCompileLayer::CompileFunction CompileJob;
+
+    // Declared last so that it is destroyed (and waited for) before the
+    // layers used by the compile jobs
+    std::unique_ptr<llvm::ThreadPool> CompileThreads;
+
 public:
     std::list<std::string> NewFunctions;
 
+    // Symbols which are neither defined by the new code nor pre-existing.
+    // They are expected to be provided by the dynamic libraries at link time.
+    std::set<std::string> UnresolvedImports;
+
     CrisprCompiler(
             string const &TargetTriple,
             uint64_t CodeSegmentVirtualAddress,
             uint64_t DataSegmentVirtualAddress,
-            uint64_t RoDataSegmentVirtualAddress);
+            uint64_t RoDataSegmentVirtualAddress,
+            const CrisprCompilerOptions &Options = CrisprCompilerOptions());
+
+    ~CrisprCompiler();
 
     CrisprCompiler(CrisprCompiler &&) = delete;
 
@@ -77,24 +153,66 @@ public:
 
     llvm::Error addObject(std::unique_ptr<llvm::MemoryBuffer> O);
 
-    llvm::Error addExistingSymbols(const std::map<string, uint64_t> &Symbols);
+    // Defines all the symbols at once, the table is not needed afterwards
+    llvm::Error addExistingSymbols(const CrisprSymbolTable &Symbols);
 
-    llvm::Error addExistingSymbols(const std::map<string, uint64_t> &Symbols, llvm::JITSymbolFlags flags);
+    llvm::Error addExistingSymbols(const CrisprSymbolTable &Symbols, llvm::JITSymbolFlags flags);
 
     llvm::Expected<llvm::JITSymbol> findSymbol(llvm::StringRef Name);
 
-    static llvm::Expected<llvm::orc::ThreadSafeModule>
-    optimizeModule(llvm::orc::ThreadSafeModule M, const llvm::orc::MaterializationResponsibility &R);
+    // Looks up all the given symbols at once, so that their compilation can
+    // be dispatched concurrently
+    llvm::Expected<std::map<string, uint64_t>> findSymbols(const std::list<string> &Names);
+
+    void optimizeModule(llvm::Module &M) const;
 
-    static llvm::Expected<llvm::orc::ThreadSafeModule>
-    isolateSections(llvm::orc::ThreadSafeModule M, const llvm::orc::MaterializationResponsibility &R);
+    void isolateSections(llvm::Module &M) const;
 
     void dumpSegments(const string &to_dir);
 
+    // The code and data of every object, relocated for the addresses given
+    // to the compiler
+    [[nodiscard]] const std::vector<std::unique_ptr<CrisprMemoryManager::MemorySegments>> &getSegments() const {
+        return MemorySegmentsV;
+    }
+
+    [[nodiscard]] std::vector<llvm::MemoryBufferRef> getObjects() const {
+        return CrisprLinkingLayer.getObjects();
+    }
+
+    // Rank of the sections of the new functions in the layout, empty unless
+    // the functions are ordered
+    [[nodiscard]] const std::map<string, unsigned> &getSectionOrder() const { return SectionOrder; }
+
+    // Sections of the functions which the layout found hot
+    [[nodiscard]] const std::set<string> &getHotSections() const { return HotSections; }
+
 
 private:
     std::unique_ptr<llvm::RuntimeDyld::MemoryManager> getMemoryManager();
 
+    llvm::orc::IRCompileLayer::CompileFunction getCompileFunction(const string &TargetTriple);
+
+    // Generates the code of the modules on the pool, then adds the objects
+    llvm::Error compileConcurrently(std::vector<llvm::orc::ThreadSafeModule> Modules);
+
+    [[nodiscard]] string getTargetCPU() const;
+
+    [[nodiscard]] std::vector<string> getTargetFeatures() const;
+
+    [[nodiscard]] llvm::CodeGenOpt::Level getCodeGenOptLevel() const;
+
+    string getCompilerConfiguration() const;
+
+    [[nodiscard]] bool isVerbose() const { return Options.LogLevel == CrisprLogLevel::Verbose; }
+
+    llvm::Expected<std::vector<llvm::orc::ThreadSafeModule>> splitModule(llvm::orc::ThreadSafeModule M);
+
+    void orderFunctions(llvm::Module &M);
+
+    llvm::Expected<llvm::orc::SymbolNameSet>
+    defineUnresolvedImports(llvm::orc::JITDylib &JD, const llvm::orc::SymbolNameSet &Names);
+
     static llvm::TargetOptions getTargetOptions() {
         llvm::TargetOptions TO;
         TO.FunctionSections = true;
@@ -0,0 +1,63 @@
+#ifndef CRISPR_CRISPRDETOURS_H
+#define CRISPR_CRISPRDETOURS_H
+
+#include <cstdint>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/MathExtras.h"
+
+// x86-64 detours from the entry point of a patched function to its new code.
+// The shortest direct jump which reaches the new code is used, falling back
+// to an indirect jump through a slot placed right after the instruction:
+//   jmp rel8
+//   jmp rel32
+//   jmp [rip + 0]; .quad target
+// Unlike an indirect jump through a register, none of them clobbers a
+// register, and the direct ones are predicted correctly.
+constexpr uint64_t JmpRel8Size = 2;
+constexpr uint64_t JmpRel32Size = 5;
+constexpr uint64_t JmpAbsoluteSize = 14;
+
+inline bool fitsInRel8(uint64_t From, uint64_t To, uint64_t InstructionSize) {
+    return llvm::isInt<8>(static_cast<int64_t>(To - From - InstructionSize));
+}
+
+inline bool fitsInRel32(uint64_t From, uint64_t To, uint64_t InstructionSize) {
+    return llvm::isInt<32>(static_cast<int64_t>(To - From - InstructionSize));
+}
+
+inline uint64_t getDetourSize(uint64_t From, uint64_t To) {
+    if (fitsInRel8(From, To, JmpRel8Size)) return JmpRel8Size;
+    if (fitsInRel32(From, To, JmpRel32Size)) return JmpRel32Size;
+    return JmpAbsoluteSize;
+}
+
+inline llvm::SmallVector<uint8_t, 16> getDetourPatch(uint64_t From, uint64_t To) {
+    using namespace llvm::support::endian;
+
+    switch (getDetourSize(From, To)) {
+        case JmpRel8Size:
+            return {0xEB, static_cast<uint8_t>(To - From - JmpRel8Size)};
+        case JmpRel32Size: {
+            llvm::SmallVector<uint8_t, 16> Patch = {0xE9, 0, 0, 0, 0};
+            write32le(&Patch[1], static_cast<uint32_t>(To - From - JmpRel32Size));
+            return Patch;
+        }
+        default: {
+            llvm::SmallVector<uint8_t, 16> Patch = {0xFF, 0x25, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+            write64le(&Patch[6], To);
+            return Patch;
+        }
+    }
+}
+
+// Displacement which points the branch of InstructionSize bytes at From,
+// ending with a rel32 operand, to To. The caller checks that To is reachable.
+inline llvm::SmallVector<uint8_t, 4> getRel32Displacement(uint64_t From, uint64_t InstructionSize, uint64_t To) {
+    llvm::SmallVector<uint8_t, 4> Displacement = {0, 0, 0, 0};
+    llvm::support::endian::write32le(Displacement.data(), static_cast<uint32_t>(To - From - InstructionSize));
+    return Displacement;
+}
+
+#endif//CRISPR_CRISPRDETOURS_H
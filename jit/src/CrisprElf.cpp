@@ -0,0 +1,249 @@
+#include <algorithm>
+
+#include "CrisprElf.h"
+
+using namespace llvm;
+using namespace std;
+
+Expected<unique_ptr<CrisprElf>> CrisprElf::open(const string &Path) {
+    // Not requiring a null terminator allows MemoryBuffer to mmap the file
+    auto MB = MemoryBuffer::getFile(Path, -1, false);
+    if (!MB) {
+        return make_error<StringError>("Could not open " + Path + ": " + MB.getError().message(),
+                                       MB.getError());
+    }
+    return create(std::move(*MB));
+}
+
+Expected<unique_ptr<CrisprElf>> CrisprElf::create(unique_ptr<MemoryBuffer> Buffer) {
+    unique_ptr<CrisprElf> Elf(new CrisprElf(std::move(Buffer)));
+    if (auto Err = Elf->parse()) return std::move(Err);
+    return std::move(Elf);
+}
+
+Error CrisprElf::malformed(const Twine &Message) const {
+    return make_error<StringError>(Buffer->getBufferIdentifier() + ": " + Message, inconvertibleErrorCode());
+}
+
+Error CrisprElf::parse() {
+    StringRef Data = getBuffer();
+    if (Data.size() < sizeof(Elf_Ehdr) || !Data.startswith(ELF::ElfMagic)) {
+        return malformed("not an ELF file");
+    }
+
+    Header = reinterpret_cast<const Elf_Ehdr *>(Data.data());
+    if (Header->getFileClass() != ELF::ELFCLASS64 || Header->getDataEncoding() != ELF::ELFDATA2LSB) {
+        return malformed("only 64-bit little endian ELF files are supported");
+    }
+
+    if (Header->e_phnum && Header->e_phentsize != sizeof(Elf_Phdr)) return malformed("unexpected e_phentsize");
+    if (Header->e_shnum && Header->e_shentsize != sizeof(Elf_Shdr)) return malformed("unexpected e_shentsize");
+
+    auto Phdrs = getArray<Elf_Phdr>(Header->e_phoff, Header->e_phnum);
+    if (!Phdrs) return Phdrs.takeError();
+    ProgramHeaders = *Phdrs;
+
+    auto Shdrs = getArray<Elf_Shdr>(Header->e_shoff, Header->e_shnum);
+    if (!Shdrs) return Shdrs.takeError();
+    Sections = *Shdrs;
+
+    if (Header->e_shstrndx != ELF::SHN_UNDEF && Header->e_shstrndx < Sections.size()) {
+        auto const &Strtab = Sections[Header->e_shstrndx];
+        auto Names = getArray<char>(Strtab.sh_offset, Strtab.sh_size);
+        if (!Names) return Names.takeError();
+        SectionNames = StringRef(Names->data(), Names->size());
+    }
+
+    return parseDynamic();
+}
+
+Error CrisprElf::parseDynamic() {
+    auto Dynamic = find_if(ProgramHeaders, [](const Elf_Phdr &P) { return P.p_type == ELF::PT_DYNAMIC; });
+    if (Dynamic == ProgramHeaders.end()) return Error::success();
+
+    auto Entries = getArray<Elf_Dyn>(Dynamic->p_offset, Dynamic->p_filesz / sizeof(Elf_Dyn));
+    if (!Entries) return Entries.takeError();
+    auto Null = find_if(*Entries, [](const Elf_Dyn &D) { return D.getTag() == ELF::DT_NULL; });
+    DynamicEntries = Entries->take_front(Null - Entries->begin());
+
+    if (auto Strtab = getDynamicTag(ELF::DT_STRTAB)) {
+        auto Strings = getArrayAt<char>(*Strtab, getDynamicTag(ELF::DT_STRSZ).getValueOr(0));
+        if (!Strings) return Strings.takeError();
+        DynamicStringTable = StringRef(Strings->data(), Strings->size());
+    }
+
+    if (auto PltRel = getDynamicTag(ELF::DT_PLTREL)) {
+        if (*PltRel != ELF::DT_RELA) return malformed("only RELA relocations are supported");
+    }
+    if (getDynamicTag(ELF::DT_REL)) return malformed("only RELA relocations are supported");
+
+    if (auto Rela = getDynamicTag(ELF::DT_RELA)) {
+        auto Relocations = getArrayAt<Elf_Rela>(*Rela, getDynamicTag(ELF::DT_RELASZ).getValueOr(0) / sizeof(Elf_Rela));
+        if (!Relocations) return Relocations.takeError();
+        DynamicRelocations = *Relocations;
+    }
+
+    if (auto JmpRel = getDynamicTag(ELF::DT_JMPREL)) {
+        auto Relocations = getArrayAt<Elf_Rela>(*JmpRel, getDynamicTag(ELF::DT_PLTRELSZ).getValueOr(0) / sizeof(Elf_Rela));
+        if (!Relocations) return Relocations.takeError();
+        PltRelocations = *Relocations;
+    }
+
+    if (auto Relr = getDynamicTag(ELF::DT_RELR)) {
+        auto Relocations = getArrayAt<Elf_Relr>(*Relr, getDynamicTag(ELF::DT_RELRSZ).getValueOr(0) / sizeof(Elf_Relr));
+        if (!Relocations) return Relocations.takeError();
+        PackedRelocations = *Relocations;
+    }
+
+    auto SymbolsCount = countDynamicSymbols();
+    if (!SymbolsCount) return SymbolsCount.takeError();
+
+    if (auto Symtab = getDynamicTag(ELF::DT_SYMTAB)) {
+        auto Symbols = getArrayAt<Elf_Sym>(*Symtab, *SymbolsCount);
+        if (!Symbols) return Symbols.takeError();
+        DynamicSymbols = *Symbols;
+    }
+
+    if (auto Versym = getDynamicTag(ELF::DT_VERSYM)) {
+        auto Versions = getArrayAt<Elf_Versym>(*Versym, *SymbolsCount);
+        if (!Versions) return Versions.takeError();
+        SymbolVersions = *Versions;
+    }
+
+    if (auto Verneed = getDynamicTag(ELF::DT_VERNEED)) {
+        auto Offset = virtualAddressToOffset(*Verneed);
+        if (!Offset) return Offset.takeError();
+
+        uint64_t NeedOffset = *Offset;
+        for (uint64_t I = 0, E = getDynamicTag(ELF::DT_VERNEEDNUM).getValueOr(0); I < E; I++) {
+            auto Need = getArray<Elf_Verneed>(NeedOffset, 1);
+            if (!Need) return Need.takeError();
+
+            VersionNeed Entry{Need->front(), {}};
+            uint64_t AuxOffset = NeedOffset + Entry.Need.vn_aux;
+            for (unsigned J = 0; J < Entry.Need.vn_cnt; J++) {
+                auto Aux = getArray<Elf_Vernaux>(AuxOffset, 1);
+                if (!Aux) return Aux.takeError();
+                Entry.Auxs.push_back(Aux->front());
+                AuxOffset += Aux->front().vna_next;
+            }
+
+            NeedOffset += Entry.Need.vn_next;
+            VersionNeeds.push_back(std::move(Entry));
+        }
+    }
+
+    return Error::success();
+}
+
+Expected<uint64_t> CrisprElf::countDynamicSymbols() const {
+    // The dynamic section does not record the number of symbols.
+    // The section headers are the most reliable source, then the hash tables.
+    for (auto const &Section : Sections) {
+        if (Section.sh_type == ELF::SHT_DYNSYM && Section.sh_entsize) {
+            return Section.sh_size / Section.sh_entsize;
+        }
+    }
+
+    if (auto Hash = getDynamicTag(ELF::DT_HASH)) {
+        // nbucket, nchain
+        auto HashHeader = getArrayAt<support::ulittle32_t>(*Hash, 2);
+        if (!HashHeader) return HashHeader.takeError();
+        return (*HashHeader)[1];
+    }
+
+    if (auto GnuHash = getDynamicTag(ELF::DT_GNU_HASH)) {
+        // nbuckets, symoffset, bloom size, bloom shift, bloom, buckets, chains
+        auto HashHeader = getArrayAt<support::ulittle32_t>(*GnuHash, 4);
+        if (!HashHeader) return HashHeader.takeError();
+        uint32_t NBuckets = (*HashHeader)[0];
+        uint32_t SymOffset = (*HashHeader)[1];
+        uint32_t BloomSize = (*HashHeader)[2];
+
+        uint64_t BucketsAddress = *GnuHash + 16 + BloomSize * sizeof(uint64_t);
+        auto Buckets = getArrayAt<support::ulittle32_t>(BucketsAddress, NBuckets);
+        if (!Buckets) return Buckets.takeError();
+
+        uint32_t Last = 0;
+        for (uint32_t Bucket : *Buckets) Last = std::max(Last, Bucket);
+        if (Last < SymOffset) return SymOffset;
+
+        // Walk the chain of the last bucket until the terminator bit
+        uint64_t ChainsAddress = BucketsAddress + NBuckets * sizeof(uint32_t);
+        while (true) {
+            auto Chain = getArrayAt<support::ulittle32_t>(ChainsAddress + (Last - SymOffset) * sizeof(uint32_t), 1);
+            if (!Chain) return Chain.takeError();
+            if (Chain->front() & 1) return Last + 1;
+            Last++;
+        }
+    }
+
+    // Last resort: the highest symbol referenced by a relocation
+    uint64_t Count = 0;
+    for (auto const &Relocations : {DynamicRelocations, PltRelocations}) {
+        for (auto const &Relocation : Relocations) {
+            Count = std::max<uint64_t>(Count, Relocation.getSymbol(false) + 1);
+        }
+    }
+    return Count;
+}
+
+StringRef CrisprElf::getSectionName(const Elf_Shdr &Section) const {
+    if (Section.sh_name >= SectionNames.size()) return "";
+    return StringRef(SectionNames.data() + Section.sh_name);
+}
+
+Optional<uint64_t> CrisprElf::getDynamicTag(int64_t Tag) const {
+    for (auto const &Entry : DynamicEntries) {
+        if (Entry.getTag() == Tag) return Entry.getVal();
+    }
+    return None;
+}
+
+uint64_t CrisprElf::getLowestLoadAddress() const {
+    uint64_t Lowest = UINT64_MAX;
+    for (auto const &Phdr : ProgramHeaders) {
+        if (Phdr.p_type == ELF::PT_LOAD) Lowest = std::min<uint64_t>(Lowest, Phdr.p_vaddr);
+    }
+    return Lowest;
+}
+
+const CrisprElf::Elf_Phdr *CrisprElf::findLoadSegment(uint64_t Address, uint64_t Size) const {
+    for (auto const &Phdr : ProgramHeaders) {
+        if (Phdr.p_type != ELF::PT_LOAD) continue;
+        if (Address < Phdr.p_vaddr + Phdr.p_memsz && Phdr.p_vaddr < Address + Size) return &Phdr;
+    }
+    return nullptr;
+}
+
+bool CrisprElf::isCode(uint64_t Address, uint64_t Size) const {
+    bool Executable = false;
+    for (auto const &Phdr : ProgramHeaders) {
+        if (Phdr.p_type != ELF::PT_LOAD || !(Phdr.p_flags & ELF::PF_X)) continue;
+        if (Address >= Phdr.p_vaddr && Address + Size <= Phdr.p_vaddr + Phdr.p_filesz) Executable = true;
+    }
+    if (!Executable) return false;
+
+    // Executable segments often contain read-only data too
+    if (Sections.empty()) return true;
+    for (auto const &Section : Sections) {
+        if (!(Section.sh_flags & ELF::SHF_EXECINSTR)) continue;
+        if (Address >= Section.sh_addr && Address + Size <= Section.sh_addr + Section.sh_size) return true;
+    }
+    return false;
+}
+
+Expected<uint64_t> CrisprElf::virtualAddressToOffset(uint64_t Address) const {
+    for (auto const &Phdr : ProgramHeaders) {
+        if (Phdr.p_type != ELF::PT_LOAD) continue;
+        if (Address >= Phdr.p_vaddr && Address < Phdr.p_vaddr + Phdr.p_filesz) {
+            return Phdr.p_offset + (Address - Phdr.p_vaddr);
+        }
+    }
+    return malformed("address 0x" + Twine::utohexstr(Address) + " is not backed by the file");
+}
+
+Expected<ArrayRef<uint8_t>> CrisprElf::readAddress(uint64_t Address, uint64_t Size) const {
+    if (Size == 0) return ArrayRef<uint8_t>();
+    return getArrayAt<uint8_t>(Address, Size);
+}
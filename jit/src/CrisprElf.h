@@ -0,0 +1,134 @@
+#ifndef CRISPR_CRISPRELF_H
+#define CRISPR_CRISPRELF_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/BinaryFormat/ELF.h"
+#include "llvm/Object/ELFTypes.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+// Read-only view over a 64-bit little endian ELF image.
+// Nothing is copied: files are mmapped and the accessors return references
+// into the mapping.
+class CrisprElf {
+public:
+    using ELFT = llvm::object::ELF64LE;
+    using Elf_Ehdr = ELFT::Ehdr;
+    using Elf_Phdr = ELFT::Phdr;
+    using Elf_Shdr = ELFT::Shdr;
+    using Elf_Sym = ELFT::Sym;
+    using Elf_Rela = ELFT::Rela;
+    using Elf_Relr = ELFT::Relr;
+    using Elf_Dyn = ELFT::Dyn;
+    using Elf_Versym = ELFT::Versym;
+    using Elf_Verneed = ELFT::Verneed;
+    using Elf_Vernaux = ELFT::Vernaux;
+
+    struct VersionNeed {
+        Elf_Verneed Need;
+        std::vector<Elf_Vernaux> Auxs;
+    };
+
+    static llvm::Expected<std::unique_ptr<CrisprElf>> open(const std::string &Path);
+
+    static llvm::Expected<std::unique_ptr<CrisprElf>> create(std::unique_ptr<llvm::MemoryBuffer> Buffer);
+
+    [[nodiscard]] llvm::StringRef getBuffer() const { return Buffer->getBuffer(); }
+
+    [[nodiscard]] uint64_t getSize() const { return Buffer->getBufferSize(); }
+
+    [[nodiscard]] const Elf_Ehdr &getHeader() const { return *Header; }
+
+    [[nodiscard]] llvm::ArrayRef<Elf_Phdr> programHeaders() const { return ProgramHeaders; }
+
+    [[nodiscard]] llvm::ArrayRef<Elf_Shdr> sections() const { return Sections; }
+
+    [[nodiscard]] llvm::StringRef getSectionName(const Elf_Shdr &Section) const;
+
+    [[nodiscard]] bool isDynamic() const { return !DynamicEntries.empty(); }
+
+    // Dynamic entries, without the terminating DT_NULL
+    [[nodiscard]] llvm::ArrayRef<Elf_Dyn> dynamicEntries() const { return DynamicEntries; }
+
+    [[nodiscard]] llvm::Optional<uint64_t> getDynamicTag(int64_t Tag) const;
+
+    [[nodiscard]] llvm::StringRef getDynamicStringTable() const { return DynamicStringTable; }
+
+    [[nodiscard]] llvm::ArrayRef<Elf_Sym> getDynamicSymbols() const { return DynamicSymbols; }
+
+    [[nodiscard]] llvm::ArrayRef<Elf_Rela> getDynamicRelocations() const { return DynamicRelocations; }
+
+    [[nodiscard]] llvm::ArrayRef<Elf_Rela> getPltRelocations() const { return PltRelocations; }
+
+    // Encoded DT_RELR table, if the linker packed the relative relocations
+    [[nodiscard]] llvm::ArrayRef<Elf_Relr> getPackedRelocations() const { return PackedRelocations; }
+
+    [[nodiscard]] llvm::ArrayRef<Elf_Versym> getSymbolVersions() const { return SymbolVersions; }
+
+    [[nodiscard]] const std::vector<VersionNeed> &getVersionNeeds() const { return VersionNeeds; }
+
+    [[nodiscard]] uint64_t getLowestLoadAddress() const;
+
+    [[nodiscard]] const Elf_Phdr *findLoadSegment(uint64_t Address, uint64_t Size) const;
+
+    // Whether the range is backed by the file in an executable segment and,
+    // if the binary has section headers, lies in a code section
+    [[nodiscard]] bool isCode(uint64_t Address, uint64_t Size) const;
+
+    llvm::Expected<uint64_t> virtualAddressToOffset(uint64_t Address) const;
+
+    llvm::Expected<llvm::ArrayRef<uint8_t>> readAddress(uint64_t Address, uint64_t Size) const;
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+
+    const Elf_Ehdr *Header;
+    llvm::ArrayRef<Elf_Phdr> ProgramHeaders;
+    llvm::ArrayRef<Elf_Shdr> Sections;
+    llvm::StringRef SectionNames;
+
+    llvm::ArrayRef<Elf_Dyn> DynamicEntries;
+    llvm::StringRef DynamicStringTable;
+    llvm::ArrayRef<Elf_Sym> DynamicSymbols;
+    llvm::ArrayRef<Elf_Rela> DynamicRelocations;
+    llvm::ArrayRef<Elf_Rela> PltRelocations;
+    llvm::ArrayRef<Elf_Relr> PackedRelocations;
+    llvm::ArrayRef<Elf_Versym> SymbolVersions;
+    std::vector<VersionNeed> VersionNeeds;
+
+    explicit CrisprElf(std::unique_ptr<llvm::MemoryBuffer> Buffer) : Buffer(std::move(Buffer)),
+                                                                     Header(nullptr) {}
+
+    llvm::Error parse();
+
+    llvm::Error parseDynamic();
+
+    llvm::Expected<uint64_t> countDynamicSymbols() const;
+
+    template<typename T>
+    llvm::Expected<llvm::ArrayRef<T>> getArray(uint64_t Offset, uint64_t Count) const {
+        if (Offset > getSize() || Count > (getSize() - Offset) / sizeof(T)) {
+            return malformed("table at offset " + llvm::Twine(Offset) + " exceeds the file size");
+        }
+        return llvm::ArrayRef<T>(reinterpret_cast<const T *>(getBuffer().data() + Offset), Count);
+    }
+
+    template<typename T>
+    llvm::Expected<llvm::ArrayRef<T>> getArrayAt(uint64_t Address, uint64_t Count) const {
+        auto Offset = virtualAddressToOffset(Address);
+        if (!Offset) return Offset.takeError();
+        return getArray<T>(*Offset, Count);
+    }
+
+    llvm::Error malformed(const llvm::Twine &Message) const;
+};
+
+#endif//CRISPR_CRISPRELF_H
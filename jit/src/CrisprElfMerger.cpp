@@ -0,0 +1,939 @@
+#include <algorithm>
+#include <map>
+#include <numeric>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprAddressPlanner.h"
+#include "CrisprElfMerger.h"
+
+using namespace llvm;
+using namespace std;
+
+static CrisprElf::Elf_Dyn makeDynamicEntry(int64_t Tag, uint64_t Value) {
+    CrisprElf::Elf_Dyn Entry;
+    Entry.d_tag = Tag;
+    Entry.d_un.d_val = Value;
+    return Entry;
+}
+
+template<typename T>
+static void appendArray(string &Out, ArrayRef<T> Array) {
+    Out.append(reinterpret_cast<const char *>(Array.data()), Array.size() * sizeof(T));
+}
+
+static void padTo(string &Out, uint64_t Alignment) {
+    Out.resize(alignTo(Out.size(), Alignment), '\0');
+}
+
+uint32_t getGnuHash(StringRef Name) {
+    uint32_t Hash = 5381;
+    for (uint8_t C : Name) Hash = Hash * 33 + C;
+    return Hash;
+}
+
+static uint32_t getSysVHash(StringRef Name) {
+    uint32_t Hash = 0;
+    for (uint8_t C : Name) {
+        Hash = (Hash << 4) + C;
+        uint32_t High = Hash & 0xf0000000;
+        Hash ^= High >> 24;
+        Hash &= ~High;
+    }
+    return Hash;
+}
+
+static bool isHashed(const CrisprElf::Elf_Sym &Symbol) {
+    return Symbol.st_shndx != ELF::SHN_UNDEF && Symbol.getBinding() != ELF::STB_LOCAL;
+}
+
+uint32_t getGnuHashBucketsCount(uint32_t HashedCount) {
+    return std::max<uint32_t>((HashedCount + 1) / 2, 1);
+}
+
+static Expected<uint32_t> getRelativeRelocationType(uint16_t Machine) {
+    switch (Machine) {
+        case ELF::EM_X86_64:
+            return ELF::R_X86_64_RELATIVE;
+        case ELF::EM_AARCH64:
+            return ELF::R_AARCH64_RELATIVE;
+        default:
+            return make_error<StringError>("Unsupported machine " + Twine(Machine), inconvertibleErrorCode());
+    }
+}
+
+// PHDR first, then INTERP, then the LOADs in ascending address order
+static pair<int, uint64_t> programHeaderSortKey(const CrisprElf::Elf_Phdr &Phdr) {
+    switch (Phdr.p_type) {
+        case ELF::PT_PHDR:
+            return {1, Phdr.p_vaddr};
+        case ELF::PT_INTERP:
+            return {2, Phdr.p_vaddr};
+        case ELF::PT_LOAD:
+            return {3, Phdr.p_vaddr};
+        default:
+            return {4, Phdr.p_vaddr};
+    }
+}
+
+Error CrisprElfMerger::error(const Twine &Message) const {
+    return make_error<StringError>("Cannot merge the dynamic sections: " + Message, inconvertibleErrorCode());
+}
+
+Error CrisprElfMerger::merge(CrisprOutputFile &Output) {
+    // If the source is not dynamic there is nothing to merge,
+    // the output already is a copy of the binary to extend
+    if (!Source.isDynamic()) return Error::success();
+
+    if (!ToExtend.isDynamic()) return error("the binary to extend is not dynamic");
+    if (ToExtend.getHeader().e_machine != Source.getHeader().e_machine) return error("the machines differ");
+    if (ToExtend.getDynamicSymbols().empty()) return error("the binary to extend has no dynamic symbols");
+
+    // Prepare new .dynstr
+    StringRef ToExtendDynstr = ToExtend.getDynamicStringTable();
+    if (ToExtendDynstr.empty() || ToExtendDynstr.back() != '\0') {
+        return error(".dynstr of the binary to extend is not NULL terminated");
+    }
+    Dynstr = ToExtendDynstr.str();
+    Dynstr += Source.getDynamicStringTable();
+
+    if (auto Err = mergeSymbols()) return Err;
+    if (auto Err = mergeRelocations()) return Err;
+    mergeVersions();
+    sortSymbolsForHashing();
+    buildGnuHashTable();
+
+    vector<Elf_Phdr> ProgramHeaders(ToExtend.programHeaders().begin(), ToExtend.programHeaders().end());
+
+    vector<Elf_Phdr> AdditionalSegments;
+    vector<pair<uint64_t, StringRef>> InPlaceContents;
+    for (auto const &Phdr : Source.programHeaders()) {
+        if (Phdr.p_type != ELF::PT_LOAD) continue;
+        if (auto Err = splitSegment(Phdr, ProgramHeaders, AdditionalSegments, InPlaceContents)) return Err;
+    }
+
+    if (PackRelativeRelocations) {
+        if (auto Err = packRelocations(ProgramHeaders, AdditionalSegments)) return Err;
+    }
+
+    // Lay out the new segment, aligning every table to its natural alignment
+    TailLayout Layout{};
+    uint64_t Cursor = 0;
+    auto Place = [&Cursor](uint64_t Size, uint64_t Alignment) {
+        Cursor = alignTo(Cursor, Alignment);
+        uint64_t Offset = Cursor;
+        Cursor += Size;
+        return Offset;
+    };
+    Layout.Dynstr = Place(Dynstr.size(), 1);
+    Layout.Dynsym = Place(Dynsym.size() * sizeof(Elf_Sym), 8);
+    Layout.Relocations = Place(Relocations.size() * sizeof(Elf_Rela), 8);
+    Layout.PltRelocations = Place(PltRelocations.size() * sizeof(Elf_Rela), 8);
+    Layout.Relr = Place(Relr.size() * sizeof(Elf_Relr), 8);
+    Layout.Versym = Place(Versym.size() * sizeof(Elf_Versym), 2);
+    Layout.VerneedSize = serializeVerneeds().size();
+    Layout.Verneed = Place(Layout.VerneedSize, 8);
+    Layout.GnuHash = Place(GnuHash.size(), 8);
+    Layout.DynamicSize = buildDynamic(0, Layout).size() * sizeof(Elf_Dyn);
+    Layout.Dynamic = Place(Layout.DynamicSize, 8);
+    Layout.SectionHeaders = Place(ToExtend.sections().size() * sizeof(Elf_Shdr), 8);
+
+    uint64_t ProgramHeadersCount = ToExtend.programHeaders().size() + AdditionalSegments.size() + 1;
+    Layout.ProgramHeaders = Place(ProgramHeadersCount * sizeof(Elf_Phdr), 8);
+    Layout.Size = Cursor;
+
+    // Executable segments are padded, with zeros in the file
+    auto getPaddedSize = [this](const Elf_Phdr &Phdr) -> uint64_t {
+        if (!(Phdr.p_flags & ELF::PF_X) || CodeSegmentAlignment <= PageSize) return Phdr.p_memsz;
+        return alignTo(Phdr.p_memsz, CodeSegmentAlignment);
+    };
+    for (auto const &Phdr : AdditionalSegments) {
+        uint64_t PaddedSize = getPaddedSize(Phdr);
+        if (PaddedSize == Phdr.p_memsz) continue;
+        if (Phdr.p_vaddr % CodeSegmentAlignment != 0 || Phdr.p_filesz != Phdr.p_memsz
+            || Source.findLoadSegment(Phdr.p_vaddr + Phdr.p_memsz, PaddedSize - Phdr.p_memsz)) {
+            return error("the code segment at 0x" + Twine::utohexstr(Phdr.p_vaddr) + " cannot be padded to 0x"
+                         + Twine::utohexstr(CodeSegmentAlignment));
+        }
+    }
+
+    // Find a free address range for the new segment after the end of the file.
+    // The offset in the file is chosen so that the segment has the same
+    // address-offset delta as the first LOAD segment, since some kernels
+    // compute AT_PHDR from e_phoff assuming that.
+    CrisprAddressPlanner Planner;
+    Planner.reserveSegments(ToExtend);
+    for (auto const &Phdr : AdditionalSegments) Planner.reserve(Phdr.p_vaddr, getPaddedSize(Phdr));
+    for (auto const &Phdr : Source.programHeaders()) {
+        if (Phdr.p_type == ELF::PT_LOAD) Planner.reserve(Phdr.p_vaddr, Phdr.p_memsz);
+    }
+    uint64_t BaseAddress = ToExtend.getLowestLoadAddress();
+    uint64_t TailAddress = Planner.findFree(Layout.Size, PageSize, BaseAddress + ToExtend.getSize());
+    uint64_t TailOffset = TailAddress - BaseAddress;
+
+    // Prepare new program headers
+    uint64_t AdditionalOffset = alignTo(TailOffset + Layout.Size, PageSize);
+    vector<pair<uint64_t, StringRef>> AdditionalContents;
+    uint64_t FileEnd = 0;
+    for (Elf_Phdr Phdr : AdditionalSegments) {
+        StringRef Content = Source.getBuffer().substr(Phdr.p_offset, Phdr.p_filesz);
+        uint64_t PaddedSize = getPaddedSize(Phdr);
+        if (PaddedSize != Phdr.p_memsz) {
+            Phdr.p_filesz = PaddedSize;
+            Phdr.p_memsz = PaddedSize;
+            Phdr.p_align = std::max<uint64_t>(Phdr.p_align, CodeSegmentAlignment);
+        }
+
+        // Keep the offset congruent to the address modulo the alignment
+        uint64_t Alignment = std::max<uint64_t>(Phdr.p_align, PageSize);
+        AdditionalOffset += (Phdr.p_vaddr - AdditionalOffset) & (Alignment - 1);
+        Phdr.p_offset = AdditionalOffset;
+        AdditionalOffset = alignTo(AdditionalOffset + Phdr.p_filesz, PageSize);
+
+        FileEnd = std::max<uint64_t>(FileEnd, Phdr.p_offset + Phdr.p_filesz);
+        ProgramHeaders.push_back(Phdr);
+        AdditionalContents.emplace_back(Phdr.p_offset, Content);
+    }
+
+    uint64_t ProgramHeadersSize = ProgramHeadersCount * sizeof(Elf_Phdr);
+    for (auto &Phdr : ProgramHeaders) {
+        if (Phdr.p_type == ELF::PT_DYNAMIC) {
+            Phdr.p_offset = TailOffset + Layout.Dynamic;
+            Phdr.p_vaddr = TailAddress + Layout.Dynamic;
+            Phdr.p_paddr = TailAddress + Layout.Dynamic;
+            Phdr.p_filesz = Layout.DynamicSize;
+            Phdr.p_memsz = Layout.DynamicSize;
+        } else if (Phdr.p_type == ELF::PT_PHDR) {
+            Phdr.p_offset = TailOffset + Layout.ProgramHeaders;
+            Phdr.p_vaddr = TailAddress + Layout.ProgramHeaders;
+            Phdr.p_paddr = TailAddress + Layout.ProgramHeaders;
+            Phdr.p_filesz = ProgramHeadersSize;
+            Phdr.p_memsz = ProgramHeadersSize;
+        }
+    }
+
+    Elf_Phdr TailSegment{};
+    TailSegment.p_type = ELF::PT_LOAD;
+    TailSegment.p_flags = ELF::PF_R | ELF::PF_W;
+    TailSegment.p_offset = TailOffset;
+    TailSegment.p_vaddr = TailAddress;
+    TailSegment.p_paddr = TailAddress;
+    TailSegment.p_filesz = Layout.Size;
+    TailSegment.p_memsz = Layout.Size;
+    TailSegment.p_align = PageSize;
+    ProgramHeaders.push_back(TailSegment);
+
+    std::stable_sort(ProgramHeaders.begin(), ProgramHeaders.end(), [](const Elf_Phdr &A, const Elf_Phdr &B) {
+        return programHeaderSortKey(A) < programHeaderSortKey(B);
+    });
+
+    // Serialize the new segment
+    string Tail;
+    Tail.reserve(Layout.Size);
+    Tail += Dynstr;
+    padTo(Tail, 8);
+    appendArray<Elf_Sym>(Tail, Dynsym);
+    padTo(Tail, 8);
+    appendArray<Elf_Rela>(Tail, Relocations);
+    padTo(Tail, 8);
+    appendArray<Elf_Rela>(Tail, PltRelocations);
+    padTo(Tail, 8);
+    appendArray<Elf_Relr>(Tail, Relr);
+    padTo(Tail, 2);
+    appendArray<Elf_Versym>(Tail, Versym);
+    padTo(Tail, 8);
+    Tail += serializeVerneeds();
+    padTo(Tail, 8);
+    Tail += GnuHash;
+    padTo(Tail, 8);
+    appendArray<Elf_Dyn>(Tail, buildDynamic(TailAddress, Layout));
+    padTo(Tail, 8);
+    appendArray<Elf_Shdr>(Tail, buildSectionHeaders(TailAddress, TailOffset, Layout));
+    padTo(Tail, 8);
+    assert(Tail.size() == Layout.ProgramHeaders && "Unexpected layout of the new segment");
+    appendArray<Elf_Phdr>(Tail, ProgramHeaders);
+
+    // Prepare new ELF header
+    CrisprElf::Elf_Ehdr Header = ToExtend.getHeader();
+    Header.e_phoff = TailOffset + Layout.ProgramHeaders;
+    Header.e_phnum = ProgramHeaders.size();
+    Header.e_shoff = TailOffset + Layout.SectionHeaders;
+
+    // Only the header and the new data are written, the rest of the file is
+    // left untouched. The padding before the new segment is left as a hole.
+    auto HeaderBytes = ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(&Header), sizeof(Header));
+    if (auto Err = Output.write(0, HeaderBytes)) return Err;
+    if (auto Err = Output.write(TailOffset, Tail)) return Err;
+    for (auto const &Additional : AdditionalContents) {
+        if (auto Err = Output.write(Additional.first, Additional.second)) return Err;
+    }
+    for (auto const &InPlace : InPlaceContents) {
+        if (auto Err = Output.write(InPlace.first, InPlace.second)) return Err;
+    }
+    if (auto Err = writePackedAddends(Output, ProgramHeaders)) return Err;
+
+    // The padding of the last segment must be in the file too
+    if (FileEnd > Output.getSize()) return Output.resize(FileEnd);
+    return Error::success();
+}
+
+// The LOAD segment of the binary to extend which can store Size bytes at
+// Address in the file. The slack up to the end of the last page of a segment
+// can be claimed by extending the segment, unless it has a zero-initialized
+// part.
+static CrisprElf::Elf_Phdr *findReusableSegment(vector<CrisprElf::Elf_Phdr> &ProgramHeaders,
+                                                uint64_t Address,
+                                                uint64_t Size) {
+    for (auto &Phdr : ProgramHeaders) {
+        if (Phdr.p_type != ELF::PT_LOAD || Address < Phdr.p_vaddr) continue;
+
+        uint64_t End = Phdr.p_vaddr + Phdr.p_filesz;
+        if (Phdr.p_filesz == Phdr.p_memsz) End = alignTo(End, PageSize);
+        if (Address + Size <= End) return &Phdr;
+    }
+    return nullptr;
+}
+
+Error CrisprElfMerger::splitSegment(const Elf_Phdr &Segment,
+                                    vector<Elf_Phdr> &ProgramHeaders,
+                                    vector<Elf_Phdr> &AdditionalSegments,
+                                    vector<pair<uint64_t, StringRef>> &InPlaceContents) const {
+    // The linker puts the sections with the same permissions in the same
+    // segment, even if some of them were placed in the unused ranges of the
+    // binary to extend: those are written in place, the others are kept in a
+    // (smaller) new segment
+    uint64_t RestStart = UINT64_MAX;
+    uint64_t RestEnd = 0;
+    bool Reused = false;
+    for (auto const &Section : Source.sections()) {
+        if (!(Section.sh_flags & ELF::SHF_ALLOC) || Section.sh_size == 0) continue;
+        if (Section.sh_addr < Segment.p_vaddr || Section.sh_addr + Section.sh_size > Segment.p_vaddr + Segment.p_memsz) {
+            continue;
+        }
+
+        Elf_Phdr *Target = findReusableSegment(ProgramHeaders, Section.sh_addr, Section.sh_size);
+        if (!Target) {
+            RestStart = std::min<uint64_t>(RestStart, Section.sh_addr);
+            RestEnd = std::max<uint64_t>(RestEnd, Section.sh_addr + Section.sh_size);
+            continue;
+        }
+
+        if (Section.sh_type == ELF::SHT_NOBITS) {
+            return error(Source.getSectionName(Section) + " is uninitialized and cannot be written in place");
+        }
+
+        uint64_t End = Section.sh_addr + Section.sh_size - Target->p_vaddr;
+        if (End > Target->p_filesz) {
+            Target->p_filesz = End;
+            Target->p_memsz = End;
+        }
+
+        uint64_t Offset = Target->p_offset + (Section.sh_addr - Target->p_vaddr);
+        InPlaceContents.emplace_back(Offset, Source.getBuffer().substr(Section.sh_offset, Section.sh_size));
+        Reused = true;
+    }
+
+    if (!Reused && !ToExtend.findLoadSegment(Segment.p_vaddr, Segment.p_memsz)) {
+        AdditionalSegments.push_back(Segment);
+        return Error::success();
+    }
+
+    // Only the headers of the source, which are not needed, can be left
+    if (RestStart >= RestEnd) return Error::success();
+
+    if (ToExtend.findLoadSegment(RestStart, RestEnd - RestStart)) {
+        return error("the segment at 0x" + Twine::utohexstr(RestStart) + " overlaps the binary to extend");
+    }
+
+    Elf_Phdr Rest = Segment;
+    uint64_t FileEnd = Segment.p_vaddr + Segment.p_filesz;
+    Rest.p_vaddr = RestStart;
+    Rest.p_paddr = RestStart;
+    Rest.p_offset = Segment.p_offset + (RestStart - Segment.p_vaddr);
+    Rest.p_memsz = RestEnd - RestStart;
+    Rest.p_filesz = FileEnd > RestStart ? std::min(FileEnd, RestEnd) - RestStart : 0;
+    AdditionalSegments.push_back(Rest);
+    return Error::success();
+}
+
+Error CrisprElfMerger::mergeSymbols() {
+    auto ToExtendSymbols = ToExtend.getDynamicSymbols();
+    uint32_t DynstrShift = ToExtend.getDynamicStringTable().size();
+
+    // The first symbol of the source (the null symbol) is dropped
+    Dynsym.assign(ToExtendSymbols.begin(), ToExtendSymbols.end());
+    for (auto &Symbol : Dynsym) {
+        if (Symbol.st_shndx == ELF::SHN_UNDEF || Symbol.getType() != ELF::STT_FUNC) continue;
+        auto Redirection = Redirections.find(Symbol.st_value);
+        if (Redirection == Redirections.end()) continue;
+        Symbol.st_value = Redirection->second;
+        RedirectedSymbols++;
+    }
+    for (auto Symbol : Source.getDynamicSymbols().drop_front()) {
+        Symbol.st_name = Symbol.st_name + DynstrShift;
+        Dynsym.push_back(Symbol);
+    }
+
+    return Error::success();
+}
+
+Error CrisprElfMerger::mergeRelocations() {
+    auto RelativeType = getRelativeRelocationType(ToExtend.getHeader().e_machine);
+    if (!RelativeType) return RelativeType.takeError();
+
+    uint32_t SymbolShift = ToExtend.getDynamicSymbols().size() - 1;
+
+    // The PLT relocations of the binary to extend are copied in the same
+    // order, since lazy binding identifies them by index, while those of the
+    // source are processed eagerly with the others
+    auto ToExtendPltRelocations = ToExtend.getPltRelocations();
+    PltRelocations.assign(ToExtendPltRelocations.begin(), ToExtendPltRelocations.end());
+    auto ToExtendRelocations = ToExtend.getDynamicRelocations();
+    Relocations.assign(ToExtendRelocations.begin(), ToExtendRelocations.end());
+    for (auto &Relocation : Relocations) {
+        if (Relocation.getType(false) != *RelativeType) continue;
+        auto Redirection = Redirections.find(Relocation.r_addend);
+        if (Redirection == Redirections.end()) continue;
+        Relocation.r_addend = Redirection->second;
+        RedirectedRelocations++;
+    }
+    for (auto const &SourceRelocations : {Source.getPltRelocations(), Source.getDynamicRelocations()}) {
+        for (auto Relocation : SourceRelocations) {
+            uint32_t Symbol = Relocation.getSymbol(false);
+            uint32_t Type = Relocation.getType(false);
+
+            if (Symbol != 0) Symbol += SymbolShift;
+            Relocation.setSymbolAndType(Symbol, Type, false);
+
+            Relocations.push_back(Relocation);
+        }
+    }
+
+    return Error::success();
+}
+
+Error CrisprElfMerger::packRelocations(const vector<Elf_Phdr> &ProgramHeaders,
+                                       const vector<Elf_Phdr> &AdditionalSegments) {
+    uint32_t RelativeType = cantFail(getRelativeRelocationType(ToExtend.getHeader().e_machine));
+    auto IsRelative = [RelativeType](const Elf_Rela &Relocation) {
+        return Relocation.getType(false) == RelativeType;
+    };
+    if (ToExtend.getPackedRelocations().empty() && none_of(Relocations, IsRelative)) return Error::success();
+
+    // glibc rejects DT_RELR without this requirement, and the versions before
+    // 2.36, which would ignore the table, fail to find it
+    if (!requireVersion("libc.so.6", "GLIBC_ABI_DT_RELR")) return Error::success();
+
+    // The relative relocations the linker of the binary to extend packed are
+    // packed again with the others, their addends are already in place
+    const uint64_t WordSize = sizeof(Elf_Relr);
+    auto AddUnpacked = [&](uint64_t Offset) -> Error {
+        auto Word = ToExtend.readAddress(Offset, WordSize);
+        if (!Word) return Word.takeError();
+        Elf_Rela Relocation;
+        Relocation.r_offset = Offset;
+        Relocation.r_addend = support::endian::read64le(Word->data());
+        Relocation.setSymbolAndType(0, RelativeType, false);
+
+        auto Redirection = Redirections.find(Relocation.r_addend);
+        if (Redirection != Redirections.end()) {
+            Relocation.r_addend = Redirection->second;
+            RedirectedRelocations++;
+        }
+        Relocations.push_back(Relocation);
+        return Error::success();
+    };
+    for (uint64_t Offset : decodeRelr(ToExtend.getPackedRelocations())) {
+        if (auto Err = AddUnpacked(Offset)) return Err;
+    }
+
+    // The loader adds the base to the words, so only the words stored in the
+    // file can hold the addends. A word relocated more than once is left to
+    // the ordered RELA relocations.
+    DenseMap<uint64_t, unsigned> Uses;
+    for (auto *Table : {&Relocations, &PltRelocations}) {
+        for (auto const &Relocation : *Table) Uses[Relocation.r_offset]++;
+    }
+    auto IsFileBacked = [&](uint64_t Address) {
+        for (auto *Headers : {&ProgramHeaders, &AdditionalSegments}) {
+            for (auto const &Phdr : *Headers) {
+                if (Phdr.p_type == ELF::PT_LOAD && Address >= Phdr.p_vaddr
+                    && Address + WordSize <= Phdr.p_vaddr + Phdr.p_filesz) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    vector<Elf_Rela> Unpacked;
+    for (auto const &Relocation : Relocations) {
+        uint64_t Offset = Relocation.r_offset;
+        if (IsRelative(Relocation) && Offset % WordSize == 0 && Uses[Offset] == 1 && IsFileBacked(Offset)) {
+            PackedRelocations.push_back(Relocation);
+        } else {
+            Unpacked.push_back(Relocation);
+        }
+    }
+    Relocations = std::move(Unpacked);
+    std::sort(PackedRelocations.begin(), PackedRelocations.end(), [](const Elf_Rela &A, const Elf_Rela &B) {
+        return A.r_offset < B.r_offset;
+    });
+
+    vector<uint64_t> Offsets;
+    for (auto const &Relocation : PackedRelocations) Offsets.push_back(Relocation.r_offset);
+    Relr = encodeRelr(Offsets);
+
+    return Error::success();
+}
+
+vector<CrisprElf::Elf_Relr> encodeRelr(ArrayRef<uint64_t> Offsets) {
+    const uint64_t WordSize = sizeof(CrisprElf::Elf_Relr);
+    const uint64_t BitmapBits = WordSize * 8 - 1;
+
+    // An address, then bitmaps of the 63 words following the last covered
+    // one, as long as any of them is relocated
+    vector<CrisprElf::Elf_Relr> Entries;
+    for (size_t I = 0; I < Offsets.size();) {
+        uint64_t Where = Offsets[I++];
+        Entries.emplace_back(Where);
+        Where += WordSize;
+        for (;;) {
+            uint64_t Bitmap = 0;
+            for (; I < Offsets.size(); I++) {
+                uint64_t Distance = Offsets[I] - Where;
+                if (Distance >= BitmapBits * WordSize) break;
+                Bitmap |= uint64_t(1) << (Distance / WordSize);
+            }
+            if (Bitmap == 0) break;
+            Entries.emplace_back((Bitmap << 1) | 1);
+            Where += BitmapBits * WordSize;
+        }
+    }
+    return Entries;
+}
+
+vector<uint64_t> decodeRelr(ArrayRef<CrisprElf::Elf_Relr> Entries) {
+    const uint64_t WordSize = sizeof(CrisprElf::Elf_Relr);
+    const uint64_t BitmapBits = WordSize * 8 - 1;
+
+    vector<uint64_t> Offsets;
+    uint64_t Where = 0;
+    for (uint64_t Entry : Entries) {
+        // Even entries are addresses, odd ones bitmaps of the next words
+        if ((Entry & 1) == 0) {
+            Offsets.push_back(Entry);
+            Where = Entry + WordSize;
+            continue;
+        }
+        for (uint64_t Bit = 0; Bit < BitmapBits; Bit++) {
+            if ((Entry >> (Bit + 1)) & 1) Offsets.push_back(Where + Bit * WordSize);
+        }
+        Where += BitmapBits * WordSize;
+    }
+    return Offsets;
+}
+
+bool CrisprElfMerger::requireVersion(StringRef File, StringRef Version) {
+    auto GetString = [this](uint64_t Offset) { return StringRef(Dynstr.c_str() + Offset); };
+    auto Need = find_if(Verneeds, [&](const CrisprElf::VersionNeed &N) { return GetString(N.Need.vn_file) == File; });
+    if (Need == Verneeds.end()) return false;
+    if (any_of(Need->Auxs, [&](const Elf_Vernaux &A) { return GetString(A.vna_name) == Version; })) return true;
+
+    uint16_t HighestIndex = std::max<uint64_t>(1, ToExtend.getDynamicTag(ELF::DT_VERDEFNUM).getValueOr(0));
+    for (auto const &N : Verneeds) {
+        for (auto const &Aux : N.Auxs) {
+            HighestIndex = std::max<uint16_t>(HighestIndex, Aux.vna_other & ELF::VERSYM_VERSION);
+        }
+    }
+
+    // No symbol has the version, it is only checked
+    Elf_Vernaux Aux{};
+    Aux.vna_hash = getSysVHash(Version);
+    Aux.vna_other = HighestIndex + 1;
+    Aux.vna_name = Dynstr.size();
+    Dynstr += Version;
+    Dynstr += '\0';
+    Need->Auxs.push_back(Aux);
+    return true;
+}
+
+Error CrisprElfMerger::writePackedAddends(CrisprOutputFile &Output, const vector<Elf_Phdr> &ProgramHeaders) const {
+    // The relocations are sorted, adjacent words are written together
+    vector<uint8_t> Run;
+    uint64_t RunOffset = 0;
+    auto Flush = [&]() -> Error {
+        if (Run.empty()) return Error::success();
+        auto Err = Output.write(RunOffset, Run);
+        Run.clear();
+        return Err;
+    };
+
+    for (auto const &Relocation : PackedRelocations) {
+        uint64_t Address = Relocation.r_offset;
+        auto Segment = find_if(ProgramHeaders, [Address](const Elf_Phdr &Phdr) {
+            return Phdr.p_type == ELF::PT_LOAD && Address >= Phdr.p_vaddr
+                   && Address + sizeof(Elf_Relr) <= Phdr.p_vaddr + Phdr.p_filesz;
+        });
+        if (Segment == ProgramHeaders.end()) {
+            return error("the relocated word at 0x" + Twine::utohexstr(Address) + " is not backed by the file");
+        }
+
+        uint64_t Offset = Segment->p_offset + (Address - Segment->p_vaddr);
+        if (Offset != RunOffset + Run.size()) {
+            if (auto Err = Flush()) return Err;
+            RunOffset = Offset;
+        }
+        uint8_t Word[sizeof(Elf_Relr)];
+        support::endian::write64le(Word, Relocation.r_addend);
+        Run.insert(Run.end(), std::begin(Word), std::end(Word));
+    }
+    return Flush();
+}
+
+void CrisprElfMerger::mergeVersions() {
+    auto ToExtendVersions = ToExtend.getSymbolVersions();
+    auto SourceVersions = Source.getSymbolVersions();
+    if (ToExtendVersions.empty() && SourceVersions.empty()) return;
+
+    uint32_t DynstrShift = ToExtend.getDynamicStringTable().size();
+    StringRef SourceDynstr = Source.getDynamicStringTable();
+    auto GetString = [this](uint64_t Offset) { return StringRef(Dynstr.c_str() + Offset); };
+
+    // Version indices 0 and 1 are reserved, the others are shared by
+    // version definitions and version requirements
+    uint16_t HighestIndex = std::max<uint64_t>(1, ToExtend.getDynamicTag(ELF::DT_VERDEFNUM).getValueOr(0));
+    Verneeds = ToExtend.getVersionNeeds();
+    for (auto const &Need : Verneeds) {
+        for (auto const &Aux : Need.Auxs) {
+            HighestIndex = std::max<uint16_t>(HighestIndex, Aux.vna_other & ELF::VERSYM_VERSION);
+        }
+    }
+
+    // Merge the requirements of the source into the existing ones, reusing
+    // the version indices of the versions which are already required
+    std::map<uint16_t, uint16_t> SourceIndexMap;
+    for (auto const &SourceNeed : Source.getVersionNeeds()) {
+        StringRef File = SourceDynstr.data() + SourceNeed.Need.vn_file;
+
+        auto Need = find_if(Verneeds, [&](const CrisprElf::VersionNeed &N) {
+            return GetString(N.Need.vn_file) == File;
+        });
+        if (Need == Verneeds.end()) {
+            CrisprElf::VersionNeed NewNeed{SourceNeed.Need, {}};
+            NewNeed.Need.vn_file = NewNeed.Need.vn_file + DynstrShift;
+            Verneeds.push_back(NewNeed);
+            Need = std::prev(Verneeds.end());
+        }
+
+        for (auto SourceAux : SourceNeed.Auxs) {
+            StringRef Name = SourceDynstr.data() + SourceAux.vna_name;
+            auto Aux = find_if(Need->Auxs, [&](const Elf_Vernaux &A) { return GetString(A.vna_name) == Name; });
+            if (Aux != Need->Auxs.end()) {
+                SourceIndexMap[SourceAux.vna_other] = Aux->vna_other;
+                continue;
+            }
+
+            SourceIndexMap[SourceAux.vna_other] = ++HighestIndex;
+            SourceAux.vna_name = SourceAux.vna_name + DynstrShift;
+            SourceAux.vna_other = HighestIndex;
+            Need->Auxs.push_back(SourceAux);
+        }
+    }
+
+    // Prepare new .gnu.version
+    if (!ToExtendVersions.empty()) {
+        Versym.assign(ToExtendVersions.begin(), ToExtendVersions.end());
+    } else {
+        Versym.resize(ToExtend.getDynamicSymbols().size());
+        for (auto &Version : Versym) Version.vs_index = ELF::VER_NDX_GLOBAL;
+        Versym[0].vs_index = ELF::VER_NDX_LOCAL;
+    }
+
+    for (size_t I = 1; I < Source.getDynamicSymbols().size(); I++) {
+        Elf_Versym Version;
+        Version.vs_index = ELF::VER_NDX_GLOBAL;
+        if (I < SourceVersions.size()) {
+            uint16_t Index = SourceVersions[I].vs_index;
+            uint16_t Hidden = Index & ELF::VERSYM_HIDDEN;
+            auto Mapped = SourceIndexMap.find(Index & ELF::VERSYM_VERSION);
+            Version.vs_index = Mapped != SourceIndexMap.end() ? (Mapped->second | Hidden) : Index;
+        }
+        Versym.push_back(Version);
+    }
+}
+
+void CrisprElfMerger::sortSymbolsForHashing() {
+    // The GNU hash table only covers a tail of .dynsym, which has to be
+    // sorted by bucket. Locals come first, followed by the undefined symbols
+    // and finally by the hashed ones.
+    uint32_t BucketsCount = getGnuHashBucketsCount(count_if(Dynsym, isHashed));
+
+    vector<uint32_t> Order(Dynsym.size());
+    std::iota(Order.begin(), Order.end(), 0);
+    auto Rank = [&](uint32_t Index) -> pair<int, uint32_t> {
+        const Elf_Sym &Symbol = Dynsym[Index];
+        if (Index == 0) return {0, 0};
+        if (Symbol.getBinding() == ELF::STB_LOCAL) return {1, 0};
+        if (!isHashed(Symbol)) return {2, 0};
+        return {3, getGnuHash(getSymbolName(Symbol)) % BucketsCount};
+    };
+    std::stable_sort(Order.begin(), Order.end(), [&](uint32_t A, uint32_t B) { return Rank(A) < Rank(B); });
+
+    vector<uint32_t> NewIndex(Dynsym.size());
+    for (uint32_t I = 0; I < Order.size(); I++) NewIndex[Order[I]] = I;
+
+    auto Permute = [&Order](auto &Table) {
+        auto Original = Table;
+        for (uint32_t I = 0; I < Order.size(); I++) Table[I] = Original[Order[I]];
+    };
+    Permute(Dynsym);
+    if (!Versym.empty()) Permute(Versym);
+
+    for (auto *Table : {&Relocations, &PltRelocations}) {
+        for (auto &Relocation : *Table) {
+            uint32_t Symbol = NewIndex[Relocation.getSymbol(false)];
+            Relocation.setSymbolAndType(Symbol, Relocation.getType(false), false);
+        }
+    }
+
+    FirstGlobalSymbol = 1;
+    while (FirstGlobalSymbol < Dynsym.size() && Dynsym[FirstGlobalSymbol].getBinding() == ELF::STB_LOCAL) {
+        FirstGlobalSymbol++;
+    }
+}
+
+void CrisprElfMerger::buildGnuHashTable() {
+    auto FirstHashed = find_if(Dynsym, isHashed);
+    vector<uint32_t> Hashes;
+    for (auto Symbol = FirstHashed; Symbol != Dynsym.end(); ++Symbol) {
+        Hashes.push_back(getGnuHash(getSymbolName(*Symbol)));
+    }
+    GnuHash = encodeGnuHashTable(Hashes, FirstHashed - Dynsym.begin());
+}
+
+string encodeGnuHashTable(ArrayRef<uint32_t> Hashes, uint32_t SymbolOffset) {
+    uint32_t HashedCount = Hashes.size();
+    uint32_t BucketsCount = getGnuHashBucketsCount(HashedCount);
+
+    // About 12 bits of bloom filter per symbol, like lld
+    uint32_t MaskWords = PowerOf2Ceil(std::max<uint32_t>(HashedCount * 12 / 64, 1));
+    const uint32_t Shift2 = 26;
+
+    vector<uint64_t> Bloom(MaskWords, 0);
+    vector<uint32_t> Buckets(BucketsCount, 0);
+    vector<uint32_t> Chains(HashedCount, 0);
+    for (uint32_t I = 0; I < HashedCount; I++) {
+        uint32_t Hash = Hashes[I];
+        uint32_t Bucket = Hash % BucketsCount;
+
+        Bloom[(Hash / 64) % MaskWords] |= (uint64_t(1) << (Hash % 64)) | (uint64_t(1) << ((Hash >> Shift2) % 64));
+        if (Buckets[Bucket] == 0) Buckets[Bucket] = SymbolOffset + I;
+
+        // The lowest bit marks the end of the chain of a bucket
+        bool LastInBucket = I + 1 == HashedCount || Hashes[I + 1] % BucketsCount != Bucket;
+        Chains[I] = (Hash & ~1u) | (LastInBucket ? 1 : 0);
+    }
+
+    // nbuckets, symoffset, bloom size, bloom shift, bloom, buckets, chains
+    vector<uint32_t> HashHeader = {BucketsCount, SymbolOffset, MaskWords, Shift2};
+    string Table;
+    appendArray<uint32_t>(Table, HashHeader);
+    appendArray<uint64_t>(Table, Bloom);
+    appendArray<uint32_t>(Table, Buckets);
+    appendArray<uint32_t>(Table, Chains);
+    return Table;
+}
+
+vector<CrisprElf::Elf_Dyn> CrisprElfMerger::buildDynamic(uint64_t TailAddress, const TailLayout &Layout) const {
+    vector<Elf_Dyn> Entries;
+
+    StringSet<> Needed;
+    for (auto const &Entry : ToExtend.dynamicEntries()) {
+        if (Entry.getTag() == ELF::DT_NEEDED) Needed.insert(ToExtend.getDynamicStringTable().data() + Entry.getVal());
+    }
+
+    // Libraries needed by the source and not by the binary to extend,
+    // inserted after the last DT_NEEDED
+    vector<Elf_Dyn> AdditionalNeeded;
+    for (auto const &Entry : Source.dynamicEntries()) {
+        if (Entry.getTag() != ELF::DT_NEEDED) continue;
+        if (!Needed.insert(Source.getDynamicStringTable().data() + Entry.getVal()).second) continue;
+        uint64_t Shifted = Entry.getVal() + ToExtend.getDynamicStringTable().size();
+        AdditionalNeeded.push_back(makeDynamicEntry(ELF::DT_NEEDED, Shifted));
+    }
+
+    auto ToExtendEntries = ToExtend.dynamicEntries();
+    auto LastNeeded = find_if(reverse(ToExtendEntries), [](const Elf_Dyn &Entry) {
+        return Entry.getTag() == ELF::DT_NEEDED;
+    });
+    if (LastNeeded == ToExtendEntries.rend()) {
+        Entries.insert(Entries.end(), AdditionalNeeded.begin(), AdditionalNeeded.end());
+    }
+
+    // glibc skips the symbol lookup of the first DT_RELACOUNT relocations,
+    // which must stay relative once the packed ones are removed
+    uint32_t RelativeType = cantFail(getRelativeRelocationType(ToExtend.getHeader().e_machine));
+    auto FirstNotRelative = find_if(Relocations, [RelativeType](const Elf_Rela &Relocation) {
+        return Relocation.getType(false) != RelativeType;
+    });
+
+    bool HasRelocations = false;
+    bool HasRelr = false;
+    bool HasVersym = false;
+    bool HasVerneed = false;
+    bool HasGnuHash = false;
+
+    for (auto const &OriginalEntry : ToExtendEntries) {
+        Elf_Dyn Entry = OriginalEntry;
+        switch (Entry.getTag()) {
+            case ELF::DT_STRTAB:
+                Entry.d_un.d_val = TailAddress + Layout.Dynstr;
+                break;
+            case ELF::DT_STRSZ:
+                Entry.d_un.d_val = Dynstr.size();
+                break;
+            case ELF::DT_RELA:
+                Entry.d_un.d_val = TailAddress + Layout.Relocations;
+                HasRelocations = true;
+                break;
+            case ELF::DT_RELASZ:
+                Entry.d_un.d_val = Relocations.size() * sizeof(Elf_Rela);
+                break;
+            case ELF::DT_RELACOUNT:
+                Entry.d_un.d_val = std::min<uint64_t>(Entry.getVal(), FirstNotRelative - Relocations.begin());
+                break;
+            case ELF::DT_RELR:
+                if (Relr.empty()) break;
+                Entry.d_un.d_val = TailAddress + Layout.Relr;
+                HasRelr = true;
+                break;
+            case ELF::DT_RELRSZ:
+                if (!Relr.empty()) Entry.d_un.d_val = Relr.size() * sizeof(Elf_Relr);
+                break;
+            case ELF::DT_JMPREL:
+                Entry.d_un.d_val = TailAddress + Layout.PltRelocations;
+                break;
+            case ELF::DT_SYMTAB:
+                Entry.d_un.d_val = TailAddress + Layout.Dynsym;
+                break;
+            case ELF::DT_VERNEED:
+                Entry.d_un.d_val = TailAddress + Layout.Verneed;
+                HasVerneed = true;
+                break;
+            case ELF::DT_VERNEEDNUM:
+                Entry.d_un.d_val = Verneeds.size();
+                break;
+            case ELF::DT_VERSYM:
+                Entry.d_un.d_val = TailAddress + Layout.Versym;
+                HasVersym = true;
+                break;
+            case ELF::DT_HASH:
+            case ELF::DT_GNU_HASH:
+                // Only the GNU hash table is emitted
+                if (HasGnuHash) continue;
+                Entry = makeDynamicEntry(ELF::DT_GNU_HASH, TailAddress + Layout.GnuHash);
+                HasGnuHash = true;
+                break;
+            default:
+                break;
+        }
+        Entries.push_back(Entry);
+
+        if (LastNeeded != ToExtendEntries.rend() && &OriginalEntry == &*LastNeeded) {
+            Entries.insert(Entries.end(), AdditionalNeeded.begin(), AdditionalNeeded.end());
+        }
+    }
+
+    if (!HasRelocations && !Relocations.empty()) {
+        Entries.push_back(makeDynamicEntry(ELF::DT_RELA, TailAddress + Layout.Relocations));
+        Entries.push_back(makeDynamicEntry(ELF::DT_RELASZ, Relocations.size() * sizeof(Elf_Rela)));
+        Entries.push_back(makeDynamicEntry(ELF::DT_RELAENT, sizeof(Elf_Rela)));
+    }
+    if (!HasRelr && !Relr.empty()) {
+        Entries.push_back(makeDynamicEntry(ELF::DT_RELR, TailAddress + Layout.Relr));
+        Entries.push_back(makeDynamicEntry(ELF::DT_RELRSZ, Relr.size() * sizeof(Elf_Relr)));
+        Entries.push_back(makeDynamicEntry(ELF::DT_RELRENT, sizeof(Elf_Relr)));
+    }
+    if (!HasVersym && !Versym.empty()) {
+        Entries.push_back(makeDynamicEntry(ELF::DT_VERSYM, TailAddress + Layout.Versym));
+    }
+    if (!HasVerneed && !Verneeds.empty()) {
+        Entries.push_back(makeDynamicEntry(ELF::DT_VERNEED, TailAddress + Layout.Verneed));
+        Entries.push_back(makeDynamicEntry(ELF::DT_VERNEEDNUM, Verneeds.size()));
+    }
+    if (!HasGnuHash) {
+        Entries.push_back(makeDynamicEntry(ELF::DT_GNU_HASH, TailAddress + Layout.GnuHash));
+    }
+    Entries.push_back(makeDynamicEntry(ELF::DT_NULL, 0));
+
+    return Entries;
+}
+
+vector<CrisprElf::Elf_Shdr>
+CrisprElfMerger::buildSectionHeaders(uint64_t TailAddress, uint64_t TailOffset, const TailLayout &Layout) const {
+    vector<Elf_Shdr> Sections(ToExtend.sections().begin(), ToExtend.sections().end());
+
+    auto Relocate = [&](Elf_Shdr &Section, uint64_t Offset, uint64_t Size) {
+        Section.sh_addr = TailAddress + Offset;
+        Section.sh_offset = TailOffset + Offset;
+        Section.sh_size = Size;
+    };
+
+    for (auto &Section : Sections) {
+        StringRef Name = ToExtend.getSectionName(Section);
+        if (Name == ".dynstr") {
+            Relocate(Section, Layout.Dynstr, Dynstr.size());
+        } else if (Name == ".dynsym") {
+            Relocate(Section, Layout.Dynsym, Dynsym.size() * sizeof(Elf_Sym));
+            Section.sh_info = FirstGlobalSymbol;
+        } else if (Name == ".rela.dyn") {
+            Relocate(Section, Layout.Relocations, Relocations.size() * sizeof(Elf_Rela));
+        } else if (Name == ".relr.dyn" && !Relr.empty()) {
+            Relocate(Section, Layout.Relr, Relr.size() * sizeof(Elf_Relr));
+        } else if (Name == ".rela.plt") {
+            Relocate(Section, Layout.PltRelocations, PltRelocations.size() * sizeof(Elf_Rela));
+        } else if (Name == ".dynamic") {
+            Relocate(Section, Layout.Dynamic, Layout.DynamicSize);
+        } else if (Name == ".gnu.version") {
+            Relocate(Section, Layout.Versym, Versym.size() * sizeof(Elf_Versym));
+        } else if (Name == ".gnu.version_r") {
+            Relocate(Section, Layout.Verneed, Layout.VerneedSize);
+            Section.sh_info = Verneeds.size();
+        } else if (Name == ".gnu.hash") {
+            Relocate(Section, Layout.GnuHash, GnuHash.size());
+        } else if (Name == ".hash") {
+            // The old SysV table does not describe the merged .dynsym anymore
+            Section.sh_type = ELF::SHT_PROGBITS;
+        }
+    }
+
+    return Sections;
+}
+
+string CrisprElfMerger::serializeVerneeds() const {
+    string Out;
+    for (size_t I = 0; I < Verneeds.size(); I++) {
+        auto const &Need = Verneeds[I];
+        bool LastNeed = I + 1 == Verneeds.size();
+
+        Elf_Verneed NeedEntry = Need.Need;
+        NeedEntry.vn_cnt = Need.Auxs.size();
+        NeedEntry.vn_aux = sizeof(Elf_Verneed);
+        NeedEntry.vn_next = LastNeed ? 0 : sizeof(Elf_Verneed) + Need.Auxs.size() * sizeof(Elf_Vernaux);
+        appendArray<Elf_Verneed>(Out, NeedEntry);
+
+        for (size_t J = 0; J < Need.Auxs.size(); J++) {
+            Elf_Vernaux AuxEntry = Need.Auxs[J];
+            AuxEntry.vna_next = J + 1 == Need.Auxs.size() ? 0 : sizeof(Elf_Vernaux);
+            appendArray<Elf_Vernaux>(Out, AuxEntry);
+        }
+    }
+    return Out;
+}
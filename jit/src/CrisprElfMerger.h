@@ -0,0 +1,167 @@
+#ifndef CRISPR_CRISPRELFMERGER_H
+#define CRISPR_CRISPRELFMERGER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Error.h"
+
+#include "CrisprElf.h"
+#include "CrisprOutputFile.h"
+#include "CrisprPages.h"
+
+// Merges the dynamic portions and the LOAD segments of a shared object, linked
+// at its final addresses, into an existing dynamic binary.
+//
+// The output is expected to already contain a copy of the binary to extend:
+// only the ELF header is rewritten in place, while the merged dynamic tables,
+// the section and program headers and the new segments are appended at the
+// end of the file in a new LOAD segment.
+// Sections which the linker placed in unused ranges of the binary to extend
+// are written in place instead, extending the containing segment up to the
+// end of its last page if needed.
+class CrisprElfMerger {
+    using string = std::string;
+    using Elf_Phdr = CrisprElf::Elf_Phdr;
+    using Elf_Shdr = CrisprElf::Elf_Shdr;
+    using Elf_Sym = CrisprElf::Elf_Sym;
+    using Elf_Rela = CrisprElf::Elf_Rela;
+    using Elf_Relr = CrisprElf::Elf_Relr;
+    using Elf_Dyn = CrisprElf::Elf_Dyn;
+    using Elf_Versym = CrisprElf::Elf_Versym;
+    using Elf_Verneed = CrisprElf::Elf_Verneed;
+    using Elf_Vernaux = CrisprElf::Elf_Vernaux;
+
+public:
+    CrisprElfMerger(const CrisprElf &ToExtend, const CrisprElf &Source) : ToExtend(ToExtend), Source(Source) {}
+
+    // Old and new addresses of moved functions: the dynamic symbols and the
+    // relative relocations (e.g. function pointers and GOT entries in
+    // position independent binaries) pointing to the old ones are redirected
+    void setRedirections(std::map<uint64_t, uint64_t> NewRedirections) { Redirections = std::move(NewRedirections); }
+
+    // Pads the new executable segments to a multiple of Alignment (e.g. 2MB),
+    // so that they can be mapped with huge pages. The linker must have
+    // aligned them, and the segments following them.
+    void setCodeSegmentAlignment(uint64_t Alignment) { CodeSegmentAlignment = Alignment; }
+
+    // Moves the relative relocations of both binaries to a DT_RELR table,
+    // which encodes most of them as bits of 64-bit words, with their addends
+    // written in place. Only glibc 2.36 and later process it: the merged
+    // binary requires GLIBC_ABI_DT_RELR so that older ones refuse to load it,
+    // and nothing is packed if it requires no version of libc.so.6.
+    void setPackRelativeRelocations(bool Pack) { PackRelativeRelocations = Pack; }
+
+    llvm::Error merge(CrisprOutputFile &Output);
+
+    [[nodiscard]] unsigned getRedirectedSymbols() const { return RedirectedSymbols; }
+
+    [[nodiscard]] unsigned getRedirectedRelocations() const { return RedirectedRelocations; }
+
+    [[nodiscard]] size_t getPackedRelocations() const { return PackedRelocations.size(); }
+
+    [[nodiscard]] size_t getPackedRelocationsSize() const { return Relr.size() * sizeof(Elf_Relr); }
+
+private:
+    const CrisprElf &ToExtend;
+    const CrisprElf &Source;
+    std::map<uint64_t, uint64_t> Redirections;
+    uint64_t CodeSegmentAlignment = PageSize;
+    bool PackRelativeRelocations = false;
+    unsigned RedirectedSymbols = 0;
+    unsigned RedirectedRelocations = 0;
+
+    // Merged tables
+    string Dynstr;
+    std::vector<Elf_Sym> Dynsym;
+    std::vector<Elf_Rela> Relocations;
+    std::vector<Elf_Rela> PltRelocations;
+    // Relative relocations moved to .relr.dyn, sorted by offset, and their
+    // encoding
+    std::vector<Elf_Rela> PackedRelocations;
+    std::vector<Elf_Relr> Relr;
+    std::vector<Elf_Versym> Versym;
+    std::vector<CrisprElf::VersionNeed> Verneeds;
+    string GnuHash;
+
+    // Index of the first non-local symbol in the merged .dynsym
+    uint32_t FirstGlobalSymbol = 1;
+
+    // Offsets of the merged tables, relative to the start of the new segment
+    struct TailLayout {
+        uint64_t Dynstr;
+        uint64_t Dynsym;
+        uint64_t Relocations;
+        uint64_t PltRelocations;
+        uint64_t Relr;
+        uint64_t Versym;
+        uint64_t Verneed;
+        uint64_t VerneedSize;
+        uint64_t GnuHash;
+        uint64_t Dynamic;
+        uint64_t DynamicSize;
+        uint64_t SectionHeaders;
+        uint64_t ProgramHeaders;
+        uint64_t Size;
+    };
+
+    llvm::Error splitSegment(const Elf_Phdr &Segment,
+                             std::vector<Elf_Phdr> &ProgramHeaders,
+                             std::vector<Elf_Phdr> &AdditionalSegments,
+                             std::vector<std::pair<uint64_t, llvm::StringRef>> &InPlaceContents) const;
+
+    llvm::Error mergeSymbols();
+
+    llvm::Error mergeRelocations();
+
+    void mergeVersions();
+
+    // The program headers are those of the output, to find which relocations
+    // apply to words backed by the file
+    llvm::Error packRelocations(const std::vector<Elf_Phdr> &ProgramHeaders,
+                                const std::vector<Elf_Phdr> &AdditionalSegments);
+
+    // Adds a requirement of a version of a library which already has some
+    bool requireVersion(llvm::StringRef File, llvm::StringRef Version);
+
+    // Writes the addends of the packed relocations where they apply
+    llvm::Error writePackedAddends(CrisprOutputFile &Output, const std::vector<Elf_Phdr> &ProgramHeaders) const;
+
+    llvm::StringRef getSymbolName(const Elf_Sym &Symbol) const { return Dynstr.c_str() + Symbol.st_name; }
+
+    void sortSymbolsForHashing();
+
+    void buildGnuHashTable();
+
+    std::vector<Elf_Dyn> buildDynamic(uint64_t TailAddress, const TailLayout &Layout) const;
+
+    std::vector<Elf_Shdr> buildSectionHeaders(uint64_t TailAddress, uint64_t TailOffset, const TailLayout &Layout) const;
+
+    string serializeVerneeds() const;
+
+    llvm::Error error(const llvm::Twine &Message) const;
+};
+
+// Hash of a symbol name in a DT_GNU_HASH table
+uint32_t getGnuHash(llvm::StringRef Name);
+
+uint32_t getGnuHashBucketsCount(uint32_t HashedCount);
+
+// DT_GNU_HASH table of the symbols from SymbolOffset on, given by the hashes
+// of their names. The symbols of a bucket must be contiguous, in the order of
+// the buckets.
+std::string encodeGnuHashTable(llvm::ArrayRef<uint32_t> Hashes, uint32_t SymbolOffset);
+
+// DT_RELR entries relocating the words at Offsets, which must be sorted and
+// aligned to words
+std::vector<CrisprElf::Elf_Relr> encodeRelr(llvm::ArrayRef<uint64_t> Offsets);
+
+// Offsets of the words relocated by DT_RELR entries
+std::vector<uint64_t> decodeRelr(llvm::ArrayRef<CrisprElf::Elf_Relr> Entries);
+
+#endif//CRISPR_CRISPRELFMERGER_H
@@ -0,0 +1,203 @@
+#include <algorithm>
+
+#include "llvm/Support/MathExtras.h"
+
+#include "CrisprFreeSpace.h"
+
+using namespace llvm;
+using namespace std;
+
+// Length of the x86-64 NOP at the start of Bytes, or 0 if there is none.
+// Covers the single and multi-byte NOPs (with their operand size and segment
+// prefixes) which compilers and assemblers use to align functions.
+static size_t getNopLength(ArrayRef<uint8_t> Bytes) {
+    size_t Prefixes = 0;
+    while (Prefixes < Bytes.size() && (Bytes[Prefixes] == 0x66 || Bytes[Prefixes] == 0x2E)) Prefixes++;
+
+    ArrayRef<uint8_t> Opcode = Bytes.drop_front(Prefixes);
+    if (Opcode.empty()) return 0;
+    if (Opcode[0] == 0x90) return Prefixes + 1;
+
+    // nopw/nopl with a memory operand: 0f 1f /0
+    if (Opcode.size() < 3 || Opcode[0] != 0x0F || Opcode[1] != 0x1F) return 0;
+    uint8_t ModRM = Opcode[2];
+    uint8_t Mod = ModRM >> 6;
+    uint8_t Reg = (ModRM >> 3) & 7;
+    uint8_t RM = ModRM & 7;
+    if (Reg != 0) return 0;
+
+    size_t Length = 3;
+    if (Mod != 3 && RM == 4) Length += 1;
+    if (Mod == 1) Length += 1;
+    if (Mod == 2 || (Mod == 0 && RM == 5)) Length += 4;
+    if (Length > Opcode.size()) return 0;
+    return Prefixes + Length;
+}
+
+static bool isPadding(ArrayRef<uint8_t> Bytes) {
+    while (!Bytes.empty()) {
+        // int3 is used as filler by some toolchains
+        if (Bytes[0] == 0xCC) {
+            Bytes = Bytes.drop_front();
+            continue;
+        }
+
+        size_t Length = getNopLength(Bytes);
+        if (Length == 0) return false;
+        Bytes = Bytes.drop_front(Length);
+    }
+    return true;
+}
+
+void CrisprFreeSpace::addRange(uint64_t Address, uint64_t Size) {
+    if (Size == 0 || Address >= Limit) return;
+    Ranges.push_back({Address, std::min(Size, Limit - Address)});
+}
+
+void CrisprFreeSpace::addPadding(const CrisprSymbolTable &Symbols) {
+    // Only x86-64 padding can be recognized
+    if (Binary.getHeader().e_machine != ELF::EM_X86_64) return;
+
+    vector<Range> Functions;
+    Functions.reserve(Symbols.size());
+    for (auto const &Symbol : Symbols.symbols()) {
+        if (Symbol.Size != 0) Functions.push_back({Symbol.Address, Symbol.Size});
+    }
+    std::sort(Functions.begin(), Functions.end(), [](const Range &A, const Range &B) {
+        return A.Address < B.Address;
+    });
+
+    uint64_t End = 0;
+    for (auto const &Function : Functions) {
+        if (End != 0 && Function.Address > End) {
+            uint64_t Size = Function.Address - End;
+            // Data without a symbol (e.g. string literals) can sit between
+            // two symbols too, but not in code sections
+            if (Binary.isCode(End, Size)) {
+                auto Bytes = Binary.readAddress(End, Size);
+                if (!Bytes) {
+                    consumeError(Bytes.takeError());
+                } else if (isPadding(*Bytes)) {
+                    addRange(End, Size);
+                }
+            }
+        }
+        End = std::max(End, Function.Address + Function.Size);
+    }
+}
+
+void CrisprFreeSpace::addSegmentSlack() {
+    // Everything stored in the file, which must not be overwritten
+    auto const &Header = Binary.getHeader();
+    vector<Range> Used = {
+            {0, sizeof(Header)},
+            {Header.e_phoff, uint64_t(Header.e_phnum) * Header.e_phentsize},
+            {Header.e_shoff, uint64_t(Header.e_shnum) * Header.e_shentsize},
+    };
+    for (auto const &Phdr : Binary.programHeaders()) {
+        Used.push_back({Phdr.p_offset, Phdr.p_filesz});
+    }
+    for (auto const &Section : Binary.sections()) {
+        if (Section.sh_type != ELF::SHT_NOBITS) Used.push_back({Section.sh_offset, Section.sh_size});
+    }
+
+    // Writing past the end of the file is fine as long as the new segment,
+    // which starts on the next page, is not reached
+    uint64_t FileEnd = alignTo(Binary.getSize(), PageSize);
+
+    for (auto const &Phdr : Binary.programHeaders()) {
+        if (Phdr.p_type != ELF::PT_LOAD || !(Phdr.p_flags & ELF::PF_X)) continue;
+        // Extending the segment would overwrite its zero-initialized part
+        if (Phdr.p_filesz != Phdr.p_memsz) continue;
+
+        uint64_t Address = Phdr.p_vaddr + Phdr.p_filesz;
+        uint64_t Offset = Phdr.p_offset + Phdr.p_filesz;
+        if (Offset >= FileEnd) continue;
+        uint64_t End = std::min(alignTo(Address, PageSize), Address + (FileEnd - Offset));
+
+        for (auto const &Other : Binary.programHeaders()) {
+            if (Other.p_type != ELF::PT_LOAD || &Other == &Phdr) continue;
+            if (Other.p_vaddr >= Address) {
+                End = std::min<uint64_t>(End, Other.p_vaddr);
+            } else if (Other.p_vaddr + Other.p_memsz > Address) {
+                End = Address;
+            }
+        }
+
+        for (auto const &Range : Used) {
+            if (Range.Size == 0 || Range.Address + Range.Size <= Offset) continue;
+            if (Range.Address <= Offset) {
+                End = Address;
+            } else {
+                End = std::min(End, Address + (Range.Address - Offset));
+            }
+        }
+
+        if (End > Address) addRange(Address, End - Address);
+    }
+}
+
+uint64_t CrisprFreeSpace::getFreeSize() const {
+    uint64_t Size = 0;
+    for (auto const &Range : Ranges) Size += Range.Size;
+    return Size;
+}
+
+void CrisprFreeSpace::coalesce() {
+    std::sort(Ranges.begin(), Ranges.end(), [](const Range &A, const Range &B) {
+        return A.Address < B.Address;
+    });
+
+    vector<Range> Coalesced;
+    for (auto const &Range : Ranges) {
+        if (Range.Size == 0) continue;
+        if (!Coalesced.empty() && Range.Address <= Coalesced.back().Address + Coalesced.back().Size) {
+            auto &Last = Coalesced.back();
+            Last.Size = std::max(Last.Address + Last.Size, Range.Address + Range.Size) - Last.Address;
+        } else {
+            Coalesced.push_back(Range);
+        }
+    }
+    Ranges = std::move(Coalesced);
+}
+
+std::map<string, uint64_t> CrisprFreeSpace::pack(vector<Section> Sections) {
+    coalesce();
+
+    // Biggest first, so that the smaller sections fill the holes left behind
+    std::stable_sort(Sections.begin(), Sections.end(), [](const Section &A, const Section &B) {
+        return A.Size > B.Size;
+    });
+
+    std::map<string, uint64_t> Placements;
+    for (auto const &Section : Sections) {
+        if (Section.Size == 0) continue;
+
+        // Best fit: the range which is left with the least free space
+        auto Best = Ranges.end();
+        uint64_t BestStart = 0;
+        uint64_t BestLeft = UINT64_MAX;
+        for (auto It = Ranges.begin(); It != Ranges.end(); ++It) {
+            uint64_t Start = alignTo(It->Address, std::max<uint64_t>(Section.Alignment, 1));
+            uint64_t End = It->Address + It->Size;
+            if (Start > End || End - Start < Section.Size) continue;
+
+            uint64_t Left = End - Start - Section.Size;
+            if (Left < BestLeft) {
+                Best = It;
+                BestStart = Start;
+                BestLeft = Left;
+            }
+        }
+        if (Best == Ranges.end()) continue;
+
+        Placements[Section.Name] = BestStart;
+
+        // Keep what is left on both sides of the section
+        Range Before = {Best->Address, BestStart - Best->Address};
+        *Best = {BestStart + Section.Size, BestLeft};
+        if (Before.Size != 0) Ranges.push_back(Before);
+    }
+
+    return Placements;
+}
@@ -0,0 +1,69 @@
+#ifndef CRISPR_CRISPRFREESPACE_H
+#define CRISPR_CRISPRFREESPACE_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+
+#include "CrisprElf.h"
+#include "CrisprPages.h"
+#include "CrisprSymbolTable.h"
+
+// Keeps track of the ranges of an existing binary which can host new code
+// without growing it, and packs the sections of the new functions into them.
+//
+// Only ranges which are executable and backed by the file are considered:
+// the bodies of the replaced functions, the padding between functions and
+// the slack between the end of an executable segment and the end of its last
+// page, which can be claimed by extending the segment.
+class CrisprFreeSpace {
+    using string = std::string;
+
+public:
+    struct Range {
+        uint64_t Address;
+        uint64_t Size;
+    };
+
+    struct Section {
+        string Name;
+        uint64_t Size;
+        uint64_t Alignment;
+    };
+
+    // Ranges at or above Limit are never used, so that the new segment
+    // placed there by the linker does not have to move
+    explicit CrisprFreeSpace(const CrisprElf &Binary, uint64_t Limit = UINT64_MAX) : Binary(Binary),
+                                                                                    Limit(Limit) {}
+
+    // Marks a range as unused, e.g. the body of a function which is replaced
+    void addRange(uint64_t Address, uint64_t Size);
+
+    // Adds the gaps between the given functions which only contain padding
+    void addPadding(const CrisprSymbolTable &Symbols);
+
+    // Adds the slack at the end of the last page of the executable segments
+    // which is not used by anything else in the file
+    void addSegmentSlack();
+
+    [[nodiscard]] uint64_t getFreeSize() const;
+
+    // Assigns an address to as many sections as possible (best fit
+    // decreasing). The sections which don't fit are not in the result.
+    std::map<string, uint64_t> pack(std::vector<Section> Sections);
+
+    // What is still unused, possibly with empty and adjacent ranges
+    [[nodiscard]] const std::vector<Range> &getRanges() const { return Ranges; }
+
+private:
+    const CrisprElf &Binary;
+    uint64_t Limit;
+    std::vector<Range> Ranges;
+
+    void coalesce();
+};
+
+#endif//CRISPR_CRISPRFREESPACE_H
@@ -5,22 +5,50 @@
 #ifndef CRISPR_CRISPRLINKER_H
 #define CRISPR_CRISPRLINKER_H
 
-#include <filesystem>
-#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
 
 class CrisprLinker : public llvm::orc::ObjectLayer {
 private:
     llvm::orc::ObjectLayer &RealLinker;
     uint LinkedCount;
 
+    // Held while recording emitted objects, which can happen concurrently
+    // when compiling on multiple threads
+    std::mutex &EmitLock;
+
+    // Where the emitted objects are dumped, nowhere if empty
+    std::string DumpDirectory;
+    llvm::raw_ostream &Log;
+
+    // Copies of every object going through this layer (static libraries and
+    // compiled modules), handed to the static linker once compilation is done.
+    // Compiled objects are keyed by the first symbol they define, so that the
+    // link order does not depend on the order in which they were compiled.
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> AddedObjects;
+    std::multimap<std::string, std::unique_ptr<llvm::MemoryBuffer>> EmittedObjects;
+
 public:
     CrisprLinker(
             llvm::orc::ExecutionSession &es,
-            llvm::orc::ObjectLayer &RealLinker) : ObjectLayer(es),
-                                                  RealLinker(RealLinker),
-                                                  LinkedCount(0) {}
+            llvm::orc::ObjectLayer &RealLinker,
+            std::mutex &EmitLock,
+            std::string DumpDirectory,
+            llvm::raw_ostream &Log) : ObjectLayer(es),
+                                      RealLinker(RealLinker),
+                                      LinkedCount(0),
+                                      EmitLock(EmitLock),
+                                      DumpDirectory(std::move(DumpDirectory)),
+                                      Log(Log) {}
 
     ~CrisprLinker() override = default;
 
@@ -28,19 +56,49 @@ public:
             llvm::orc::JITDylib &JD,
             std::unique_ptr<llvm::MemoryBuffer> O,
             llvm::orc::VModuleKey K = llvm::orc::VModuleKey()) override {
+        AddedObjects.push_back(llvm::MemoryBuffer::getMemBufferCopy(O->getBuffer(), O->getBufferIdentifier()));
         return RealLinker.add(JD, std::move(O), K);
     }
 
     void emit(llvm::orc::MaterializationResponsibility R, std::unique_ptr<llvm::MemoryBuffer> O) override {
-        std::filesystem::path out_path("tmp/obj_" + std::to_string(LinkedCount));
-        llvm::outs() << "CrisprLinker::emit() called, dumping object file to " << out_path << "\n";
-        std::ofstream out(out_path);
-        out << O->getBuffer().str();
-        out.close();
-        LinkedCount++;
+        std::string Key;
+        for (auto const &Symbol : R.getSymbols()) {
+            if (Key.empty() || (*Symbol.first).str() < Key) Key = (*Symbol.first).str();
+        }
+
+        {
+            std::lock_guard<std::mutex> Lock(EmitLock);
+            if (!DumpDirectory.empty()) {
+                llvm::SmallString<128> Path(DumpDirectory);
+                llvm::sys::path::append(Path, "obj_" + std::to_string(LinkedCount));
+                Log << "CrisprLinker::emit() called, dumping object file to " << Path << "\n";
+                std::error_code EC;
+                llvm::raw_fd_ostream Out(Path, EC, llvm::sys::fs::F_None);
+                if (EC) {
+                    Log << "Could not dump the object file: " << EC.message() << "\n";
+                } else {
+                    Out << O->getBuffer();
+                }
+            }
+            LinkedCount++;
 
+            auto Copy = llvm::MemoryBuffer::getMemBufferCopy(O->getBuffer(), O->getBufferIdentifier());
+            EmittedObjects.emplace(Key, std::move(Copy));
+        }
+
+        // Not under the lock: resolving the relocations may wait for other
+        // objects to be emitted
         return RealLinker.emit(std::move(R), std::move(O));
     }
+
+    // Static libraries first, in the order they were added, then the
+    // compiled objects
+    [[nodiscard]] std::vector<llvm::MemoryBufferRef> getObjects() const {
+        std::vector<llvm::MemoryBufferRef> Objects;
+        for (auto const &O : AddedObjects) Objects.push_back(O->getMemBufferRef());
+        for (auto const &O : EmittedObjects) Objects.push_back(O.second->getMemBufferRef());
+        return Objects;
+    }
 };
 
 
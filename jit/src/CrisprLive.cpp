@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <climits>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "CrisprAddressPlanner.h"
+#include "CrisprDetours.h"
+#include "CrisprLive.h"
+#include "CrisprPages.h"
+
+using namespace llvm;
+using namespace std;
+
+// Room left above a binary which is not position independent for its brk
+// heap
+static constexpr uint64_t LiveHeapGap = 0x10000000;
+
+static Error makeError(const Twine &Message) {
+    return make_error<StringError>(Message, inconvertibleErrorCode());
+}
+
+static Error makeError(const Twine &Message, Error Cause) {
+    return makeError(Message + ": " + toString(std::move(Cause)));
+}
+
+static Expected<unique_ptr<CrisprProcess>> attachProcess(pid_t Pid) {
+    auto Process = CrisprProcess::attach(Pid);
+    if (!Process) return makeError("Could not attach to process " + Twine(Pid), Process.takeError());
+    return std::move(*Process);
+}
+
+static Expected<uint64_t> callProcess(CrisprProcess &Process, long Number, ArrayRef<uint64_t> Args) {
+    auto Result = Process.syscall(Number, Args);
+    if (!Result) return makeError("Error while calling into the process", Result.takeError());
+    return *Result;
+}
+
+static Expected<vector<CrisprProcess::Mapping>> getMappings(const CrisprProcess &Process) {
+    auto Mappings = Process.getMappings();
+    if (!Mappings) return makeError("Could not read the mappings of the process", Mappings.takeError());
+    return std::move(*Mappings);
+}
+
+static Expected<uint64_t> findLoadBase(const CrisprProcess &Process, const CrisprElf &Binary) {
+    if (Binary.getHeader().e_type != ELF::ET_DYN) return 0;
+
+    auto Path = Process.getExecutablePath();
+    if (!Path) return makeError("Could not find the binary of the process", Path.takeError());
+    auto Mappings = getMappings(Process);
+    if (!Mappings) return Mappings.takeError();
+    for (auto const &Mapping : *Mappings) {
+        if (Mapping.Path != *Path || Mapping.Offset != 0) continue;
+        return Mapping.Start - alignDown(Binary.getLowestLoadAddress(), PageSize);
+    }
+    return makeError("Could not find " + *Path + " in the mappings of process " + Twine(Process.getPid()));
+}
+
+// Lets the threads run until none of them is stopped inside the bytes which
+// a detour replaces. A thread at the start of a function runs either the old
+// code or the new one, whole. Only where the threads are stopped is checked,
+// not the return addresses on their stacks, which a detour longer than a
+// call at the start of a function could cover.
+static Error waitForSafePoints(CrisprProcess &Process,
+                               const vector<CrisprLivePatch::Detour> &Detours,
+                               raw_ostream &Log) {
+    for (unsigned Attempt = 0; Attempt < 1000; Attempt++) {
+        auto Pointers = Process.getInstructionPointers();
+        if (!Pointers) return makeError("Error while looking for safe points", Pointers.takeError());
+        bool Unsafe = any_of(*Pointers, [&Detours](uint64_t Pointer) {
+            return any_of(Detours, [Pointer](const CrisprLivePatch::Detour &Detour) {
+                return Pointer > Detour.Address && Pointer < Detour.Address + Detour.Patch.size();
+            });
+        });
+        if (!Unsafe) {
+            if (Attempt != 0) Log << "Reached safe points after " << Attempt << " attempts\n";
+            return Error::success();
+        }
+        if (auto Err = Process.run(std::chrono::microseconds(100))) {
+            return makeError("Error while looking for safe points", std::move(Err));
+        }
+    }
+    return makeError("The threads of process " + Twine(Process.getPid()) + " keep running the code to patch");
+}
+
+static Error saveRollback(const string &Path,
+                          pid_t Pid,
+                          uint64_t Reserved,
+                          const vector<CrisprLivePatch::Detour> &Detours) {
+    json::Array Entries;
+    for (auto const &Detour : Detours) {
+        Entries.push_back(json::Object{
+                {"function", Detour.Function},
+                {"address",  static_cast<int64_t>(Detour.Address)},
+                {"original", toHex(Detour.Original)},
+                {"patch",    toHex(Detour.Patch)},
+        });
+    }
+    json::Object Root{
+            {"pid",      Pid},
+            {"reserved", static_cast<int64_t>(Reserved)},
+            {"detours",  std::move(Entries)},
+    };
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+    if (EC) return make_error<StringError>("Could not write " + Path, EC);
+    OS << formatv("{0:2}", json::Value(std::move(Root)));
+    return Error::success();
+}
+
+static Expected<vector<CrisprLivePatch::Detour>> loadRollback(const string &Path, pid_t Pid) {
+    auto Malformed = [&Path]() { return makeError(Path + " is not a rollback file"); };
+
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer) return make_error<StringError>("Could not read " + Path, Buffer.getError());
+    auto Value = json::parse((*Buffer)->getBuffer());
+    if (!Value) return makeError("Could not parse " + Path, Value.takeError());
+    auto *Root = Value->getAsObject();
+    if (!Root || !Root->getArray("detours")) return Malformed();
+    if (Root->getInteger("pid") != static_cast<int64_t>(Pid)) {
+        return makeError(Path + " was saved for another process");
+    }
+
+    vector<CrisprLivePatch::Detour> Detours;
+    for (auto const &Entry : *Root->getArray("detours")) {
+        auto *Object = Entry.getAsObject();
+        if (!Object) return Malformed();
+        auto Function = Object->getString("function");
+        auto Address = Object->getInteger("address");
+        auto Original = Object->getString("original");
+        auto Patch = Object->getString("patch");
+        if (!Function || !Address || !Original || !Patch || Original->size() != Patch->size()) return Malformed();
+
+        CrisprLivePatch::Detour Detour{Function->str(), static_cast<uint64_t>(*Address), {}, {}};
+        string OriginalBytes = fromHex(*Original);
+        string PatchBytes = fromHex(*Patch);
+        Detour.Original.append(OriginalBytes.begin(), OriginalBytes.end());
+        Detour.Patch.append(PatchBytes.begin(), PatchBytes.end());
+        Detours.push_back(std::move(Detour));
+    }
+    return std::move(Detours);
+}
+
+Expected<unique_ptr<CrisprLivePatch>> CrisprLivePatch::reserve(pid_t Pid, const CrisprElf &Binary, raw_ostream &Log) {
+    auto Process = attachProcess(Pid);
+    if (!Process) return Process.takeError();
+    auto LoadBase = findLoadBase(**Process, Binary);
+    if (!LoadBase) return LoadBase.takeError();
+    auto Mappings = getMappings(**Process);
+    if (!Mappings) return Mappings.takeError();
+
+    CrisprAddressPlanner Planner;
+    for (auto const &Mapping : *Mappings) Planner.reserve(Mapping.Start, Mapping.End - Mapping.Start);
+
+    uint64_t Start = *LoadBase + alignDown(Binary.getLowestLoadAddress(), PageSize);
+    uint64_t End = Start;
+    for (auto const &Phdr : Binary.programHeaders()) {
+        if (Phdr.p_type == ELF::PT_LOAD) End = std::max<uint64_t>(End, *LoadBase + Phdr.p_vaddr + Phdr.p_memsz);
+    }
+
+    const uint64_t Size = 3 * LiveSegmentSpan;
+    uint64_t Address = Planner.findFree(Size, HugePageSize, End + LiveHeapGap);
+    if (Address + Size - Start > static_cast<uint64_t>(INT32_MAX)) {
+        return makeError("No room for the patch within 2GB of the binary of process " + Twine(Pid));
+    }
+
+    auto Mapped = callProcess(**Process, SYS_mmap, {Address, Size, PROT_NONE,
+                                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                                    static_cast<uint64_t>(-1), 0});
+    if (!Mapped) return Mapped.takeError();
+    if (*Mapped != Address) {
+        Error Err = makeError("The process mapped the space for the patch at 0x" + utohexstr(*Mapped)
+                              + " instead of 0x" + utohexstr(Address));
+        auto Unmapped = callProcess(**Process, SYS_munmap, {*Mapped, Size});
+        if (!Unmapped) return joinErrors(std::move(Err), Unmapped.takeError());
+        return std::move(Err);
+    }
+    Log << "Reserved " << format_hex(Size, 10) << " bytes at " << format_hex(Address, 10) << " in process " << Pid
+        << "\n";
+    return unique_ptr<CrisprLivePatch>(new CrisprLivePatch(Pid, *LoadBase, Address));
+}
+
+Error CrisprLivePatch::installSegments(CrisprProcess &Process, const CrisprCompiler &Recompiler) const {
+    struct LiveSegment {
+        uint64_t Address;
+        uint64_t End;
+        int Protection;
+    };
+    LiveSegment Segments[] = {
+            {Address,                       Address,                       PROT_READ | PROT_EXEC},
+            {Address + LiveSegmentSpan,     Address + LiveSegmentSpan,     PROT_READ | PROT_WRITE},
+            {Address + 2 * LiveSegmentSpan, Address + 2 * LiveSegmentSpan, PROT_READ},
+    };
+    for (auto const &MS : Recompiler.getSegments()) {
+        Segments[0].End = std::max<uint64_t>(Segments[0].End, MS->CodeSegmentAddress + MS->CodeSegmentSize);
+        Segments[1].End = std::max<uint64_t>(Segments[1].End, MS->DataSegmentAddress + MS->DataSegmentSize);
+        Segments[2].End = std::max<uint64_t>(Segments[2].End, MS->RoDataSegmentAddress + MS->RoDataSegmentSize);
+    }
+    for (auto const &Segment : Segments) {
+        uint64_t Size = alignTo(Segment.End - Segment.Address, PageSize);
+        if (Size > LiveSegmentSpan) {
+            return makeError("The patch does not fit in the 0x" + utohexstr(LiveSegmentSpan)
+                             + " bytes reserved for each of its segments");
+        }
+        if (Size == 0) continue;
+        auto Result = callProcess(Process, SYS_mprotect, {Segment.Address, Size, PROT_READ | PROT_WRITE});
+        if (!Result) return Result.takeError();
+    }
+
+    auto Copy = [&Process](uint64_t Address, const uint8_t *Data, size_t Size) -> Error {
+        if (Size == 0) return Error::success();
+        if (auto Err = Process.write(Address, makeArrayRef(Data, Size))) {
+            return makeError("Error while copying the patch", std::move(Err));
+        }
+        return Error::success();
+    };
+    for (auto const &MS : Recompiler.getSegments()) {
+        if (auto Err = Copy(MS->CodeSegmentAddress, MS->CodeSegment, MS->CodeSegmentSize)) return Err;
+        if (auto Err = Copy(MS->DataSegmentAddress, MS->DataSegment, MS->DataSegmentSize)) return Err;
+        if (auto Err = Copy(MS->RoDataSegmentAddress, MS->RoDataSegment, MS->RoDataSegmentSize)) return Err;
+    }
+
+    for (auto const &Segment : Segments) {
+        uint64_t Size = alignTo(Segment.End - Segment.Address, PageSize);
+        if (Size == 0) continue;
+        auto Result = callProcess(Process, SYS_mprotect, {Segment.Address, Size,
+                                                          static_cast<uint64_t>(Segment.Protection)});
+        if (!Result) return Result.takeError();
+    }
+    return Error::success();
+}
+
+Error CrisprLivePatch::install(const CrisprCompiler &Recompiler,
+                               const map<string, uint64_t> &NewSymbols,
+                               const CrisprSymbolTable &ExistingSymbols,
+                               const string &Path,
+                               raw_ostream &Log) {
+    // A detour longer than its function would overwrite the code following
+    // it, which other threads may be running. Checked before the process is
+    // changed.
+    for (auto const &NewSymbol : NewSymbols) {
+        auto OldSymbol = ExistingSymbols.lookup(NewSymbol.first);
+        if (!OldSymbol) {
+            return makeError("Symbol " + NewSymbol.first
+                             + " was not found in the binary and was not manually provided");
+        }
+        uint64_t DetourSize = getDetourSize(OldSymbol->Address, NewSymbol.second);
+        if (OldSymbol->Size != 0 && DetourSize > OldSymbol->Size) {
+            return makeError("The " + Twine(DetourSize) + " bytes detour of " + NewSymbol.first
+                             + " is longer than the function (" + Twine(OldSymbol->Size)
+                             + " bytes), it cannot be patched live");
+        }
+    }
+
+    auto Process = attachProcess(Pid);
+    if (!Process) return Process.takeError();
+    // The threads stay stopped until the process is restored
+    auto Fail = [this, &Process](Error Err) { return restore(**Process, std::move(Err)); };
+
+    if (auto Err = installSegments(**Process, Recompiler)) return Fail(std::move(Err));
+
+    for (auto const &NewSymbol : NewSymbols) {
+        uint64_t OldAddress = ExistingSymbols.lookup(NewSymbol.first)->Address;
+        Detour NewDetour{NewSymbol.first, OldAddress, {}, getDetourPatch(OldAddress, NewSymbol.second)};
+        NewDetour.Original.resize(NewDetour.Patch.size());
+        if (auto Err = (*Process)->read(NewDetour.Address, NewDetour.Original)) {
+            return Fail(makeError("Error while reading " + NewSymbol.first, std::move(Err)));
+        }
+        Detours.push_back(std::move(NewDetour));
+    }
+    if (auto Err = saveRollback(Path, Pid, Address, Detours)) return Fail(std::move(Err));
+    RollbackPath = Path;
+
+    if (auto Err = waitForSafePoints(**Process, Detours, Log)) return Fail(std::move(Err));
+    for (auto const &Detour : Detours) {
+        // Restored along with the others if it is only partly written
+        Written++;
+        if (auto Err = (*Process)->write(Detour.Address, Detour.Patch)) {
+            return Fail(makeError("Error while writing the detour of " + Detour.Function, std::move(Err)));
+        }
+    }
+    Installed = true;
+    Log << "Patched " << Detours.size() << " functions in process " << Pid << " (" << (*Process)->getThreadCount()
+        << " threads), the rollback is saved in " << RollbackPath << "\n";
+    return Error::success();
+}
+
+Error CrisprLivePatch::abandon(Error Cause) {
+    if (Installed || Released) return Cause;
+    auto Process = attachProcess(Pid);
+    if (!Process) return joinErrors(std::move(Cause), Process.takeError());
+    return restore(**Process, std::move(Cause));
+}
+
+Error CrisprLivePatch::restore(CrisprProcess &Process, Error Cause) {
+    Released = true;
+    // The threads were not resumed since the detours were written, so none
+    // of them runs the new code
+    for (size_t I = 0; I < Written; I++) {
+        if (auto Err = Process.write(Detours[I].Address, Detours[I].Original)) {
+            // The new code stays mapped, the detour may still lead there
+            return joinErrors(std::move(Cause), makeError("Could not restore " + Detours[I].Function,
+                                                          std::move(Err)));
+        }
+    }
+    Written = 0;
+
+    auto Unmapped = callProcess(Process, SYS_munmap, {Address, 3 * LiveSegmentSpan});
+    if (!Unmapped) return joinErrors(std::move(Cause), Unmapped.takeError());
+    if (!RollbackPath.empty()) sys::fs::remove(RollbackPath);
+    return Cause;
+}
+
+Error CrisprLivePatch::rollBack(pid_t Pid, const string &RollbackPath, raw_ostream &Log) {
+    auto Detours = loadRollback(RollbackPath, Pid);
+    if (!Detours) return Detours.takeError();
+    auto Process = attachProcess(Pid);
+    if (!Process) return Process.takeError();
+    for (auto const &Detour : *Detours) {
+        SmallVector<uint8_t, 16> Current(Detour.Patch.size());
+        if (auto Err = (*Process)->read(Detour.Address, Current)) {
+            return makeError("Error while reading " + Detour.Function, std::move(Err));
+        }
+        if (Current != Detour.Patch) {
+            return makeError(Detour.Function + " was changed since it was patched, not rolling back");
+        }
+    }
+
+    if (auto Err = waitForSafePoints(**Process, *Detours, Log)) return Err;
+    for (auto const &Detour : *Detours) {
+        if (auto Err = (*Process)->write(Detour.Address, Detour.Original)) {
+            return makeError("Error while restoring " + Detour.Function, std::move(Err));
+        }
+    }
+    Log << "Restored " << Detours->size() << " functions in process " << Pid << "\n";
+    return Error::success();
+}
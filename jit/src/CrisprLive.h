@@ -0,0 +1,110 @@
+#ifndef CRISPR_CRISPRLIVE_H
+#define CRISPR_CRISPRLIVE_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprCompiler.h"
+#include "CrisprElf.h"
+#include "CrisprProcess.h"
+#include "CrisprSymbolTable.h"
+
+// Space reserved in a live process for each segment of the patch
+constexpr uint64_t LiveSegmentSpan = 0x4000000;
+
+// Patch of a running process (crispr live).
+//
+// Space is first reserved in the process for the code, data and rodata of the
+// patch, above its binary but within reach of the rel32 jumps of the detours,
+// so that the patch can be compiled for it. Installing the patch copies it
+// there, then writes the detours while all the threads are stopped, none of
+// them inside the bytes being replaced, which are saved to roll the patch
+// back. The process is only attached to while it is changed, not while the
+// patch is compiled.
+//
+// Whatever fails once the space is reserved, abandon() detaches from the
+// process and leaves it as it was: the detours already written are restored
+// and the reserved space is unmapped.
+class CrisprLivePatch {
+    using string = std::string;
+
+public:
+    // A detour written in the process, with the bytes it replaces
+    struct Detour {
+        string Function;
+        uint64_t Address;
+        llvm::SmallVector<uint8_t, 16> Original;
+        llvm::SmallVector<uint8_t, 16> Patch;
+    };
+
+    // Reserves the space for a patch of the process, whose binary is given
+    static llvm::Expected<std::unique_ptr<CrisprLivePatch>> reserve(pid_t Pid,
+                                                                    const CrisprElf &Binary,
+                                                                    llvm::raw_ostream &Log);
+
+    CrisprLivePatch(const CrisprLivePatch &) = delete;
+
+    CrisprLivePatch &operator=(const CrisprLivePatch &) = delete;
+
+    // Where the binary of the process is loaded relative to the addresses it
+    // was linked at, zero unless it is position independent
+    [[nodiscard]] uint64_t getLoadBase() const { return LoadBase; }
+
+    // Start of the reserved space for the code, followed by the data and the
+    // rodata, LiveSegmentSpan bytes each
+    [[nodiscard]] uint64_t getAddress() const { return Address; }
+
+    [[nodiscard]] const std::vector<Detour> &getDetours() const { return Detours; }
+
+    // Copies the compiled patch to the reserved space, then points the old
+    // functions (ExistingSymbols, rebased to the load address) to the new
+    // ones. The bytes the detours replace are saved to Path first.
+    // The process is restored if anything fails once it is attached to.
+    llvm::Error install(const CrisprCompiler &Recompiler,
+                        const std::map<string, uint64_t> &NewSymbols,
+                        const CrisprSymbolTable &ExistingSymbols,
+                        const string &Path,
+                        llvm::raw_ostream &Log);
+
+    // Leaves the process as it was before the space was reserved, unless the
+    // patch was installed. Returns Cause, with what failed while restoring.
+    llvm::Error abandon(llvm::Error Cause);
+
+    // Restores the functions patched by install, as saved in RollbackPath.
+    // The new code stays mapped: the stacks of the threads may still return
+    // into it.
+    static llvm::Error rollBack(pid_t Pid, const string &RollbackPath, llvm::raw_ostream &Log);
+
+private:
+    pid_t Pid;
+    uint64_t LoadBase;
+    uint64_t Address;
+    std::vector<Detour> Detours;
+    // How many of the detours were written
+    size_t Written = 0;
+    // Where the rollback was saved, if it was
+    string RollbackPath;
+    bool Installed = false;
+    bool Released = false;
+
+    CrisprLivePatch(pid_t Pid, uint64_t LoadBase, uint64_t Address) : Pid(Pid), LoadBase(LoadBase), Address(Address) {}
+
+    // Copies the code and data of the patch to the reserved space, and gives
+    // them their final protection
+    llvm::Error installSegments(CrisprProcess &Process, const CrisprCompiler &Recompiler) const;
+
+    // Restores the detours written so far and releases the reserved space,
+    // with the threads of the process stopped. Returns Cause, with what
+    // failed while restoring.
+    llvm::Error restore(CrisprProcess &Process, llvm::Error Cause);
+};
+
+#endif//CRISPR_CRISPRLIVE_H
@@ -0,0 +1,191 @@
+#include <cerrno>
+#include <mutex>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "lld/Common/Driver.h"
+#include "lld/Common/ErrorHandler.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprLldLinker.h"
+
+using namespace llvm;
+using namespace std;
+
+CrisprLldLinker::~CrisprLldLinker() {
+    for (int FD : MemoryFileDescriptors) {
+        close(FD);
+    }
+}
+
+Error CrisprLldLinker::addObject(MemoryBufferRef O) {
+    auto Obj = object::ObjectFile::createObjectFile(O);
+    if (!Obj) return Obj.takeError();
+
+    // Remember what the objects define, so that we don't clash with it
+    // when defining the pre-existing symbols
+    for (auto const &Sym : (*Obj)->symbols()) {
+        uint32_t Flags = Sym.getFlags();
+        if (Flags & object::SymbolRef::SF_Undefined || !(Flags & object::SymbolRef::SF_Global)) continue;
+
+        auto Name = Sym.getName();
+        if (!Name) return Name.takeError();
+        DefinedByObjects.insert(*Name);
+    }
+
+    auto Path = createMemoryFile(O.getBufferIdentifier(), O.getBuffer());
+    if (!Path) return Path.takeError();
+    InputPaths.push_back(std::move(*Path));
+    return Error::success();
+}
+
+Error CrisprLldLinker::addLibrary(const string &Path) {
+    auto Buffer = MemoryBuffer::getFile(Path, -1, false);
+    if (!Buffer) return make_error<StringError>("Could not open " + Path, Buffer.getError());
+
+    // Anything else is a linker script, whose errors lld reports
+    switch (identify_magic((*Buffer)->getBuffer())) {
+        case file_magic::elf:
+        case file_magic::elf_relocatable:
+        case file_magic::elf_executable:
+        case file_magic::elf_shared_object:
+        case file_magic::elf_core: {
+            auto Library = object::ObjectFile::createObjectFile((*Buffer)->getMemBufferRef());
+            if (!Library) {
+                return make_error<StringError>("Malformed library " + Path + ": " + toString(Library.takeError()),
+                                               inconvertibleErrorCode());
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    Libraries.push_back(Path);
+    return Error::success();
+}
+
+Error CrisprLldLinker::link(const string &OutputPath) {
+    vector<string> Args = {
+            "ld.lld",
+            "-shared",
+            "--as-needed",
+            "--image-base=0x" + utohexstr(ImageBase),
+            "-o", OutputPath
+    };
+
+    if (Symbolic) Args.push_back("-Bsymbolic");
+
+    if (MaxPageSize != 0) {
+        Args.push_back("-zmax-page-size=0x" + utohexstr(MaxPageSize));
+        Args.push_back("-zcommon-page-size=0x" + utohexstr(MaxPageSize));
+    }
+
+    for (auto const &SectionStart : SectionStarts) {
+        Args.push_back("--section-start=" + SectionStart.first + "=0x" + utohexstr(SectionStart.second));
+    }
+
+    Args.insert(Args.end(), InputPaths.begin(), InputPaths.end());
+
+    if (ExistingSymbols && !ExistingSymbols->empty()) {
+        auto ScriptPath = createMemoryFile("crispr-existing-symbols.ld", buildExistingSymbolsScript());
+        if (!ScriptPath) return ScriptPath.takeError();
+        Args.push_back(std::move(*ScriptPath));
+    }
+
+    Args.insert(Args.end(), Libraries.begin(), Libraries.end());
+
+    vector<const char *> Argv;
+    for (auto const &Arg : Args) {
+        Argv.push_back(Arg.c_str());
+    }
+
+    string Diagnostics;
+    raw_string_ostream DiagnosticsStream(Diagnostics);
+    bool Success;
+    {
+        // lld keeps its state in globals, links cannot run concurrently.
+        // It never resets its count of errors, which would fail every link
+        // following a failed one.
+        static std::mutex LinkLock;
+        std::lock_guard<std::mutex> Lock(LinkLock);
+        lld::errorHandler().ErrorCount = 0;
+        Success = lld::elf::link(Argv, false, DiagnosticsStream);
+    }
+    DiagnosticsStream.flush();
+
+    if (!Success) {
+        return make_error<StringError>("lld failed to link " + OutputPath + ":\n" + Diagnostics,
+                                       inconvertibleErrorCode());
+    }
+
+    // Warnings
+    errs() << Diagnostics;
+    return Error::success();
+}
+
+Expected<unique_ptr<MemoryBuffer>> CrisprLldLinker::link() {
+    SmallString<128> Path;
+    if (auto EC = sys::fs::createTemporaryFile("crispr-linked", "so", Path)) {
+        return make_error<StringError>("Could not create a temporary file for the linker", EC);
+    }
+    FileRemover Remover(Path);
+
+    if (auto Err = link(Path.str().str())) return std::move(Err);
+
+    auto Buffer = MemoryBuffer::getFile(Path, -1, false);
+    if (!Buffer) return make_error<StringError>("Could not read the linked object", Buffer.getError());
+    return std::move(*Buffer);
+}
+
+Expected<string> CrisprLldLinker::createMemoryFile(StringRef Name, StringRef Content) {
+    int FD = memfd_create(Name.str().c_str(), MFD_CLOEXEC);
+    if (FD < 0) {
+        return errorCodeToError(error_code(errno, generic_category()));
+    }
+    MemoryFileDescriptors.push_back(FD);
+
+    raw_fd_ostream Out(FD, false);
+    Out << Content;
+    Out.flush();
+    if (Out.has_error()) {
+        Out.clear_error();
+        return make_error<StringError>("Could not write " + Name + " to a memory file", inconvertibleErrorCode());
+    }
+
+    return "/proc/self/fd/" + to_string(FD);
+}
+
+string CrisprLldLinker::buildExistingSymbolsScript() const {
+    // lld refuses PC-relative relocations against absolute symbols when
+    // producing a shared object, so the symbols are defined relative to the
+    // ELF header, which lld places at the image base.
+    // Only the referenced symbols are defined, and hidden: the patch binds
+    // to them directly, they need neither dynamic symbols nor relocations.
+    string Script;
+    raw_string_ostream Out(Script);
+
+    for (auto const &Symbol : ExistingSymbols->symbols()) {
+        StringRef Name = Symbol.Name;
+        uint64_t Address = Symbol.Address;
+
+        // Versioned symbols can only come from the dynamic libraries
+        if (Name.contains('@') || Name.contains('"')) continue;
+        if (DefinedByObjects.count(Name)) continue;
+
+        Out << "PROVIDE_HIDDEN(\"" << Name << "\" = __ehdr_start ";
+        if (Address >= ImageBase) {
+            Out << "+ 0x" << utohexstr(Address - ImageBase);
+        } else {
+            Out << "- 0x" << utohexstr(ImageBase - Address);
+        }
+        Out << ");\n";
+    }
+
+    return Out.str();
+}
@@ -0,0 +1,84 @@
+#ifndef CRISPR_CRISPRLLDLINKER_H
+#define CRISPR_CRISPRLLDLINKER_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "CrisprSymbolTable.h"
+
+// Links the objects produced by the compiler into a shared object using lld
+// as a library, so that no linker process has to be spawned.
+// Inputs are not written to disk: every object and the linker script defining
+// the pre-existing symbols live in an anonymous memory file (memfd) which lld
+// opens through /proc/self/fd.
+//
+// lld ends the process on the inputs it cannot parse (fatal errors), even
+// when used as a library. The objects and the ELF libraries are parsed when
+// they are added, so that they fail like any other error instead. An input
+// which lld finds malformed all the same still ends the process, and every
+// job of a batch with it.
+class CrisprLldLinker {
+    using string = std::string;
+
+private:
+    uint64_t ImageBase;
+    bool Symbolic;
+    uint64_t MaxPageSize;
+
+    std::vector<int> MemoryFileDescriptors;
+    std::vector<string> InputPaths;
+    std::vector<string> Libraries;
+    std::map<string, uint64_t> SectionStarts;
+
+    const CrisprSymbolTable *ExistingSymbols;
+    llvm::StringSet<> DefinedByObjects;
+
+public:
+    explicit CrisprLldLinker(uint64_t ImageBase) : ImageBase(ImageBase),
+                                                   Symbolic(false),
+                                                   MaxPageSize(0),
+                                                   ExistingSymbols(nullptr) {}
+
+    ~CrisprLldLinker();
+
+    CrisprLldLinker(const CrisprLldLinker &) = delete;
+
+    CrisprLldLinker &operator=(const CrisprLldLinker &) = delete;
+
+    llvm::Error addObject(llvm::MemoryBufferRef O);
+
+    // An ELF shared object, or a linker script such as libc.so
+    llvm::Error addLibrary(const string &Path);
+
+    // Binds the references to the symbols defined in the output (including
+    // the pre-existing ones) directly, instead of through the PLT and the GOT
+    void setSymbolic(bool Value) { Symbolic = Value; }
+
+    // Aligns the segments to Size (e.g. 2MB for huge pages), 0 for the
+    // default of lld
+    void setMaxPageSize(uint64_t Size) { MaxPageSize = Size; }
+
+    void setSectionStart(const string &SectionName, uint64_t Address) { SectionStarts[SectionName] = Address; }
+
+    // The symbols must outlive the call to link()
+    void setExistingSymbols(const CrisprSymbolTable &Symbols) { ExistingSymbols = &Symbols; }
+
+    llvm::Error link(const string &OutputPath);
+
+    // Links in memory. lld can only write to a file, so it writes to a
+    // private temporary file, which is read back and removed right away.
+    llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> link();
+
+private:
+    llvm::Expected<string> createMemoryFile(llvm::StringRef Name, llvm::StringRef Content);
+
+    string buildExistingSymbolsScript() const;
+};
+
+#endif//CRISPR_CRISPRLLDLINKER_H
@@ -1,10 +1,13 @@
 #include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iterator>
 #include <memory>
 
+#include "llvm/Support/MathExtras.h"
+
 #include "CrisprMemoryManager.h"
 
-using llvm::outs;
 using llvm::errs;
 using llvm::format_hex;
 
@@ -15,9 +18,11 @@ CrisprMemoryManager::allocateCodeSection(
         unsigned SectionID,
         StringRef SectionName
 ) {
-    uint8_t *LocalAddress = MS.CodeSegment + CodeSegmentNextFreeOffset;
-    uint64_t TargetAddress = CodeSegmentTargetProcessBaseVirtAddr + CodeSegmentNextFreeOffset;
-    CodeSegmentNextFreeOffset += Size;
+    std::lock_guard<std::mutex> Guard(Lock);
+    size_t Offset = allocateInSegment(CodeSegmentNextFreeOffset, MS.CodeSegmentSize, CodeSegmentReservedSize,
+                                      Size, Alignment, SectionName);
+    uint8_t *LocalAddress = MS.CodeSegment + Offset;
+    uint64_t TargetAddress = CodeSegmentTargetProcessBaseVirtAddr + Offset;
 
     AllocatedSections[SectionName] = {
             .LocalAddress = LocalAddress,
@@ -26,9 +31,12 @@ CrisprMemoryManager::allocateCodeSection(
             .Attributes = SectionAttributes::EXECUTABLE
     };
 
-    outs() << "Allocated code section \"" << SectionName << "\""
-           << " of size " << format_hex(Size, 6)
-           << " at target address " << format_hex(TargetAddress, 10) << "\n";
+    if (Stats) Stats->add("code_bytes", Size);
+    if (Verbose) {
+        Log << "Allocated code section \"" << SectionName << "\""
+            << " of size " << format_hex(Size, 6)
+            << " at target address " << format_hex(TargetAddress, 10) << "\n";
+    }
 
     return LocalAddress;
 }
@@ -41,54 +49,78 @@ CrisprMemoryManager::allocateDataSection(
         StringRef SectionName,
         bool IsReadOnly
 ) {
-
+    std::lock_guard<std::mutex> Guard(Lock);
     SectionAllocation NewAllocation{
             .Size=Size,
             .Attributes = SectionAttributes::NONE
     };
 
     if (!IsReadOnly) {
-        NewAllocation.LocalAddress = MS.DataSegment + DataSegmentNextFreeOffset;
-        NewAllocation.TargetProcessAddress = DataSegmentTargetProcessBaseVirtAddr + DataSegmentNextFreeOffset;
-        DataSegmentNextFreeOffset += Size;
+        size_t Offset = allocateInSegment(DataSegmentNextFreeOffset, MS.DataSegmentSize, DataSegmentReservedSize,
+                                          Size, Alignment, SectionName);
+        NewAllocation.LocalAddress = MS.DataSegment + Offset;
+        NewAllocation.TargetProcessAddress = DataSegmentTargetProcessBaseVirtAddr + Offset;
         NewAllocation.Attributes = SectionAttributes::WRITABLE;
     } else {
-        NewAllocation.LocalAddress = MS.RoDataSegment + RoDataSegmentNextFreeOffset;
-        NewAllocation.TargetProcessAddress = RoDataSegmentTargetProcessBaseVirtAddr + RoDataSegmentNextFreeOffset;
-        RoDataSegmentNextFreeOffset += Size;
+        size_t Offset = allocateInSegment(RoDataSegmentNextFreeOffset, MS.RoDataSegmentSize,
+                                          RoDataSegmentReservedSize, Size, Alignment, SectionName);
+        NewAllocation.LocalAddress = MS.RoDataSegment + Offset;
+        NewAllocation.TargetProcessAddress = RoDataSegmentTargetProcessBaseVirtAddr + Offset;
     }
 
     AllocatedSections[SectionName] = NewAllocation;
 
-    outs() << "Allocated data section \"" << SectionName << "\""
-           << " of size " << format_hex(Size, 6)
-           << " at target address " << format_hex(NewAllocation.TargetProcessAddress, 10) << "\n";
+    if (Stats) Stats->add(IsReadOnly ? "rodata_bytes" : "data_bytes", Size);
+    if (Verbose) {
+        Log << "Allocated data section \"" << SectionName << "\""
+            << " of size " << format_hex(Size, 6)
+            << " at target address " << format_hex(NewAllocation.TargetProcessAddress, 10) << "\n";
+    }
 
     return NewAllocation.LocalAddress;
 }
 
 void CrisprMemoryManager::notifyObjectLoaded(RuntimeDyld &Dyld, const ObjectFile &Obj) {
-    outs() << "Loaded object with sections:\n";
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Stats) {
+        uint64_t Relocations = 0;
+        for (auto S: Obj.sections()) Relocations += std::distance(S.relocation_begin(), S.relocation_end());
+        Stats->add("relocations", Relocations);
+        Stats->add("object_symbols", std::distance(Obj.symbol_begin(), Obj.symbol_end()));
+    }
+    if (Verbose) dumpObject(Obj);
+
+    for (auto const &S: AllocatedSections) {
+        if (Verbose) {
+            Log << "Remapping section " << S.first
+                << " to " << format_hex(S.second.TargetProcessAddress, 10) << "\n";
+        }
+        Dyld.mapSectionAddress(S.second.LocalAddress, S.second.TargetProcessAddress);
+    }
+}
+
+void CrisprMemoryManager::dumpObject(const ObjectFile &Obj) {
+    Log << "Loaded object with sections:\n";
     for (auto S: Obj.sections()) {
         StringRef SectionName;
         S.getName(SectionName);
 
 
-        outs() << "\t" << SectionName << " size " << S.getSize() << "\n";
+        Log << "\t" << SectionName << " size " << S.getSize() << "\n";
 
         if (!empty(S.relocations())) {
-            outs() << "\t\tRelocations: \n";
+            Log << "\t\tRelocations: \n";
         }
 
         for (auto Rel: S.relocations()) {
             auto SymName = Rel.getSymbol()->getName();
             if (!SymName) {
-                outs() << "Error while reading relocation name: " << SymName.takeError() << "\n";
+                Log << "Error while reading relocation name: " << SymName.takeError() << "\n";
                 continue;
             }
             auto SymAddr = Rel.getSymbol()->getAddress();
             if (!SymAddr) {
-                outs() << "Error while reading relocation address: " << SymAddr.takeError() << "\n";
+                Log << "Error while reading relocation address: " << SymAddr.takeError() << "\n";
                 continue;
             }
             auto SymVal = Rel.getSymbol()->getValue();
@@ -96,7 +128,7 @@ void CrisprMemoryManager::notifyObjectLoaded(RuntimeDyld &Dyld, const ObjectFile
             llvm::SmallVector<char, 20> RelTypeName;
             Rel.getTypeName(RelTypeName);
 
-            outs() << "\t\t"
+            Log << "\t\t"
                    << RelTypeName << " "
                    << SymName.get() << ", "
                    << SymAddr.get() << ", "
@@ -106,41 +138,33 @@ void CrisprMemoryManager::notifyObjectLoaded(RuntimeDyld &Dyld, const ObjectFile
         }
     }
 
-    outs() << "Defined symbols: \n";
+    Log << "Defined symbols: \n";
     for (auto S: Obj.symbols()) {
         auto Name = S.getName();
         auto Address = S.getAddress();
         auto Type = S.getType();
 
         if (!Name) {
-            errs() << "Error while reading symbol: " << Name.takeError() << "\n";
+            Log << "Error while reading symbol: " << Name.takeError() << "\n";
             continue;
         }
 
         if (!Address) {
-            errs() << "Error while reading symbol: " << Address.takeError() << "\n";
+            Log << "Error while reading symbol: " << Address.takeError() << "\n";
             continue;
         }
 
         if (!Type) {
-            errs() << "Error while reading symbol: " << Type.takeError() << "\n";
+            Log << "Error while reading symbol: " << Type.takeError() << "\n";
             continue;
         }
 
-        outs() << "\t"
+        Log << "\t"
                << "Name: " << *Name
                << ", addr: " << *Address
                << ", type: " << *Type
                << "\n";
     }
-
-    for (auto const &S: AllocatedSections) {
-        string SectionName = S.first;
-        SectionAllocation Allocation = S.second;
-        outs() << "Remapping section " << SectionName
-               << " to " << format_hex(Allocation.TargetProcessAddress, 10) << "\n";
-        Dyld.mapSectionAddress(Allocation.LocalAddress, Allocation.TargetProcessAddress);
-    }
 }
 
 
@@ -150,33 +174,54 @@ void CrisprMemoryManager::reserveAllocationSpace(uintptr_t CodeSize,
                                                  uint32_t RODataAlign,
                                                  uintptr_t RWDataSize,
                                                  uint32_t RWDataAlign) {
-    outs() << "Request to allocate \n"
-           << "\t" << format_hex(CodeSize, 10) << " for code\n"
-           << "\t" << format_hex(RODataSize, 10) << " for rodata\n"
-           << "\t" << format_hex(RWDataSize, 10) << " for data\n\n";
-
-    MS.CodeSegment = reinterpret_cast<uint8_t *>(malloc(CodeSize));
-    MS.CodeSegmentSize = CodeSize;
-    if (MS.CodeSegment == nullptr) {
-        errs() << "Cannot allocate code segment";
-        exit(1);
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Verbose) {
+        Log << "Request to allocate \n"
+            << "\t" << format_hex(CodeSize, 10) << " for code\n"
+            << "\t" << format_hex(RODataSize, 10) << " for rodata\n"
+            << "\t" << format_hex(RWDataSize, 10) << " for data\n\n";
     }
 
-    MS.DataSegment = reinterpret_cast<uint8_t *>(malloc(RWDataSize));
-    MS.DataSegmentSize = RWDataSize;
-    if (MS.DataSegment == nullptr) {
-        errs() << "Cannot allocate data segment";
-        exit(1);
-    }
+    // The sizes computed by RuntimeDyld include the padding needed to align
+    // every section, as long as the segments are aligned too
+    MS.CodeSegment = allocateSegment(CodeSize, CodeAlign);
+    MS.DataSegment = allocateSegment(RWDataSize, RWDataAlign);
+    MS.RoDataSegment = allocateSegment(RODataSize, RODataAlign);
+    MS.CodeSegmentSize = MS.DataSegmentSize = MS.RoDataSegmentSize = 0;
+    CodeSegmentReservedSize = CodeSize;
+    DataSegmentReservedSize = RWDataSize;
+    RoDataSegmentReservedSize = RODataSize;
+
+    CodeSegmentTargetProcessBaseVirtAddr = CSM.requestCodeAddr(CodeSize, CodeAlign);
+    DataSegmentTargetProcessBaseVirtAddr = CSM.requestDataAddr(RWDataSize, RWDataAlign);
+    RoDataSegmentTargetProcessBaseVirtAddr = CSM.requestRoDataAddr(RODataSize, RODataAlign);
+    MS.CodeSegmentAddress = CodeSegmentTargetProcessBaseVirtAddr;
+    MS.DataSegmentAddress = DataSegmentTargetProcessBaseVirtAddr;
+    MS.RoDataSegmentAddress = RoDataSegmentTargetProcessBaseVirtAddr;
+}
+
+uint8_t *CrisprMemoryManager::allocateSegment(uintptr_t Size, uint32_t Alignment) {
+    if (Size == 0) return nullptr;
+
+    // Zeroed, so that the padding between sections is deterministic
+    auto *Segment = static_cast<uint8_t *>(Arena.Allocate(Size, std::max<uint32_t>(Alignment, 1)));
+    memset(Segment, 0, Size);
+    return Segment;
+}
 
-    MS.RoDataSegment = reinterpret_cast<uint8_t *>(malloc(RODataSize));
-    MS.RoDataSegmentSize = RODataSize;
-    if (MS.RoDataSegment == nullptr) {
-        errs() << "Cannot allocate rodata segment";
+size_t CrisprMemoryManager::allocateInSegment(size_t &NextFreeOffset,
+                                              size_t &UsedSize,
+                                              size_t ReservedSize,
+                                              uintptr_t Size,
+                                              unsigned Alignment,
+                                              StringRef SectionName) {
+    size_t Offset = llvm::alignTo(NextFreeOffset, std::max(Alignment, 1u));
+    if (Offset + Size > ReservedSize) {
+        errs() << "Section \"" << SectionName << "\" does not fit in the space reserved for its segment\n";
         exit(1);
     }
 
-    CodeSegmentTargetProcessBaseVirtAddr = CSM.requestCodeAddr(CodeSize);
-    DataSegmentTargetProcessBaseVirtAddr = CSM.requestDataAddr(RWDataSize);
-    RoDataSegmentTargetProcessBaseVirtAddr = CSM.requestRoDataAddr(RODataSize);
+    NextFreeOffset = Offset + Size;
+    UsedSize = NextFreeOffset;
+    return Offset;
 }
@@ -2,17 +2,26 @@
 #define CRISPR_CRISPRMEMORYMANAGER_H
 
 #include "llvm/ExecutionEngine/RuntimeDyld.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/raw_ostream.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "CrisprSegmentManager.h"
+#include "CrisprStats.h"
 
+// Allocates the sections of an object in three segments (code, data and
+// rodata) reserved at once for the whole object.
+// The segments are carved from an arena owned by the compiler, which frees
+// them all when it is destroyed, and sections are placed at their required
+// alignment both in the segments and in the target process.
 class CrisprMemoryManager : public llvm::RuntimeDyld::MemoryManager {
     using StringRef = llvm::StringRef;
     using string = std::string;
@@ -20,6 +29,8 @@ class CrisprMemoryManager : public llvm::RuntimeDyld::MemoryManager {
     using ObjectFile = llvm::object::ObjectFile;
 
 public:
+    // The sizes only count the bytes actually used by the sections, padding
+    // included, which can be less than what was reserved
     struct MemorySegments {
         uint8_t *CodeSegment;
         uint8_t *DataSegment;
@@ -27,6 +38,10 @@ public:
         size_t CodeSegmentSize;
         size_t DataSegmentSize;
         size_t RoDataSegmentSize;
+        // Addresses of the segments in the target process
+        uint64_t CodeSegmentAddress;
+        uint64_t DataSegmentAddress;
+        uint64_t RoDataSegmentAddress;
     };
 
     enum SectionAttributes {
@@ -44,11 +59,24 @@ public:
 
     CrisprMemoryManager(
             CrisprSegmentManager &CSM,
-            MemorySegments &MemorySegments) : CSM(CSM),
-                                              MS(MemorySegments),
-                                              CodeSegmentNextFreeOffset(0),
-                                              DataSegmentNextFreeOffset(0),
-                                              RoDataSegmentNextFreeOffset(0) {}
+            llvm::BumpPtrAllocator &Arena,
+            MemorySegments &MemorySegments,
+            std::mutex &Lock,
+            llvm::raw_ostream &Log,
+            CrisprStats *Stats,
+            bool Verbose) : CSM(CSM),
+                            Arena(Arena),
+                            MS(MemorySegments),
+                            Lock(Lock),
+                            Log(Log),
+                            Stats(Stats),
+                            Verbose(Verbose),
+                            CodeSegmentReservedSize(0),
+                            DataSegmentReservedSize(0),
+                            RoDataSegmentReservedSize(0),
+                            CodeSegmentNextFreeOffset(0),
+                            DataSegmentNextFreeOffset(0),
+                            RoDataSegmentNextFreeOffset(0) {}
 
     ~CrisprMemoryManager() override = default;
 
@@ -87,8 +115,24 @@ public:
 
 private:
     CrisprSegmentManager &CSM;
+    llvm::BumpPtrAllocator &Arena;
     MemorySegments &MS;
 
+    // Shared by the memory managers of objects linked concurrently, it
+    // protects the segment manager, the arena and the log
+    std::mutex &Lock;
+    llvm::raw_ostream &Log;
+
+    // Optional, counts the bytes allocated per segment and the relocations
+    CrisprStats *Stats;
+
+    // Dumps every allocation, relocation and symbol to the log
+    bool Verbose;
+
+    size_t CodeSegmentReservedSize;
+    size_t DataSegmentReservedSize;
+    size_t RoDataSegmentReservedSize;
+
     size_t CodeSegmentNextFreeOffset;
     size_t DataSegmentNextFreeOffset;
     size_t RoDataSegmentNextFreeOffset;
@@ -98,6 +142,14 @@ private:
     uint64_t CodeSegmentTargetProcessBaseVirtAddr;
     uint64_t DataSegmentTargetProcessBaseVirtAddr;
     uint64_t RoDataSegmentTargetProcessBaseVirtAddr;
+
+    uint8_t *allocateSegment(uintptr_t Size, uint32_t Alignment);
+
+    void dumpObject(const ObjectFile &Obj);
+
+    // Offset of a section in its segment, which must have been reserved
+    static size_t allocateInSegment(size_t &NextFreeOffset, size_t &UsedSize, size_t ReservedSize,
+                                    uintptr_t Size, unsigned Alignment, StringRef SectionName);
 };
 
 #endif//CRISPR_CRISPRMEMORYMANAGER_H
\ No newline at end of file
@@ -0,0 +1,112 @@
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprObjectCache.h"
+
+using namespace llvm;
+using namespace std;
+
+// Bump when the format of the entries or of the key changes
+static const char *CacheVersion = "crispr-object-cache-1";
+
+Expected<unique_ptr<CrisprObjectCache>> CrisprObjectCache::create(const string &Directory) {
+    if (auto EC = sys::fs::create_directories(Directory)) {
+        return make_error<StringError>("Could not create cache directory " + Directory, EC);
+    }
+    return unique_ptr<CrisprObjectCache>(new CrisprObjectCache(Directory));
+}
+
+string CrisprObjectCache::computeKey(const Module &M) const {
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream BitcodeStream(Bitcode);
+    WriteBitcodeToFile(M, BitcodeStream);
+
+    SHA1 Hasher;
+    Hasher.update(CacheVersion);
+    Hasher.update(LLVM_VERSION_STRING);
+    {
+        lock_guard<mutex> Lock(KeysLock);
+        Hasher.update(Configuration);
+    }
+    Hasher.update(M.getTargetTriple());
+    Hasher.update(StringRef(Bitcode.data(), Bitcode.size()));
+    return toHex(Hasher.final());
+}
+
+string CrisprObjectCache::getEntryPath(const string &Key) const {
+    SmallString<128> Path(Directory);
+    sys::path::append(Path, "llvmcache-" + Key);
+    return Path.str().str();
+}
+
+unique_ptr<MemoryBuffer> CrisprObjectCache::getObject(const Module *M) {
+    string Key = computeKey(*M);
+    string Path = getEntryPath(Key);
+
+    // Remember the key to store the object once it has been compiled
+    auto Miss = [&]() {
+        Misses++;
+        lock_guard<mutex> Lock(KeysLock);
+        PendingKeys[M] = Key;
+        return nullptr;
+    };
+
+    int FD;
+    if (sys::fs::openFileForRead(Path, FD)) return Miss();
+
+    // Refresh the access time, which is what the pruning is based on
+    sys::fs::setLastModificationAndAccessTime(FD, chrono::system_clock::now());
+    auto Entry = MemoryBuffer::getOpenFile(FD, Path, -1, false);
+    sys::Process::SafelyCloseFileDescriptor(FD);
+    if (!Entry) {
+        errs() << "Could not read cache entry " << Path << ": " << Entry.getError().message() << "\n";
+        return Miss();
+    }
+
+    Hits++;
+    return std::move(*Entry);
+}
+
+void CrisprObjectCache::notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) {
+    string Key;
+    {
+        lock_guard<mutex> Lock(KeysLock);
+        auto Pending = PendingKeys.find(M);
+        if (Pending == PendingKeys.end()) return;
+        Key = std::move(Pending->second);
+        PendingKeys.erase(Pending);
+    }
+
+    // Write to a temporary file and rename it, so that concurrent crispr
+    // processes never see partial entries
+    SmallString<128> Model(Directory);
+    sys::path::append(Model, "tmp-%%%%%%%%.o");
+    auto Temp = sys::fs::TempFile::create(Model);
+    if (!Temp) {
+        errs() << "Could not create cache entry: " << Temp.takeError() << "\n";
+        return;
+    }
+
+    {
+        raw_fd_ostream OS(Temp->FD, false);
+        OS << Obj.getBuffer();
+    }
+
+    if (auto Err = Temp->keep(getEntryPath(Key))) {
+        errs() << "Could not store cache entry: " << Err << "\n";
+    }
+}
+
+Error CrisprObjectCache::prune(StringRef Policy) {
+    auto ParsedPolicy = parseCachePruningPolicy(Policy);
+    if (!ParsedPolicy) return ParsedPolicy.takeError();
+    pruneCache(Directory, *ParsedPolicy);
+    return Error::success();
+}
@@ -0,0 +1,67 @@
+#ifndef CRISPR_CRISPROBJECTCACHE_H
+#define CRISPR_CRISPROBJECTCACHE_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+// Persistent cache of the objects compiled from the patch modules.
+// Entries are keyed by the hash of the optimized IR of a module and of the
+// configuration of the compiler, so the same functions compiled for a
+// different binary (which only changes the addresses of the existing symbols,
+// resolved at link time) are not compiled again.
+//
+// Entries are named llvmcache-<hash>, so that the directory can be bounded
+// with llvm::pruneCache like the lld ThinLTO cache.
+class CrisprObjectCache : public llvm::ObjectCache {
+    using string = std::string;
+
+private:
+    string Directory;
+    string Configuration;
+
+    // Keys computed by getObject() for the modules being compiled, reused
+    // when the compiled object is notified. The cache can be shared by
+    // compilers running concurrently, which also set the configuration.
+    mutable std::mutex KeysLock;
+    std::map<const llvm::Module *, string> PendingKeys;
+
+    std::atomic<unsigned> Hits{0};
+    std::atomic<unsigned> Misses{0};
+
+    explicit CrisprObjectCache(string Directory) : Directory(std::move(Directory)) {}
+
+    string computeKey(const llvm::Module &M) const;
+
+    string getEntryPath(const string &Key) const;
+
+public:
+    static llvm::Expected<std::unique_ptr<CrisprObjectCache>> create(const string &Directory);
+
+    // Everything besides the IR that affects the generated code
+    void setConfiguration(string Config) {
+        std::lock_guard<std::mutex> Lock(KeysLock);
+        Configuration = std::move(Config);
+    }
+
+    void notifyObjectCompiled(const llvm::Module *M, llvm::MemoryBufferRef Obj) override;
+
+    std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *M) override;
+
+    // Evicts the least recently used entries according to an lld-style cache
+    // policy, e.g. "cache_size_bytes=1g:prune_after=30d"
+    llvm::Error prune(llvm::StringRef Policy);
+
+    [[nodiscard]] unsigned getHits() const { return Hits; }
+
+    [[nodiscard]] unsigned getMisses() const { return Misses; }
+};
+
+#endif//CRISPR_CRISPROBJECTCACHE_H
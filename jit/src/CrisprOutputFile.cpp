@@ -0,0 +1,114 @@
+#include <cerrno>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/FileSystem.h"
+
+#include "CrisprOutputFile.h"
+
+using namespace llvm;
+using namespace std;
+
+Expected<unique_ptr<CrisprOutputFile>> CrisprOutputFile::createCopy(const string &From, const string &To) {
+    // Truncating the output would destroy the input before it is copied
+    bool Same = false;
+    if (!sys::fs::equivalent(From, To, Same) && Same) {
+        return make_error<StringError>(To + " is the same file as " + From,
+                                       make_error_code(errc::invalid_argument));
+    }
+
+    int FromFD = ::open(From.c_str(), O_RDONLY | O_CLOEXEC);
+    if (FromFD < 0) {
+        return make_error<StringError>("Could not open " + From, error_code(errno, generic_category()));
+    }
+
+    struct stat FromStat{};
+    if (fstat(FromFD, &FromStat) < 0) {
+        close(FromFD);
+        return make_error<StringError>("Could not stat " + From, error_code(errno, generic_category()));
+    }
+
+    int ToFD = ::open(To.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, FromStat.st_mode & 07777);
+    if (ToFD < 0) {
+        close(FromFD);
+        return make_error<StringError>("Could not create " + To, error_code(errno, generic_category()));
+    }
+
+    unique_ptr<CrisprOutputFile> Output(new CrisprOutputFile(To, ToFD, FromStat.st_size));
+    Error Err = Output->copyContent(FromFD, FromStat.st_size);
+    close(FromFD);
+    if (Err) return std::move(Err);
+
+    return std::move(Output);
+}
+
+Expected<unique_ptr<CrisprOutputFile>> CrisprOutputFile::openExisting(const string &Path) {
+    int FD = ::open(Path.c_str(), O_RDWR | O_CLOEXEC);
+    if (FD < 0) {
+        return make_error<StringError>("Could not open " + Path, error_code(errno, generic_category()));
+    }
+
+    struct stat Stat{};
+    if (fstat(FD, &Stat) < 0) {
+        close(FD);
+        return make_error<StringError>("Could not stat " + Path, error_code(errno, generic_category()));
+    }
+
+    return unique_ptr<CrisprOutputFile>(new CrisprOutputFile(Path, FD, Stat.st_size));
+}
+
+CrisprOutputFile::~CrisprOutputFile() {
+    close(FD);
+}
+
+Error CrisprOutputFile::copyContent(int FromFD, uint64_t Length) {
+    // Share the extents with the input if the filesystem supports it
+    if (ioctl(FD, FICLONE, FromFD) == 0) return Error::success();
+
+    uint64_t Copied = 0;
+    while (Copied < Length) {
+        ssize_t Ret = copy_file_range(FromFD, nullptr, FD, nullptr, Length - Copied, 0);
+        if (Ret < 0 && errno == EINTR) continue;
+        if (Ret <= 0) break;
+        Copied += Ret;
+    }
+    if (Copied == Length) return Error::success();
+
+    // copy_file_range is not available (old kernel or cross-filesystem copy)
+    char Buffer[1 << 16];
+    while (Copied < Length) {
+        ssize_t Read = pread(FromFD, Buffer, sizeof(Buffer), Copied);
+        if (Read < 0 && errno == EINTR) continue;
+        if (Read <= 0) return errorFromErrno("Could not read input file");
+
+        if (auto Err = write(Copied, ArrayRef<uint8_t>(reinterpret_cast<uint8_t *>(Buffer), Read))) return Err;
+        Copied += Read;
+    }
+    return Error::success();
+}
+
+Error CrisprOutputFile::write(uint64_t Offset, ArrayRef<uint8_t> Data) {
+    uint64_t Written = 0;
+    while (Written < Data.size()) {
+        ssize_t Ret = pwrite(FD, Data.data() + Written, Data.size() - Written, Offset + Written);
+        if (Ret < 0 && errno == EINTR) continue;
+        if (Ret < 0) return errorFromErrno("Could not write");
+        Written += Ret;
+    }
+    Size = std::max(Size, Offset + Data.size());
+    return Error::success();
+}
+
+Error CrisprOutputFile::resize(uint64_t NewSize) {
+    if (ftruncate(FD, NewSize) < 0) return errorFromErrno("Could not resize");
+    Size = NewSize;
+    return Error::success();
+}
+
+Error CrisprOutputFile::errorFromErrno(const Twine &What) const {
+    return make_error<StringError>(What + " " + Path, error_code(errno, generic_category()));
+}
@@ -0,0 +1,59 @@
+#ifndef CRISPR_CRISPROUTPUTFILE_H
+#define CRISPR_CRISPROUTPUTFILE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Error.h"
+
+// Output binary created as a copy of an existing file.
+// The copy is done by the kernel (reflink or copy_file_range where the
+// filesystem supports them), so that the unchanged bulk of the input never
+// goes through user space. Changes are then written in place at the given
+// offsets.
+class CrisprOutputFile {
+    using string = std::string;
+
+private:
+    string Path;
+    int FD;
+    uint64_t Size;
+
+    CrisprOutputFile(string Path, int FD, uint64_t Size) : Path(std::move(Path)), FD(FD), Size(Size) {}
+
+public:
+    static llvm::Expected<std::unique_ptr<CrisprOutputFile>> createCopy(const string &From, const string &To);
+
+    // Opens a binary produced by a previous run, to be changed in place
+    static llvm::Expected<std::unique_ptr<CrisprOutputFile>> openExisting(const string &Path);
+
+    ~CrisprOutputFile();
+
+    CrisprOutputFile(const CrisprOutputFile &) = delete;
+
+    CrisprOutputFile &operator=(const CrisprOutputFile &) = delete;
+
+    llvm::Error write(uint64_t Offset, llvm::ArrayRef<uint8_t> Data);
+
+    llvm::Error write(uint64_t Offset, llvm::StringRef Data) {
+        return write(Offset, llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(Data.data()), Data.size()));
+    }
+
+    // Extends (with a hole) or truncates the file
+    llvm::Error resize(uint64_t NewSize);
+
+    [[nodiscard]] uint64_t getSize() const { return Size; }
+
+    [[nodiscard]] const string &getPath() const { return Path; }
+
+private:
+    llvm::Error copyContent(int FromFD, uint64_t Length);
+
+    llvm::Error errorFromErrno(const llvm::Twine &What) const;
+};
+
+#endif//CRISPR_CRISPROUTPUTFILE_H
@@ -0,0 +1,11 @@
+#ifndef CRISPR_CRISPRPAGES_H
+#define CRISPR_CRISPRPAGES_H
+
+#include <cstdint>
+
+// Granularity of the mappings of x86-64 processes, and of the ones which can
+// be backed by huge pages (--huge-pages)
+constexpr uint64_t PageSize = 0x1000;
+constexpr uint64_t HugePageSize = 0x200000;
+
+#endif//CRISPR_CRISPRPAGES_H
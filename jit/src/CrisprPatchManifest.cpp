@@ -0,0 +1,354 @@
+#include <algorithm>
+#include <set>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/ModuleSlotTracker.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprPatchManifest.h"
+
+using namespace llvm;
+using namespace std;
+
+static constexpr int64_t ManifestVersion = 3;
+
+static string hashTexts(vector<string> &Texts) {
+    // The order of the definitions in the module does not matter
+    std::sort(Texts.begin(), Texts.end());
+    MD5 Hash;
+    for (auto const &Text : Texts) {
+        Hash.update(Text);
+        Hash.update(StringRef("\0", 1));
+    }
+    MD5::MD5Result Result;
+    Hash.final(Result);
+    return Result.digest().str().str();
+}
+
+// Whether the definition is part of the hash of the functions using it.
+// Declarations are resolved to the input binary, variables are hashed apart.
+static bool isHashed(const GlobalObject &GO) {
+    if (GO.isDeclaration()) return false;
+    if (auto *GV = dyn_cast<GlobalVariable>(&GO)) return GV->isConstant();
+    return isa<Function>(GO);
+}
+
+static void collectReferences(const Constant *C,
+                              SmallPtrSetImpl<const GlobalObject *> &References,
+                              SmallPtrSetImpl<const Constant *> &Visited) {
+    if (!Visited.insert(C).second) return;
+    if (auto *GO = dyn_cast<GlobalObject>(C)) {
+        if (isHashed(*GO)) References.insert(GO);
+        return;
+    }
+    for (auto const &Operand : C->operands()) {
+        if (auto *Nested = dyn_cast<Constant>(Operand)) collectReferences(Nested, References, Visited);
+    }
+}
+
+bool CrisprPatchManifest::hasFixedAddress(const GlobalVariable &GV) {
+    return !GV.isConstant() || (!GV.hasLocalLinkage() && !GV.hasGlobalUnnamedAddr());
+}
+
+map<string, string> CrisprPatchManifest::hashFunctions(const Module &M) {
+    // Text and direct references of every hashed definition
+    ModuleSlotTracker MST(&M);
+    DenseMap<const GlobalObject *, string> Texts;
+    DenseMap<const GlobalObject *, SmallPtrSet<const GlobalObject *, 8>> References;
+    auto Add = [&](const GlobalObject &GO) {
+        raw_string_ostream OS(Texts[&GO]);
+        GO.print(OS, MST);
+        OS.flush();
+
+        auto &Referenced = References[&GO];
+        SmallPtrSet<const Constant *, 16> Visited;
+        if (auto *F = dyn_cast<Function>(&GO)) {
+            for (auto const &I : instructions(*F)) {
+                for (auto const &Operand : I.operands()) {
+                    if (auto *C = dyn_cast<Constant>(Operand)) collectReferences(C, Referenced, Visited);
+                }
+            }
+        } else {
+            collectReferences(cast<GlobalVariable>(GO).getInitializer(), Referenced, Visited);
+        }
+    };
+    for (auto const &F : M.functions()) {
+        if (isHashed(F)) Add(F);
+    }
+    for (auto const &GV : M.globals()) {
+        if (isHashed(GV)) Add(GV);
+    }
+
+    map<string, string> Hashes;
+    for (auto const &F : M.functions()) {
+        if (F.isDeclaration() || F.hasLocalLinkage()) continue;
+
+        SmallPtrSet<const GlobalObject *, 16> Reached = {&F};
+        vector<const GlobalObject *> Worklist = {&F};
+        vector<string> Reachable;
+        while (!Worklist.empty()) {
+            const GlobalObject *GO = Worklist.back();
+            Worklist.pop_back();
+            Reachable.push_back(Texts[GO]);
+            for (auto const *Referenced : References[GO]) {
+                if (Reached.insert(Referenced).second) Worklist.push_back(Referenced);
+            }
+        }
+        Hashes[F.getName().str()] = hashTexts(Reachable);
+    }
+    return Hashes;
+}
+
+string CrisprPatchManifest::hashVariables(const Module &M) {
+    vector<string> Texts = {M.getTargetTriple(), M.getDataLayoutStr()};
+    auto Add = [&Texts](const GlobalValue &GV) {
+        Texts.emplace_back();
+        raw_string_ostream OS(Texts.back());
+        GV.print(OS);
+        OS.flush();
+    };
+    for (auto const &GV : M.globals()) {
+        if (hasFixedAddress(GV)) Add(GV);
+    }
+    for (auto const &GA : M.aliases()) Add(GA);
+    for (auto const &GI : M.ifuncs()) Add(GI);
+    return hashTexts(Texts);
+}
+
+Expected<CrisprPatchManifest>
+CrisprPatchManifest::create(const Module &M, const string &InputBinaryPath, const string &Configuration) {
+    CrisprPatchManifest Manifest;
+    sys::fs::file_status Status;
+    if (auto EC = sys::fs::status(InputBinaryPath, Status)) {
+        return make_error<StringError>("Could not stat " + InputBinaryPath, EC);
+    }
+    Manifest.Input = InputBinaryPath;
+    Manifest.InputSize = Status.getSize();
+    Manifest.InputTime = sys::toTimeT(Status.getLastModificationTime());
+    Manifest.Configuration = Configuration;
+    Manifest.VariablesHash = hashVariables(M);
+    Manifest.FunctionHashes = hashFunctions(M);
+    return std::move(Manifest);
+}
+
+Error CrisprPatchManifest::addLinked(MemoryBufferRef LinkedBuffer) {
+    auto Linked = object::ObjectFile::createObjectFile(LinkedBuffer);
+    if (!Linked) return Linked.takeError();
+
+    for (auto const &S : (*Linked)->sections()) {
+        StringRef Name;
+        if (S.getName(Name) || !Name.startswith(".funcs.")) continue;
+        Sections[Name.str()] = {S.getAddress(), S.getSize(), S.getSize()};
+    }
+
+    // Local symbols of different objects can share a name, and cannot be
+    // told apart afterwards
+    std::set<string> Ambiguous;
+    for (auto const &S : (*Linked)->symbols()) {
+        if (S.getFlags() & object::SymbolRef::SF_Undefined) continue;
+        auto Type = S.getType();
+        if (!Type) return Type.takeError();
+        if (*Type != object::SymbolRef::ST_Function && *Type != object::SymbolRef::ST_Data) continue;
+
+        auto Name = S.getName();
+        if (!Name) return Name.takeError();
+        auto Address = S.getAddress();
+        if (!Address) return Address.takeError();
+
+        Symbol Defined = {*Address, object::ELFSymbolRef(S).getSize()};
+        if (!Symbols.emplace(Name->str(), Defined).second) Ambiguous.insert(Name->str());
+    }
+    for (auto const &Name : Ambiguous) Symbols.erase(Name);
+    return Error::success();
+}
+
+// Size and modification time of a file, the time in nanoseconds
+static std::error_code getIdentity(const string &Path, uint64_t &Size, int64_t &Time) {
+    sys::fs::file_status Status;
+    if (auto EC = sys::fs::status(Path, Status)) return EC;
+    Size = Status.getSize();
+    Time = Status.getLastModificationTime().time_since_epoch().count();
+    return std::error_code();
+}
+
+Error CrisprPatchManifest::setOutput(const string &OutputBinaryPath) {
+    if (auto EC = getIdentity(OutputBinaryPath, OutputSize, OutputTime)) {
+        return make_error<StringError>("Could not stat " + OutputBinaryPath, EC);
+    }
+    return Error::success();
+}
+
+bool CrisprPatchManifest::isOutputUnchanged(const string &OutputBinaryPath) const {
+    uint64_t Size;
+    int64_t Time;
+    if (getIdentity(OutputBinaryPath, Size, Time)) return false;
+    return Size == OutputSize && Time == OutputTime;
+}
+
+bool CrisprPatchManifest::isCompatible(const CrisprPatchManifest &Previous, string &Reason) const {
+    if (Input != Previous.Input || InputSize != Previous.InputSize || InputTime != Previous.InputTime) {
+        Reason = "the input binary changed";
+    } else if (Configuration != Previous.Configuration) {
+        Reason = "the options changed";
+    } else if (VariablesHash != Previous.VariablesHash) {
+        Reason = "the variables of the patch changed";
+    } else {
+        return true;
+    }
+    return false;
+}
+
+Error CrisprPatchManifest::save(const string &Path) const {
+    json::Object Functions;
+    for (auto const &Function : FunctionHashes) Functions[Function.first] = Function.second;
+
+    json::Object SectionsObject;
+    for (auto const &S : Sections) {
+        SectionsObject[S.first] = json::Object{
+                {"address",  static_cast<int64_t>(S.second.Address)},
+                {"size",     static_cast<int64_t>(S.second.Size)},
+                {"capacity", static_cast<int64_t>(S.second.Capacity)},
+        };
+    }
+
+    json::Object SymbolsObject;
+    for (auto const &S : Symbols) {
+        SymbolsObject[S.first] = json::Array{static_cast<int64_t>(S.second.Address),
+                                             static_cast<int64_t>(S.second.Size)};
+    }
+
+    json::Array Free;
+    for (auto const &Range : FreeRanges) {
+        Free.push_back(json::Array{static_cast<int64_t>(Range.Address), static_cast<int64_t>(Range.Size)});
+    }
+
+    json::Array UndetouredArray;
+    for (auto const &Name : Undetoured) UndetouredArray.push_back(Name);
+
+    json::Object Root{
+            {"version",       ManifestVersion},
+            {"input",         json::Object{{"path", Input},
+                                           {"size", static_cast<int64_t>(InputSize)},
+                                           {"time", InputTime}}},
+            {"output",        json::Object{{"size", static_cast<int64_t>(OutputSize)},
+                                           {"time", OutputTime}}},
+            {"configuration", Configuration},
+            {"variables",     VariablesHash},
+            {"functions",     std::move(Functions)},
+            {"sections",      std::move(SectionsObject)},
+            {"symbols",       std::move(SymbolsObject)},
+            {"free",          std::move(Free)},
+            {"undetoured",    std::move(UndetouredArray)},
+    };
+
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::F_None);
+    if (EC) return make_error<StringError>("Could not write " + Path, EC);
+    OS << formatv("{0:2}", json::Value(std::move(Root))) << "\n";
+    return Error::success();
+}
+
+// Reads two numbers stored as a JSON array
+static bool getPair(const json::Value *Value, uint64_t &First, uint64_t &Second) {
+    auto *Array = Value ? Value->getAsArray() : nullptr;
+    if (!Array || Array->size() != 2) return false;
+    auto A = (*Array)[0].getAsInteger();
+    auto B = (*Array)[1].getAsInteger();
+    if (!A || !B) return false;
+    First = *A;
+    Second = *B;
+    return true;
+}
+
+Expected<CrisprPatchManifest> CrisprPatchManifest::load(const string &Path) {
+    auto Malformed = [&Path]() {
+        return make_error<StringError>(Path + " is not a valid patch manifest", inconvertibleErrorCode());
+    };
+
+    auto Buffer = MemoryBuffer::getFile(Path);
+    if (!Buffer) return make_error<StringError>("Could not read " + Path, Buffer.getError());
+    auto Value = json::parse((*Buffer)->getBuffer());
+    if (!Value) return Value.takeError();
+
+    auto *Root = Value->getAsObject();
+    if (!Root || Root->getInteger("version") != ManifestVersion) return Malformed();
+
+    CrisprPatchManifest Manifest;
+    auto *InputObject = Root->getObject("input");
+    auto *OutputObject = Root->getObject("output");
+    auto Configuration = Root->getString("configuration");
+    auto Variables = Root->getString("variables");
+    auto *Functions = Root->getObject("functions");
+    auto *SectionsObject = Root->getObject("sections");
+    auto *SymbolsObject = Root->getObject("symbols");
+    auto *Free = Root->getArray("free");
+    auto *UndetouredArray = Root->getArray("undetoured");
+    if (!InputObject || !OutputObject || !Configuration || !Variables || !Functions || !SectionsObject ||
+        !SymbolsObject || !Free || !UndetouredArray) {
+        return Malformed();
+    }
+
+    auto InputPath = InputObject->getString("path");
+    auto InputSize = InputObject->getInteger("size");
+    auto InputTime = InputObject->getInteger("time");
+    if (!InputPath || !InputSize || !InputTime) return Malformed();
+    Manifest.Input = InputPath->str();
+    Manifest.InputSize = *InputSize;
+    Manifest.InputTime = *InputTime;
+
+    auto OutputSize = OutputObject->getInteger("size");
+    auto OutputTime = OutputObject->getInteger("time");
+    if (!OutputSize || !OutputTime) return Malformed();
+    Manifest.OutputSize = *OutputSize;
+    Manifest.OutputTime = *OutputTime;
+    Manifest.Configuration = Configuration->str();
+    Manifest.VariablesHash = Variables->str();
+
+    for (auto const &Function : *Functions) {
+        auto Hash = Function.second.getAsString();
+        if (!Hash) return Malformed();
+        Manifest.FunctionHashes[Function.first.str()] = Hash->str();
+    }
+
+    for (auto const &S : *SectionsObject) {
+        auto *Object = S.second.getAsObject();
+        if (!Object) return Malformed();
+        auto Address = Object->getInteger("address");
+        auto Size = Object->getInteger("size");
+        auto Capacity = Object->getInteger("capacity");
+        if (!Address || !Size || !Capacity) return Malformed();
+        Manifest.Sections[S.first.str()] = {static_cast<uint64_t>(*Address), static_cast<uint64_t>(*Size),
+                                            static_cast<uint64_t>(*Capacity)};
+    }
+
+    for (auto const &S : *SymbolsObject) {
+        Symbol Defined;
+        if (!getPair(&S.second, Defined.Address, Defined.Size)) return Malformed();
+        Manifest.Symbols[S.first.str()] = Defined;
+    }
+
+    for (auto const &Value : *Free) {
+        CrisprFreeSpace::Range Range;
+        if (!getPair(&Value, Range.Address, Range.Size)) return Malformed();
+        Manifest.FreeRanges.push_back(Range);
+    }
+
+    for (auto const &Value : *UndetouredArray) {
+        auto Name = Value.getAsString();
+        if (!Name) return Malformed();
+        Manifest.Undetoured.insert(Name->str());
+    }
+
+    return std::move(Manifest);
+}
@@ -0,0 +1,109 @@
+#ifndef CRISPR_CRISPRPATCHMANIFEST_H
+#define CRISPR_CRISPRPATCHMANIFEST_H
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/IR/Module.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "CrisprFreeSpace.h"
+
+// Record of what a patch placed in the binary it produced, saved next to it
+// as JSON (<output>.crispr.json), so that a later run with a modified patch
+// only recompiles the functions which changed and writes them over the
+// previous ones, without linking and merging everything again.
+//
+// Functions are compared through a hash of their IR before optimization,
+// which covers everything that can end up in their code: the functions they
+// call, which can be inlined, and the constants they use, transitively.
+// Variables (and the constants whose address can be compared) have to keep
+// their address, so changing any of them, the input binary or the options
+// requires patching from scratch, as does any change to the output binary
+// made since the manifest was saved.
+class CrisprPatchManifest {
+    using string = std::string;
+
+public:
+    // A section of the patch in the output binary. Capacity is the size of
+    // the slot it was given, which a recompiled version can reuse.
+    struct Section {
+        uint64_t Address;
+        uint64_t Size;
+        uint64_t Capacity;
+    };
+
+    struct Symbol {
+        uint64_t Address;
+        uint64_t Size;
+    };
+
+    // Identity of the input binary
+    string Input;
+    uint64_t InputSize = 0;
+    int64_t InputTime = 0;
+
+    // Identity of the output binary when the manifest was saved, the time
+    // in nanoseconds so that a rewrite within the same second is noticed
+    uint64_t OutputSize = 0;
+    int64_t OutputTime = 0;
+
+    // Everything besides the IR that affects the layout and the code
+    string Configuration;
+
+    // Hash of the globals with a fixed address and of the aliases
+    string VariablesHash;
+
+    // Hashes of the functions visible outside of the patch
+    std::map<string, string> FunctionHashes;
+
+    // Sections of the functions (.funcs.<name>, .funcs.<name>.cold)
+    std::map<string, Section> Sections;
+
+    // Functions and variables defined by the patch, where they are in the output
+    std::map<string, Symbol> Symbols;
+
+    // Functions of the input binary too small for their detour, which only
+    // the branches retargeted to their first version reach
+    std::set<string> Undetoured;
+
+    // Executable ranges of the output which are not used
+    std::vector<CrisprFreeSpace::Range> FreeRanges;
+
+    static string getPath(const string &OutputBinaryPath) { return OutputBinaryPath + ".crispr.json"; }
+
+    static llvm::Expected<CrisprPatchManifest> load(const string &Path);
+
+    llvm::Error save(const string &Path) const;
+
+    // Hashes the module and records the identity of the input binary
+    static llvm::Expected<CrisprPatchManifest>
+    create(const llvm::Module &M, const string &InputBinaryPath, const string &Configuration);
+
+    // Records the sections and symbols of the linked patch
+    llvm::Error addLinked(llvm::MemoryBufferRef Linked);
+
+    // Records the identity of the output binary, as it is now
+    llvm::Error setOutput(const string &OutputBinaryPath);
+
+    // Whether the output binary is still the one the manifest was saved with
+    [[nodiscard]] bool isOutputUnchanged(const string &OutputBinaryPath) const;
+
+    // Whether the previous patch was applied to the same binary in the same way
+    [[nodiscard]] bool isCompatible(const CrisprPatchManifest &Previous, string &Reason) const;
+
+    // Whether the global has to keep its address when functions using it
+    // are recompiled, instead of being emitted again along with them
+    static bool hasFixedAddress(const llvm::GlobalVariable &GV);
+
+private:
+    static std::map<string, string> hashFunctions(const llvm::Module &M);
+
+    static string hashVariables(const llvm::Module &M);
+};
+
+#endif//CRISPR_CRISPRPATCHMANIFEST_H
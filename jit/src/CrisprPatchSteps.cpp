@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <set>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/Format.h"
+
+#include "CrisprDetours.h"
+#include "CrisprElfMerger.h"
+#include "CrisprLldLinker.h"
+#include "CrisprPatchSteps.h"
+#include "CrisprRetargeter.h"
+
+using namespace llvm;
+using namespace std;
+
+static Error makeError(const Twine &Message) {
+    return make_error<StringError>(Message, inconvertibleErrorCode());
+}
+
+static Error makeError(const Twine &Message, Error Cause) {
+    return makeError(Message + ": " + toString(std::move(Cause)));
+}
+
+Expected<map<string, CrisprFreeSpace::Section>> collectSections(CrisprCompiler &Recompiler, bool RoData) {
+    map<string, CrisprFreeSpace::Section> Sections;
+    for (auto const &O : Recompiler.getObjects()) {
+        auto Obj = object::ObjectFile::createObjectFile(O);
+        if (!Obj) return makeError("Could not parse compiled object", Obj.takeError());
+
+        for (auto const &S : (*Obj)->sections()) {
+            StringRef Name;
+            if (S.getName(Name)) continue;
+            if (RoData && (Name == ".rodata" || Name.startswith(".rodata."))) {
+                Name = ".rodata";
+            } else if (!Name.startswith(".funcs.")) {
+                continue;
+            }
+
+            uint64_t Alignment = std::max<uint64_t>(S.getAlignment(), 1);
+            auto &Section = Sections[Name.str()];
+            Section.Name = Name.str();
+            Section.Size = alignTo(Section.Size, Alignment) + S.getSize();
+            Section.Alignment = std::max(Section.Alignment, Alignment);
+        }
+    }
+    return std::move(Sections);
+}
+
+Expected<map<string, uint64_t>> planCodeLayout(const string &InputBinaryPath,
+                                               CrisprCompiler &Recompiler,
+                                               const CrisprSymbolTable &ExistingSymbols,
+                                               uint64_t ImageBase,
+                                               vector<CrisprFreeSpace::Range> &FreeRanges,
+                                               raw_ostream &Log) {
+    auto Input = CrisprElf::open(InputBinaryPath);
+    if (!Input) return makeError("Could not parse the input binary", Input.takeError());
+
+    auto Collected = collectSections(Recompiler, false);
+    if (!Collected) return Collected.takeError();
+    auto &Sections = *Collected;
+    bool Ordered = !Recompiler.getSectionOrder().empty();
+    auto const &HotSections = Recompiler.getHotSections();
+
+    // The new segment is placed at the image base by the linker
+    CrisprFreeSpace FreeSpace(**Input, ImageBase);
+    map<string, uint64_t> SectionStarts;
+    for (auto const &Name : Recompiler.NewFunctions) {
+        auto OldSymbol = ExistingSymbols.lookup(Name);
+        if (!OldSymbol) continue;
+
+        uint64_t Address = OldSymbol->Address;
+        uint64_t Size = OldSymbol->Size;
+        if (Address + Size > ImageBase || !(*Input)->isCode(Address, Size)) continue;
+
+        // The new code is either in the binary or right after the image base
+        uint64_t DetourSize = fitsInRel32(Address, ImageBase, JmpRel32Size) ? JmpRel32Size : JmpAbsoluteSize;
+        if (Size <= DetourSize) continue;
+
+        auto Section = Sections.find(".funcs." + Name);
+        if (Section != Sections.end() && !HotSections.count(Section->first) && Section->second.Size <= Size
+            && Address % std::max<uint64_t>(Section->second.Alignment, 1) == 0) {
+            SectionStarts[Section->first] = Address;
+            FreeSpace.addRange(Address + Section->second.Size, Size - Section->second.Size);
+            Sections.erase(Section);
+        } else {
+            FreeSpace.addRange(Address + DetourSize, Size - DetourSize);
+        }
+    }
+    FreeSpace.addPadding(ExistingSymbols);
+    FreeSpace.addSegmentSlack();
+    Log << "Found " << FreeSpace.getFreeSize() << " reusable bytes in the input binary\n";
+
+    // Without a layout, the cold parts split from the functions are left for
+    // the new segment, away from the hot code, which gets all the reusable
+    // space. With one, the hot clusters are kept whole in the new segment
+    // and everything else can be scattered in the holes.
+    vector<CrisprFreeSpace::Section> ToPack;
+    uint64_t LeftSize = 0;
+    for (auto const &Section : Sections) {
+        bool Pack = Ordered ? !HotSections.count(Section.first) : !StringRef(Section.first).endswith(".cold");
+        if (Pack) ToPack.push_back(Section.second);
+        LeftSize += Section.second.Size;
+    }
+
+    auto Packed = FreeSpace.pack(ToPack);
+    for (auto const &Placement : Packed) {
+        SectionStarts[Placement.first] = Placement.second;
+        LeftSize -= Sections[Placement.first].Size;
+    }
+
+    Log << SectionStarts.size() - Packed.size() << " functions kept at their old address, "
+        << Packed.size() << " of " << ToPack.size() << " packed in unused ranges, "
+        << LeftSize << " bytes of code left for the new segment\n";
+    FreeRanges = FreeSpace.getRanges();
+    return std::move(SectionStarts);
+}
+
+Expected<unique_ptr<MemoryBuffer>> linkNewCode(CrisprCompiler &Recompiler,
+                                               uint64_t ImageBase,
+                                               const vector<string> &DylibPaths,
+                                               const CrisprSymbolTable &ExistingSymbols,
+                                               const map<string, uint64_t> &SectionStarts,
+                                               bool Symbolic,
+                                               uint64_t MaxPageSize) {
+    CrisprLldLinker Linker(ImageBase);
+    Linker.setSymbolic(Symbolic);
+    Linker.setMaxPageSize(MaxPageSize);
+
+    // The objects are compiled concurrently, and come in no particular order.
+    // The linker places their sections in the order it gets them, which is
+    // the one chosen by the layout.
+    auto Objects = Recompiler.getObjects();
+    auto const &Order = Recompiler.getSectionOrder();
+    if (!Order.empty()) {
+        map<const char *, unsigned> Ranks;
+        for (auto const &O : Objects) {
+            unsigned &Rank = Ranks[O.getBufferStart()] = Order.size();
+            auto Obj = object::ObjectFile::createObjectFile(O);
+            if (!Obj) {
+                consumeError(Obj.takeError());
+                continue;
+            }
+            for (auto const &S : (*Obj)->sections()) {
+                StringRef Name;
+                if (S.getName(Name)) continue;
+                auto Section = Order.find(Name.str());
+                if (Section != Order.end()) Rank = std::min(Rank, Section->second);
+            }
+        }
+        std::stable_sort(Objects.begin(), Objects.end(), [&Ranks](MemoryBufferRef A, MemoryBufferRef B) {
+            return Ranks[A.getBufferStart()] < Ranks[B.getBufferStart()];
+        });
+    }
+
+    for (auto const &O : Objects) {
+        if (auto Err = Linker.addObject(O)) return makeError("Error while adding object to the linker", std::move(Err));
+    }
+
+    for (auto const &DylibPath : DylibPaths) {
+        if (auto Err = Linker.addLibrary(DylibPath)) return makeError("Error while adding a library", std::move(Err));
+    }
+
+    // lld sorts the sections with an address before the others, which follow
+    // the one with the highest address. If the new functions are placed in
+    // the input binary, anchor the rest of the output above the image base.
+    bool Anchor = false;
+    for (auto const &SectionStart : SectionStarts) {
+        Linker.setSectionStart(SectionStart.first, SectionStart.second);
+        if (SectionStart.second < ImageBase) Anchor = true;
+    }
+    if (Anchor) Linker.setSectionStart(".dynsym", ImageBase + PageSize);
+
+    Linker.setExistingSymbols(ExistingSymbols);
+
+    auto Linked = Linker.link();
+    if (!Linked) return makeError("Error while linking", Linked.takeError());
+    return std::move(*Linked);
+}
+
+Expected<map<string, uint64_t>> lookupLinkedSymbols(MemoryBufferRef LinkedBuffer, const CrisprCompiler &Recompiler) {
+    auto Linked = object::ObjectFile::createObjectFile(LinkedBuffer);
+    if (!Linked) return makeError("Could not open the linked object", Linked.takeError());
+
+    map<string, uint64_t> Symbols;
+    set<string> Wanted(Recompiler.NewFunctions.begin(), Recompiler.NewFunctions.end());
+    for (auto const &S : (*Linked)->symbols()) {
+        // Only the functions visible from outside the patch replace old ones
+        uint32_t Flags = S.getFlags();
+        if (!(Flags & object::SymbolRef::SF_Global) || Flags & object::SymbolRef::SF_Undefined) continue;
+
+        auto Name = S.getName();
+        if (!Name) return makeError("Error while reading linked symbols", Name.takeError());
+        auto Address = S.getAddress();
+        if (!Address) return makeError("Error while reading linked symbols", Address.takeError());
+        if (Wanted.count(Name->str())) Symbols[Name->str()] = *Address;
+    }
+    return std::move(Symbols);
+}
+
+map<uint64_t, uint64_t> getRedirections(const map<string, uint64_t> &NewSymbols,
+                                        const CrisprSymbolTable &ExistingSymbols) {
+    map<uint64_t, uint64_t> Redirections;
+    for (auto const &NewSymbol : NewSymbols) {
+        auto OldSymbol = ExistingSymbols.lookup(NewSymbol.first);
+        if (!OldSymbol || OldSymbol->Address == NewSymbol.second) continue;
+        Redirections[OldSymbol->Address] = NewSymbol.second;
+    }
+    return Redirections;
+}
+
+// The bodies of the replaced functions are dead, and may host new code
+static set<uint64_t> getReplacedBodies(const map<string, uint64_t> &NewSymbols,
+                                       const CrisprSymbolTable &ExistingSymbols) {
+    set<uint64_t> Replaced;
+    for (auto const &NewSymbol : NewSymbols) {
+        if (auto OldSymbol = ExistingSymbols.lookup(NewSymbol.first)) Replaced.insert(OldSymbol->Address);
+    }
+    return Replaced;
+}
+
+Expected<pair<unsigned, unsigned>> retargetBranches(const CrisprElf &Input,
+                                                    CrisprOutputFile &Output,
+                                                    const map<uint64_t, uint64_t> &Redirections,
+                                                    const map<string, uint64_t> &NewSymbols,
+                                                    const CrisprSymbolTable &ExistingSymbols,
+                                                    set<uint64_t> &Missed) {
+    auto Retargeter = CrisprRetargeter::create(Input);
+    if (!Retargeter) return makeError("Cannot retarget the branches", Retargeter.takeError());
+
+    set<uint64_t> Targets;
+    for (auto const &Redirection : Redirections) Targets.insert(Redirection.first);
+
+    set<uint64_t> Replaced = getReplacedBodies(NewSymbols, ExistingSymbols);
+    pair<unsigned, unsigned> Retargeted = {0, 0};
+    for (auto const &Site : (*Retargeter)->findBranches(ExistingSymbols, Replaced, Targets)) {
+        uint64_t NewTarget = Redirections.at(Site.Target);
+        if (!fitsInRel32(Site.Address, NewTarget, Site.Size)) {
+            Missed.insert(Site.Target);
+            continue;
+        }
+
+        auto Offset = Input.virtualAddressToOffset(Site.Address + Site.Size - 4);
+        if (!Offset) return makeError("Cannot retarget the branch at 0x" + utohexstr(Site.Address), Offset.takeError());
+        if (auto Err = Output.write(*Offset, getRel32Displacement(Site.Address, Site.Size, NewTarget))) {
+            return makeError("Error while retargeting a branch", std::move(Err));
+        }
+
+        if (Site.IsCall) {
+            Retargeted.first++;
+        } else {
+            Retargeted.second++;
+        }
+    }
+    return Retargeted;
+}
+
+// Of the given addresses of functions, those which may be taken, and so
+// reached other than through the retargeted branches: referenced by a dynamic
+// relocation or symbol, an aligned word of the data (e.g. a function pointer
+// in a binary which is not position independent, or a DT_RELR addend), or an
+// instruction of the code.
+static Expected<set<uint64_t>> findTakenAddresses(const CrisprElf &Input,
+                                                  const map<string, uint64_t> &NewSymbols,
+                                                  const CrisprSymbolTable &ExistingSymbols,
+                                                  const set<uint64_t> &Addresses) {
+    auto Retargeter = CrisprRetargeter::create(Input);
+    if (!Retargeter) return makeError("Cannot look for the references to functions", Retargeter.takeError());
+    set<uint64_t> Taken = (*Retargeter)->findOtherReferences(ExistingSymbols,
+                                                             getReplacedBodies(NewSymbols, ExistingSymbols),
+                                                             Addresses);
+
+    for (auto const &Relocations : {Input.getDynamicRelocations(), Input.getPltRelocations()}) {
+        for (auto const &Relocation : Relocations) {
+            if (Addresses.count(Relocation.r_addend)) Taken.insert(Relocation.r_addend);
+        }
+    }
+    for (auto const &Symbol : Input.getDynamicSymbols()) {
+        if (Symbol.st_shndx != ELF::SHN_UNDEF && Addresses.count(Symbol.st_value)) Taken.insert(Symbol.st_value);
+    }
+
+    const uint64_t WordSize = sizeof(uint64_t);
+    for (auto const &Segment : Input.programHeaders()) {
+        if (Segment.p_type != ELF::PT_LOAD || Segment.p_flags & ELF::PF_X) continue;
+        auto Bytes = Input.readAddress(Segment.p_vaddr, Segment.p_filesz);
+        if (!Bytes) return makeError("Cannot look for the references to functions", Bytes.takeError());
+        uint64_t Start = alignTo(Segment.p_vaddr, WordSize) - Segment.p_vaddr;
+        for (uint64_t Offset = Start; Offset + WordSize <= Bytes->size(); Offset += WordSize) {
+            uint64_t Word = support::endian::read64le(Bytes->data() + Offset);
+            if (Addresses.count(Word)) Taken.insert(Word);
+        }
+    }
+    return std::move(Taken);
+}
+
+Error mergeIntoBinary(const string &InputBinaryPath,
+                      MemoryBufferRef LinkedBuffer,
+                      const string &OutputBinaryPath,
+                      const map<string, uint64_t> &NewSymbols,
+                      const CrisprSymbolTable &ExistingSymbols,
+                      bool Retarget,
+                      uint64_t CodeAlignment,
+                      bool PackRelocations,
+                      CrisprStats &Stats,
+                      bool Verbose,
+                      raw_ostream &Log,
+                      set<string> *Undetoured) {
+    auto Input = CrisprElf::open(InputBinaryPath);
+    if (!Input) return makeError("Could not parse the input binary", Input.takeError());
+
+    auto Linked = CrisprElf::create(MemoryBuffer::getMemBuffer(LinkedBuffer, false));
+    if (!Linked) return makeError("Could not parse the linked object", Linked.takeError());
+
+    auto Output = CrisprOutputFile::createCopy(InputBinaryPath, OutputBinaryPath);
+    if (!Output) return makeError("Could not create the output binary", Output.takeError());
+
+    // The entry point detours are kept for the indirect calls which cannot be
+    // found, e.g. through function pointers stored without a relocation
+    auto Redirections = getRedirections(NewSymbols, ExistingSymbols);
+
+    Log << "Merging new segments and dynamic libraries\n";
+    CrisprElfMerger Merger(**Input, **Linked);
+    if (Retarget) Merger.setRedirections(Redirections);
+    Merger.setCodeSegmentAlignment(CodeAlignment);
+    Merger.setPackRelativeRelocations(PackRelocations);
+    if (auto Err = Merger.merge(**Output)) return makeError("Error while merging", std::move(Err));
+    if (PackRelocations) {
+        Stats.add("packed_relocations", Merger.getPackedRelocations());
+        Stats.add("relr_bytes", Merger.getPackedRelocationsSize());
+        Log << "Packed " << Merger.getPackedRelocations() << " relative relocations in "
+            << Merger.getPackedRelocationsSize() << " bytes of DT_RELR\n";
+    }
+
+    // The functions too small for their detour, which are only left to the
+    // retargeting if nothing else may reach them
+    map<uint64_t, string> TooSmall;
+    Log << "Applying detours\n";
+    {
+        auto DetoursStage = Stats.stage("detours");
+        for (auto const &NewSymbol : NewSymbols) {
+            auto OldSymbol = ExistingSymbols.lookup(NewSymbol.first);
+            if (!OldSymbol) {
+                return makeError("Symbol " + NewSymbol.first
+                                 + " was not found in the old binary and was not manually provided");
+            }
+
+            // Placed over the old function
+            if (NewSymbol.second == OldSymbol->Address) continue;
+
+            auto Offset = (*Input)->virtualAddressToOffset(OldSymbol->Address);
+            if (!Offset) return makeError("Cannot patch " + NewSymbol.first, Offset.takeError());
+
+            if (Verbose) Log << "Patching " << NewSymbol.first << " at offset " << format_hex(*Offset, 10) << "\n";
+            // A longer detour would overwrite the next function, or new code
+            // placed in the padding after this one
+            auto Patch = getDetourPatch(OldSymbol->Address, NewSymbol.second);
+            if (OldSymbol->Size != 0 && Patch.size() > OldSymbol->Size) {
+                if (!Retarget) {
+                    return makeError("The " + Twine(Patch.size()) + " bytes detour of " + NewSymbol.first
+                                     + " does not fit in " + Twine(OldSymbol->Size)
+                                     + " bytes, use --retarget to only redirect its callers");
+                }
+                TooSmall[OldSymbol->Address] = NewSymbol.first;
+                continue;
+            }
+            if (auto Err = (*Output)->write(*Offset, Patch)) {
+                return makeError("Error while writing detour", std::move(Err));
+            }
+            Stats.add("detours");
+        }
+    }
+
+    if (Retarget) {
+        auto RetargetStage = Stats.stage("retarget");
+        set<uint64_t> Missed;
+        auto Branches = retargetBranches(**Input, **Output, Redirections, NewSymbols, ExistingSymbols, Missed);
+        if (!Branches) return Branches.takeError();
+
+        if (!TooSmall.empty()) {
+            set<uint64_t> Addresses;
+            for (auto const &Function : TooSmall) Addresses.insert(Function.first);
+            auto Taken = findTakenAddresses(**Input, NewSymbols, ExistingSymbols, Addresses);
+            if (!Taken) return Taken.takeError();
+            for (auto const &Function : TooSmall) {
+                auto Symbol = ExistingSymbols.lookup(Function.second);
+                uint64_t DetourSize = getDetourSize(Function.first, NewSymbols.at(Function.second));
+                if (Taken->count(Function.first) || Missed.count(Function.first)) {
+                    return makeError("The " + Twine(DetourSize) + " bytes detour of " + Function.second
+                                     + " does not fit in " + Twine(Symbol->Size) + " bytes, and "
+                                     + (Missed.count(Function.first) ? "some of its callers cannot reach the new code"
+                                                                     : "its address may be taken"));
+                }
+                Log << "Not detouring " << Function.second << ", which is too small: only its callers are redirected\n";
+                Stats.add("skipped_detours");
+                if (Undetoured) Undetoured->insert(Function.second);
+            }
+        }
+
+        Stats.add("retargeted_calls", Branches->first);
+        Stats.add("retargeted_jumps", Branches->second);
+        Stats.add("redirected_dynamic_symbols", Merger.getRedirectedSymbols());
+        Stats.add("redirected_relocations", Merger.getRedirectedRelocations());
+        Log << "Retargeted " << Branches->first << " direct calls, " << Branches->second << " direct jumps, "
+            << Merger.getRedirectedSymbols() << " dynamic symbols and "
+            << Merger.getRedirectedRelocations() << " relocations\n";
+    }
+    return Error::success();
+}
@@ -0,0 +1,105 @@
+#ifndef CRISPR_CRISPRPATCHSTEPS_H
+#define CRISPR_CRISPRPATCHSTEPS_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprCompiler.h"
+#include "CrisprElf.h"
+#include "CrisprFreeSpace.h"
+#include "CrisprOutputFile.h"
+#include "CrisprStats.h"
+#include "CrisprSymbolTable.h"
+
+// The steps which place the code compiled by a CrisprCompiler in an existing
+// binary: the layout of the new functions, the link against the symbols of
+// the binary, and the merge into a copy of it whose old functions jump to the
+// new ones. They are shared by crispr and the benchmarks, which time them.
+
+// Sizes and alignments of the sections of the new functions in the compiled
+// objects. With RoData, the read-only data sections are added up as a single
+// .rodata section, which is what the linker makes of them.
+llvm::Expected<std::map<std::string, CrisprFreeSpace::Section>>
+collectSections(CrisprCompiler &Recompiler, bool RoData);
+
+// Places the sections of the new functions in the unused ranges of the input
+// binary, so that only what does not fit ends up in a new segment.
+// Replaced functions which did not grow stay at their old address and need no
+// detour, the others are packed in the rest of the bodies of the replaced
+// functions, in the padding between functions and at the end of the
+// executable segments. When the functions are ordered along the call graph,
+// the hot ones are left to the new segment, where their clusters stay whole
+// and in order, and the holes go to the others. Returns the start of the
+// sections which were placed, the ranges which are left unused are returned
+// in FreeRanges.
+llvm::Expected<std::map<std::string, uint64_t>> planCodeLayout(const std::string &InputBinaryPath,
+                                                               CrisprCompiler &Recompiler,
+                                                               const CrisprSymbolTable &ExistingSymbols,
+                                                               uint64_t ImageBase,
+                                                               std::vector<CrisprFreeSpace::Range> &FreeRanges,
+                                                               llvm::raw_ostream &Log);
+
+// Links the compiled objects at ImageBase, against the existing symbols and
+// the dynamic libraries, with the sections in SectionStarts at their address.
+// With Symbolic, the references to the symbols of the patch are bound to its
+// own definitions.
+llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>
+linkNewCode(CrisprCompiler &Recompiler,
+            uint64_t ImageBase,
+            const std::vector<std::string> &DylibPaths,
+            const CrisprSymbolTable &ExistingSymbols,
+            const std::map<std::string, uint64_t> &SectionStarts,
+            bool Symbolic,
+            uint64_t MaxPageSize = 0);
+
+// Addresses of the new functions in the linked patch
+llvm::Expected<std::map<std::string, uint64_t>> lookupLinkedSymbols(llvm::MemoryBufferRef LinkedBuffer,
+                                                                    const CrisprCompiler &Recompiler);
+
+// Old and new addresses of the replaced functions which were moved
+std::map<uint64_t, uint64_t> getRedirections(const std::map<std::string, uint64_t> &NewSymbols,
+                                             const CrisprSymbolTable &ExistingSymbols);
+
+// Points the direct branches to the replaced functions to the new code, so
+// that they don't go through the detours. Returns the number of calls and
+// jumps which were retargeted, and adds to Missed the old addresses which
+// some branches still go to, the new code being out of their reach.
+llvm::Expected<std::pair<unsigned, unsigned>> retargetBranches(const CrisprElf &Input,
+                                                               CrisprOutputFile &Output,
+                                                               const std::map<uint64_t, uint64_t> &Redirections,
+                                                               const std::map<std::string, uint64_t> &NewSymbols,
+                                                               const CrisprSymbolTable &ExistingSymbols,
+                                                               std::set<uint64_t> &Missed);
+
+// Merges the linked patch into a copy of the input binary and writes the
+// detours from the replaced functions to the new ones. With Retarget, the
+// branches, dynamic symbols and relocations pointing to the replaced
+// functions are also redirected, and the functions too small for their
+// detour are left to them if their address is never taken, i.e. only
+// branches which were retargeted refer to them, and added to Undetoured if
+// given. The new code segments are aligned to
+// CodeAlignment, and with PackRelocations the relative relocations are
+// packed as DT_RELR.
+llvm::Error mergeIntoBinary(const std::string &InputBinaryPath,
+                            llvm::MemoryBufferRef LinkedBuffer,
+                            const std::string &OutputBinaryPath,
+                            const std::map<std::string, uint64_t> &NewSymbols,
+                            const CrisprSymbolTable &ExistingSymbols,
+                            bool Retarget,
+                            uint64_t CodeAlignment,
+                            bool PackRelocations,
+                            CrisprStats &Stats,
+                            bool Verbose,
+                            llvm::raw_ostream &Log,
+                            std::set<std::string> *Undetoured = nullptr);
+
+#endif//CRISPR_CRISPRPATCHSTEPS_H
@@ -0,0 +1,249 @@
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include "CrisprProcess.h"
+
+using namespace llvm;
+using namespace std;
+
+Expected<unique_ptr<CrisprProcess>> CrisprProcess::attach(pid_t Pid) {
+    string MemPath = "/proc/" + to_string(Pid) + "/mem";
+    int MemFD = ::open(MemPath.c_str(), O_RDWR | O_CLOEXEC);
+    if (MemFD < 0) {
+        return make_error<StringError>("Could not open " + MemPath, error_code(errno, generic_category()));
+    }
+
+    unique_ptr<CrisprProcess> Process(new CrisprProcess(Pid, MemFD));
+    if (auto Err = Process->stopAll()) return std::move(Err);
+    if (Process->Threads.empty()) {
+        return make_error<StringError>("Process " + Twine(Pid) + " has no thread left", inconvertibleErrorCode());
+    }
+    return std::move(Process);
+}
+
+CrisprProcess::~CrisprProcess() {
+    for (pid_t Tid : Threads) ptrace(PTRACE_DETACH, Tid, nullptr, PendingSignals.lookup(Tid));
+    close(MemFD);
+}
+
+Error CrisprProcess::stopAll() {
+    vector<pid_t> Stopped;
+    for (pid_t Tid : Threads) {
+        if (ptrace(PTRACE_INTERRUPT, Tid, nullptr, nullptr) < 0 && errno != ESRCH) {
+            return errorFromErrno("Could not interrupt thread " + Twine(Tid) + " of");
+        }
+        auto Alive = waitForStop(Tid);
+        if (!Alive) return Alive.takeError();
+        if (*Alive) Stopped.push_back(Tid);
+    }
+    Threads = std::move(Stopped);
+
+    // Running threads can create others while the first ones are stopped
+    string TaskPath = "/proc/" + to_string(Pid) + "/task";
+    for (bool Added = true; Added;) {
+        Added = false;
+        DIR *Tasks = opendir(TaskPath.c_str());
+        if (!Tasks) return errorFromErrno("Could not list the threads of");
+        while (dirent *Task = readdir(Tasks)) {
+            pid_t Tid;
+            if (StringRef(Task->d_name).getAsInteger(10, Tid)) continue;
+            if (std::find(Threads.begin(), Threads.end(), Tid) != Threads.end()) continue;
+
+            if (ptrace(PTRACE_SEIZE, Tid, nullptr, nullptr) < 0) {
+                if (errno == ESRCH) continue;
+                closedir(Tasks);
+                return errorFromErrno("Could not attach to thread " + Twine(Tid) + " of");
+            }
+            ptrace(PTRACE_INTERRUPT, Tid, nullptr, nullptr);
+            auto Alive = waitForStop(Tid);
+            if (!Alive) {
+                closedir(Tasks);
+                return Alive.takeError();
+            }
+            if (*Alive) Threads.push_back(Tid);
+            Added = true;
+        }
+        closedir(Tasks);
+    }
+    return Error::success();
+}
+
+Expected<bool> CrisprProcess::waitForStop(pid_t Tid) {
+    for (;;) {
+        int Status;
+        if (waitpid(Tid, &Status, __WALL) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == ECHILD) return false;
+            return errorFromErrno("Could not wait for thread " + Twine(Tid) + " of");
+        }
+        if (WIFEXITED(Status) || WIFSIGNALED(Status)) return false;
+        if (!WIFSTOPPED(Status)) continue;
+        if (Status >> 16 == PTRACE_EVENT_STOP) return true;
+
+        // A signal arrived first: deliver it, the interrupt is still pending
+        if (ptrace(PTRACE_CONT, Tid, nullptr, WSTOPSIG(Status)) < 0) {
+            return errorFromErrno("Could not resume thread " + Twine(Tid) + " of");
+        }
+    }
+}
+
+Error CrisprProcess::run(chrono::microseconds Duration) {
+    for (pid_t Tid : Threads) {
+        if (ptrace(PTRACE_CONT, Tid, nullptr, PendingSignals.lookup(Tid)) < 0 && errno != ESRCH) {
+            return errorFromErrno("Could not resume thread " + Twine(Tid) + " of");
+        }
+    }
+    PendingSignals.clear();
+    this_thread::sleep_for(Duration);
+    return stopAll();
+}
+
+Error CrisprProcess::read(uint64_t Address, MutableArrayRef<uint8_t> Data) const {
+    size_t Done = 0;
+    while (Done < Data.size()) {
+        ssize_t Read = pread(MemFD, Data.data() + Done, Data.size() - Done, Address + Done);
+        if (Read < 0 && errno == EINTR) continue;
+        if (Read <= 0) return errorFromErrno("Could not read " + Twine::utohexstr(Address + Done) + " in");
+        Done += Read;
+    }
+    return Error::success();
+}
+
+Error CrisprProcess::write(uint64_t Address, ArrayRef<uint8_t> Data) const {
+    size_t Done = 0;
+    while (Done < Data.size()) {
+        ssize_t Written = pwrite(MemFD, Data.data() + Done, Data.size() - Done, Address + Done);
+        if (Written < 0 && errno == EINTR) continue;
+        if (Written <= 0) return errorFromErrno("Could not write " + Twine::utohexstr(Address + Done) + " in");
+        Done += Written;
+    }
+    return Error::success();
+}
+
+Expected<uint64_t> CrisprProcess::syscall(long Number, ArrayRef<uint64_t> Args) {
+    assert(Args.size() <= 6 && "Too many system call arguments");
+    pid_t Tid = Threads.front();
+
+    user_regs_struct Saved{};
+    if (ptrace(PTRACE_GETREGS, Tid, nullptr, &Saved) < 0) return errorFromErrno("Could not read the registers of");
+
+    errno = 0;
+    long Word = ptrace(PTRACE_PEEKTEXT, Tid, Saved.rip, nullptr);
+    if (errno) return errorFromErrno("Could not read the code of");
+    // syscall
+    long Syscall = (Word & ~0xFFFFL) | 0x050F;
+    if (ptrace(PTRACE_POKETEXT, Tid, Saved.rip, Syscall) < 0) return errorFromErrno("Could not write the code of");
+
+    // Without orig_rax, an interrupted system call would not be restarted
+    // in place of this one
+    user_regs_struct Regs = Saved;
+    Regs.orig_rax = -1;
+    Regs.rax = Number;
+    unsigned long long *ArgRegs[] = {&Regs.rdi, &Regs.rsi, &Regs.rdx, &Regs.r10, &Regs.r8, &Regs.r9};
+    for (size_t I = 0; I < Args.size(); I++) *ArgRegs[I] = Args[I];
+
+    Error Err = Error::success();
+    if (ptrace(PTRACE_SETREGS, Tid, nullptr, &Regs) < 0 || ptrace(PTRACE_SINGLESTEP, Tid, nullptr, nullptr) < 0) {
+        Err = errorFromErrno("Could not step thread " + Twine(Tid) + " of");
+    }
+    while (!Err) {
+        int Status;
+        if (waitpid(Tid, &Status, __WALL) < 0) {
+            if (errno == EINTR) continue;
+            Err = errorFromErrno("Could not wait for thread " + Twine(Tid) + " of");
+        } else if (!WIFSTOPPED(Status)) {
+            return make_error<StringError>("Process " + Twine(Pid) + " exited during a system call",
+                                           inconvertibleErrorCode());
+        } else if (WSTOPSIG(Status) == SIGTRAP) {
+            break;
+        } else {
+            // Kept for later, the handler must not run on these registers
+            PendingSignals[Tid] = WSTOPSIG(Status);
+            if (ptrace(PTRACE_SINGLESTEP, Tid, nullptr, nullptr) < 0) {
+                Err = errorFromErrno("Could not step thread " + Twine(Tid) + " of");
+            }
+        }
+    }
+
+    if (!Err && ptrace(PTRACE_GETREGS, Tid, nullptr, &Regs) < 0) {
+        Err = errorFromErrno("Could not read the registers of");
+    }
+    if (ptrace(PTRACE_POKETEXT, Tid, Saved.rip, Word) < 0 || ptrace(PTRACE_SETREGS, Tid, nullptr, &Saved) < 0) {
+        Err = joinErrors(std::move(Err), errorFromErrno("Could not restore thread " + Twine(Tid) + " of"));
+    }
+    if (Err) return std::move(Err);
+
+    // Errors are returned as -errno
+    if (Regs.rax >= -4095ULL) {
+        return make_error<StringError>("System call " + Twine(Number) + " failed in process " + Twine(Pid),
+                                       error_code(-static_cast<int>(Regs.rax), generic_category()));
+    }
+    return Regs.rax;
+}
+
+Expected<vector<CrisprProcess::Mapping>> CrisprProcess::getMappings() const {
+    string MapsPath = "/proc/" + to_string(Pid) + "/maps";
+    // The size of procfs files is unknown, they must be read as streams
+    auto Buffer = MemoryBuffer::getFileAsStream(MapsPath);
+    if (!Buffer) return make_error<StringError>("Could not read " + MapsPath, Buffer.getError());
+
+    // start-end perms offset dev inode [path]
+    vector<Mapping> Mappings;
+    SmallVector<StringRef, 0> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+    for (StringRef Line : Lines) {
+        StringRef Range, Perms, Offset, Device, Inode;
+        std::tie(Range, Line) = Line.split(' ');
+        std::tie(Perms, Line) = Line.split(' ');
+        std::tie(Offset, Line) = Line.split(' ');
+        std::tie(Device, Line) = Line.split(' ');
+        std::tie(Inode, Line) = Line.split(' ');
+
+        Mapping M{};
+        StringRef Start, End;
+        std::tie(Start, End) = Range.split('-');
+        if (Start.getAsInteger(16, M.Start) || End.getAsInteger(16, M.End) || Offset.getAsInteger(16, M.Offset)) {
+            return make_error<StringError>("Could not parse " + MapsPath, inconvertibleErrorCode());
+        }
+        M.Path = Line.trim().str();
+        Mappings.push_back(std::move(M));
+    }
+    return std::move(Mappings);
+}
+
+Expected<string> CrisprProcess::getExecutablePath() const {
+    string ExePath = "/proc/" + to_string(Pid) + "/exe";
+    char Path[PATH_MAX];
+    ssize_t Size = readlink(ExePath.c_str(), Path, sizeof(Path));
+    if (Size < 0) return make_error<StringError>("Could not read " + ExePath, error_code(errno, generic_category()));
+    return string(Path, Size);
+}
+
+Expected<vector<uint64_t>> CrisprProcess::getInstructionPointers() const {
+    vector<uint64_t> Pointers;
+    for (pid_t Tid : Threads) {
+        user_regs_struct Regs{};
+        if (ptrace(PTRACE_GETREGS, Tid, nullptr, &Regs) < 0) {
+            return errorFromErrno("Could not read the registers of thread " + Twine(Tid) + " of");
+        }
+        Pointers.push_back(Regs.rip);
+    }
+    return std::move(Pointers);
+}
+
+Error CrisprProcess::errorFromErrno(const Twine &What) const {
+    return make_error<StringError>(What + " process " + Twine(Pid), error_code(errno, generic_category()));
+}
@@ -0,0 +1,88 @@
+#ifndef CRISPR_CRISPRPROCESS_H
+#define CRISPR_CRISPRPROCESS_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/Error.h"
+
+// A running process whose threads are all stopped with ptrace while the
+// object exists, so that its memory can be changed with none of them running
+// in the middle of the change. They are resumed when it is destroyed.
+//
+// The memory is accessed through /proc/<pid>/mem, which ignores the page
+// protections as a debugger does. System calls are made in the process by
+// single-stepping a syscall instruction written where its first thread is
+// stopped, then restoring the instruction and the registers.
+class CrisprProcess {
+    using string = std::string;
+
+public:
+    struct Mapping {
+        uint64_t Start;
+        uint64_t End;
+        uint64_t Offset;
+        string Path;
+    };
+
+    static llvm::Expected<std::unique_ptr<CrisprProcess>> attach(pid_t Pid);
+
+    ~CrisprProcess();
+
+    CrisprProcess(const CrisprProcess &) = delete;
+
+    CrisprProcess &operator=(const CrisprProcess &) = delete;
+
+    [[nodiscard]] pid_t getPid() const { return Pid; }
+
+    [[nodiscard]] size_t getThreadCount() const { return Threads.size(); }
+
+    llvm::Error read(uint64_t Address, llvm::MutableArrayRef<uint8_t> Data) const;
+
+    llvm::Error write(uint64_t Address, llvm::ArrayRef<uint8_t> Data) const;
+
+    // Makes the system call in the process and returns its result, at most
+    // six arguments
+    llvm::Expected<uint64_t> syscall(long Number, llvm::ArrayRef<uint64_t> Args);
+
+    [[nodiscard]] llvm::Expected<std::vector<Mapping>> getMappings() const;
+
+    // Target of /proc/<pid>/exe, as it appears in the mappings
+    [[nodiscard]] llvm::Expected<string> getExecutablePath() const;
+
+    // Where each thread is stopped
+    [[nodiscard]] llvm::Expected<std::vector<uint64_t>> getInstructionPointers() const;
+
+    // Lets the threads run for a while, e.g. to leave code about to be
+    // changed, then stops them again with the threads they created
+    llvm::Error run(std::chrono::microseconds Duration);
+
+private:
+    pid_t Pid;
+    int MemFD;
+    std::vector<pid_t> Threads;
+
+    // Signals which arrived while a thread was stepped through a system
+    // call, delivered when it is resumed
+    llvm::DenseMap<pid_t, int> PendingSignals;
+
+    CrisprProcess(pid_t Pid, int MemFD) : Pid(Pid), MemFD(MemFD) {}
+
+    // Stops the known threads, then attaches to and stops the others until
+    // none is left running
+    llvm::Error stopAll();
+
+    // False if the thread exited instead
+    llvm::Expected<bool> waitForStop(pid_t Tid);
+
+    llvm::Error errorFromErrno(const llvm::Twine &What) const;
+};
+
+#endif//CRISPR_CRISPRPROCESS_H
@@ -0,0 +1,129 @@
+#include "llvm/MC/MCInst.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprRetargeter.h"
+
+using namespace llvm;
+using namespace std;
+
+Expected<unique_ptr<CrisprRetargeter>> CrisprRetargeter::create(const CrisprElf &Binary) {
+    if (Binary.getHeader().e_machine != ELF::EM_X86_64) {
+        return make_error<StringError>("Call sites can only be retargeted in x86-64 binaries", inconvertibleErrorCode());
+    }
+
+    const string TargetTriple = "x86_64-unknown-linux-gnu";
+    string Error;
+    const Target *T = TargetRegistry::lookupTarget(TargetTriple, Error);
+    if (!T) return make_error<StringError>(Error, inconvertibleErrorCode());
+
+    unique_ptr<CrisprRetargeter> Retargeter(new CrisprRetargeter(Binary));
+    Retargeter->RegisterInfo.reset(T->createMCRegInfo(TargetTriple));
+    Retargeter->AsmInfo.reset(T->createMCAsmInfo(*Retargeter->RegisterInfo, TargetTriple));
+    Retargeter->SubtargetInfo.reset(T->createMCSubtargetInfo(TargetTriple, "", ""));
+    Retargeter->InstrInfo.reset(T->createMCInstrInfo());
+    Retargeter->Context = std::make_unique<MCContext>(Retargeter->AsmInfo.get(),
+                                                      Retargeter->RegisterInfo.get(),
+                                                      nullptr);
+    Retargeter->Disassembler.reset(T->createMCDisassembler(*Retargeter->SubtargetInfo, *Retargeter->Context));
+    Retargeter->InstrAnalysis.reset(T->createMCInstrAnalysis(Retargeter->InstrInfo.get()));
+    if (!Retargeter->Disassembler || !Retargeter->InstrAnalysis) {
+        return make_error<StringError>("Could not create the disassembler", inconvertibleErrorCode());
+    }
+
+    return std::move(Retargeter);
+}
+
+// Whether the instruction ends with a 32-bit displacement which can be
+// rewritten in place: call rel32, jmp rel32 or jcc rel32, without prefixes
+static bool hasRel32Displacement(ArrayRef<uint8_t> Instruction) {
+    if (Instruction.size() == 5) return Instruction[0] == 0xE8 || Instruction[0] == 0xE9;
+    if (Instruction.size() == 6) return Instruction[0] == 0x0F && (Instruction[1] & 0xF0) == 0x80;
+    return false;
+}
+
+bool CrisprRetargeter::forEachInstruction(const CrisprSymbolTable &Functions,
+                                          const set<uint64_t> &ExcludedBodies,
+                                          InstructionCallback Callback) const {
+    // Aliases share the same body
+    std::map<uint64_t, uint64_t> Bodies;
+    for (auto const &Function : Functions.symbols()) {
+        if (Function.Size == 0 || ExcludedBodies.count(Function.Address)) continue;
+        if (!Binary.isCode(Function.Address, Function.Size)) continue;
+        Bodies[Function.Address] = std::max(Bodies[Function.Address], Function.Size);
+    }
+
+    bool Complete = true;
+    for (auto const &Body : Bodies) {
+        auto Bytes = Binary.readAddress(Body.first, Body.second);
+        if (!Bytes) {
+            consumeError(Bytes.takeError());
+            Complete = false;
+            continue;
+        }
+
+        uint64_t Offset = 0;
+        while (Offset < Bytes->size()) {
+            MCInst Instruction;
+            uint64_t Size;
+            uint64_t Address = Body.first + Offset;
+            auto Status = Disassembler->getInstruction(Instruction, Size, Bytes->slice(Offset), Address, nulls(),
+                                                       nulls());
+            // Nothing after an invalid instruction can be trusted
+            if (Status != MCDisassembler::Success) {
+                Complete = false;
+                break;
+            }
+
+            Callback(Instruction, Bytes->slice(Offset, Size), Address);
+            Offset += Size;
+        }
+    }
+    return Complete;
+}
+
+vector<CrisprRetargeter::BranchSite> CrisprRetargeter::findBranches(const CrisprSymbolTable &Functions,
+                                                                    const set<uint64_t> &ExcludedBodies,
+                                                                    const set<uint64_t> &Targets) const {
+    vector<BranchSite> Branches;
+    forEachInstruction(Functions, ExcludedBodies, [&](const MCInst &Instruction, ArrayRef<uint8_t> Bytes,
+                                                      uint64_t Address) {
+        uint64_t Target;
+        bool IsCall = InstrAnalysis->isCall(Instruction);
+        if ((IsCall || InstrAnalysis->isBranch(Instruction)) && hasRel32Displacement(Bytes)
+            && InstrAnalysis->evaluateBranch(Instruction, Address, Bytes.size(), Target) && Targets.count(Target)) {
+            Branches.push_back({Address, Bytes.size(), Target, IsCall});
+        }
+    });
+    return Branches;
+}
+
+set<uint64_t> CrisprRetargeter::findOtherReferences(const CrisprSymbolTable &Functions,
+                                                    const set<uint64_t> &ExcludedBodies,
+                                                    const set<uint64_t> &Targets) const {
+    set<uint64_t> Referenced;
+    bool Complete = forEachInstruction(Functions, ExcludedBodies, [&](const MCInst &Instruction,
+                                                                      ArrayRef<uint8_t> Bytes,
+                                                                      uint64_t Address) {
+        uint64_t Target;
+        if ((InstrAnalysis->isCall(Instruction) || InstrAnalysis->isBranch(Instruction))
+            && InstrAnalysis->evaluateBranch(Instruction, Address, Bytes.size(), Target)) {
+            if (!hasRel32Displacement(Bytes) && Targets.count(Target)) Referenced.insert(Target);
+            return;
+        }
+
+        for (unsigned I = 0; I < Instruction.getNumOperands(); I++) {
+            auto const &Operand = Instruction.getOperand(I);
+            if (Operand.isImm() && Targets.count(static_cast<uint64_t>(Operand.getImm()))) {
+                Referenced.insert(Operand.getImm());
+            }
+            // Memory operands are base, scale, index, displacement and segment
+            if (Operand.isReg() && StringRef(RegisterInfo->getName(Operand.getReg())) == "RIP"
+                && I + 3 < Instruction.getNumOperands() && Instruction.getOperand(I + 3).isImm()) {
+                uint64_t Referred = Address + Bytes.size() + Instruction.getOperand(I + 3).getImm();
+                if (Targets.count(Referred)) Referenced.insert(Referred);
+            }
+        }
+    });
+    return Complete ? Referenced : Targets;
+}
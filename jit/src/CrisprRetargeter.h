@@ -0,0 +1,86 @@
+#ifndef CRISPR_CRISPRRETARGETER_H
+#define CRISPR_CRISPRRETARGETER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/MC/MCAsmInfo.h"
+#include "llvm/MC/MCContext.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInst.h"
+#include "llvm/MC/MCInstrAnalysis.h"
+#include "llvm/MC/MCInstrInfo.h"
+#include "llvm/MC/MCRegisterInfo.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/Support/Error.h"
+
+#include "CrisprElf.h"
+#include "CrisprSymbolTable.h"
+
+// Finds the direct branches (calls, tail calls and conditional jumps with a
+// 32-bit displacement) to the patched functions in the code of a binary, so
+// that they can be pointed to the new code instead of going through the
+// detour at the old entry point.
+//
+// Only the bodies of the given functions are disassembled, starting from
+// their entry point, so that data in the executable segments is never
+// mistaken for code.
+class CrisprRetargeter {
+    using string = std::string;
+
+public:
+    struct BranchSite {
+        uint64_t Address;
+        uint64_t Size;
+        uint64_t Target;
+        bool IsCall;
+    };
+
+    static llvm::Expected<std::unique_ptr<CrisprRetargeter>> create(const CrisprElf &Binary);
+
+    // Branches to any of Targets from the bodies of the given functions, except
+    // the ones starting at one of ExcludedBodies
+    std::vector<BranchSite> findBranches(const CrisprSymbolTable &Functions,
+                                         const std::set<uint64_t> &ExcludedBodies,
+                                         const std::set<uint64_t> &Targets) const;
+
+    // Targets which the bodies of the given functions, except the ones
+    // starting at one of ExcludedBodies, refer to other than through branches
+    // findBranches finds: as an immediate (e.g. the address of a function
+    // moved to a register), a RIP-relative operand (e.g. a lea) or the target
+    // of a short branch. All of them if a body cannot be disassembled to its
+    // end, since its remaining instructions are unknown.
+    std::set<uint64_t> findOtherReferences(const CrisprSymbolTable &Functions,
+                                           const std::set<uint64_t> &ExcludedBodies,
+                                           const std::set<uint64_t> &Targets) const;
+
+private:
+    const CrisprElf &Binary;
+
+    std::unique_ptr<llvm::MCRegisterInfo> RegisterInfo;
+    std::unique_ptr<llvm::MCAsmInfo> AsmInfo;
+    std::unique_ptr<llvm::MCSubtargetInfo> SubtargetInfo;
+    std::unique_ptr<llvm::MCInstrInfo> InstrInfo;
+    std::unique_ptr<llvm::MCContext> Context;
+    std::unique_ptr<llvm::MCDisassembler> Disassembler;
+    std::unique_ptr<llvm::MCInstrAnalysis> InstrAnalysis;
+
+    explicit CrisprRetargeter(const CrisprElf &Binary) : Binary(Binary) {}
+
+    using InstructionCallback = llvm::function_ref<void(const llvm::MCInst &Instruction,
+                                                        llvm::ArrayRef<uint8_t> Bytes,
+                                                        uint64_t Address)>;
+
+    // Disassembles the bodies, returns whether all of them were disassembled
+    // to their end
+    bool forEachInstruction(const CrisprSymbolTable &Functions,
+                            const std::set<uint64_t> &ExcludedBodies,
+                            InstructionCallback Callback) const;
+};
+
+#endif//CRISPR_CRISPRRETARGETER_H
@@ -5,8 +5,11 @@
 #ifndef CRISPR_CRISPRSEGMENTMANAGER_H
 #define CRISPR_CRISPRSEGMENTMANAGER_H
 
+#include <algorithm>
 #include <cstdint>
 
+#include "llvm/Support/MathExtras.h"
+
 class CrisprSegmentManager {
 private:
     uint64_t NextFreeCodeSegmentVirtualAddress;
@@ -22,21 +25,24 @@ public:
                                                         NextFreeRoDataSegmentVirtualAddress(baseRoDataSegmentVirtualAddress) {}
 
 public:
-    uint64_t requestCodeAddr(uintptr_t size) {
-        uint64_t ReturnedAddress = NextFreeCodeSegmentVirtualAddress;
-        NextFreeCodeSegmentVirtualAddress += size;
-        return ReturnedAddress;
+    // The returned addresses are aligned as requested, so that the sections
+    // aligned within a segment are aligned in the target process too
+    uint64_t requestCodeAddr(uintptr_t size, uint32_t alignment = 1) {
+        return request(NextFreeCodeSegmentVirtualAddress, size, alignment);
     }
 
-    uint64_t requestDataAddr(uintptr_t size) {
-        uint64_t ReturnedAddress = NextFreeDataSegmentVirtualAddress;
-        NextFreeDataSegmentVirtualAddress += size;
-        return ReturnedAddress;
+    uint64_t requestDataAddr(uintptr_t size, uint32_t alignment = 1) {
+        return request(NextFreeDataSegmentVirtualAddress, size, alignment);
     }
 
-    uint64_t requestRoDataAddr(uintptr_t size) {
-        uint64_t ReturnedAddress = NextFreeRoDataSegmentVirtualAddress;
-        NextFreeRoDataSegmentVirtualAddress += size;
+    uint64_t requestRoDataAddr(uintptr_t size, uint32_t alignment = 1) {
+        return request(NextFreeRoDataSegmentVirtualAddress, size, alignment);
+    }
+
+private:
+    static uint64_t request(uint64_t &NextFree, uintptr_t size, uint32_t alignment) {
+        uint64_t ReturnedAddress = llvm::alignTo(NextFree, std::max<uint32_t>(alignment, 1));
+        NextFree = ReturnedAddress + size;
         return ReturnedAddress;
     }
 };
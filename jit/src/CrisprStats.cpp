@@ -0,0 +1,95 @@
+#include <sys/resource.h>
+
+#include "llvm/Support/Format.h"
+
+#include "CrisprStats.h"
+
+using namespace llvm;
+
+// Process-wide, so stages running concurrently (in batch mode) share it
+static uint64_t getPeakRSS() {
+    struct rusage Usage = {};
+    getrusage(RUSAGE_SELF, &Usage);
+    // Kilobytes on Linux
+    return static_cast<uint64_t>(Usage.ru_maxrss) * 1024;
+}
+
+CrisprStats::Stage CrisprStats::stage(StringRef Name) {
+    Stages.push_back({Name.str(), Depth++, TimeRecord::getCurrentTime(true), 0});
+    return Stage(*this, Stages.size() - 1);
+}
+
+void CrisprStats::endStage(size_t Index) {
+    StageRecord &Record = Stages[Index];
+    TimeRecord End = TimeRecord::getCurrentTime(false);
+    End -= Record.Time;
+    Record.Time = End;
+    Record.PeakRSS = getPeakRSS();
+    Depth--;
+}
+
+void CrisprStats::add(StringRef Counter, uint64_t Value) {
+    std::lock_guard<std::mutex> Lock(CountersLock);
+    Counters[Counter.str()] += Value;
+}
+
+double CrisprStats::getWallTime(StringRef Name) const {
+    double Time = 0;
+    for (auto const &Record : Stages) {
+        if (Record.Name == Name) Time += Record.Time.getWallTime() * 1000;
+    }
+    return Time;
+}
+
+void CrisprStats::printReport(raw_ostream &OS) const {
+    OS << "===" << std::string(73, '-') << "===\n"
+       << "                          crispr time report\n"
+       << "===" << std::string(73, '-') << "===\n"
+       << "   Wall (ms)    User (ms)  System (ms)  Peak RSS (MiB)  Stage\n";
+    for (auto const &Record : Stages) {
+        OS << format("%12.1f %12.1f %12.1f %15.1f  ",
+                     Record.Time.getWallTime() * 1000,
+                     Record.Time.getUserTime() * 1000,
+                     Record.Time.getSystemTime() * 1000,
+                     Record.PeakRSS / (1024.0 * 1024.0))
+           << std::string(Record.Depth * 2, ' ') << Record.Name << "\n";
+    }
+
+    std::lock_guard<std::mutex> Lock(CountersLock);
+    if (Counters.empty()) return;
+    OS << "\n       Value  Counter\n";
+    for (auto const &Counter : Counters) {
+        OS << format("%12llu  ", static_cast<unsigned long long>(Counter.second)) << Counter.first << "\n";
+    }
+}
+
+json::Array CrisprStats::stagesToJSON(size_t &Index, unsigned Depth) const {
+    json::Array Array;
+    while (Index < Stages.size() && Stages[Index].Depth == Depth) {
+        auto const &Record = Stages[Index++];
+        json::Object Object{
+                {"name",           Record.Name},
+                {"wall_ms",        Record.Time.getWallTime() * 1000},
+                {"user_ms",        Record.Time.getUserTime() * 1000},
+                {"system_ms",      Record.Time.getSystemTime() * 1000},
+                {"peak_rss_bytes", static_cast<int64_t>(Record.PeakRSS)},
+        };
+        auto Children = stagesToJSON(Index, Depth + 1);
+        if (!Children.empty()) Object["stages"] = std::move(Children);
+        Array.push_back(std::move(Object));
+    }
+    return Array;
+}
+
+json::Object CrisprStats::toJSON() const {
+    size_t Index = 0;
+    json::Object CountersObject;
+    {
+        std::lock_guard<std::mutex> Lock(CountersLock);
+        for (auto const &Counter : Counters) CountersObject[Counter.first] = static_cast<int64_t>(Counter.second);
+    }
+    return json::Object{
+            {"stages",   stagesToJSON(Index, 0)},
+            {"counters", std::move(CountersObject)},
+    };
+}
@@ -0,0 +1,84 @@
+#ifndef CRISPR_CRISPRSTATS_H
+#define CRISPR_CRISPRSTATS_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// How much progress is reported. Quiet only reports errors, Verbose adds the
+// dumps of every section, relocation and symbol, which are not even
+// formatted at the other levels.
+enum class CrisprLogLevel {
+    Quiet,
+    Info,
+    Verbose
+};
+
+// Instrumentation of a patching run: nested stage timers, which also record
+// the peak resident set size of the process at the end of every stage, and
+// counters (symbols defined, relocations processed, bytes emitted...).
+// Stages are started and ended by a single thread, counters can be updated
+// concurrently, e.g. by the compile threads.
+class CrisprStats {
+    using string = std::string;
+
+public:
+    // Ends its stage when destroyed
+    class Stage {
+        CrisprStats &Stats;
+        size_t Index;
+
+        Stage(CrisprStats &Stats, size_t Index) : Stats(Stats), Index(Index) {}
+
+        friend class CrisprStats;
+
+    public:
+        Stage(const Stage &) = delete;
+
+        Stage &operator=(const Stage &) = delete;
+
+        ~Stage() { Stats.endStage(Index); }
+    };
+
+    // Starts a stage, nested in the innermost running one
+    [[nodiscard]] Stage stage(llvm::StringRef Name);
+
+    void add(llvm::StringRef Counter, uint64_t Value = 1);
+
+    // Wall time of the stage in milliseconds, summed over its occurrences
+    [[nodiscard]] double getWallTime(llvm::StringRef Name) const;
+
+    // Table of the stages and counters, in the style of -time-passes
+    void printReport(llvm::raw_ostream &OS) const;
+
+    // {"stages": [{"name", "wall_ms", "user_ms", "system_ms", "peak_rss_bytes", "stages"}...], "counters": {...}}
+    [[nodiscard]] llvm::json::Object toJSON() const;
+
+private:
+    struct StageRecord {
+        string Name;
+        unsigned Depth;
+        llvm::TimeRecord Time;
+        uint64_t PeakRSS;
+    };
+
+    // In the order they were started, children following their parent
+    std::vector<StageRecord> Stages;
+    unsigned Depth = 0;
+
+    mutable std::mutex CountersLock;
+    std::map<string, uint64_t> Counters;
+
+    void endStage(size_t Index);
+
+    llvm::json::Array stagesToJSON(size_t &Index, unsigned Depth) const;
+};
+
+#endif//CRISPR_CRISPRSTATS_H
@@ -0,0 +1,214 @@
+#include "llvm/ADT/Twine.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Support/Endian.h"
+
+#include "CrisprSymbolTable.h"
+
+using namespace llvm;
+using namespace std;
+using namespace llvm::support;
+
+namespace {
+
+struct BinaryHeader {
+    char Magic[8];
+    ulittle64_t Count;
+    ulittle64_t NamesOffset;
+};
+
+struct BinaryEntry {
+    ulittle64_t Address;
+    ulittle64_t Size;
+    ulittle32_t NameOffset;
+    ulittle32_t NameSize;
+};
+
+} // namespace
+
+constexpr char CrisprSymbolTable::BinaryMagic[9];
+
+// Hexadecimal, with or without the 0x prefix, as std::stoull reads it
+static bool parseHex(StringRef Text, uint64_t &Value) {
+    if (Text.startswith("0x") || Text.startswith("0X")) Text = Text.drop_front(2);
+    return Text.getAsInteger(16, Value);
+}
+
+static Error malformed(StringRef Path, const Twine &Message) {
+    return make_error<StringError>("Malformed symbol table " + Path + ": " + Message, inconvertibleErrorCode());
+}
+
+Expected<unique_ptr<CrisprSymbolTable>> CrisprSymbolTable::load(const string &Path) {
+    unique_ptr<CrisprSymbolTable> Table(new CrisprSymbolTable());
+    if (Error Err = Table->addFile(Path)) return std::move(Err);
+    return std::move(Table);
+}
+
+Error CrisprSymbolTable::addFile(const string &Path) {
+    // Big files are mmapped
+    auto Buffer = MemoryBuffer::getFile(Path, -1, false);
+    if (!Buffer) {
+        return make_error<StringError>("Could not open symbol table " + Path, Buffer.getError());
+    }
+
+    bool IsBinary = (*Buffer)->getBuffer().startswith(StringRef(BinaryMagic, sizeof(BinaryHeader::Magic)));
+    Error Err = IsBinary ? parseBinary(**Buffer) : parseCSV(**Buffer);
+    if (Err) return Err;
+
+    Buffers.push_back(std::move(*Buffer));
+    return Error::success();
+}
+
+Error CrisprSymbolTable::addElf(const string &Path, bool PltSymbols) {
+    auto Buffer = MemoryBuffer::getFile(Path, -1, false);
+    if (!Buffer) {
+        return make_error<StringError>("Could not open " + Path, Buffer.getError());
+    }
+
+    auto Binary = object::ObjectFile::createObjectFile((*Buffer)->getMemBufferRef());
+    if (!Binary) return Binary.takeError();
+    auto *Elf = dyn_cast<object::ELFObjectFileBase>(Binary->get());
+    if (!Elf) return malformed(Path, "not an ELF file");
+
+    // The names point into the string tables of the mapped file
+    auto AddSymbols = [this](object::ELFObjectFileBase::elf_symbol_iterator_range Range) -> Error {
+        for (auto const &Symbol : Range) {
+            uint8_t Type = Symbol.getELFType();
+            uint8_t Visibility = Symbol.getOther() & 0x3;
+            bool Exported = Visibility == ELF::STV_DEFAULT || Visibility == ELF::STV_PROTECTED;
+            if (!(Type == ELF::STT_FUNC && Exported) && Type != ELF::STT_OBJECT) continue;
+            if (Symbol.getFlags() & object::SymbolRef::SF_Undefined) continue;
+
+            auto Name = Symbol.getName();
+            if (!Name) return Name.takeError();
+            auto Address = Symbol.getAddress();
+            if (!Address) return Address.takeError();
+            if (!Name->empty()) add(*Name, *Address, Symbol.getSize());
+        }
+        return Error::success();
+    };
+    if (Error Err = AddSymbols(Elf->symbols())) return Err;
+    if (Error Err = AddSymbols(Elf->getDynamicSymbolIterators())) return Err;
+
+    if (PltSymbols) {
+        for (auto const &Entry : Elf->getPltAddresses()) {
+            object::SymbolRef Symbol(Entry.first, Elf);
+            auto Name = Symbol.getName();
+            if (!Name) return Name.takeError();
+            if (!Name->empty() && !lookup(*Name)) add(*Name, Entry.second, 0);
+        }
+
+        // The GOT slots of the imported symbols are filled by GLOB_DAT
+        // relocations, the functions called through the PLT have their own
+        for (auto const &Section : Elf->sections()) {
+            if (object::ELFSectionRef(Section).getType() != ELF::SHT_RELA) continue;
+            for (auto const &Relocation : Section.relocations()) {
+                if (Relocation.getType() != ELF::R_X86_64_GLOB_DAT) continue;
+                auto Symbol = Relocation.getSymbol();
+                if (Symbol == Elf->symbol_end() || !(Symbol->getFlags() & object::SymbolRef::SF_Undefined)) continue;
+                auto Name = Symbol->getName();
+                if (!Name) return Name.takeError();
+                if (!Name->empty()) add(Names.save(getGotSlotName(*Name)), Relocation.getOffset(), 8);
+            }
+        }
+    }
+
+    Buffers.push_back(std::move(*Buffer));
+    return Error::success();
+}
+
+void CrisprSymbolTable::add(StringRef Name, uint64_t Address, uint64_t Size) {
+    auto Inserted = Index.insert({Name, Symbols.size()});
+    if (Inserted.second) {
+        Symbols.push_back({Name, Address, Size});
+    } else {
+        Symbols[Inserted.first->second] = {Name, Address, Size};
+    }
+}
+
+void CrisprSymbolTable::rebase(uint64_t Base) {
+    for (auto &S : Symbols) S.Address += Base;
+}
+
+const CrisprSymbolTable::Symbol *CrisprSymbolTable::lookup(StringRef Name) const {
+    auto It = Index.find(Name);
+    if (It == Index.end()) return nullptr;
+    return &Symbols[It->second];
+}
+
+Error CrisprSymbolTable::parseCSV(const MemoryBuffer &Buffer) {
+    StringRef Rest = Buffer.getBuffer();
+    Symbols.reserve(Symbols.size() + Rest.count('\n') + 1);
+    Index.reserve(Symbols.capacity());
+
+    unsigned LineNumber = 0;
+    while (!Rest.empty()) {
+        StringRef Line;
+        std::tie(Line, Rest) = Rest.split('\n');
+        LineNumber++;
+        Line = Line.rtrim("\r");
+        if (Line.empty()) continue;
+
+        // The name is everything before the last two fields, so it may
+        // contain commas
+        StringRef Name, Address, Size;
+        std::tie(Line, Size) = Line.rsplit(',');
+        std::tie(Name, Address) = Line.rsplit(',');
+
+        uint64_t AddressValue, SizeValue;
+        if (Name.empty() || parseHex(Address, AddressValue) || parseHex(Size, SizeValue)) {
+            return malformed(Buffer.getBufferIdentifier(), "invalid line " + Twine(LineNumber));
+        }
+        add(Name, AddressValue, SizeValue);
+    }
+
+    return Error::success();
+}
+
+Error CrisprSymbolTable::parseBinary(const MemoryBuffer &Buffer) {
+    StringRef Data = Buffer.getBuffer();
+    StringRef Path = Buffer.getBufferIdentifier();
+    if (Data.size() < sizeof(BinaryHeader)) return malformed(Path, "truncated header");
+
+    auto *Header = reinterpret_cast<const BinaryHeader *>(Data.data());
+    uint64_t Count = Header->Count;
+    uint64_t NamesOffset = Header->NamesOffset;
+    if (Count > (Data.size() - sizeof(BinaryHeader)) / sizeof(BinaryEntry)) return malformed(Path, "truncated entries");
+    if (NamesOffset < sizeof(BinaryHeader) + Count * sizeof(BinaryEntry) || NamesOffset > Data.size()) {
+        return malformed(Path, "invalid names offset");
+    }
+
+    StringRef Names = Data.substr(NamesOffset);
+    auto *Entries = reinterpret_cast<const BinaryEntry *>(Data.data() + sizeof(BinaryHeader));
+    Symbols.reserve(Symbols.size() + Count);
+    Index.reserve(Symbols.capacity());
+    for (uint64_t I = 0; I < Count; I++) {
+        auto const &Entry = Entries[I];
+        uint64_t NameOffset = Entry.NameOffset;
+        uint64_t NameSize = Entry.NameSize;
+        if (NameOffset + NameSize > Names.size()) return malformed(Path, "name of symbol " + Twine(I) + " out of bounds");
+        add(Names.substr(NameOffset, NameSize), Entry.Address, Entry.Size);
+    }
+
+    return Error::success();
+}
+
+void CrisprSymbolTable::writeBinary(raw_ostream &Out) const {
+    BinaryHeader Header;
+    memcpy(Header.Magic, BinaryMagic, sizeof(Header.Magic));
+    Header.Count = Symbols.size();
+    Header.NamesOffset = sizeof(BinaryHeader) + Symbols.size() * sizeof(BinaryEntry);
+    Out.write(reinterpret_cast<const char *>(&Header), sizeof(Header));
+
+    uint32_t NameOffset = 0;
+    for (auto const &Symbol : Symbols) {
+        BinaryEntry Entry;
+        Entry.Address = Symbol.Address;
+        Entry.Size = Symbol.Size;
+        Entry.NameOffset = NameOffset;
+        Entry.NameSize = Symbol.Name.size();
+        Out.write(reinterpret_cast<const char *>(&Entry), sizeof(Entry));
+        NameOffset += Symbol.Name.size();
+    }
+
+    for (auto const &Symbol : Symbols) Out << Symbol.Name;
+}
@@ -0,0 +1,89 @@
+#ifndef CRISPR_CRISPRSYMBOLTABLE_H
+#define CRISPR_CRISPRSYMBOLTABLE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Symbols of the binary being patched, indexed by name.
+//
+// Names are not copied: they point into the (mmapped) files they were loaded
+// from, which the table keeps alive, so loading costs a single pass over the
+// file and no allocation per symbol.
+//
+// Symbols are read from the binary itself, and from symbol table files in
+// two formats:
+//  - CSV, one name,address,size line per symbol with hexadecimal numbers
+//  - a binary format, which can be produced from the CSV with crispr-symtab:
+//      header   "CRSYMTB1", symbol count, offset of the names (64 bits each)
+//      entries  address, size (64 bits), name offset, name size (32 bits)
+//      names    not terminated, offsets are relative to the first name
+class CrisprSymbolTable {
+    using string = std::string;
+
+public:
+    struct Symbol {
+        llvm::StringRef Name;
+        uint64_t Address;
+        uint64_t Size;
+    };
+
+    static constexpr char BinaryMagic[9] = "CRSYMTB1";
+
+    // Detects the format from the content of the file
+    static llvm::Expected<std::unique_ptr<CrisprSymbolTable>> load(const string &Path);
+
+    // Adds the symbols of a symbol table file, detecting its format
+    llvm::Error addFile(const string &Path);
+
+    // Adds the defined functions visible outside of their object and the
+    // defined variables of an ELF binary, from both .symtab and .dynsym.
+    // With PltSymbols, imported functions which are not defined are given
+    // the address of their PLT entry, and imported variables a symbol named
+    // by getGotSlotName at the GOT slot the dynamic linker fills.
+    llvm::Error addElf(const string &Path, bool PltSymbols);
+
+    // Symbol of the GOT slot of an imported variable
+    static string getGotSlotName(llvm::StringRef Name) { return ("crispr.got." + Name).str(); }
+
+    // Name must outlive the table. A symbol with the same name is replaced.
+    void add(llvm::StringRef Name, uint64_t Address, uint64_t Size);
+
+    // Moves all the symbols by Base, e.g. to the load address of a position
+    // independent binary
+    void rebase(uint64_t Base);
+
+    [[nodiscard]] const Symbol *lookup(llvm::StringRef Name) const;
+
+    [[nodiscard]] llvm::ArrayRef<Symbol> symbols() const { return Symbols; }
+
+    [[nodiscard]] size_t size() const { return Symbols.size(); }
+
+    [[nodiscard]] bool empty() const { return Symbols.empty(); }
+
+    void writeBinary(llvm::raw_ostream &Out) const;
+
+private:
+    std::vector<std::unique_ptr<llvm::MemoryBuffer>> Buffers;
+    // Names which are not in any file, e.g. of the GOT slots
+    llvm::BumpPtrAllocator NameAllocator;
+    llvm::StringSaver Names{NameAllocator};
+    std::vector<Symbol> Symbols;
+    llvm::DenseMap<llvm::StringRef, uint32_t> Index;
+
+    llvm::Error parseCSV(const llvm::MemoryBuffer &Buffer);
+
+    llvm::Error parseBinary(const llvm::MemoryBuffer &Buffer);
+};
+
+#endif//CRISPR_CRISPRSYMBOLTABLE_H
@@ -9,18 +9,30 @@
 #include "llvm/IR/Function.h"
 #include "llvm/Support/raw_ostream.h"
 
+// Puts every function in a section of its own, so that it can be placed
+// independently of the others, and applies the function alignment policy.
+// Functions which were already assigned a .funcs section keep it.
+// An alignment of 0 keeps the one chosen by the backend.
 class SeparateFunctionsPass : public llvm::FunctionPass {
 private:
     char ID;
+    unsigned FunctionAlignment;
+    unsigned ColdFunctionAlignment;
 
 public:
     bool runOnFunction(llvm::Function &F) override {
-        F.setAlignment(1);
-        F.setSection(".funcs." + F.getName().str());
+        unsigned Alignment = F.hasFnAttribute(llvm::Attribute::Cold) ? ColdFunctionAlignment : FunctionAlignment;
+        if (Alignment != 0) F.setAlignment(Alignment);
+        if (!F.getSection().startswith(".funcs.")) F.setSection(".funcs." + F.getName().str());
         return true;
     }
 
-    SeparateFunctionsPass() : FunctionPass(ID), ID(0) {
+    SeparateFunctionsPass(unsigned FunctionAlignment, unsigned ColdFunctionAlignment) : FunctionPass(ID),
+                                                                                       ID(0),
+                                                                                       FunctionAlignment(
+                                                                                               FunctionAlignment),
+                                                                                       ColdFunctionAlignment(
+                                                                                               ColdFunctionAlignment) {
 
     };
 
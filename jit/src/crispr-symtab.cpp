@@ -0,0 +1,36 @@
+// Converts a symbol table (e.g. a CSV exported from a disassembler) to the
+// binary format, which crispr loads without parsing.
+//
+// Usage: crispr-symtab INPUT OUTPUT
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprSymbolTable.h"
+
+using namespace llvm;
+using namespace std;
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        errs() << "Usage: " << argv[0] << " INPUT OUTPUT\n";
+        return 1;
+    }
+
+    auto Table = CrisprSymbolTable::load(argv[1]);
+    if (!Table) {
+        errs() << Table.takeError() << "\n";
+        return 1;
+    }
+
+    error_code EC;
+    raw_fd_ostream Out(argv[2], EC, sys::fs::F_None);
+    if (EC) {
+        errs() << "Could not open " << argv[2] << ": " << EC.message() << "\n";
+        return 1;
+    }
+    (*Table)->writeBinary(Out);
+
+    outs() << "Converted " << (*Table)->size() << " symbols\n";
+    return 0;
+}
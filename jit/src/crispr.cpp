@@ -1,20 +1,56 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
 #include <vector>
 #include <iostream>
 #include <string>
 
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/IRReader/IRReader.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Object/ELFObjectFile.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/ProfileData/SampleProfReader.h"
 #include "llvm/Support/FileCheck.h"
+#include "llvm/Support/Chrono.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/Threading.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
+#include "CrisprAddressPlanner.h"
 #include "CrisprCompiler.h"
 #include "CrisprLinker.h"
+#include "CrisprObjectCache.h"
+#include "CrisprElf.h"
+#include "CrisprFreeSpace.h"
+#include "CrisprLive.h"
+#include "CrisprOutputFile.h"
+#include "CrisprPatchManifest.h"
+#include "CrisprPatchSteps.h"
+#include "CrisprDetours.h"
+#include "CrisprStats.h"
+#include "CrisprSymbolTable.h"
 #include "ArgParser.h"
-#include "CSVReader.h"
 #include "util.h"
 
 using namespace llvm;
@@ -25,37 +61,44 @@ void InitTarget() {
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
     InitializeNativeTargetAsmParser();
+    InitializeNativeTargetDisassembler();
 }
 
-void add_static_libraries(const string &paths, CrisprCompiler &Recompiler) {
+// Failures of the steps of a patch are returned rather than fatal: in batch
+// mode they only fail the job they happen in
+static Error patch_error(const Twine &message) {
+    return make_error<StringError>(message, inconvertibleErrorCode());
+}
+
+static Error patch_error(const Twine &message, Error cause) {
+    return patch_error(message + ": " + toString(std::move(cause)));
+}
+
+static Error patch_error(const Twine &message, std::error_code cause) {
+    return patch_error(message + ": " + cause.message());
+}
+
+// Outside of batch mode, a failed step ends the process
+static ExitOnError exit_on_error;
+
+Error add_static_libraries(const string &paths, CrisprCompiler &Recompiler) {
     auto libraries = split(paths, ",");
 
     for (const auto &lib: libraries) {
         auto MB = llvm::MemoryBuffer::getFile(lib);
-        if (MB.getError()) {
-            errs() << "Could not open " << lib << "\n";
-            exit(1);
-        } else {
-            auto Err = Recompiler.addObject(std::move(*MB));
-            if (Err) {
-                errs() << "Error while adding library: " << Err << "\n";
-                exit(1);
-            }
+        if (!MB) return patch_error("Could not open " + lib, MB.getError());
+        if (auto Err = Recompiler.addObject(std::move(*MB))) {
+            return patch_error("Error while adding library", std::move(Err));
         }
     }
+    return Error::success();
 }
 
-ThreadSafeModule ParseModule(const string &path) {
+Expected<unique_ptr<Module>> ParseModule(const string &path, LLVMContext &Context) {
     SMDiagnostic Err;
 
-    ThreadSafeContext TSCtx(std::make_unique<LLVMContext>());
-
-    unique_ptr<Module> M = parseIRFile(path, Err, *TSCtx.getContext());
-    if (!M) {
-        errs() << "Could not parse IR file. The error was:\n";
-        errs() << Err.getMessage();
-        exit(1);
-    }
+    unique_ptr<Module> M = parseIRFile(path, Err, Context);
+    if (!M) return patch_error("Could not parse IR file " + path + ". The error was:\n" + Err.getMessage());
 
     std::string buffer;
     raw_string_ostream es(buffer);
@@ -63,94 +106,1568 @@ ThreadSafeModule ParseModule(const string &path) {
         cerr << "Module verification failed: " << es.str().c_str();
     }
 
+    return std::move(M);
+}
+
+// Parses the modules of the patch and links them into one, so that they are
+// optimized together, e.g. helpers shared by several files can be inlined in
+// the patched functions. Only the protected definitions, the entry points of
+// the patch, stay visible: the rest is internalized, so that the unused
+// helpers are dropped and the others are not mistaken for patched functions.
+Expected<ThreadSafeModule> ParseModules(const vector<string> &paths, raw_ostream &log) {
+    if (paths.empty()) return patch_error("No module to compile, pass it with -m");
+    ThreadSafeContext TSCtx(std::make_unique<LLVMContext>());
+    auto First = ParseModule(paths.front(), *TSCtx.getContext());
+    if (!First) return First.takeError();
+    unique_ptr<Module> M = std::move(*First);
+    if (paths.size() == 1) return ThreadSafeModule(std::move(M), TSCtx);
+
+    Linker L(*M);
+    for (auto const &path : make_range(std::next(paths.begin()), paths.end())) {
+        auto Next = ParseModule(path, *TSCtx.getContext());
+        if (!Next) return Next.takeError();
+        if (L.linkInModule(std::move(*Next))) return patch_error("Could not link " + path + " with the other modules");
+    }
+
+    unsigned defined = 0;
+    for (auto const &F : *M) {
+        if (!F.isDeclaration()) defined++;
+    }
+    internalizeModule(*M, [](const GlobalValue &GV) {
+        return GV.hasProtectedVisibility();
+    });
+    legacy::PassManager PM;
+    PM.add(createGlobalDCEPass());
+    PM.run(*M);
+
+    unsigned kept = 0;
+    for (auto const &F : *M) {
+        if (!F.isDeclaration()) kept++;
+    }
+    log << "Linked " << paths.size() << " modules, " << kept << " of " << defined << " functions kept\n";
     return ThreadSafeModule(std::move(M), TSCtx);
 }
 
-void AddSymbolsFromCSV(const string &symbols_path, CrisprCompiler &Recompiler) {
-    std::map<string, uint64_t> Symbols;
-    ifstream symbols_file(symbols_path);
-    CSVRow row;
-    while (symbols_file >> row) {
-        string SymbolName = row[0];
-        uint64_t Address = std::stoull(row[1], nullptr, 16);
-        uint64_t Size = std::stoull(row[2], nullptr, 16);
-        Size += 0;
-        Symbols[SymbolName] = Address;
-    }
-    Error Err = Recompiler.addExistingSymbols(Symbols);
-    if (Err) {
-        errs() << "Error while adding existing symbols: " << Err;
+// Reports how many of the new functions have samples in the profile, where
+// they are matched by name
+Error check_sample_profile(const string &profile_path, const Module &M, raw_ostream &log) {
+    LLVMContext Context;
+    auto Reader = sampleprof::SampleProfileReader::create(profile_path, Context);
+    if (!Reader) return patch_error("Could not open the sample profile", Reader.getError());
+    if (auto EC = (*Reader)->read()) return patch_error("Could not read the sample profile", EC);
+
+    unsigned Defined = 0;
+    unsigned Sampled = 0;
+    for (auto const &F : M) {
+        if (F.isDeclaration()) continue;
+        Defined++;
+        if ((*Reader)->getSamplesFor(F.getName())) Sampled++;
+    }
+    log << "The sample profile covers " << Sampled << " of " << Defined << " new functions\n";
+    return Error::success();
+}
+
+// Loads the symbols of the binary being patched. The symbols provided by the
+// user (CSV or binary symbol table) take precedence over the ones read from
+// the binary.
+Expected<unique_ptr<CrisprSymbolTable>> read_symbols(const string &input_binary_path,
+                                                     const string &symbols_path,
+                                                     bool plt_symbols,
+                                                     raw_ostream &log) {
+    auto Symbols = std::make_unique<CrisprSymbolTable>();
+    if (!input_binary_path.empty()) {
+        if (auto Err = Symbols->addElf(input_binary_path, plt_symbols)) {
+            return patch_error("Error while reading the symbols of the input binary", std::move(Err));
+        }
+    }
+    if (!symbols_path.empty()) {
+        if (auto Err = Symbols->addFile(symbols_path)) {
+            return patch_error("Error while loading existing symbols", std::move(Err));
+        }
+    }
+    log << "Loaded " << Symbols->size() << " existing symbols\n";
+    return std::move(Symbols);
+}
+
+Error define_symbols(const CrisprSymbolTable &Symbols, CrisprCompiler &Recompiler) {
+    if (auto Err = Recompiler.addExistingSymbols(Symbols)) {
+        return patch_error("Error while adding existing symbols", std::move(Err));
+    }
+    return Error::success();
+}
+
+// Loads the symbols of the binary being patched and defines them in the JIT.
+// The imported functions and variables the binary already has a PLT entry or
+// a GOT slot for are bound to them, only the others are imported again.
+Expected<unique_ptr<CrisprSymbolTable>> load_symbols(const string &input_binary_path,
+                                                     const string &symbols_path,
+                                                     CrisprCompiler &Recompiler,
+                                                     raw_ostream &log) {
+    auto Symbols = read_symbols(input_binary_path, symbols_path, true, log);
+    if (!Symbols) return Symbols.takeError();
+    if (auto Err = define_symbols(**Symbols, Recompiler)) return std::move(Err);
+    return std::move(*Symbols);
+}
+
+// Makes the uses of the imported variables which the binary has a GOT slot
+// for load their address from that slot, rather than import them again with
+// a dynamic symbol and a relocation of their own. Variables used by
+// constants (e.g. in the initializer of another variable) are left alone.
+void bind_imported_variables(Module &M, const CrisprSymbolTable &Symbols, CrisprStats &stats, raw_ostream &log) {
+    vector<GlobalVariable *> Imported;
+    for (auto &GV : M.globals()) {
+        if (GV.isDeclaration() && !Symbols.lookup(GV.getName())) Imported.push_back(&GV);
+    }
+
+    unsigned bound = 0;
+    for (auto *GV : Imported) {
+        string SlotName = CrisprSymbolTable::getGotSlotName(GV->getName());
+        if (!Symbols.lookup(SlotName)) continue;
+        bool Loadable = std::all_of(GV->user_begin(), GV->user_end(), [](const User *U) {
+            return isa<Instruction>(U) && !isa<PHINode>(U);
+        });
+        if (!Loadable) continue;
+
+        auto *Slot = new GlobalVariable(M, GV->getType(), true, GlobalValue::ExternalLinkage, nullptr, SlotName);
+        Slot->setDSOLocal(true);
+        while (!GV->use_empty()) {
+            Use &U = *GV->use_begin();
+            U.set(new LoadInst(GV->getType(), Slot, GV->getName() + ".address", cast<Instruction>(U.getUser())));
+        }
+        GV->eraseFromParent();
+        bound++;
+    }
+    if (bound == 0) return;
+    stats.add("bound_variables", bound);
+    log << "Bound " << bound << " imported variables to the GOT of the binary\n";
+}
+
+Expected<std::shared_ptr<std::map<string, uint64_t>>>
+lookup_new_symbols(CrisprCompiler &Recompiler, bool verbose, raw_ostream &log) {
+    // A single lookup lets the JIT compile all the functions concurrently
+    log << "Looking up " << Recompiler.NewFunctions.size() << " new functions\n";
+    auto Symbols = Recompiler.findSymbols(Recompiler.NewFunctions);
+    if (!Symbols) return patch_error("Could not look up the new functions", Symbols.takeError());
+
+    auto lookup_results = std::make_shared<std::map<string, uint64_t>>(std::move(*Symbols));
+    if (verbose) {
+        for (auto const &symbol : *lookup_results) {
+            log << "Looked up address of " << symbol.first << ": " << format_hex(symbol.second, 10) << "\n";
+        }
+    }
+    return std::move(lookup_results);
+}
+
+Error write_file(const string &path, StringRef content) {
+    std::error_code EC;
+    raw_fd_ostream OS(path, EC, sys::fs::F_None);
+    if (EC) return patch_error("Could not write " + path, EC);
+    OS << content;
+    return Error::success();
+}
+
+// Reports how many pages and cache lines the hot functions span once linked,
+// and the fewest pages they could fit in
+Error report_hot_code(MemoryBufferRef linked, const std::set<string> &hot_sections, CrisprStats &stats,
+                      raw_ostream &log) {
+    if (hot_sections.empty()) return Error::success();
+    auto Linked = object::ObjectFile::createObjectFile(linked);
+    if (!Linked) return patch_error("Could not open the linked object", Linked.takeError());
+
+    const uint64_t CacheLineSize = 64;
+    std::set<uint64_t> Pages;
+    std::set<uint64_t> Lines;
+    uint64_t Size = 0;
+    for (auto const &S : (*Linked)->sections()) {
+        StringRef Name;
+        if (S.getName(Name) || !hot_sections.count(Name.str()) || S.getSize() == 0) continue;
+        uint64_t End = S.getAddress() + S.getSize() - 1;
+        for (uint64_t Page = S.getAddress() / PageSize; Page <= End / PageSize; Page++) Pages.insert(Page);
+        for (uint64_t Line = S.getAddress() / CacheLineSize; Line <= End / CacheLineSize; Line++) Lines.insert(Line);
+        Size += S.getSize();
+    }
+
+    stats.add("hot_code_bytes", Size);
+    stats.add("hot_pages", Pages.size());
+    stats.add("hot_cache_lines", Lines.size());
+    log << "Hot code: " << Size << " bytes over " << Pages.size() << " pages (" << alignTo(Size, PageSize) / PageSize
+        << " at best) and " << Lines.size() << " cache lines\n";
+    return Error::success();
+}
+
+// Address of the patch when it is not given: right after the last segment
+// of the input binary, where it overlaps nothing and the new code stays in
+// reach of the rel32 calls and jumps of the old one
+Expected<uint64_t> plan_image_base(const string &input_binary_path, uint64_t alignment) {
+    auto Input = CrisprElf::open(input_binary_path);
+    if (!Input) return patch_error("Could not parse the input binary", Input.takeError());
+
+    uint64_t End = 0;
+    for (auto const &Phdr : (*Input)->programHeaders()) {
+        if (Phdr.p_type == ELF::PT_LOAD) End = std::max<uint64_t>(End, Phdr.p_vaddr + Phdr.p_memsz);
+    }
+    CrisprAddressPlanner Planner;
+    Planner.reserveSegments(**Input);
+    return Planner.findFree(PageSize, alignment, End);
+}
+
+// Checks that the segments the linker placed from the image base overlap
+// none of the input binary, which happens when the address is given
+Error check_new_segments(const string &input_binary_path, MemoryBufferRef linked, uint64_t image_base) {
+    auto Input = CrisprElf::open(input_binary_path);
+    if (!Input) return patch_error("Could not parse the input binary", Input.takeError());
+    auto Linked = CrisprElf::create(MemoryBuffer::getMemBuffer(linked, false));
+    if (!Linked) return patch_error("Could not parse the linked object", Linked.takeError());
+
+    CrisprAddressPlanner Planner;
+    Planner.reserveSegments(**Input);
+    for (auto const &Phdr : (*Linked)->programHeaders()) {
+        if (Phdr.p_type != ELF::PT_LOAD || Phdr.p_vaddr < image_base) continue;
+        if (!Planner.isFree(Phdr.p_vaddr, Phdr.p_memsz)) {
+            return patch_error("The new segment at 0x" + utohexstr(Phdr.p_vaddr) + " (" + Twine(Phdr.p_memsz)
+                               + " bytes) overlaps the input binary, choose another --map-code-to or leave it to auto");
+        }
+    }
+    return Error::success();
+}
+
+// Without a link step the new code stays where the JIT placed it, so its
+// segments are checked against each other and against the input binary
+Error check_jit_segments(const string &input_binary_path, const CrisprCompiler &Recompiler) {
+    struct Extent {
+        const char *Option;
+        uint64_t Start;
+        uint64_t End;
+    };
+    Extent Extents[] = {{"--map-code-to",   UINT64_MAX, 0},
+                        {"--map-data-to",   UINT64_MAX, 0},
+                        {"--map-rodata-to", UINT64_MAX, 0}};
+    auto extend = [](Extent &E, uint64_t Address, uint64_t Size) {
+        if (Size == 0) return;
+        E.Start = std::min(E.Start, Address);
+        E.End = std::max(E.End, Address + Size);
+    };
+    for (auto const &MS : Recompiler.getSegments()) {
+        extend(Extents[0], MS->CodeSegmentAddress, MS->CodeSegmentSize);
+        extend(Extents[1], MS->DataSegmentAddress, MS->DataSegmentSize);
+        extend(Extents[2], MS->RoDataSegmentAddress, MS->RoDataSegmentSize);
+    }
+
+    CrisprAddressPlanner Planner;
+    if (!input_binary_path.empty()) {
+        auto Input = CrisprElf::open(input_binary_path);
+        if (!Input) return patch_error("Could not parse the input binary", Input.takeError());
+        Planner.reserveSegments(**Input);
+    }
+    for (auto const &E : Extents) {
+        if (E.Start >= E.End) continue;
+        if (!Planner.isFree(E.Start, E.End - E.Start)) {
+            return patch_error("The new segment at 0x" + utohexstr(E.Start) + " (" + Twine(E.End - E.Start)
+                               + " bytes) overlaps the input binary or another new segment, choose another "
+                               + E.Option);
+        }
+        Planner.reserve(E.Start, E.End - E.Start);
+    }
+    return Error::success();
+}
+
+// Reports the bytes of new code mapped as new segments, and how many iTLB
+// entries they take with 4KB pages and with 2MB ones
+Error report_new_text(MemoryBufferRef linked, uint64_t image_base, CrisprStats &stats, raw_ostream &log) {
+    auto Linked = CrisprElf::create(MemoryBuffer::getMemBuffer(linked, false));
+    if (!Linked) return patch_error("Could not parse the linked object", Linked.takeError());
+
+    uint64_t Size = 0;
+    std::set<uint64_t> Pages;
+    std::set<uint64_t> HugePages;
+    for (auto const &Phdr : (*Linked)->programHeaders()) {
+        if (Phdr.p_type != ELF::PT_LOAD || !(Phdr.p_flags & ELF::PF_X) || Phdr.p_vaddr < image_base
+            || Phdr.p_memsz == 0) {
+            continue;
+        }
+        uint64_t End = Phdr.p_vaddr + Phdr.p_memsz - 1;
+        for (uint64_t Page = Phdr.p_vaddr / PageSize; Page <= End / PageSize; Page++) Pages.insert(Page);
+        for (uint64_t Page = Phdr.p_vaddr / HugePageSize; Page <= End / HugePageSize; Page++) HugePages.insert(Page);
+        Size += Phdr.p_memsz;
+    }
+    if (Size == 0) return Error::success();
+
+    stats.add("new_text_bytes", Size);
+    stats.add("itlb_entries_4k", Pages.size());
+    stats.add("itlb_entries_2m", HugePages.size());
+    log << "New code segments: " << Size << " bytes, " << Pages.size() << " iTLB entries with 4KB pages, "
+        << HugePages.size() << " with 2MB pages\n";
+    return Error::success();
+}
+
+// Highest GLIBC_x.y version of libc.so.6 the binary requires, empty if none.
+// GLIBC_ABI_DT_RELR counts as 2.36, which introduced it.
+string get_required_glibc(const CrisprElf &Binary) {
+    StringRef Strings = Binary.getDynamicStringTable();
+    auto get_string = [Strings](uint64_t Offset) {
+        return Offset < Strings.size() ? StringRef(Strings.data() + Offset) : StringRef();
+    };
+
+    string highest;
+    for (auto const &Need : Binary.getVersionNeeds()) {
+        if (get_string(Need.Need.vn_file) != "libc.so.6") continue;
+        for (auto const &Aux : Need.Auxs) {
+            StringRef Name = get_string(Aux.vna_name);
+            string version = Name == "GLIBC_ABI_DT_RELR" ? "2.36" : "";
+            if (Name.consume_front("GLIBC_") && !Name.empty() && isDigit(Name.front())) version = Name.str();
+            if (!version.empty() && (highest.empty() || strverscmp(version.c_str(), highest.c_str()) > 0)) {
+                highest = version;
+            }
+        }
+    }
+    return highest;
+}
+
+// Whether the glibc the output binary runs with processes DT_RELR, which it
+// does since 2.36: the one given with --target-glibc, else the one the input
+// binary requires at least. An older glibc refuses to load the packed
+// binaries, so the relocations are left unpacked, with a warning since they
+// were asked for.
+Expected<bool> target_supports_relr(const string &input_binary_path, const string &target_glibc) {
+    string version = target_glibc;
+    if (version.empty()) {
+        auto Input = CrisprElf::open(input_binary_path);
+        if (!Input) return patch_error("Could not parse the input binary", Input.takeError());
+        version = get_required_glibc(**Input);
+    }
+    if (!version.empty() && strverscmp(version.c_str(), "2.36") >= 0) return true;
+
+    string reason = !target_glibc.empty() ? "glibc " + target_glibc + " does not process DT_RELR"
+                  : version.empty() ? input_binary_path + " requires no version of glibc"
+                  : input_binary_path + " only requires glibc " + version + ", which may not process DT_RELR";
+    // A single write, jobs of a batch may warn concurrently
+    errs() << "warning: " + reason + ", the relative relocations are not packed"
+              + (target_glibc.empty() ? " (set the glibc it runs with with --target-glibc)\n" : "\n");
+    return false;
+}
+
+// Writes the new functions over the old ones in a copy of the input binary.
+// The copy shares the extents of the input where the filesystem supports it,
+// and only the bytes of the new functions are written, so that the cost does
+// not depend on the size of the binary. With fill, the rest of the old
+// functions is filled with NOPs.
+Error patch_in_place(const string &input_binary_path,
+                     MemoryBufferRef linked,
+                     const string &output_binary_path,
+                     const std::map<string, uint64_t> &new_symbols,
+                     const CrisprSymbolTable &existing_symbols,
+                     bool fill,
+                     CrisprStats &stats,
+                     raw_ostream &log) {
+    auto Input = CrisprElf::open(input_binary_path);
+    if (!Input) return patch_error("Could not parse the input binary", Input.takeError());
+
+    auto Linked = CrisprElf::create(MemoryBuffer::getMemBuffer(linked, false));
+    if (!Linked) return patch_error("Could not parse the linked object", Linked.takeError());
+
+    // The sizes are only in the symbol table
+    auto LinkedObject = object::ObjectFile::createObjectFile(linked);
+    if (!LinkedObject) return patch_error("Could not open the linked object", LinkedObject.takeError());
+    std::map<string, uint64_t> Sizes;
+    for (auto const &S : (*LinkedObject)->symbols()) {
+        auto Name = S.getName();
+        if (!Name) return patch_error("Error while reading linked symbols", Name.takeError());
+        if (new_symbols.count(Name->str())) Sizes[Name->str()] = object::ELFSymbolRef(S).getSize();
+    }
+
+    // Nothing is written unless every function fits
+    struct Patch {
+        uint64_t Offset;
+        ArrayRef<uint8_t> Code;
+        uint64_t Padding;
+    };
+    vector<Patch> Patches;
+    for (auto const &NewSymbol : new_symbols) {
+        auto OldSymbol = existing_symbols.lookup(NewSymbol.first);
+        if (!OldSymbol) {
+            log << "Symbol " << NewSymbol.first << " not found in original binary\n";
+            continue;
+        }
+
+        uint64_t Size = Sizes[NewSymbol.first];
+        if (Size == 0) return patch_error("Size for new symbol " + NewSymbol.first + " is zero");
+        if (OldSymbol->Size < Size) {
+            return patch_error("New code for symbol " + NewSymbol.first + " is bigger than old code, can't patch in "
+                               "place (new: " + Twine(Size) + " bytes, old: " + Twine(OldSymbol->Size) + " bytes)");
+        }
+
+        auto Code = (*Linked)->readAddress(NewSymbol.second, Size);
+        if (!Code) return patch_error("Cannot read the new code of " + NewSymbol.first, Code.takeError());
+        auto Offset = (*Input)->virtualAddressToOffset(OldSymbol->Address);
+        if (!Offset) return patch_error("Cannot patch " + NewSymbol.first, Offset.takeError());
+        Patches.push_back({*Offset, *Code, fill ? OldSymbol->Size - Size : 0});
+    }
+
+    auto Output = CrisprOutputFile::createCopy(input_binary_path, output_binary_path);
+    if (!Output) return patch_error("Could not create the output binary", Output.takeError());
+
+    log << "Applying in place patches\n";
+    uint64_t Written = 0;
+    for (auto const &Patch : Patches) {
+        auto Err = (*Output)->write(Patch.Offset, Patch.Code);
+        if (!Err && Patch.Padding != 0) {
+            Err = (*Output)->write(Patch.Offset + Patch.Code.size(), string(Patch.Padding, '\x90'));
+        }
+        if (Err) return patch_error("Error while patching in place", std::move(Err));
+        Written += Patch.Code.size() + Patch.Padding;
+    }
+    stats.add("patched_in_place", Patches.size());
+    stats.add("patched_bytes", Written);
+    return Error::success();
+}
+
+// Optimization level and target CPU options, as in clang
+void parse_codegen_options(const InputParser &Parser, CrisprCompilerOptions &Options) {
+    const std::map<string, pair<unsigned, unsigned>> Levels = {
+            {"-O0", {0, 0}},
+            {"-O1", {1, 0}},
+            {"-O2", {2, 0}},
+            {"-O3", {3, 0}},
+            {"-Os", {2, 1}},
+            {"-Oz", {2, 2}},
+    };
+    for (auto const &Level : Levels) {
+        if (Parser.cmdOptionExists(Level.first)) {
+            Options.OptLevel = Level.second.first;
+            Options.SizeLevel = Level.second.second;
+        }
+    }
+
+    Options.CPU = Parser.getCmdOption("-mcpu", "generic");
+    Options.SampleProfile = Parser.getCmdOption("--profile");
+    Options.OrderFunctions = !Parser.cmdOptionExists("--no-order-functions");
+    Options.Features = split(Parser.getCmdOption("-mattr"), ",");
+
+    // Hot loops benefit from 16, 32 or 64 bytes, cold code should be packed
+    Options.FunctionAlignment = std::stoul(Parser.getCmdOption("--function-alignment", "0"));
+    Options.ColdFunctionAlignment = std::stoul(Parser.getCmdOption("--cold-function-alignment", "1"));
+    for (unsigned Alignment : {Options.FunctionAlignment, Options.ColdFunctionAlignment}) {
+        if (Alignment != 0 && !isPowerOf2_32(Alignment)) {
+            errs() << "Function alignments must be powers of two\n";
+            exit(1);
+        }
+    }
+}
+
+// Settings shared by all the binaries patched by a process
+struct PatchSettings {
+    // Where the JIT places the new code. When linking, the image base of the
+    // patch, unless it is planned from the segments of the input binary.
+    uint64_t CodeAddress;
+    bool PlanImageBase;
+    uint64_t DataAddress;
+    uint64_t RoDataAddress;
+    string StaticLibraries;
+    vector<string> Dylibs;
+    bool InPlace;
+    bool FillWithNops;
+    bool ReuseSpace;
+    bool Retarget;
+    bool Incremental;
+    // Aligns the new code segments to 2MB pages
+    bool HugePages;
+    // Packs the relative relocations of the output binary as DT_RELR, if
+    // the glibc it runs with processes them
+    bool PackRelocations;
+    // Version of that glibc, the one the input binary requires if empty
+    string TargetGlibc;
+    CrisprCompilerOptions CompilerOptions;
+};
+
+// A binary to patch
+struct PatchJob {
+    vector<string> ModulePaths;
+    string SymbolsPath;
+    string InputBinaryPath;
+    string OutputBinaryPath;
+    // Where the linked patch is written, if anywhere
+    string LinkTo;
+    string ExportTo;
+    // Where the intermediate objects are kept, nowhere if empty
+    string TempsDirectory;
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Writes the linked patch where it was asked for, and with the temporaries
+Error save_linked(const PatchJob &Job, MemoryBufferRef linked) {
+    if (!Job.LinkTo.empty()) {
+        if (auto Err = write_file(Job.LinkTo, linked.getBuffer())) return Err;
+    }
+    if (!Job.TempsDirectory.empty()) {
+        SmallString<128> path(Job.TempsDirectory);
+        sys::path::append(path, "linked.so");
+        return write_file(path.str().str(), linked.getBuffer());
+    }
+    return Error::success();
+}
+
+Error export_symbols(const string &path, const std::map<string, uint64_t> &symbols) {
+    ofstream exported_symbols_file(path);
+    if (!exported_symbols_file) return patch_error("Could not write " + path);
+    for (const auto &ExportedSymbol: symbols) {
+        string SymbolName = ExportedSymbol.first;
+        uint64_t SymbolAddress = ExportedSymbol.second;
+        exported_symbols_file << SymbolName << "," << SymbolAddress << "\n";
+    }
+    exported_symbols_file.close();
+    return Error::success();
+}
+
+// Identity of a file the patch depends on
+static string get_file_identity(const string &path) {
+    sys::fs::file_status Status;
+    if (path.empty() || sys::fs::status(path, Status)) return path;
+    return path + ":" + std::to_string(Status.getSize()) + ":"
+           + std::to_string(sys::toTimeT(Status.getLastModificationTime()));
+}
+
+// Everything besides the module which affects the code of the patch or
+// where it is placed. An incremental run is only possible if it did not
+// change since the previous one.
+string get_configuration(const PatchSettings &Settings, const PatchJob &Job) {
+    auto const &Options = Settings.CompilerOptions;
+    string Configuration;
+    raw_string_ostream OS(Configuration);
+    OS << "code=" << (Settings.PlanImageBase ? "auto" : utohexstr(Settings.CodeAddress)) << ";data=" << utohexstr(Settings.DataAddress)
+       << ";rodata=" << utohexstr(Settings.RoDataAddress)
+       << ";reuse=" << Settings.ReuseSpace << ";retarget=" << Settings.Retarget << ";huge=" << Settings.HugePages
+       << ";relr=" << Settings.PackRelocations << "," << Settings.TargetGlibc
+       << ";opt=" << Options.OptLevel << "," << Options.SizeLevel
+       << ";cpu=" << Options.CPU << ";features=" << join(Options.Features, ",")
+       << ";align=" << Options.FunctionAlignment << "," << Options.ColdFunctionAlignment
+       << ";order=" << Options.OrderFunctions
+       << ";symbols=" << get_file_identity(Job.SymbolsPath)
+       << ";profile=" << get_file_identity(Options.SampleProfile);
+    for (auto const &lib : split(Settings.StaticLibraries, ",")) OS << ";lib=" << get_file_identity(lib);
+    for (auto const &dylib : Settings.Dylibs) OS << ";dylib=" << get_file_identity(dylib);
+    return OS.str();
+}
+
+// Whether the range is mapped from the file, in an executable segment. The
+// section headers are not checked, they do not cover the merged segments.
+static bool is_mapped_code(const CrisprElf &Binary, uint64_t Address, uint64_t Size) {
+    for (auto const &Phdr : Binary.programHeaders()) {
+        if (Phdr.p_type != ELF::PT_LOAD || !(Phdr.p_flags & ELF::PF_X)) continue;
+        if (Address >= Phdr.p_vaddr && Address + Size <= Phdr.p_vaddr + Phdr.p_filesz) return true;
+    }
+    return false;
+}
+
+// Saves the manifest next to the output binary, with the unused ranges which
+// are still in executable segments after the merge (the slack at the end of
+// a segment is only mapped if something was placed there) and the identity
+// of the binary, which must be written before
+Error save_manifest(CrisprPatchManifest &Manifest,
+                    const string &output_binary_path,
+                    vector<CrisprFreeSpace::Range> free_ranges) {
+    auto Output = CrisprElf::open(output_binary_path);
+    if (!Output) return patch_error("Could not parse the output binary", Output.takeError());
+
+    Manifest.FreeRanges.clear();
+    for (auto const &Range : free_ranges) {
+        if (Range.Size != 0 && is_mapped_code(**Output, Range.Address, Range.Size)) {
+            Manifest.FreeRanges.push_back(Range);
+        }
+    }
+
+    if (auto Err = Manifest.setOutput(output_binary_path)) {
+        return patch_error("Error while saving the patch manifest", std::move(Err));
+    }
+    if (auto Err = Manifest.save(CrisprPatchManifest::getPath(output_binary_path))) {
+        return patch_error("Error while saving the patch manifest", std::move(Err));
+    }
+    return Error::success();
+}
+
+// Applies the functions of the module which changed since the previous run
+// to the binary it produced, as recorded in its manifest. They are compiled
+// alone, against the input binary and the rest of the previous patch, then
+// written over their previous version when they fit, or in the unused ranges
+// of the output binary otherwise, the previous version jumping to them.
+// Nothing else is linked or merged again.
+// Returns false, without touching the output binary, when the binary has to
+// be patched from scratch.
+Expected<bool> repatch_binary(const PatchSettings &Settings,
+                              const PatchJob &Job,
+                              ThreadSafeModule &M,
+                              CrisprPatchManifest &Current,
+                              CrisprStats &stats,
+                              raw_ostream &log) {
+    bool verbose = Settings.CompilerOptions.LogLevel == CrisprLogLevel::Verbose;
+    auto fall_back = [&log](const Twine &Reason) {
+        log << "Patching from scratch: " << Reason << "\n";
+        return false;
+    };
+
+    string manifest_path = CrisprPatchManifest::getPath(Job.OutputBinaryPath);
+    if (!sys::fs::exists(manifest_path) || !sys::fs::exists(Job.OutputBinaryPath)) {
+        return fall_back("no previous patch of " + Job.OutputBinaryPath);
+    }
+    auto Loaded = CrisprPatchManifest::load(manifest_path);
+    if (!Loaded) return fall_back(toString(Loaded.takeError()));
+    // Owns the names of the previous symbols, which are added to the tables
+    CrisprPatchManifest &Previous = *Loaded;
+
+    // The manifest only describes the binary as the previous run left it
+    if (!Previous.isOutputUnchanged(Job.OutputBinaryPath)) {
+        return fall_back(Job.OutputBinaryPath + " changed since it was patched");
+    }
+
+    string Reason;
+    if (!Current.isCompatible(Previous, Reason)) return fall_back(Reason);
+
+    std::set<string> Changed;
+    for (auto const &Function : Current.FunctionHashes) {
+        auto Old = Previous.FunctionHashes.find(Function.first);
+        if (Old == Previous.FunctionHashes.end() || Old->second != Function.second) Changed.insert(Function.first);
+    }
+    for (auto const &Function : Previous.FunctionHashes) {
+        // Its original version would have to be restored
+        if (!Current.FunctionHashes.count(Function.first)) return fall_back(Function.first + " was removed");
+    }
+    stats.add("changed_functions", Changed.size());
+
+    Current.Sections = Previous.Sections;
+    Current.Symbols = Previous.Symbols;
+    Current.FreeRanges = Previous.FreeRanges;
+    Current.Undetoured = Previous.Undetoured;
+    auto export_functions = [&]() -> Error {
+        if (Job.ExportTo.empty()) return Error::success();
+        std::map<string, uint64_t> Exported;
+        for (auto const &Function : Current.FunctionHashes) {
+            auto Symbol = Current.Symbols.find(Function.first);
+            if (Symbol != Current.Symbols.end()) Exported[Function.first] = Symbol->second.Address;
+        }
+        return export_symbols(Job.ExportTo, Exported);
+    };
+    if (Changed.empty()) {
+        log << "No function changed since the previous patch of " << Job.OutputBinaryPath << "\n";
+        if (auto Err = export_functions()) return std::move(Err);
+        return true;
+    }
+    log << Changed.size() << " of " << Current.FunctionHashes.size() << " functions changed\n";
+
+    // The function a section of the patch belongs to, if it is one of the
+    // changed ones. The sections of local functions can be shared with
+    // unchanged code, and are never overwritten.
+    auto get_changed_function = [&Changed](StringRef Section) -> StringRef {
+        if (!Section.consume_front(".funcs.")) return "";
+        if (Changed.count(Section.str())) return Section;
+        if (Section.consume_back(".cold") && Changed.count(Section.str())) return Section;
+        return "";
+    };
+
+    // Only the changed functions are defined, along with the local functions
+    // and the constants they use. Everything else is resolved to the previous
+    // patch: the unchanged functions, which stay where they are, and the
+    // globals which must keep their address.
+    unique_ptr<Module> Partial = CloneModule(*M.getModule());
+    if (!Partial->alias_empty() || !Partial->ifunc_empty()) return fall_back("the patch has aliases");
+    for (auto const *Name : {"llvm.global_ctors", "llvm.global_dtors"}) {
+        if (auto *GV = Partial->getNamedGlobal(Name)) GV->eraseFromParent();
+    }
+    for (auto &F : *Partial) {
+        if (F.isDeclaration() || F.hasLocalLinkage() || Changed.count(F.getName().str())) continue;
+        F.deleteBody();
+        F.setComdat(nullptr);
+    }
+    for (auto &GV : Partial->globals()) {
+        if (GV.isDeclaration() || GV.getName().startswith("llvm.")) continue;
+        if (!CrisprPatchManifest::hasFixedAddress(GV)) continue;
+        GV.setInitializer(nullptr);
+        GV.setLinkage(GlobalValue::ExternalLinkage);
+        GV.setComdat(nullptr);
+    }
+    // Referenced directly rather than through the GOT, which would need
+    // dynamic relocations
+    for (auto &GO : Partial->global_objects()) {
+        if (GO.isDeclaration() && !GO.getName().startswith("llvm.")) GO.setDSOLocal(true);
+    }
+    if (verifyModule(*Partial, nullptr)) return fall_back("the changed functions cannot be compiled alone");
+
+    // Imported functions are called through the PLT of the input binary, and
+    // imported variables loaded from its GOT
+    unique_ptr<CrisprSymbolTable> existing_symbols;
+    std::map<string, CrisprSymbolTable::Symbol> Original;
+    {
+        auto load_stage = stats.stage("load symbols");
+        auto Symbols = read_symbols(Job.InputBinaryPath, Job.SymbolsPath, true, log);
+        if (!Symbols) return Symbols.takeError();
+        existing_symbols = std::move(*Symbols);
+        for (auto const &Name : Changed) {
+            if (auto *Symbol = existing_symbols->lookup(Name)) Original[Name] = *Symbol;
+        }
+        for (auto const &Symbol : Previous.Symbols) {
+            if (!Changed.count(Symbol.first)) {
+                existing_symbols->add(Symbol.first, Symbol.second.Address, Symbol.second.Size);
+            }
+        }
+        bind_imported_variables(*Partial, *existing_symbols, stats, log);
+    }
+
+    const string TargetTriple = "x86_64-unknown-linux-gnu";
+    CrisprCompilerOptions CompilerOptions = Settings.CompilerOptions;
+    CompilerOptions.Log = &log;
+    CompilerOptions.Stats = &stats;
+    CompilerOptions.DumpDirectory = Job.TempsDirectory;
+    CrisprCompiler Recompiler(TargetTriple, Settings.CodeAddress, Settings.DataAddress, Settings.RoDataAddress,
+                              CompilerOptions);
+    if (auto Err = define_symbols(*existing_symbols, Recompiler)) return std::move(Err);
+
+    {
+        auto optimize_stage = stats.stage("optimize");
+        if (auto Err = Recompiler.addModule(ThreadSafeModule(std::move(Partial), M.getContext()))) {
+            return patch_error("Error while adding module", std::move(Err));
+        }
+    }
+    {
+        auto codegen_stage = stats.stage("codegen");
+        auto Symbols = lookup_new_symbols(Recompiler, verbose, log);
+        if (!Symbols) return Symbols.takeError();
+    }
+    // The dynamic symbols and relocations of the output are not updated
+    if (!Recompiler.UnresolvedImports.empty()) {
+        return fall_back(*Recompiler.UnresolvedImports.begin() + " would be imported from a library");
+    }
+
+    auto Output = CrisprElf::open(Job.OutputBinaryPath);
+    if (!Output) return patch_error("Could not parse the output binary", Output.takeError());
+
+    std::map<string, CrisprFreeSpace::Section> Sections;
+    std::map<string, uint64_t> section_starts;
+    std::map<uint64_t, uint64_t> Detours;
+    unsigned InPlace = 0;
+    std::unique_ptr<MemoryBuffer> LinkedBuffer;
+    {
+        auto link_stage = stats.stage("link");
+        // Above everything in the output binary, lld anchors what was not
+        // placed (the dynamic symbols...) there
+        uint64_t image_base = 0;
+        for (auto const &Phdr : (*Output)->programHeaders()) {
+            if (Phdr.p_type == ELF::PT_LOAD) image_base = std::max<uint64_t>(image_base, Phdr.p_vaddr + Phdr.p_memsz);
+        }
+        image_base = alignTo(image_base, PageSize);
+
+        {
+            // Sections which fit in the slot of their previous version stay
+            // there, the others go in the unused ranges of the output binary.
+            // The slots they leave can be reused, except for the start of
+            // the functions, which becomes a detour.
+            auto layout_stage = stats.stage("plan layout");
+            auto Collected = collectSections(Recompiler, true);
+            if (!Collected) return Collected.takeError();
+            Sections = std::move(*Collected);
+            CrisprFreeSpace FreeSpace(**Output, image_base);
+            for (auto const &Range : Previous.FreeRanges) FreeSpace.addRange(Range.Address, Range.Size);
+
+            vector<CrisprFreeSpace::Section> ToPack;
+            for (auto const &Section : Sections) {
+                auto Old = Previous.Sections.find(Section.first);
+                if (!get_changed_function(Section.first).empty() && Old != Previous.Sections.end()
+                    && Section.second.Size <= Old->second.Capacity
+                    && Old->second.Address % Section.second.Alignment == 0) {
+                    section_starts[Section.first] = Old->second.Address;
+                    InPlace++;
+                } else if (Section.second.Size != 0) {
+                    ToPack.push_back(Section.second);
+                }
+            }
+            for (auto const &Old : Previous.Sections) {
+                StringRef Function = get_changed_function(Old.first);
+                if (Function.empty()) continue;
+                Current.Sections.erase(Old.first);
+                if (section_starts.count(Old.first)) continue;
+                uint64_t Kept = Old.first == ".funcs." + Function.str() ? JmpAbsoluteSize : 0;
+                if (Old.second.Capacity > Kept) {
+                    FreeSpace.addRange(Old.second.Address + Kept, Old.second.Capacity - Kept);
+                }
+            }
+
+            auto Packed = FreeSpace.pack(ToPack);
+            if (Packed.size() != ToPack.size()) return fall_back("the changed functions do not fit in the binary");
+            section_starts.insert(Packed.begin(), Packed.end());
+            // Rodata copied by the previous incremental runs is not reclaimed
+            Current.FreeRanges = FreeSpace.getRanges();
+            for (auto const &Start : section_starts) {
+                if (Start.first == ".rodata") continue;
+                auto Old = Previous.Sections.find(Start.first);
+                uint64_t Size = Sections[Start.first].Size;
+                bool Kept = Old != Previous.Sections.end() && Old->second.Address == Start.second;
+                Current.Sections[Start.first] = {Start.second, Size, Kept ? Old->second.Capacity : Size};
+            }
+
+            // The previous version of the functions which moved and their
+            // original version jump to the new one. The detours must fit
+            // where the previous ones were.
+            for (auto const &Name : Changed) {
+                auto Start = section_starts.find(".funcs." + Name);
+                auto Input = Original.find(Name);
+                if (Start == section_starts.end() || Input == Original.end()) {
+                    return fall_back(Name + " cannot be located");
+                }
+                uint64_t NewAddress = Start->second;
+                uint64_t InputAddress = Input->second.Address;
+                // Only its callers were retargeted, which would have to be
+                // found again
+                if (Previous.Undetoured.count(Name)) return fall_back(Name + " has no detour in the binary");
+
+                if (!Previous.FunctionHashes.count(Name)) {
+                    if (Input->second.Size != 0 && getDetourSize(InputAddress, NewAddress) > Input->second.Size) {
+                        return fall_back("the detour of " + Name + " does not fit");
+                    }
+                    Detours[InputAddress] = NewAddress;
+                    continue;
+                }
+
+                auto OldSymbol = Previous.Symbols.find(Name);
+                auto OldSection = Previous.Sections.find(".funcs." + Name);
+                if (OldSymbol == Previous.Symbols.end() || OldSection == Previous.Sections.end()) {
+                    return fall_back("the previous version of " + Name + " cannot be located");
+                }
+                uint64_t OldAddress = OldSymbol->second.Address;
+                if (OldAddress == NewAddress) continue;
+                if (getDetourSize(OldAddress, NewAddress) > OldSection->second.Capacity) {
+                    return fall_back("the detour of " + Name + " does not fit");
+                }
+                Detours[OldAddress] = NewAddress;
+
+                if (InputAddress == OldAddress) continue;
+                // The original function may host new code past its detour
+                uint64_t InputDetourSize = getDetourSize(InputAddress, NewAddress);
+                if (InputDetourSize > getDetourSize(InputAddress, OldAddress)
+                    || (Input->second.Size != 0 && InputDetourSize > Input->second.Size)) {
+                    return fall_back("the detour of " + Name + " does not fit");
+                }
+                Detours[InputAddress] = NewAddress;
+            }
+        }
+
+        auto Linked = linkNewCode(Recompiler, image_base, {}, *existing_symbols, section_starts, true);
+        if (!Linked) return Linked.takeError();
+        LinkedBuffer = std::move(*Linked);
+        if (auto Err = save_linked(Job, LinkedBuffer->getMemBufferRef())) return std::move(Err);
+    }
+
+    auto apply_stage = stats.stage("apply");
+    auto Linked = CrisprElf::create(MemoryBuffer::getMemBuffer(LinkedBuffer->getMemBufferRef(), false));
+    if (!Linked) return patch_error("Could not parse the linked object", Linked.takeError());
+    if (!(*Linked)->getDynamicRelocations().empty() || !(*Linked)->getPltRelocations().empty()) {
+        return fall_back("the changed functions need dynamic relocations");
+    }
+
+    CrisprPatchManifest LinkedSymbols;
+    if (auto Err = LinkedSymbols.addLinked(LinkedBuffer->getMemBufferRef())) {
+        return patch_error("Error while reading the linked symbols", std::move(Err));
+    }
+    for (auto const &Name : Changed) {
+        auto Symbol = LinkedSymbols.Symbols.find(Name);
+        if (Symbol == LinkedSymbols.Symbols.end() || Symbol->second.Address != section_starts[".funcs." + Name]) {
+            return fall_back(Name + " does not start its section");
+        }
+        Current.Symbols[Name] = Symbol->second;
+    }
+
+    // Everything the linker emitted must have been placed, besides what is
+    // only needed to load the linked object on its own
+    const std::set<StringRef> Unused = {".dynsym", ".dynstr", ".hash", ".gnu.hash", ".dynamic", ".eh_frame",
+                                        ".eh_frame_hdr"};
+    vector<pair<uint64_t, ArrayRef<uint8_t>>> Contents;
+    for (auto const &Section : (*Linked)->sections()) {
+        if (!(Section.sh_flags & ELF::SHF_ALLOC) || Section.sh_size == 0) continue;
+        StringRef Name = (*Linked)->getSectionName(Section);
+        if (Unused.count(Name)) continue;
+
+        auto Start = section_starts.find(Name.str());
+        if (Start == section_starts.end() || Start->second != Section.sh_addr || Section.sh_type == ELF::SHT_NOBITS
+            || Section.sh_size > Sections[Name.str()].Size) {
+            return fall_back(Name + " cannot be placed in the binary");
+        }
+        if (!is_mapped_code(**Output, Section.sh_addr, Section.sh_size)) {
+            return fall_back(Name + " would not be loaded");
+        }
+        auto Offset = (*Output)->virtualAddressToOffset(Section.sh_addr);
+        if (!Offset) return patch_error("Cannot place " + Name, Offset.takeError());
+        auto Bytes = ArrayRef<uint8_t>(reinterpret_cast<const uint8_t *>(
+                (*Linked)->getBuffer().data() + Section.sh_offset), Section.sh_size);
+        Contents.emplace_back(*Offset, Bytes);
+    }
+
+    // From here on the output binary is changed
+    auto File = CrisprOutputFile::openExisting(Job.OutputBinaryPath);
+    if (!File) return patch_error("Could not open the output binary", File.takeError());
+    for (auto const &Content : Contents) {
+        if (auto Err = (*File)->write(Content.first, Content.second)) {
+            return patch_error("Error while writing the changed functions", std::move(Err));
+        }
+    }
+    for (auto const &Detour : Detours) {
+        auto Offset = (*Output)->virtualAddressToOffset(Detour.first);
+        if (!Offset) {
+            return patch_error("Cannot write the detour at 0x" + utohexstr(Detour.first), Offset.takeError());
+        }
+        if (verbose) {
+            log << "Detour from " << format_hex(Detour.first, 10) << " to " << format_hex(Detour.second, 10) << "\n";
+        }
+        if (auto Err = (*File)->write(*Offset, getDetourPatch(Detour.first, Detour.second))) {
+            return patch_error("Error while writing detour", std::move(Err));
+        }
+    }
+    stats.add("detours", Detours.size());
+
+    log << "Re-patched " << Job.OutputBinaryPath << ": " << InPlace << " sections overwritten in place, "
+        << section_starts.size() - InPlace << " placed in unused ranges, " << Detours.size() << " detours\n";
+    if (auto Err = save_manifest(Current, Job.OutputBinaryPath, Current.FreeRanges)) return std::move(Err);
+    if (auto Err = export_functions()) return std::move(Err);
+    return true;
+}
+
+// Compiles the module, links it against the existing symbols and merges it
+// into the output binary. Everything is reported to log, and the stages are
+// timed in stats.
+Error patch_binary(const PatchSettings &Settings,
+                   const PatchJob &Job,
+                   ThreadSafeModule M,
+                   CrisprStats &stats,
+                   raw_ostream &log) {
+    auto patch_stage = stats.stage("patch");
+    bool verbose = Settings.CompilerOptions.LogLevel == CrisprLogLevel::Verbose;
+
+    // Only the functions which changed since the previous run are patched,
+    // if possible. Otherwise the manifest is saved for the next run.
+    Optional<CrisprPatchManifest> manifest;
+    if (Settings.Incremental && !Job.OutputBinaryPath.empty()) {
+        auto incremental_stage = stats.stage("incremental");
+        auto Created = CrisprPatchManifest::create(*M.getModule(), Job.InputBinaryPath,
+                                                   get_configuration(Settings, Job));
+        if (!Created) return patch_error("Error while hashing the module", Created.takeError());
+        manifest = std::move(*Created);
+        auto Repatched = repatch_binary(Settings, Job, M, *manifest, stats, log);
+        if (!Repatched) return Repatched.takeError();
+        if (*Repatched) return Error::success();
+    }
+
+    const string TargetTriple = "x86_64-unknown-linux-gnu";
+    CrisprCompilerOptions CompilerOptions = Settings.CompilerOptions;
+    CompilerOptions.Log = &log;
+    CompilerOptions.Stats = &stats;
+    CompilerOptions.DumpDirectory = Job.TempsDirectory;
+    CrisprCompiler CrisprCompiler(TargetTriple, Settings.CodeAddress, Settings.DataAddress, Settings.RoDataAddress,
+                                  CompilerOptions);
+
+    // Add new static libraries
+    if (auto Err = add_static_libraries(Settings.StaticLibraries, CrisprCompiler)) return Err;
+
+    // Add pre-existing symbols, from the input binary and provided by the user.
+    // The new code calls the imported functions through the PLT of the binary.
+    unique_ptr<CrisprSymbolTable> existing_symbols;
+    {
+        auto load_stage = stats.stage("load symbols");
+        auto Symbols = load_symbols(Job.InputBinaryPath, Job.SymbolsPath, CrisprCompiler, log);
+        if (!Symbols) return Symbols.takeError();
+        existing_symbols = std::move(*Symbols);
+        bind_imported_variables(*M.getModule(), *existing_symbols, stats, log);
+    }
+
+    // Add the module to be compiled, which optimizes it
+    {
+        auto optimize_stage = stats.stage("optimize");
+        if (auto Err = CrisprCompiler.addModule(std::move(M))) {
+            return patch_error("Error while adding module", std::move(Err));
+        }
+    }
+
+    // Lookup symbols to export
+    // This will trigger compilation of those symbols and their dependencies
+    std::shared_ptr<std::map<string, uint64_t>> exported_symbols;
+    {
+        auto codegen_stage = stats.stage("codegen");
+        auto Symbols = lookup_new_symbols(CrisprCompiler, verbose, log);
+        if (!Symbols) return Symbols.takeError();
+        exported_symbols = std::move(*Symbols);
+        stats.add("new_functions", exported_symbols->size());
+    }
+
+    // Link the new code against the existing symbols and the dynamic libraries.
+    // The linked object is only kept in memory, unless asked for.
+    vector<CrisprFreeSpace::Range> free_ranges;
+    std::unique_ptr<MemoryBuffer> linked;
+    uint64_t image_base = Settings.CodeAddress;
+    uint64_t page_size = Settings.HugePages ? HugePageSize : 0;
+    if (!Job.LinkTo.empty() || !Job.OutputBinaryPath.empty()) {
+        auto link_stage = stats.stage("link");
+        // main only allows auto with an input binary
+        if (Settings.PlanImageBase) {
+            auto Planned = plan_image_base(Job.InputBinaryPath, std::max(page_size, PageSize));
+            if (!Planned) return Planned.takeError();
+            image_base = *Planned;
+            log << "Placing the new segments at " << format_hex(image_base, 10) << "\n";
+        }
+
+        std::map<string, uint64_t> section_starts;
+        if (Settings.InPlace) {
+            // When patching in place the new functions overwrite the old ones
+            for (auto const &symbol : CrisprCompiler.NewFunctions) {
+                auto OldSymbol = existing_symbols->lookup(symbol);
+                if (OldSymbol) section_starts[".funcs." + symbol] = OldSymbol->Address;
+            }
+        } else if (!Job.OutputBinaryPath.empty() && Settings.ReuseSpace) {
+            auto layout_stage = stats.stage("plan layout");
+            auto Layout = planCodeLayout(Job.InputBinaryPath, CrisprCompiler, *existing_symbols,
+                                           image_base, free_ranges, log);
+            if (!Layout) return Layout.takeError();
+            section_starts = std::move(*Layout);
+        }
+
+        auto Linked = linkNewCode(CrisprCompiler, image_base, Settings.Dylibs, *existing_symbols, section_starts,
+                                    false, page_size);
+        if (!Linked) return Linked.takeError();
+        linked = std::move(*Linked);
+        if (auto Err = save_linked(Job, linked->getMemBufferRef())) return Err;
+        if (!Settings.InPlace && !Job.InputBinaryPath.empty()) {
+            if (auto Err = check_new_segments(Job.InputBinaryPath, linked->getMemBufferRef(), image_base)) return Err;
+        }
+        auto Symbols = lookupLinkedSymbols(linked->getMemBufferRef(), CrisprCompiler);
+        if (!Symbols) return Symbols.takeError();
+        exported_symbols = std::make_shared<std::map<string, uint64_t>>(std::move(*Symbols));
+        if (auto Err = report_hot_code(linked->getMemBufferRef(), CrisprCompiler.getHotSections(), stats, log)) {
+            return Err;
+        }
+        if (auto Err = report_new_text(linked->getMemBufferRef(), image_base, stats, log)) return Err;
+    } else {
+        if (auto Err = check_jit_segments(Job.InputBinaryPath, CrisprCompiler)) return Err;
+    }
+
+    // Merge the linked code into the binary and redirect the old functions,
+    // or overwrite the old functions when patching in place
+    if (!Job.OutputBinaryPath.empty()) {
+        auto merge_stage = stats.stage("merge");
+        // A manifest left by a previous run would describe another binary.
+        // It is saved again below when patching incrementally.
+        sys::fs::remove(CrisprPatchManifest::getPath(Job.OutputBinaryPath));
+        std::set<string> undetoured;
+        bool pack_relocations = false;
+        if (Settings.PackRelocations && !Settings.InPlace) {
+            auto Supported = target_supports_relr(Job.InputBinaryPath, Settings.TargetGlibc);
+            if (!Supported) return Supported.takeError();
+            pack_relocations = *Supported;
+        }
+        Error Err = Settings.InPlace
+                    ? patch_in_place(Job.InputBinaryPath, linked->getMemBufferRef(), Job.OutputBinaryPath,
+                                     *exported_symbols, *existing_symbols, Settings.FillWithNops, stats, log)
+                    : mergeIntoBinary(Job.InputBinaryPath, linked->getMemBufferRef(), Job.OutputBinaryPath,
+                                        *exported_symbols, *existing_symbols, Settings.Retarget,
+                                        std::max(page_size, PageSize),
+                                        pack_relocations, stats, verbose, log, &undetoured);
+        if (Err) return Err;
+        if (manifest) manifest->Undetoured = std::move(undetoured);
+    }
+
+    if (manifest) {
+        if (auto Err = manifest->addLinked(linked->getMemBufferRef())) {
+            return patch_error("Error while reading the linked symbols", std::move(Err));
+        }
+        if (auto Err = save_manifest(*manifest, Job.OutputBinaryPath, free_ranges)) return Err;
+    }
+
+    // Export symbols for the patcher
+    if (!Job.ExportTo.empty()) {
+        if (auto Err = export_symbols(Job.ExportTo, *exported_symbols)) return Err;
+    }
+
+    if (!Job.TempsDirectory.empty()) CrisprCompiler.dumpSegments(Job.TempsDirectory);
+    return Error::success();
+}
+
+// Patches a running process. The new code is compiled for space reserved in
+// the process and for the load address of its binary, then installed there
+// by CrisprLivePatch. Whatever fails once the space is reserved, the process
+// is left as it was.
+Error live_patch(const PatchSettings &Settings,
+                 const PatchJob &Job,
+                 pid_t pid,
+                 const string &rollback_path,
+                 CrisprStats &stats,
+                 raw_ostream &log) {
+    auto patch_stage = stats.stage("live patch");
+    bool verbose = Settings.CompilerOptions.LogLevel == CrisprLogLevel::Verbose;
+
+    // Still readable if the file was replaced since the process started
+    const string exe_path = "/proc/" + std::to_string(pid) + "/exe";
+    auto Binary = CrisprElf::open(exe_path);
+    if (!Binary) return patch_error("Could not parse the binary of the process", Binary.takeError());
+
+    // The threads are only stopped while the process is changed, not while
+    // the patch is compiled
+    unique_ptr<CrisprLivePatch> Patch;
+    {
+        auto reserve_stage = stats.stage("reserve");
+        auto Reserved = CrisprLivePatch::reserve(pid, **Binary, log);
+        if (!Reserved) return Reserved.takeError();
+        Patch = std::move(*Reserved);
+    }
+
+    Error Err = [&]() -> Error {
+        const string TargetTriple = "x86_64-unknown-linux-gnu";
+        CrisprCompilerOptions CompilerOptions = Settings.CompilerOptions;
+        CompilerOptions.Log = &log;
+        CompilerOptions.Stats = &stats;
+        CompilerOptions.DumpDirectory = Job.TempsDirectory;
+        uint64_t reserved = Patch->getAddress();
+        CrisprCompiler Recompiler(TargetTriple, reserved, reserved + LiveSegmentSpan, reserved + 2 * LiveSegmentSpan,
+                                  CompilerOptions);
+        if (auto Err = add_static_libraries(Settings.StaticLibraries, Recompiler)) return Err;
+
+        // The imported functions are called through the PLT of the binary
+        unique_ptr<CrisprSymbolTable> existing_symbols;
+        {
+            auto load_stage = stats.stage("load symbols");
+            auto Symbols = read_symbols(exe_path, Job.SymbolsPath, true, log);
+            if (!Symbols) return Symbols.takeError();
+            existing_symbols = std::move(*Symbols);
+            existing_symbols->rebase(Patch->getLoadBase());
+            if (auto Err = define_symbols(*existing_symbols, Recompiler)) return Err;
+        }
+
+        ThreadSafeModule M;
+        {
+            auto parse_stage = stats.stage("parse module");
+            auto Parsed = ParseModules(Job.ModulePaths, log);
+            if (!Parsed) return Parsed.takeError();
+            M = std::move(*Parsed);
+            bind_imported_variables(*M.getModule(), *existing_symbols, stats, log);
+        }
+        {
+            auto optimize_stage = stats.stage("optimize");
+            if (auto Err = Recompiler.addModule(std::move(M))) {
+                return patch_error("Error while adding module", std::move(Err));
+            }
+        }
+        std::shared_ptr<std::map<string, uint64_t>> new_symbols;
+        {
+            auto codegen_stage = stats.stage("codegen");
+            auto Symbols = lookup_new_symbols(Recompiler, verbose, log);
+            if (!Symbols) return Symbols.takeError();
+            new_symbols = std::move(*Symbols);
+            stats.add("new_functions", new_symbols->size());
+        }
+        if (!Recompiler.UnresolvedImports.empty()) {
+            return patch_error(*Recompiler.UnresolvedImports.begin()
+                               + " is neither in the binary nor in its PLT, a live patch cannot import it");
+        }
+        if (!Job.TempsDirectory.empty()) Recompiler.dumpSegments(Job.TempsDirectory);
+
+        auto install_stage = stats.stage("install");
+        if (auto Err = Patch->install(Recompiler, *new_symbols, *existing_symbols, rollback_path, log)) return Err;
+        stats.add("detours", Patch->getDetours().size());
+        return Error::success();
+    }();
+    if (Err) return Patch->abandon(std::move(Err));
+    return Error::success();
+}
+
+void write_stats_json(const string &path, json::Value stats) {
+    std::error_code EC;
+    raw_fd_ostream OS(path, EC, sys::fs::F_None);
+    if (EC) {
+        errs() << "Could not write the statistics to " << path << ": " << EC.message() << "\n";
         exit(1);
     }
+    OS << formatv("{0:2}", stats) << "\n";
 }
 
-std::shared_ptr<std::map<string, uint64_t>>
-lookup_new_symbols(CrisprCompiler &Recompiler) {
-    auto lookup_results = std::make_shared<std::map<string, uint64_t>>();
+// Patch modules parsed (and linked) once per process, by list of paths.
+// Every job loads its own copy from the bitcode, in a context of its own,
+// which is much faster than parsing the IR again.
+struct ParsedModules {
+    std::mutex Lock;
+    std::map<string, SmallVector<char, 0>> Bitcode;
+};
+
+Expected<ThreadSafeModule> load_module(ParsedModules &Modules,
+                                       const vector<string> &paths,
+                                       const CrisprCompilerOptions &Options,
+                                       raw_ostream &log) {
+    const string path = join(paths, ",");
+    const SmallVector<char, 0> *Bitcode;
+    {
+        std::lock_guard<std::mutex> Lock(Modules.Lock);
+        auto Parsed = Modules.Bitcode.find(path);
+        if (Parsed == Modules.Bitcode.end()) {
+            auto M = ParseModules(paths, log);
+            if (!M) return M.takeError();
+            if (!Options.SampleProfile.empty()) {
+                if (auto Err = check_sample_profile(Options.SampleProfile, *M->getModule(), log)) return std::move(Err);
+            }
 
-    for (auto const &symbol: Recompiler.NewFunctions) {
-        errs() << "Looking up " << symbol << "\n";
-        auto S = Recompiler.findSymbol(symbol);
-        if (!S) {
-            errs() << "Could not look up address of " << symbol
-                   << ": " << S.takeError() << "\n";
+            Parsed = Modules.Bitcode.emplace(path, SmallVector<char, 0>()).first;
+            raw_svector_ostream BitcodeStream(Parsed->second);
+            WriteBitcodeToFile(*M->getModule(), BitcodeStream);
+        }
+        Bitcode = &Parsed->second;
+    }
+
+    ThreadSafeContext Context(std::make_unique<LLVMContext>());
+    MemoryBufferRef Buffer(StringRef(Bitcode->data(), Bitcode->size()), path);
+    auto M = parseBitcodeFile(Buffer, *Context.getContext());
+    if (!M) return patch_error("Could not load module " + path, M.takeError());
+    return ThreadSafeModule(std::move(*M), std::move(Context));
+}
+
+// Patches the binaries listed in a manifest, one JSON object per line:
+//   {"input": "bin/ls", "output": "out/ls", "symbols": "ls.csv"}
+// "module" and "symbols" default to the command line options, "export_to"
+// and "link_to" are optional. The temporaries of a job are kept in job_<line>
+// under the temporaries directory, if any. Jobs are started as the manifest is
+// read, so it can be streamed on the standard input ("-"), and run on
+// worker threads, each compiling on a single thread. The modules, the LLVM
+// targets and the compilation cache are shared, every job has its own
+// ExecutionSession. A failing job, or an invalid line of the manifest, is
+// reported and the other jobs go on. Returns how many failed.
+// Every job is timed on its own, the statistics are written to
+// stats_json_path as {"jobs": [{"input", "output", "stats", "error"}...]}.
+unsigned run_batch(const string &manifest_path,
+               const PatchSettings &BatchSettings,
+               const PatchJob &Defaults,
+               unsigned workers,
+               bool time_report,
+               const string &stats_json_path) {
+    std::ifstream manifest_file;
+    if (manifest_path != "-") {
+        manifest_file.open(manifest_path);
+        if (!manifest_file) {
+            errs() << "Could not open the batch manifest " << manifest_path << "\n";
             exit(1);
         }
+    }
+    std::istream &manifest = manifest_path == "-" ? std::cin : manifest_file;
+
+    PatchSettings Settings = BatchSettings;
+    Settings.CompilerOptions.Jobs = 1;
+
+    ParsedModules Modules;
+    std::mutex OutputLock;
+    json::Array JobStats;
+    unsigned patched = 0;
+    unsigned failed = 0;
+    auto fail = [&OutputLock, &failed](const Twine &message) {
+        std::lock_guard<std::mutex> Lock(OutputLock);
+        errs() << message << "\n";
+        failed++;
+    };
+    bool quiet = Settings.CompilerOptions.LogLevel == CrisprLogLevel::Quiet;
+    raw_ostream &out = quiet ? nulls() : outs();
+    ThreadPool Workers(workers);
+    auto start = std::chrono::steady_clock::now();
+
+    string line;
+    unsigned line_number = 0;
+    unsigned submitted = 0;
+    while (std::getline(manifest, line)) {
+        line_number++;
+        if (StringRef(line).trim().empty()) continue;
+
+        auto Value = json::parse(line);
+        if (!Value) {
+            fail("Invalid job at line " + Twine(line_number) + " of the manifest: " + toString(Value.takeError()));
+            continue;
+        }
+        auto *Object = Value->getAsObject();
+        if (!Object) {
+            fail("Job at line " + Twine(line_number) + " of the manifest is not an object");
+            continue;
+        }
+        auto get = [Object](StringRef Key, const string &Default) {
+            auto String = Object->getString(Key);
+            return String ? String->str() : Default;
+        };
 
-        JITTargetAddress Addr = cantFail(S->getAddress());
-        outs() << "Looked up address of " << symbol << ": " << format_hex(reinterpret_cast<uint64_t>(Addr), 10) << "\n";
-        (*lookup_results)[symbol] = Addr;
+        PatchJob Job;
+        Job.InputBinaryPath = get("input", "");
+        Job.OutputBinaryPath = get("output", "");
+        // One module or a list of modules linked together
+        Job.ModulePaths = Defaults.ModulePaths;
+        bool valid_modules = true;
+        if (auto *Modules = Object->getArray("module")) {
+            Job.ModulePaths.clear();
+            for (auto const &Module : *Modules) {
+                auto Path = Module.getAsString();
+                if (Path) Job.ModulePaths.push_back(Path->str());
+                valid_modules &= Path.hasValue();
+            }
+        } else if (auto Module = Object->getString("module")) {
+            Job.ModulePaths = {Module->str()};
+        }
+        if (!valid_modules) {
+            fail("Job at line " + Twine(line_number) + " of the manifest has an invalid module list");
+            continue;
+        }
+        Job.SymbolsPath = get("symbols", Defaults.SymbolsPath);
+        // Every job exports its own symbols, if any
+        Job.ExportTo = get("export_to", "");
+        Job.LinkTo = get("link_to", "");
+        if (Job.InputBinaryPath.empty() || Job.OutputBinaryPath.empty()) {
+            fail("Job at line " + Twine(line_number) + " of the manifest needs an input and an output");
+            continue;
+        }
+        if (!Defaults.TempsDirectory.empty()) {
+            SmallString<128> Directory(Defaults.TempsDirectory);
+            sys::path::append(Directory, "job_" + std::to_string(line_number));
+            if (auto EC = sys::fs::create_directory(Directory)) {
+                fail("Could not create " + Directory + ": " + EC.message());
+                continue;
+            }
+            Job.TempsDirectory = Directory.str().str();
+        }
+
+        submitted++;
+        Workers.async([&Settings, &Modules, &OutputLock, &JobStats, &patched, &failed, &out, quiet, time_report,
+                       Job]() {
+            auto job_start = std::chrono::steady_clock::now();
+            string Log;
+            raw_string_ostream job_log(Log);
+            raw_ostream &log = quiet ? nulls() : job_log;
+
+            CrisprStats stats;
+            Error Err = [&]() -> Error {
+                ThreadSafeModule M;
+                {
+                    auto load_stage = stats.stage("load module");
+                    auto Loaded = load_module(Modules, Job.ModulePaths, Settings.CompilerOptions, log);
+                    if (!Loaded) return Loaded.takeError();
+                    M = std::move(*Loaded);
+                }
+                return patch_binary(Settings, Job, std::move(M), stats, log);
+            }();
+            string error = Err ? toString(std::move(Err)) : "";
+
+            std::lock_guard<std::mutex> Lock(OutputLock);
+            out << job_log.str();
+            if (!error.empty()) {
+                errs() << "Could not patch " << Job.InputBinaryPath << " into " << Job.OutputBinaryPath << ": "
+                       << error << "\n";
+                failed++;
+            } else {
+                patched++;
+                out << "Patched " << Job.InputBinaryPath << " into " << Job.OutputBinaryPath << ": "
+                    << format("compile %.1f ms, link %.1f ms, merge %.1f ms, total %.1f ms\n",
+                              stats.getWallTime("optimize") + stats.getWallTime("codegen"),
+                              stats.getWallTime("link"), stats.getWallTime("merge"), elapsed_ms(job_start));
+            }
+            // On stderr as in single mode, stdout only has the progress
+            if (time_report) stats.printReport(errs());
+            outs().flush();
+            json::Object Stats{
+                    {"input",  Job.InputBinaryPath},
+                    {"output", Job.OutputBinaryPath},
+                    {"stats",  stats.toJSON()},
+            };
+            if (!error.empty()) Stats["error"] = error;
+            JobStats.push_back(std::move(Stats));
+        });
     }
-    return lookup_results;
+    Workers.wait();
+
+    out << "Patched " << patched << " of " << submitted << " binaries in "
+        << format("%.1f ms\n", elapsed_ms(start));
+    if (failed != 0) errs() << failed << " jobs failed\n";
+    if (!stats_json_path.empty()) write_stats_json(stats_json_path, json::Object{{"jobs", std::move(JobStats)}});
+    return failed;
 }
 
 int main(int argc, char **argv) {
     InputParser Parser(argc, argv);
-    string module_path = Parser.getCmdOption("-m");
-    uint64_t code_vaddr = std::stoull(Parser.getCmdOption("--map-code-to", "a000"), nullptr, 16);
-    uint64_t rodata_vaddr = std::stoull(Parser.getCmdOption("--map-rodata-to", "b000"), nullptr, 16);
-    uint64_t data_vaddr = std::stoull(Parser.getCmdOption("--map-data-to", "c000"), nullptr, 16);
+    bool live = argc > 1 && StringRef(argv[1]) == "live";
+    vector<string> module_paths = Parser.getCmdOptions("-m");
+    string code_address = Parser.getCmdOption("--map-code-to", "auto");
+    string data_address = Parser.getCmdOption("--map-data-to");
+    string rodata_address = Parser.getCmdOption("--map-rodata-to");
     string symbols_file_path = Parser.getCmdOption("--symbols");
     string static_libs_file_paths = Parser.getCmdOption("--static-link-libs");
     string export_new_symbols_to = Parser.getCmdOption("--export-to");
+    string link_to = Parser.getCmdOption("--link-to");
+    vector<string> dylib_paths = Parser.getCmdOptions("--dylib");
+    bool inplace = Parser.cmdOptionExists("--inplace");
+    bool fill_with_nops = !Parser.cmdOptionExists("--no-fill");
+    // The unwind information of the input binary still describes the old code
+    // in the reused ranges, so it is opt-in
+    bool reuse_space = Parser.cmdOptionExists("--reuse-space");
+    bool retarget = Parser.cmdOptionExists("--retarget");
+    bool incremental = Parser.cmdOptionExists("--incremental");
+    bool huge_pages = Parser.cmdOptionExists("--huge-pages");
+    bool pack_relocations = Parser.cmdOptionExists("--pack-relocations");
+    string target_glibc = Parser.getCmdOption("--target-glibc");
+    string input_binary_path = Parser.getCmdOption("--input-binary");
+    string output_binary_path = Parser.getCmdOption("--output-binary");
+    string batch_manifest_path = Parser.getCmdOption("--batch");
+    unsigned jobs = std::stoul(Parser.getCmdOption("--jobs", "1"));
+    if (jobs == 0) jobs = llvm::hardware_concurrency();
+    string cache_dir = Parser.getCmdOption("--cache-dir");
+    string cache_policy = Parser.getCmdOption("--cache-policy", "prune_interval=0s:cache_size_bytes=1g");
+    string log_level_name = Parser.getCmdOption("--log-level", "info");
+    bool time_report = Parser.cmdOptionExists("--time-report");
+    string stats_json_path = Parser.getCmdOption("--stats-json");
+    bool save_temps = Parser.cmdOptionExists("--save-temps");
+    pid_t pid = std::stoi(Parser.getCmdOption("--pid", "0"));
+    bool rollback = Parser.cmdOptionExists("--rollback");
+    string rollback_path = Parser.getCmdOption("--rollback-file", "crispr-live-" + std::to_string(pid) + ".json");
+
+    const std::map<string, CrisprLogLevel> LogLevels = {
+            {"quiet",   CrisprLogLevel::Quiet},
+            {"info",    CrisprLogLevel::Info},
+            {"verbose", CrisprLogLevel::Verbose},
+    };
+    if (!LogLevels.count(log_level_name)) {
+        errs() << "--log-level must be quiet, info or verbose\n";
+        exit(1);
+    }
+    CrisprLogLevel log_level = LogLevels.at(log_level_name);
+    raw_ostream &log = log_level == CrisprLogLevel::Quiet ? nulls() : outs();
+
+    if (live) {
+        if (pid <= 0) {
+            errs() << "crispr live requires --pid\n";
+            exit(1);
+        }
+        if (!rollback && module_paths.empty()) {
+            errs() << "crispr live requires -m, or --rollback\n";
+            exit(1);
+        }
+    } else if (!output_binary_path.empty()) {
+        if (input_binary_path.empty()) {
+            errs() << "--output-binary requires --input-binary\n";
+            exit(1);
+        }
+    } else if (incremental && batch_manifest_path.empty()) {
+        errs() << "--incremental requires --output-binary\n";
+        exit(1);
+    }
+    // The planned image base only exists once the patch is linked, after the
+    // segments of the input binary
+    bool auto_code_address = code_address == "auto";
+    bool linked = !output_binary_path.empty() || !link_to.empty() || !batch_manifest_path.empty();
+    if (!live && auto_code_address && (!linked || (input_binary_path.empty() && batch_manifest_path.empty()))) {
+        errs() << "--map-code-to auto places the patch after the segments of --input-binary when linking it "
+                  "(--output-binary or --link-to), give the address of the new code otherwise\n";
+        exit(1);
+    }
+    if (!batch_manifest_path.empty() && !export_new_symbols_to.empty()) {
+        errs() << "--export-to would be written by every job of the batch, set export_to per job in the manifest\n";
+        exit(1);
+    }
 
     // Initialize the JIT
     InitTarget();
 
-    const string TargetTriple = "x86_64-unknown-linux-gnu";
-    CrisprCompiler CrisprCompiler(TargetTriple, code_vaddr, data_vaddr, rodata_vaddr);
+    // Objects compiled by previous runs, possibly for other binaries
+    unique_ptr<CrisprObjectCache> object_cache;
+    if (!cache_dir.empty()) {
+        auto Cache = CrisprObjectCache::create(cache_dir);
+        if (!Cache) {
+            errs() << "Error while opening the compilation cache: " << Cache.takeError() << "\n";
+            exit(1);
+        }
+        object_cache = std::move(*Cache);
+    }
 
-    // Add new static libraries
-    add_static_libraries(static_libs_file_paths, CrisprCompiler);
+    // The linker places the data and read-only data segments after the code
+    // one, the addresses only matter when the JIT output is used as is. The
+    // segments then default to spans following the code, as in live mode.
+    uint64_t code_vaddr = auto_code_address ? CrisprAddressPlanner::LowestAddress
+                                            : std::stoull(code_address, nullptr, 16);
+    uint64_t data_vaddr = data_address.empty() ? code_vaddr + LiveSegmentSpan : std::stoull(data_address, nullptr, 16);
+    uint64_t rodata_vaddr = rodata_address.empty() ? code_vaddr + 2 * LiveSegmentSpan
+                                                   : std::stoull(rodata_address, nullptr, 16);
 
-    // Get the module to be compiled
-    ThreadSafeModule M = ParseModule(module_path);
+    PatchSettings Settings;
+    Settings.CodeAddress = code_vaddr;
+    Settings.PlanImageBase = auto_code_address;
+    Settings.DataAddress = data_vaddr;
+    Settings.RoDataAddress = rodata_vaddr;
+    Settings.StaticLibraries = static_libs_file_paths;
+    Settings.Dylibs = dylib_paths;
+    Settings.InPlace = inplace;
+    Settings.FillWithNops = fill_with_nops;
+    Settings.ReuseSpace = reuse_space;
+    Settings.Retarget = retarget;
+    Settings.HugePages = huge_pages;
+    Settings.PackRelocations = pack_relocations;
+    Settings.TargetGlibc = target_glibc;
+    // Patching in place has its own layout, which the manifest does not describe
+    Settings.Incremental = incremental && !inplace;
+    parse_codegen_options(Parser, Settings.CompilerOptions);
+    Settings.CompilerOptions.Jobs = jobs;
+    // The new functions start exactly where the old ones did
+    if (inplace) Settings.CompilerOptions.FunctionAlignment = Settings.CompilerOptions.ColdFunctionAlignment = 1;
+    Settings.CompilerOptions.ObjectCache = object_cache.get();
+    Settings.CompilerOptions.LogLevel = log_level;
 
-    // TODO: read the symbols from the target binary
-    // Add pre-existing symbols provided by the user
-    AddSymbolsFromCSV(symbols_file_path, CrisprCompiler);
+    PatchJob Job;
+    Job.ModulePaths = module_paths;
+    Job.SymbolsPath = symbols_file_path;
+    Job.InputBinaryPath = input_binary_path;
+    Job.OutputBinaryPath = output_binary_path;
+    Job.LinkTo = link_to;
+    Job.ExportTo = export_new_symbols_to;
 
-    // Add the module to be compiled
-    Error Err = CrisprCompiler.addModule(std::move(M));
-    if (Err) {
-        errs() << "Error while adding module: " << Err;
-        exit(1);
+    // The objects, the segments and the linked patch of every run are kept in
+    // a directory of their own
+    if (save_temps) {
+        SmallString<128> temps_directory;
+        if (auto EC = sys::fs::createUniqueDirectory("crispr-temps", temps_directory)) {
+            errs() << "Could not create the temporaries directory: " << EC.message() << "\n";
+            exit(1);
+        }
+        Job.TempsDirectory = temps_directory.str().str();
+        log << "Saving the temporaries in " << Job.TempsDirectory << "\n";
     }
 
-    // Lookup symbols to export
-    // This will trigger compilation of those symbols and their dependencies
-    auto exported_symbols = lookup_new_symbols(CrisprCompiler);
+    CrisprStats stats;
+    unsigned failed_jobs = 0;
+    if (live) {
+        if (rollback) {
+            exit_on_error(CrisprLivePatch::rollBack(pid, rollback_path, log));
+        } else {
+            exit_on_error(live_patch(Settings, Job, pid, rollback_path, stats, log));
+        }
+    } else if (!batch_manifest_path.empty()) {
+        failed_jobs = run_batch(batch_manifest_path, Settings, Job, jobs, time_report, stats_json_path);
+    } else {
+        // Get the module to be compiled
+        ThreadSafeModule M;
+        {
+            auto parse_stage = stats.stage("parse module");
+            M = exit_on_error(ParseModules(module_paths, log));
+            if (!Settings.CompilerOptions.SampleProfile.empty()) {
+                exit_on_error(check_sample_profile(Settings.CompilerOptions.SampleProfile, *M.getModule(), log));
+            }
+        }
+        exit_on_error(patch_binary(Settings, Job, std::move(M), stats, log));
+    }
 
-    // Export symbols for the patcher
-    ofstream exported_symbols_file(export_new_symbols_to);
-    for (const auto &ExportedSymbol: *exported_symbols) {
-        string SymbolName = ExportedSymbol.first;
-        uint64_t SymbolAddress = ExportedSymbol.second;
-        exported_symbols_file << SymbolName << "," << SymbolAddress << "\n";
+    if (object_cache) {
+        stats.add("cache_hits", object_cache->getHits());
+        stats.add("cache_misses", object_cache->getMisses());
+        log << "Compilation cache: " << object_cache->getHits() << " hits, "
+            << object_cache->getMisses() << " misses\n";
+        if (auto Err = object_cache->prune(cache_policy)) {
+            errs() << "Error while pruning the compilation cache: " << Err << "\n";
+            exit(1);
+        }
     }
-    exported_symbols_file.close();
 
-    CrisprCompiler.dumpSegments(std::filesystem::current_path() / "tmp");
+    // In batch mode every job has its own statistics
+    if (batch_manifest_path.empty()) {
+        if (time_report) stats.printReport(errs());
+        if (!stats_json_path.empty()) write_stats_json(stats_json_path, stats.toJSON());
+    }
 
-    return 0;
+    return failed_jobs == 0 ? 0 : 1;
 }
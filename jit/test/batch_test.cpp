@@ -0,0 +1,109 @@
+// Patches a binary three times in a batch whose second job fails to link, and
+// checks that the jobs around it still succeed.
+//
+// Usage: crispr-batch-test CRISPR CC WORK_DIR
+//
+// The fixture, built with CC, exits with what crispr_batch_test_value returns:
+// 1. The good jobs make it return 2. The bad job calls a function placed out of
+// the reach of the new code, so that lld reports an out of range relocation,
+// which it remembers across links unless crispr resets it.
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Exit code of the command, -1 if it did not exit
+static int run(const vector<string> &command) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        vector<char *> argv;
+        for (auto const &arg : command) argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static bool write_file(const string &path, const string &content) {
+    ofstream file(path);
+    file << content;
+    if (!file) cerr << "Could not write " << path << "\n";
+    return static_cast<bool>(file);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4) {
+        cerr << "Usage: " << argv[0] << " CRISPR CC WORK_DIR\n";
+        return 1;
+    }
+    string crispr = argv[1];
+    string cc = argv[2];
+    string work_dir = argv[3] + string("/batch_test");
+    string source_path = work_dir + "/fixture.c";
+    string binary_path = work_dir + "/fixture";
+    string good_path = work_dir + "/good.ll";
+    string bad_path = work_dir + "/bad.ll";
+    string far_symbols_path = work_dir + "/far.csv";
+    string manifest_path = work_dir + "/manifest.jsonl";
+    string output_path[] = {work_dir + "/first", work_dir + "/failing", work_dir + "/last"};
+
+    if (run({"mkdir", "-p", work_dir}) != 0) {
+        cerr << "Could not create " << work_dir << "\n";
+        return 1;
+    }
+    // The function reads a variable, so that it has room for the detour
+    const string triple = "target triple = \"x86_64-unknown-linux-gnu\"\n\n";
+    bool written = write_file(source_path,
+                              "static volatile int value = 1;\n"
+                              "int crispr_batch_test_value(void) { return value; }\n"
+                              "int main(void) { return crispr_batch_test_value(); }\n")
+                   && write_file(good_path, triple + "define i32 @crispr_batch_test_value() {\n  ret i32 2\n}\n")
+                   && write_file(bad_path, triple + "declare i32 @crispr_batch_test_far()\n\n"
+                                                    "define i32 @crispr_batch_test_value() {\n"
+                                                    "  %1 = call i32 @crispr_batch_test_far()\n"
+                                                    "  ret i32 %1\n}\n")
+                   && write_file(far_symbols_path, "crispr_batch_test_far,0x7fff00000000,0\n")
+                   && write_file(manifest_path,
+                                 "{\"input\": \"" + binary_path + "\", \"output\": \"" + output_path[0]
+                                 + "\", \"module\": \"" + good_path + "\"}\n"
+                                 + "{\"input\": \"" + binary_path + "\", \"output\": \"" + output_path[1]
+                                 + "\", \"module\": \"" + bad_path + "\", \"symbols\": \"" + far_symbols_path + "\"}\n"
+                                 + "{\"input\": \"" + binary_path + "\", \"output\": \"" + output_path[2]
+                                 + "\", \"module\": \"" + good_path + "\"}\n");
+    if (!written) return 1;
+
+    if (run({cc, "-O0", "-o", binary_path, source_path}) != 0) {
+        cerr << "Could not build the fixture\n";
+        return 1;
+    }
+    if (run({binary_path}) != 1) {
+        cerr << "The fixture does not return the old value\n";
+        return 1;
+    }
+
+    // One worker, so that the failing link comes between the good ones
+    if (run({crispr, "--jobs", "1", "--batch", manifest_path}) != 1) {
+        cerr << "The batch did not report the failing job\n";
+        return 1;
+    }
+    for (auto const &path : {output_path[0], output_path[2]}) {
+        if (run({path}) != 2) {
+            cerr << path << " does not return the new value\n";
+            return 1;
+        }
+    }
+    return 0;
+}
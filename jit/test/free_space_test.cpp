@@ -0,0 +1,82 @@
+// Packs sections into free ranges and checks where they end up: the best fit,
+// biggest sections first, aligned, in coalesced ranges and below the limit.
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "CrisprElf.h"
+#include "CrisprFreeSpace.h"
+
+using namespace llvm;
+using namespace std;
+
+static bool check_placements(const string &name,
+                             const map<string, uint64_t> &placements,
+                             const map<string, uint64_t> &expected) {
+    if (placements == expected) return true;
+    cerr << name << ": unexpected placements";
+    for (auto const &placement : placements) cerr << " " << placement.first << "=0x" << hex << placement.second;
+    cerr << dec << "\n";
+    return false;
+}
+
+static bool check_free_size(const string &name, const CrisprFreeSpace &space, uint64_t expected) {
+    if (space.getFreeSize() == expected) return true;
+    cerr << name << ": 0x" << hex << space.getFreeSize() << " bytes free instead of 0x" << expected << dec << "\n";
+    return false;
+}
+
+int main() {
+    // Only the ranges added explicitly are used, the binary does not matter
+    auto binary = CrisprElf::open("/proc/self/exe");
+    if (!binary) {
+        cerr << toString(binary.takeError()) << "\n";
+        return 1;
+    }
+    bool ok = true;
+
+    {
+        // The biggest section takes the biggest range, the others the ranges
+        // they leave the least of, and the one which fits nowhere is left out
+        CrisprFreeSpace space(**binary);
+        space.addRange(0x1000, 0x100);
+        space.addRange(0x2000, 0x40);
+        space.addRange(0x3000, 0x20);
+        auto placements = space.pack({{"a", 0x30, 1}, {"b", 0x20, 1}, {"c", 0xf0, 1}, {"d", 0x200, 1}});
+        ok &= check_placements("best fit", placements, {{"a", 0x2000}, {"b", 0x3000}, {"c", 0x1000}});
+        ok &= check_free_size("best fit", space, 0x20);
+    }
+
+    {
+        // The bytes skipped to align a section remain free on its both sides
+        CrisprFreeSpace space(**binary);
+        space.addRange(0x4001, 0x4f);
+        auto placements = space.pack({{"aligned", 0x20, 16}, {"small", 0x8, 1}});
+        ok &= check_placements("alignment", placements, {{"aligned", 0x4010}, {"small", 0x4001}});
+        ok &= check_free_size("alignment", space, 0x4f - 0x28);
+    }
+
+    {
+        // Adjacent and overlapping ranges are merged
+        CrisprFreeSpace space(**binary);
+        space.addRange(0x5000, 0x10);
+        space.addRange(0x5010, 0x10);
+        space.addRange(0x5008, 0x10);
+        auto placements = space.pack({{"merged", 0x20, 1}});
+        ok &= check_placements("coalescing", placements, {{"merged", 0x5000}});
+    }
+
+    {
+        // Nothing is placed at or above the limit
+        CrisprFreeSpace space(**binary, 0x6010);
+        space.addRange(0x6000, 0x40);
+        space.addRange(0x7000, 0x40);
+        ok &= check_free_size("limit", space, 0x10);
+        auto placements = space.pack({{"big", 0x20, 1}, {"fits", 0x10, 1}});
+        ok &= check_placements("limit", placements, {{"fits", 0x6000}});
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,114 @@
+// Checks the GNU hash of known names, then looks up symbols in a DT_GNU_HASH
+// table built by the merger the way the dynamic loader does.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "CrisprElfMerger.h"
+
+using namespace llvm;
+using namespace std;
+
+template<typename T>
+static T read_word(const string &table, size_t offset) {
+    T word;
+    memcpy(&word, table.data() + offset, sizeof(T));
+    return word;
+}
+
+// Returned by lookup when a chain runs into the symbols of another bucket
+static constexpr uint32_t CorruptChain = UINT32_MAX;
+
+// Index of the symbol named name, 0 if the table does not have it. names holds
+// the name of each symbol of the table, by index.
+static uint32_t lookup(const string &table, const vector<string> &names, StringRef name) {
+    auto buckets_count = read_word<uint32_t>(table, 0);
+    auto symbol_offset = read_word<uint32_t>(table, 4);
+    auto bloom_size = read_word<uint32_t>(table, 8);
+    auto bloom_shift = read_word<uint32_t>(table, 12);
+    size_t bloom_offset = 16;
+    size_t buckets_offset = bloom_offset + bloom_size * sizeof(uint64_t);
+    size_t chains_offset = buckets_offset + buckets_count * sizeof(uint32_t);
+
+    uint32_t hash = getGnuHash(name);
+    auto bloom = read_word<uint64_t>(table, bloom_offset + (hash / 64 % bloom_size) * sizeof(uint64_t));
+    uint64_t mask = (uint64_t(1) << (hash % 64)) | (uint64_t(1) << ((hash >> bloom_shift) % 64));
+    if ((bloom & mask) != mask) return 0;
+
+    auto index = read_word<uint32_t>(table, buckets_offset + (hash % buckets_count) * sizeof(uint32_t));
+    if (index == 0) return 0;
+    for (;; index++) {
+        if (index >= names.size() || getGnuHash(names[index]) % buckets_count != hash % buckets_count) {
+            return CorruptChain;
+        }
+        auto chain = read_word<uint32_t>(table, chains_offset + (index - symbol_offset) * sizeof(uint32_t));
+        if ((chain | 1) == (hash | 1) && names[index] == name) return index;
+        if (chain & 1) return 0;
+    }
+}
+
+int main() {
+    bool failed = false;
+
+    const pair<const char *, uint32_t> known_hashes[] = {
+            {"", 0x1505},
+            {"printf", 0x156b2bb8},
+            {"exit", 0x7c967e3f},
+            {"syscall", 0xbac212a0},
+    };
+    for (auto const &known : known_hashes) {
+        if (getGnuHash(known.first) != known.second) {
+            cerr << "Wrong hash of \"" << known.first << "\": " << getGnuHash(known.first) << "\n";
+            failed = true;
+        }
+    }
+
+    // The hashed symbols follow the first ones, sorted by bucket like in the
+    // merged .dynsym
+    const uint32_t symbol_offset = 3;
+    vector<string> hashed = {"printf", "exit", "syscall", "main"};
+    for (int i = 0; i < 40; i++) hashed.push_back("crispr_symbol_" + to_string(i));
+    uint32_t buckets_count = getGnuHashBucketsCount(hashed.size());
+    std::stable_sort(hashed.begin(), hashed.end(), [buckets_count](const string &a, const string &b) {
+        return getGnuHash(a) % buckets_count < getGnuHash(b) % buckets_count;
+    });
+
+    vector<string> names(symbol_offset);
+    vector<uint32_t> hashes;
+    for (auto const &name : hashed) {
+        names.push_back(name);
+        hashes.push_back(getGnuHash(name));
+    }
+    string table = encodeGnuHashTable(hashes, symbol_offset);
+
+    for (uint32_t index = symbol_offset; index < names.size(); index++) {
+        uint32_t found = lookup(table, names, names[index]);
+        if (found != index) {
+            cerr << names[index] << " found at " << found << " instead of " << index << "\n";
+            failed = true;
+        }
+    }
+    // Lookups of names which the bloom filter rejects never reach the chains,
+    // whose ends are checked directly
+    size_t chains_offset = 16 + read_word<uint32_t>(table, 8) * sizeof(uint64_t) + buckets_count * sizeof(uint32_t);
+    for (uint32_t i = 0; i < hashes.size(); i++) {
+        bool last_in_bucket = i + 1 == hashes.size() || hashes[i + 1] % buckets_count != hashes[i] % buckets_count;
+        auto chain = read_word<uint32_t>(table, chains_offset + i * sizeof(uint32_t));
+        if ((chain & 1) != last_in_bucket) {
+            cerr << "Wrong end of chain at " << names[symbol_offset + i] << "\n";
+            failed = true;
+        }
+    }
+    for (auto const &missing : {"puts", "crispr_symbol_40", "crispr_symbol"}) {
+        if (uint32_t found = lookup(table, names, missing)) {
+            cerr << missing << " found at " << found << "\n";
+            failed = true;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,198 @@
+// Patches a running multi-threaded process with crispr live, then rolls the
+// patch back.
+//
+// Usage: crispr-live-test CRISPR WORK_DIR
+//
+// A child of the test calls crispr_live_test_value in a loop from several
+// threads and publishes what it returned in shared memory. The function
+// returns 1, the patch written to WORK_DIR makes it return 2, and the rollback
+// restores 1. A second patch, compiled with --jobs 2, makes it return 3
+// through a static helper, which splitting the module renames. The test is
+// skipped (exit code 77) when the child cannot be
+// traced, e.g. under kernel.yama.ptrace_scope 2 or without CAP_SYS_PTRACE in a
+// container.
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+static constexpr int SkipExitCode = 77;
+static constexpr int Threads = 4;
+
+// Read by the function, so that it has a body longer than the detour
+static volatile int Value = 1;
+
+extern "C" __attribute__((noinline, used)) int crispr_live_test_value() {
+    return Value;
+}
+
+// Called through, so that the calls are neither inlined nor folded
+static int (*volatile GetValue)() = crispr_live_test_value;
+
+// The last value every thread of the child got, in memory shared with it
+struct Observations {
+    atomic<int> Values[Threads];
+};
+
+[[noreturn]] static void run_child(Observations &Seen) {
+    // Under kernel.yama.ptrace_scope 1 only the ancestors of a process may
+    // trace it, and crispr is its sibling
+    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY, 0, 0, 0);
+
+    vector<thread> Workers;
+    for (int i = 0; i < Threads; i++) {
+        Workers.emplace_back([&Seen, i]() {
+            for (;;) Seen.Values[i].store(GetValue());
+        });
+    }
+    for (;;) pause();
+}
+
+// Whether all the threads got Expected within a few seconds. A thread may
+// still store a value it got before the change once.
+static bool wait_for(const Observations &Seen, int Expected) {
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(10);
+    while (chrono::steady_clock::now() < deadline) {
+        bool all = true;
+        for (auto const &Observed : Seen.Values) all &= Observed.load() == Expected;
+        if (all) return true;
+        this_thread::sleep_for(chrono::milliseconds(1));
+    }
+    return false;
+}
+
+// Why a sibling of the child, as crispr is, may not trace it, 0 if it may
+static int get_trace_error(pid_t child) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    // The child is detached when the probe exits
+    if (pid == 0) _exit(ptrace(PTRACE_SEIZE, child, nullptr, nullptr) == 0 ? 0 : errno);
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EPERM;
+}
+
+// Runs the command, returns whether it succeeded
+static bool run(const vector<string> &command) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        vector<char *> argv;
+        for (auto const &arg : command) argv.push_back(const_cast<char *>(arg.c_str()));
+        argv.push_back(nullptr);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool write_module(const string &path, const string &body) {
+    ofstream module(path);
+    module << "target triple = \"x86_64-unknown-linux-gnu\"\n\n" << body;
+    if (!module) cerr << "Could not write " << path << "\n";
+    return static_cast<bool>(module);
+}
+
+// Patches the child with the module, checks that the function returns
+// Expected, then rolls the patch back. Returns an error message, if any.
+static string patch_and_roll_back(const string &crispr,
+                                  pid_t child,
+                                  const string &module_path,
+                                  const string &rollback_path,
+                                  const vector<string> &options,
+                                  const Observations &Seen,
+                                  int Expected) {
+    string pid = to_string(child);
+    vector<string> command = {crispr, "live", "--pid", pid, "-m", module_path, "--rollback-file", rollback_path};
+    command.insert(command.end(), options.begin(), options.end());
+    if (!run(command)) return "crispr live failed with " + module_path;
+    if (!wait_for(Seen, Expected)) return "The function patched with " + module_path + " does not return "
+                                          + to_string(Expected);
+
+    if (!run({crispr, "live", "--pid", pid, "--rollback", "--rollback-file", rollback_path})) {
+        return "crispr live --rollback failed";
+    }
+    if (!wait_for(Seen, 1)) return "The rolled back function does not return the old value";
+    return "";
+}
+
+static int finish(pid_t child, int code, const string &message) {
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    if (!message.empty()) cerr << message << "\n";
+    return code;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        cerr << "Usage: " << argv[0] << " CRISPR WORK_DIR\n";
+        return 1;
+    }
+    string crispr = argv[1];
+    string work_dir = argv[2];
+    string module_path = work_dir + "/live_test.ll";
+    string helper_module_path = work_dir + "/live_test_helper.ll";
+    string rollback_path = work_dir + "/live_test_rollback.json";
+
+    bool written = write_module(module_path, "define i32 @crispr_live_test_value() {\n  ret i32 2\n}\n")
+                   && write_module(helper_module_path,
+                                   // Opaque, so that the call is not folded
+                                   "define internal i32 @helper() noinline {\n"
+                                   "  %1 = call i32 asm \"movl $$3, $0\", \"=r\"()\n"
+                                   "  ret i32 %1\n}\n\n"
+                                   "define i32 @crispr_live_test_value() {\n"
+                                   "  %1 = call i32 @helper()\n"
+                                   "  ret i32 %1\n}\n");
+    if (!written) return 1;
+
+    void *Shared = mmap(nullptr, sizeof(Observations), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (Shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    auto &Seen = *new(Shared) Observations();
+    for (auto &Observed : Seen.Values) Observed.store(0);
+
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (child == 0) run_child(Seen);
+
+    if (!wait_for(Seen, 1)) return finish(child, 1, "The child did not start calling the function");
+    if (int error = get_trace_error(child)) {
+        return finish(child, SkipExitCode, "Skipped: the child cannot be traced (" + string(strerror(error)) + ")");
+    }
+
+    string error = patch_and_roll_back(crispr, child, module_path, rollback_path, {}, Seen, 2);
+    if (error.empty()) {
+        error = patch_and_roll_back(crispr, child, helper_module_path, rollback_path, {"--jobs", "2"}, Seen, 3);
+    }
+    return finish(child, error.empty() ? 0 : 1, error);
+}
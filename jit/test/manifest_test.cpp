@@ -0,0 +1,136 @@
+// Saves a patch manifest and loads it back, checking that nothing an
+// incremental patch relies on is lost, and that other manifests are rejected.
+//
+// Usage: crispr-manifest-test WORK_DIR
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "CrisprPatchManifest.h"
+
+using namespace llvm;
+using namespace std;
+
+static bool same_sections(const CrisprPatchManifest &a, const CrisprPatchManifest &b) {
+    if (a.Sections.size() != b.Sections.size()) return false;
+    for (auto const &section : a.Sections) {
+        auto other = b.Sections.find(section.first);
+        if (other == b.Sections.end() || other->second.Address != section.second.Address
+            || other->second.Size != section.second.Size || other->second.Capacity != section.second.Capacity) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool same_symbols(const CrisprPatchManifest &a, const CrisprPatchManifest &b) {
+    if (a.Symbols.size() != b.Symbols.size()) return false;
+    for (auto const &symbol : a.Symbols) {
+        auto other = b.Symbols.find(symbol.first);
+        if (other == b.Symbols.end() || other->second.Address != symbol.second.Address
+            || other->second.Size != symbol.second.Size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool same_free_ranges(const CrisprPatchManifest &a, const CrisprPatchManifest &b) {
+    if (a.FreeRanges.size() != b.FreeRanges.size()) return false;
+    for (size_t i = 0; i < a.FreeRanges.size(); i++) {
+        if (a.FreeRanges[i].Address != b.FreeRanges[i].Address || a.FreeRanges[i].Size != b.FreeRanges[i].Size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Names the first field which differs, empty if none does
+static string get_difference(const CrisprPatchManifest &a, const CrisprPatchManifest &b) {
+    if (a.Input != b.Input || a.InputSize != b.InputSize || a.InputTime != b.InputTime) return "input";
+    if (a.OutputSize != b.OutputSize || a.OutputTime != b.OutputTime) return "output";
+    if (a.Configuration != b.Configuration) return "configuration";
+    if (a.VariablesHash != b.VariablesHash) return "variables";
+    if (a.FunctionHashes != b.FunctionHashes) return "functions";
+    if (!same_sections(a, b)) return "sections";
+    if (!same_symbols(a, b)) return "symbols";
+    if (!same_free_ranges(a, b)) return "free ranges";
+    if (a.Undetoured != b.Undetoured) return "undetoured functions";
+    return "";
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " WORK_DIR\n";
+        return 1;
+    }
+    string path = argv[1] + string("/manifest_test.crispr.json");
+    string other_version_path = argv[1] + string("/manifest_test_other_version.crispr.json");
+
+    CrisprPatchManifest saved;
+    saved.Input = "/usr/bin/program";
+    saved.InputSize = 123456;
+    saved.InputTime = 1700000000;
+    saved.OutputSize = 234567;
+    saved.OutputTime = 1700000000123456789;
+    saved.Configuration = "code=auto,relr=1,2.36";
+    saved.VariablesHash = "0123456789abcdef0123456789abcdef";
+    saved.FunctionHashes = {
+            {"main", "00112233445566778899aabbccddeeff"},
+            {"helper", "ffeeddccbbaa99887766554433221100"},
+    };
+    saved.Sections = {{".funcs.main", {0x401000, 0x40, 0x60}}, {".funcs.main.cold", {0x402000, 0x10, 0x10}}};
+    // Addresses above INT64_MAX are stored as negative JSON integers
+    saved.Symbols = {{"main", {0x401000, 0x40}}, {"kernel", {0xffffffffff600000, 0x8}}};
+    saved.FreeRanges = {{0x401040, 0x20}, {0x403000, 0x1000}};
+    saved.Undetoured = {"tiny", "short"};
+
+    if (auto Err = saved.save(path)) {
+        cerr << toString(std::move(Err)) << "\n";
+        return 1;
+    }
+    auto loaded = CrisprPatchManifest::load(path);
+    if (!loaded) {
+        cerr << toString(loaded.takeError()) << "\n";
+        return 1;
+    }
+    bool ok = true;
+    string difference = get_difference(saved, *loaded);
+    if (!difference.empty()) {
+        cerr << "The " << difference << " changed through the manifest\n";
+        ok = false;
+    }
+
+    string reason;
+    if (!saved.isCompatible(*loaded, reason)) {
+        cerr << "The loaded manifest is incompatible: " << reason << "\n";
+        ok = false;
+    }
+    CrisprPatchManifest reconfigured = *loaded;
+    reconfigured.Configuration = "code=auto,relr=0,2.36";
+    if (reconfigured.isCompatible(saved, reason) || reason != "the options changed") {
+        cerr << "Changed options were not noticed\n";
+        ok = false;
+    }
+
+    // The manifests of other versions are patched from scratch
+    ifstream saved_file(path);
+    string content((istreambuf_iterator<char>(saved_file)), istreambuf_iterator<char>());
+    size_t version = content.find("\"version\": ");
+    if (version == string::npos) {
+        cerr << "No version in the manifest\n";
+        return 1;
+    }
+    content.insert(version + 11, "1");
+    ofstream(other_version_path) << content;
+    auto other_version = CrisprPatchManifest::load(other_version_path);
+    if (other_version) {
+        cerr << "A manifest of another version was accepted\n";
+        ok = false;
+    } else {
+        consumeError(other_version.takeError());
+    }
+    return ok ? 0 : 1;
+}
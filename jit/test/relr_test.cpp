@@ -0,0 +1,65 @@
+// Encodes relative relocations as DT_RELR entries, checks a known encoding and
+// that decoding gives back the relocated words.
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "CrisprElfMerger.h"
+
+using namespace llvm;
+using namespace std;
+
+static vector<uint64_t> get_values(const vector<CrisprElf::Elf_Relr> &entries) {
+    return vector<uint64_t>(entries.begin(), entries.end());
+}
+
+static bool check_round_trip(const string &name, const vector<uint64_t> &offsets) {
+    auto entries = encodeRelr(offsets);
+    if (decodeRelr(entries) != offsets) {
+        cerr << name << ": the decoded offsets differ from the encoded ones\n";
+        return false;
+    }
+    return true;
+}
+
+int main() {
+    bool failed = false;
+
+    // An address, a bitmap of the three next words relocated out of four, one
+    // of the word right after the 63 covered by the first bitmap, and another
+    // address too far for a bitmap
+    vector<uint64_t> offsets = {0x10000, 0x10008, 0x10010, 0x10020, 0x10200, 0x20000};
+    vector<uint64_t> expected = {0x10000, 0x17, 0x3, 0x20000};
+    auto entries = get_values(encodeRelr(offsets));
+    if (entries != expected) {
+        cerr << "Unexpected encoding:";
+        for (uint64_t entry : entries) cerr << " 0x" << hex << entry;
+        cerr << "\n";
+        failed = true;
+    }
+    failed |= !check_round_trip("known", offsets);
+
+    // 200 consecutive words take an address and ceil(199 / 63) bitmaps
+    vector<uint64_t> dense;
+    for (uint64_t i = 0; i < 200; i++) dense.push_back(0x400000 + i * 8);
+    if (encodeRelr(dense).size() != 5) {
+        cerr << "200 consecutive words take " << encodeRelr(dense).size() << " entries\n";
+        failed = true;
+    }
+    failed |= !check_round_trip("dense", dense);
+    failed |= !check_round_trip("empty", {});
+
+    // Words scattered with gaps of all sizes
+    mt19937_64 generator(25);
+    for (int run = 0; run < 100; run++) {
+        set<uint64_t> words;
+        uint64_t range = run % 2 == 0 ? 0x1000 : 0x100000;
+        for (int i = 0; i < 500; i++) words.insert(0x200000 + generator() % range * 8);
+        failed |= !check_round_trip("random " + to_string(run), vector<uint64_t>(words.begin(), words.end()));
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+// Loads symbol tables in the CSV and binary formats, and checks that malformed
+// ones are rejected.
+//
+// Usage: crispr-symbol-table-test WORK_DIR
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "llvm/Support/raw_ostream.h"
+
+#include "CrisprSymbolTable.h"
+
+using namespace llvm;
+using namespace std;
+
+static bool write_file(const string &path, const string &content) {
+    ofstream file(path, ios::binary);
+    file << content;
+    if (!file) cerr << "Could not write " << path << "\n";
+    return static_cast<bool>(file);
+}
+
+// Whether the table has the symbol with this address and size
+static bool check_symbol(const CrisprSymbolTable &table, StringRef name, uint64_t address, uint64_t size) {
+    auto *symbol = table.lookup(name);
+    if (symbol == nullptr) {
+        cerr << "Missing symbol " << name.str() << "\n";
+        return false;
+    }
+    if (symbol->Address != address || symbol->Size != size) {
+        cerr << "Wrong address or size of " << name.str() << "\n";
+        return false;
+    }
+    return true;
+}
+
+static bool check_symbols(const string &format, const CrisprSymbolTable &table) {
+    bool ok = table.size() == 4;
+    if (!ok) cerr << format << ": " << table.size() << " symbols instead of 4\n";
+    ok &= check_symbol(table, "main", 0x401000, 0x20);
+    ok &= check_symbol(table, "helper", 0x401020, 0x10);
+    // The last definition wins
+    ok &= check_symbol(table, "twice", 0x402000, 0x8);
+    ok &= check_symbol(table, "operator,(a, b)", 0x403000, 0x30);
+    if (table.lookup("missing") != nullptr) {
+        cerr << format << ": found a missing symbol\n";
+        ok = false;
+    }
+    return ok;
+}
+
+// Whether loading the file fails with an error mentioning expected
+static bool check_rejected(const string &path, const string &content, const string &expected) {
+    if (!write_file(path, content)) return false;
+    auto table = CrisprSymbolTable::load(path);
+    if (table) {
+        cerr << path << " was accepted\n";
+        return false;
+    }
+    string message = toString(table.takeError());
+    if (message.find(expected) == string::npos) {
+        cerr << path << ": unexpected error " << message << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        cerr << "Usage: " << argv[0] << " WORK_DIR\n";
+        return 1;
+    }
+    string prefix = argv[1] + string("/symbol_table_test");
+    string csv_path = prefix + ".csv";
+    string binary_path = prefix + ".bin";
+    bool ok = true;
+
+    // With and without the 0x prefix, CRLF line ends and an empty line
+    if (!write_file(csv_path,
+                    "main,0x401000,0x20\n"
+                    "helper,401020,10\r\n"
+                    "\n"
+                    "twice,1000,8\n"
+                    "twice,0x402000,8\n"
+                    "operator,(a, b),403000,30\n")) {
+        return 1;
+    }
+    auto csv = CrisprSymbolTable::load(csv_path);
+    if (!csv) {
+        cerr << toString(csv.takeError()) << "\n";
+        return 1;
+    }
+    ok &= check_symbols("CSV", **csv);
+
+    string binary;
+    raw_string_ostream binary_stream(binary);
+    (*csv)->writeBinary(binary_stream);
+    if (!write_file(binary_path, binary_stream.str())) return 1;
+    auto loaded = CrisprSymbolTable::load(binary_path);
+    if (!loaded) {
+        cerr << toString(loaded.takeError()) << "\n";
+        return 1;
+    }
+    ok &= check_symbols("binary", **loaded);
+
+    ok &= check_rejected(prefix + "_bad_number.csv", "main,401000,20\nhelper,0xg,10\n", "invalid line 2");
+    ok &= check_rejected(prefix + "_bad_fields.csv", "main,401000\n", "invalid line 1");
+    ok &= check_rejected(prefix + "_no_name.csv", ",401000,20\n", "invalid line 1");
+    ok &= check_rejected(prefix + "_truncated.bin", binary.substr(0, 30), "truncated");
+    // The size of the last name is stored right before the names
+    string long_name = binary;
+    size_t names_offset = 24 + 4 * 24;
+    long_name[names_offset - 4] = '\x7f';
+    ok &= check_rejected(prefix + "_long_name.bin", long_name, "out of bounds");
+    return ok ? 0 : 1;
+}
@@ -5,12 +5,14 @@ from .patcher import main
 argparser = argparse.ArgumentParser()
 argparser.add_argument("input_binary",
                        help="Path to the binary to patch")
-argparser.add_argument("module",
-                       help="Path to the LLVM module with patches")
+argparser.add_argument("modules", nargs="+",
+                       help="Paths to the LLVM modules with patches, linked together. Only their protected "
+                            "definitions are visible across modules")
 argparser.add_argument("--symbols",
                        help="Path to a CSV containing additional symbols for the input binary")
-argparser.add_argument("--map-new-code-to", default="0x700000",
-                       help="Address where new code (and data, etc) will be mapped. Defaults to 0x700000")
+argparser.add_argument("--map-new-code-to",
+                       help="Address where new code (and data, etc) will be mapped. Defaults to right after the "
+                            "input binary")
 argparser.add_argument("--dylib", action="append", default=[],
                        help="Path to an additional dynamic library to be linked together with the output.\n" +
                             "By default, all symbols are imported. To import only some symbols, "
@@ -22,6 +24,40 @@ argparser.add_argument("--inplace", action="store_true",
                        help="Patch the binary in place, if possible, else exit with an error")
 argparser.add_argument("--nofill", dest="fill", action="store_false",
                        help="Don't fill with NOPs until function end when patching in place")
+argparser.add_argument("--jobs", "-j", type=int, default=1,
+                       help="Number of threads used to compile the patch, 0 to use all cores. Defaults to 1")
+argparser.add_argument("-O", dest="opt_level", default="2", choices=["0", "1", "2", "3", "s", "z"],
+                       help="Optimization level of the patch, as in clang. Defaults to 2")
+argparser.add_argument("--mcpu",
+                       help="Target CPU of the patch (e.g. skylake, or native). Defaults to generic")
+argparser.add_argument("--mattr",
+                       help="Additional target features of the patch (e.g. +avx2,+fma)")
+argparser.add_argument("--profile",
+                       help="Sample profile of the original binary (AutoFDO text or llvm-profdata output) used to "
+                            "optimize the patch. The patch needs line tables (-gline-tables-only)")
+argparser.add_argument("--function-alignment", type=int,
+                       help="Alignment of the new functions in bytes (e.g. 16, 32 or 64). "
+                            "Defaults to the one chosen by the compiler")
+argparser.add_argument("--cold-function-alignment", type=int,
+                       help="Alignment of the new functions marked as cold. Defaults to 1")
+argparser.add_argument("--no-order-functions", dest="order_functions", action="store_false",
+                       help="Keep the new functions in the order of the module instead of ordering them along the "
+                            "call graph")
+argparser.add_argument("--cache-dir",
+                       help="Directory where compiled functions are cached across runs")
+argparser.add_argument("--retarget", action="store_true",
+                       help="Point the direct calls and jumps, dynamic symbols and relocations referring to the "
+                            "patched functions to the new code, keeping the detours only for indirect calls")
+argparser.add_argument("--huge-pages", action="store_true",
+                       help="Align and pad the new code segments to 2MB, so that they can be mapped with huge pages")
+argparser.add_argument("--pack-relocations", action="store_true",
+                       help="Pack the relative relocations of the output binary as DT_RELR, which needs glibc 2.36")
+argparser.add_argument("--target-glibc",
+                       help="Version of the glibc the output binary runs with, if the input binary requires an older "
+                            "one")
+argparser.add_argument("--save-temps", action="store_true",
+                       help="Keep the compiled objects, the segments and the linked patch in a new crispr-temps.* "
+                            "directory")
 
 
 def cmdline_main():
@@ -30,14 +66,40 @@ def cmdline_main():
     if not args.output_binary:
         args.output_binary = args.input_binary + ".patched"
 
-    args.map_new_code_to = int(args.map_new_code_to, base=0)
+    if args.map_new_code_to is not None:
+        args.map_new_code_to = int(args.map_new_code_to, base=0)
 
-    main(args.module,
+    main(args.modules,
          args.input_binary,
          args.output_binary,
          args.map_new_code_to,
          additional_dylib_paths=args.dylib,
          inplace=args.inplace,
          fill_with_nops=args.fill,
-         additional_symbols_path=args.symbols
+         additional_symbols_path=args.symbols,
+         jobs=args.jobs,
+         cache_dir=args.cache_dir,
+         retarget=args.retarget,
+         huge_pages=args.huge_pages,
+         pack_relocations=args.pack_relocations,
+         target_glibc=args.target_glibc,
+         save_temps=args.save_temps,
+         codegen_args=codegen_args(args)
          )
+
+
+def codegen_args(args):
+    result = [f"-O{args.opt_level}"]
+    if args.mcpu:
+        result += ["-mcpu", args.mcpu]
+    if args.mattr:
+        result += ["-mattr", args.mattr]
+    if args.profile:
+        result += ["--profile", args.profile]
+    if args.function_alignment is not None:
+        result += ["--function-alignment", str(args.function_alignment)]
+    if args.cold_function_alignment is not None:
+        result += ["--cold-function-alignment", str(args.cold_function_alignment)]
+    if not args.order_functions:
+        result.append("--no-order-functions")
+    return result